@@ -0,0 +1,325 @@
+/* Lock-free bounded rings.
+ *
+ * Head and tail count positions from the start and are never wrapped, the
+ * slot of a position is picked by its low bits, so that a full ring is told
+ * from an empty one without a slot left unused. Producer and consumer sides
+ * are on their own cache lines, and each side keeps the last index of the
+ * other side it read, reading it again only when that does not do, so that
+ * a busy ring does not move cache lines back and forth for each element.
+ *
+ * A single producer publishes elements by moving head on commit. Multiple
+ * producers reserve positions by moving head with CAS, and publish each slot
+ * on its own through its sequence, so that a producer interrupted between
+ * reservation and commit by an IRQ handler producing to the same ring does
+ * not block it, the consumer only stops at the slot not committed yet. */
+#include "containers_ring.h"
+#include "cpu.h"
+#include "kernel_panic.h"
+#include "mm.h"
+
+void ring_init(ring_t *ring, vptr_t slots, volatile u64_t *seqs, usz_t elem,
+    usz_t cnt)
+{
+  kernel_assert(cnt > 0 && (cnt & (cnt - 1)) == 0 && elem > 0);
+  ring->head = 0;
+  ring->tail_seen = 0;
+  ring->tail = 0;
+  ring->head_seen = 0;
+  ring->slots = slots;
+  ring->seqs = seqs;
+  ring->elem = elem;
+  ring->mask = cnt - 1;
+  if (seqs != NULL) {
+    /* Position 0 is committed once its sequence is 1. */
+    for (usz_t i = 0; i < cnt; i++) {
+      seqs[i] = 0;
+    }
+  }
+}
+
+usz_t ring_capacity(ring_t *ring)
+{
+  return ring->mask + 1;
+}
+
+usz_t ring_len(ring_t *ring)
+{
+  u64_t tail;
+  u64_t head;
+
+  tail = cpu_atomic_load(&ring->tail);
+  head = cpu_atomic_load(&ring->head);
+  return head - tail;
+}
+
+vptr_t ring_slot(ring_t *ring, u64_t pos)
+{
+  return ring->slots + (pos & ring->mask) * ring->elem;
+}
+
+usz_t ring_reserve(ring_t *ring, usz_t cnt, u64_t *pos)
+{
+  u64_t head;
+  u64_t free;
+  usz_t n;
+
+  if (ring->seqs == NULL) {
+    head = ring->head;
+    free = ring_capacity(ring) - (head - ring->tail_seen);
+    if (free < cnt) {
+      ring->tail_seen = cpu_atomic_load_acquire(&ring->tail);
+      free = ring_capacity(ring) - (head - ring->tail_seen);
+    }
+    n = cnt < free ? cnt : free;
+  } else {
+    /* Tail read after head may be ahead of it, CAS fails then. */
+    do {
+      head = cpu_atomic_load(&ring->head);
+      free = ring_capacity(ring) - (head - cpu_atomic_load(&ring->tail));
+      n = cnt < free ? cnt : free;
+    } while (n > 0 && !cpu_atomic_cas(&ring->head, head, head + n));
+  }
+  *pos = head;
+  return n;
+}
+
+void ring_commit(ring_t *ring, u64_t pos, usz_t cnt)
+{
+  if (ring->seqs == NULL) {
+    kernel_assert(pos == ring->head);
+    cpu_atomic_store_release(&ring->head, pos + cnt);
+  } else {
+    for (usz_t i = 0; i < cnt; i++) {
+      cpu_atomic_store_release(
+          &ring->seqs[(pos + i) & ring->mask], pos + i + 1);
+    }
+  }
+}
+
+base_private bo_t _committed(ring_t *ring, u64_t pos)
+{
+  return cpu_atomic_load_acquire(&ring->seqs[pos & ring->mask]) == pos + 1;
+}
+
+usz_t ring_peek(ring_t *ring, usz_t cnt, u64_t *pos)
+{
+  u64_t tail;
+  u64_t used;
+  usz_t n;
+
+  tail = ring->tail;
+  if (ring->seqs == NULL) {
+    used = ring->head_seen - tail;
+    if (used < cnt) {
+      ring->head_seen = cpu_atomic_load_acquire(&ring->head);
+      used = ring->head_seen - tail;
+    }
+    n = cnt < used ? cnt : used;
+  } else {
+    /* Sequence left from the last lap is a capacity behind. */
+    n = 0;
+    while (n < cnt && _committed(ring, tail + n)) {
+      n++;
+    }
+  }
+  *pos = tail;
+  return n;
+}
+
+void ring_release(ring_t *ring, usz_t cnt)
+{
+  cpu_atomic_store_release(&ring->tail, ring->tail + cnt);
+}
+
+/* Copy @cnt elements between @elems and @ring from @pos on, in at most two
+ * runs as slots wrap around. */
+base_private void _copy(
+    ring_t *ring, u64_t pos, byte_t *elems, usz_t cnt, bo_t to_ring)
+{
+  usz_t first;
+  byte_t *slot;
+
+  first = ring_capacity(ring) - (pos & ring->mask);
+  first = cnt < first ? cnt : first;
+  for (usz_t run = 0; run < 2 && cnt > 0; run++) {
+    slot = ring_slot(ring, pos);
+    if (to_ring) {
+      mm_copy(slot, elems, first * ring->elem);
+    } else {
+      mm_copy(elems, slot, first * ring->elem);
+    }
+    pos += first;
+    elems += first * ring->elem;
+    cnt -= first;
+    first = cnt;
+  }
+}
+
+usz_t ring_push(ring_t *ring, const byte_t *elems, usz_t cnt)
+{
+  u64_t pos;
+
+  cnt = ring_reserve(ring, cnt, &pos);
+  /* Only read from when copying to ring. */
+  _copy(ring, pos, (byte_t *)(uptr_t)elems, cnt, true);
+  ring_commit(ring, pos, cnt);
+  return cnt;
+}
+
+usz_t ring_pop(ring_t *ring, byte_t *elems, usz_t cnt)
+{
+  u64_t pos;
+
+  cnt = ring_peek(ring, cnt, &pos);
+  _copy(ring, pos, elems, cnt, false);
+  ring_release(ring, cnt);
+  return cnt;
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "drivers_time.h"
+#include "log.h"
+#include "sched.h"
+
+#define _TEST_SLOTS 8
+#define _TEST_BIG_SLOTS 256
+#define _TEST_ITEMS (u64_literal(1) << 16)
+#define _TEST_PRODUCERS 4
+#define _TEST_BATCH 8
+
+base_private ring_t _test_ring;
+base_private u64_t _test_slots[_TEST_BIG_SLOTS];
+base_private volatile u64_t _test_seqs[_TEST_BIG_SLOTS];
+base_private volatile u64_t _test_running;
+
+/* Fill, overflow, drain and wrap around a ring of @_TEST_SLOTS, copying and
+ * zero-copy. */
+base_private void _test_basic(volatile u64_t *seqs)
+{
+  u64_t in[_TEST_SLOTS];
+  u64_t out[_TEST_SLOTS];
+  u64_t pos;
+  usz_t n;
+
+  ring_init(&_test_ring, _test_slots, seqs, sizeof(u64_t), _TEST_SLOTS);
+  for (u64_t i = 0; i < _TEST_SLOTS; i++) {
+    in[i] = i + 100;
+  }
+  kernel_assert(ring_pop(&_test_ring, (byte_t *)out, 1) == 0);
+  kernel_assert(ring_push(&_test_ring, (byte_t *)in, 5) == 5);
+  kernel_assert(ring_push(&_test_ring, (byte_t *)in, 5) == 3);
+  kernel_assert(ring_len(&_test_ring) == _TEST_SLOTS);
+  kernel_assert(ring_reserve(&_test_ring, 1, &pos) == 0);
+  kernel_assert(ring_pop(&_test_ring, (byte_t *)out, 6) == 6);
+  for (u64_t i = 0; i < 6; i++) {
+    kernel_assert(out[i] == in[i < 5 ? i : i - 5]);
+  }
+
+  /* Runs across the end of slots. */
+  kernel_assert(ring_push(&_test_ring, (byte_t *)in, 6) == 6);
+  kernel_assert(ring_pop(&_test_ring, (byte_t *)out, _TEST_SLOTS) == 8);
+  kernel_assert(out[0] == 101 && out[1] == 102 && out[7] == 105);
+
+  n = ring_reserve(&_test_ring, 3, &pos);
+  kernel_assert(n == 3);
+  for (usz_t i = 0; i < n; i++) {
+    *(u64_t *)ring_slot(&_test_ring, pos + i) = i + 200;
+  }
+  kernel_assert(ring_peek(&_test_ring, 3, &pos) == 0);
+  ring_commit(&_test_ring, pos, n);
+  n = ring_peek(&_test_ring, _TEST_SLOTS, &pos);
+  kernel_assert(n == 3);
+  for (usz_t i = 0; i < n; i++) {
+    kernel_assert(*(u64_t *)ring_slot(&_test_ring, pos + i) == i + 200);
+  }
+  ring_release(&_test_ring, n);
+  kernel_assert(ring_len(&_test_ring) == 0);
+}
+
+/* Producer of @arg pushes items tagged with it, a batch at a time. */
+base_private void _test_produce(vptr_t arg)
+{
+  u64_t batch[_TEST_BATCH];
+  u64_t seq;
+  usz_t n;
+
+  seq = 0;
+  while (seq < _TEST_ITEMS) {
+    n = 0;
+    while (n < _TEST_BATCH && seq + n < _TEST_ITEMS) {
+      batch[n] = ((u64_t)arg << 32) | (seq + n);
+      n++;
+    }
+    n = ring_push(&_test_ring, (byte_t *)batch, n);
+    if (n == 0) {
+      sched_yield();
+    }
+    seq += n;
+  }
+  cpu_atomic_fetch_add(&_test_running, U64_MAX);
+}
+
+/* Pop items of @producers threads, each one must come in order.
+ * @return Cycles taken. */
+base_private u64_t _test_consume(volatile u64_t *seqs, u64_t producers)
+{
+  u64_t next[_TEST_PRODUCERS];
+  u64_t batch[_TEST_BATCH];
+  u64_t start;
+  u64_t got;
+  usz_t n;
+  sched_thread_t *thread;
+
+  ring_init(
+      &_test_ring, _test_slots, seqs, sizeof(u64_t), _TEST_BIG_SLOTS);
+  for (u64_t i = 0; i < producers; i++) {
+    next[i] = 0;
+  }
+  _test_running = producers;
+  start = cpu_read_tsc();
+  for (u64_t i = 0; i < producers; i++) {
+    thread = sched_thread_new(
+        "ring_test", _test_produce, (vptr_t)i, SCHED_CPU_ANY);
+    kernel_assert(thread != NULL);
+  }
+
+  got = 0;
+  while (got < producers * _TEST_ITEMS) {
+    n = ring_pop(&_test_ring, (byte_t *)batch, _TEST_BATCH);
+    if (n == 0) {
+      sched_yield();
+    }
+    for (usz_t i = 0; i < n; i++) {
+      kernel_assert(batch[i] >> 32 < producers);
+      kernel_assert((batch[i] & U32_MAX) == next[batch[i] >> 32]);
+      next[batch[i] >> 32]++;
+    }
+    got += n;
+  }
+  start = cpu_read_tsc() - start;
+  kernel_assert(ring_len(&_test_ring) == 0);
+  while (cpu_atomic_load(&_test_running) != 0) {
+    sched_yield();
+  }
+  return start;
+}
+
+/* Rings of both kinds keep elements in order and never take more than they
+ * hold, and throughput across CPUs is logged. */
+void test_containers_ring(void)
+{
+  u64_t cycles;
+
+  _test_basic(NULL);
+  _test_basic(_test_seqs);
+
+  cycles = _test_consume(NULL, 1);
+  log_line_format(LOG_LEVEL_SELF_TEST, "SPSC ring: %lu ns per element",
+      time_cycles_to_ns(cycles) / _TEST_ITEMS);
+  cycles = _test_consume(_test_seqs, _TEST_PRODUCERS);
+  log_line_format(LOG_LEVEL_SELF_TEST,
+      "MPSC ring of %lu producers: %lu ns per element", (u64_t)_TEST_PRODUCERS,
+      time_cycles_to_ns(cycles) / (_TEST_ITEMS * _TEST_PRODUCERS));
+  log_builtin_test_pass();
+}
+#endif
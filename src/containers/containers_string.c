@@ -154,6 +154,33 @@ usz_t str_buf_marshal_uint(
   return digit_cnt;
 }
 
+usz_t str_buf_marshal_uint_in_hex(
+    ch_t *buf, const usz_t buf_off, const usz_t buf_len, const u64_t val)
+{
+  u64_t val_pro;
+  usz_t digit_cnt;
+  usz_t digit;
+
+  /* Counting digits in total*/
+  digit_cnt = 0;
+  val_pro = val;
+  do {
+    val_pro >>= 4;
+    digit_cnt++;
+  } while (val_pro > 0);
+  kernel_assert((buf_len - buf_off) > digit_cnt + 2);
+
+  buf[buf_off] = '0';
+  buf[buf_off + 1] = 'x';
+  val_pro = val;
+  for (usz_t i = digit_cnt; i > 0; i--) {
+    digit = val_pro & 0x0f;
+    buf[buf_off + 1 + i] = (ch_t)(digit < 10 ? digit + '0' : digit - 10 + 'A');
+    val_pro >>= 4;
+  }
+  return digit_cnt + 2;
+}
+
 usz_t str_buf_marshal_uint_in_size(
     ch_t *buf, const usz_t buf_off, const usz_t buf_len, const u64_t val)
 {
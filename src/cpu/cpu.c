@@ -1,6 +1,24 @@
 #include "cpu.h"
+#include "kernel_panic.h"
 #include "log.h"
 
+u64_t cpu_read_cr0(void)
+{
+  u64_t value;
+  __asm__("movq %%cr0, %0" : "=r"(value) : /* no input */);
+  return value;
+}
+
+void cpu_write_cr0(u64_t value)
+{
+  __asm__ volatile("movq %0, %%cr0" : /* no output */ : "r"(value));
+}
+
+void cpu_clts(void)
+{
+  __asm__ volatile("clts");
+}
+
 u64_t cpu_read_cr2(void)
 {
   u64_t value;
@@ -20,6 +38,53 @@ u64_t cpu_read_cr3(void)
   return value;
 }
 
+u64_t cpu_read_cr4(void)
+{
+  u64_t value;
+  __asm__("movq %%cr4, %0" : "=r"(value) : /* no input */);
+  return value;
+}
+
+void cpu_write_cr4(u64_t value)
+{
+  __asm__ volatile("movq %0, %%cr4" : /* no output */ : "r"(value));
+}
+
+void cpu_write_xcr(u32_t xcr, u64_t value)
+{
+  __asm__ volatile("xsetbv"
+                   : /* no output */
+                   : "c"(xcr), "a"((u32_t)value), "d"((u32_t)(value >> 32)));
+}
+
+u64_t cpu_read_msr(u32_t msr)
+{
+  u32_t lo;
+  u32_t hi;
+  __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((u64_t)hi << 32) | lo;
+}
+
+void cpu_write_msr(u32_t msr, u64_t value)
+{
+  __asm__ volatile("wrmsr"
+                   : /* no output */
+                   : "c"(msr), "a"((u32_t)value), "d"((u32_t)(value >> 32))
+                   : "memory");
+}
+
+void cpu_cpuid(u32_t leaf, u32_t sub, u32_t out[4])
+{
+  __asm__ volatile("cpuid"
+                   : "=a"(out[0]), "=b"(out[1]), "=c"(out[2]), "=d"(out[3])
+                   : "a"(leaf), "c"(sub));
+}
+
+void cpu_invlpg(uptr_t va)
+{
+  __asm__ volatile("invlpg (%0)" : /* no output */ : "r"(va) : "memory");
+}
+
 u64_t cpu_read_rbp(void)
 {
   u64_t value;
@@ -43,3 +108,86 @@ void cpu_write_rsp(u64_t value)
 {
   __asm__("movq %0, %%rsp" : /* no output */ : "r"(value));
 }
+
+void cpu_call_on_stack(uptr_t sp, void (*fn)(vptr_t), vptr_t arg)
+{
+  kernel_assert(sp % 16 == 0);
+
+  /* Callee saved RBX keeps our stack pointer across the call, everything
+   * else caller saved is clobbered by @fn. SIMD registers are not, kernel is
+   * built without them. */
+  __asm__ volatile("movq %%rsp, %%rbx\n\t"
+                   "movq %1, %%rsp\n\t"
+                   "callq *%2\n\t"
+                   "movq %%rbx, %%rsp"
+                   : "+D"(arg)
+                   : "r"(sp), "r"(fn)
+                   : "rax", "rbx", "rcx", "rdx", "rsi", "r8", "r9", "r10",
+                   "r11", "memory", "cc");
+}
+
+u64_t cpu_read_tsc(void)
+{
+  u32_t lo;
+  u32_t hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((u64_t)hi << 32) | lo;
+}
+
+bo_t cpu_atomic_cas(volatile u64_t *ptr, u64_t expect, u64_t desire)
+{
+  return __atomic_compare_exchange_n(
+      ptr, &expect, desire, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+u64_t cpu_atomic_load(volatile u64_t *ptr)
+{
+  return __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
+}
+
+void cpu_atomic_store(volatile u64_t *ptr, u64_t val)
+{
+  __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+u64_t cpu_atomic_load_acquire(volatile u64_t *ptr)
+{
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+void cpu_atomic_store_release(volatile u64_t *ptr, u64_t val)
+{
+  __atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+
+u64_t cpu_atomic_fetch_add(volatile u64_t *ptr, u64_t val)
+{
+  return __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+u64_t cpu_atomic_swap(volatile u64_t *ptr, u64_t val)
+{
+  return __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+bo_t cpu_atomic_bit_test_and_set(volatile u64_t *ptr, u8_t bit)
+{
+  u64_t mask = u64_literal(1) << bit;
+  return (__atomic_fetch_or(ptr, mask, __ATOMIC_SEQ_CST) & mask) != 0;
+}
+
+void cpu_atomic_bit_clear(volatile u64_t *ptr, u8_t bit)
+{
+  u64_t mask = u64_literal(1) << bit;
+  __atomic_fetch_and(ptr, ~mask, __ATOMIC_SEQ_CST);
+}
+
+void cpu_mfence(void)
+{
+  __asm__ volatile("mfence" ::: "memory");
+}
+
+void cpu_relax(void)
+{
+  __asm__ volatile("pause" ::: "memory");
+}
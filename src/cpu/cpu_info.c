@@ -0,0 +1,411 @@
+/* CPU features, caches and topology from CPUID, and dispatch of hot
+ * routines.
+ *
+ * Everything is read once from bootstrap processor. Routines with several
+ * implementations are called through a pointer, bound to the best
+ * implementation for this CPU at boot, and to one working on any x86-64
+ * before that. */
+#include "cpu_info.h"
+#include "cpu.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "util.h"
+
+#define _CACHE_CAP 8
+/* Below this, REP MOVSB start up costs more than it saves without FSRM. */
+#define _ERMS_COPY_MIN 128
+
+typedef enum {
+  _EAX,
+  _EBX,
+  _ECX,
+  _EDX,
+} reg_t;
+
+typedef struct {
+  const ch_t *name;
+  u32_t leaf;
+  u32_t sub;
+  reg_t reg;
+  u32_t bit;
+} feature_bit_t;
+
+/* Indexed by cpu_feature_t. */
+base_private const feature_bit_t _FEATURE_BITS[CPU_FEATURE_MAX] = {
+    {"popcnt", 0x1, 0, _ECX, 23},
+    {"monitor", 0x1, 0, _ECX, 3},
+    {"x2apic", 0x1, 0, _ECX, 21},
+    {"tsc_deadline", 0x1, 0, _ECX, 24},
+    {"xsave", 0x1, 0, _ECX, 26},
+    {"xsaveopt", 0xd, 1, _EAX, 0},
+    {"avx", 0x1, 0, _ECX, 28},
+    {"avx2", 0x7, 0, _EBX, 5},
+    {"avx512f", 0x7, 0, _EBX, 16},
+    {"bmi2", 0x7, 0, _EBX, 8},
+    {"erms", 0x7, 0, _EBX, 9},
+    {"fsrm", 0x7, 0, _EDX, 4},
+    {"invpcid", 0x7, 0, _EBX, 10},
+    {"page_1g", 0x80000001, 0, _EDX, 26},
+    {"invariant_tsc", 0x80000007, 0, _EDX, 8},
+};
+
+base_private u64_t _features;
+base_private cpu_perfmon_t _perfmon;
+base_private cpu_cache_t _caches[_CACHE_CAP];
+base_private ucnt_t _cache_cnt;
+/* Bits of local APIC id numbering threads of a core, and logical CPUs of a
+ * package. */
+base_private u32_t _smt_bits;
+base_private u32_t _pkg_bits;
+
+base_private void _copy_movsq(byte_t *dst, const byte_t *src, usz_t len);
+base_private void _zero_stosq(byte_t *mem, usz_t len);
+base_private void (*_copy)(byte_t *, const byte_t *, usz_t) = _copy_movsq;
+base_private void (*_zero)(byte_t *, usz_t) = _zero_stosq;
+
+/* @return false if @leaf is above the highest one supported. */
+base_private bo_t _cpuid(u32_t leaf, u32_t sub, u32_t out[4])
+{
+  u32_t max[4];
+  bo_t ok;
+
+  cpu_cpuid(leaf & 0x80000000, 0, max);
+  ok = leaf <= max[0];
+  if (ok) {
+    cpu_cpuid(leaf, sub, out);
+  }
+  return ok;
+}
+
+base_private void _features_read(void)
+{
+  const feature_bit_t *bit;
+  u32_t regs[4];
+
+  for (usz_t i = 0; i < CPU_FEATURE_MAX; i++) {
+    bit = &_FEATURE_BITS[i];
+    if (_cpuid(bit->leaf, bit->sub, regs) &&
+        (regs[bit->reg] & (1U << bit->bit)) != 0) {
+      _features |= u64_literal(1) << i;
+    }
+  }
+}
+
+/* Deterministic cache parameters, leaf 4 and 0x8000001D share the format. */
+base_private void _caches_read(u32_t leaf)
+{
+  cpu_cache_t *cache;
+  u32_t regs[4];
+  u32_t type;
+  u32_t parts;
+
+  for (u32_t sub = 0; _cache_cnt < _CACHE_CAP; sub++) {
+    if (!_cpuid(leaf, sub, regs)) {
+      break;
+    }
+    type = regs[_EAX] & 0x1f;
+    if (type == 0) {
+      break;
+    }
+    cache = &_caches[_cache_cnt++];
+    cache->type = (cpu_cache_type_t)type;
+    cache->level = (regs[_EAX] >> 5) & 0x7;
+    cache->shared_by = ((regs[_EAX] >> 14) & 0xfff) + 1;
+    cache->line = (regs[_EBX] & 0xfff) + 1;
+    parts = ((regs[_EBX] >> 12) & 0x3ff) + 1;
+    cache->ways = ((regs[_EBX] >> 22) & 0x3ff) + 1;
+    cache->sets = regs[_ECX] + 1;
+    cache->size = (u64_t)cache->line * parts * cache->ways * cache->sets;
+  }
+}
+
+/* Widths of thread and core fields of local APIC id, from extended topology
+ * leaf if there is, or from logical CPU count of leaf 1. */
+base_private void _topology_read(void)
+{
+  u32_t regs[4];
+  u32_t leaf;
+  u32_t type;
+  u32_t shift;
+
+  leaf = 0x1f;
+  if (!_cpuid(leaf, 0, regs) || regs[_EBX] == 0) {
+    leaf = 0xb;
+  }
+  if (_cpuid(leaf, 0, regs) && regs[_EBX] != 0) {
+    for (u32_t sub = 0; _cpuid(leaf, sub, regs); sub++) {
+      type = (regs[_ECX] >> 8) & 0xff;
+      if (type == 0) {
+        break;
+      }
+      /* Shift of a level is the bits of all levels below and itself. */
+      shift = regs[_EAX] & 0x1f;
+      if (type == 1) {
+        _smt_bits = shift;
+      }
+      _pkg_bits = shift;
+    }
+  } else {
+    cpu_cpuid(0x1, 0, regs);
+    _pkg_bits = (u32_t)util_math_log_2_up((regs[_EBX] >> 16) & 0xff);
+  }
+}
+
+base_private void _copy_movsq(byte_t *dst, const byte_t *src, usz_t len)
+{
+  usz_t words = len / 8;
+
+  __asm__ volatile("rep movsq\n\t"
+                   "movq %3, %%rcx\n\t"
+                   "rep movsb"
+                   : "+D"(dst), "+S"(src), "+c"(words)
+                   : "r"(len % 8)
+                   : "memory");
+}
+
+base_private void _copy_movsb(byte_t *dst, const byte_t *src, usz_t len)
+{
+  __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(len) : : "memory");
+}
+
+base_private void _copy_erms(byte_t *dst, const byte_t *src, usz_t len)
+{
+  if (len < _ERMS_COPY_MIN) {
+    _copy_movsq(dst, src, len);
+  } else {
+    _copy_movsb(dst, src, len);
+  }
+}
+
+base_private void _zero_stosq(byte_t *mem, usz_t len)
+{
+  usz_t words = len / 8;
+
+  __asm__ volatile("rep stosq\n\t"
+                   "movq %2, %%rcx\n\t"
+                   "rep stosb"
+                   : "+D"(mem), "+c"(words)
+                   : "r"(len % 8), "a"(0)
+                   : "memory");
+}
+
+base_private void _zero_stosb(byte_t *mem, usz_t len)
+{
+  __asm__ volatile("rep stosb" : "+D"(mem), "+c"(len) : "a"(0) : "memory");
+}
+
+base_private const cpu_impl_t _COPY_IMPLS[] = {
+    {"rep movsb", CPU_FEATURE_FSRM, _copy_movsb},
+    {"rep movsb above 128 bytes", CPU_FEATURE_ERMS, _copy_erms},
+    {"rep movsq", CPU_FEATURE_MAX, _copy_movsq},
+};
+
+base_private const cpu_impl_t _ZERO_IMPLS[] = {
+    {"rep stosb", CPU_FEATURE_ERMS, _zero_stosb},
+    {"rep stosq", CPU_FEATURE_MAX, _zero_stosq},
+};
+
+#define _IMPL_CNT(impls) (sizeof(impls) / sizeof(impls[0]))
+
+void cpu_info_bootstrap(void)
+{
+  u32_t regs[4];
+  ch_t vendor[13];
+  cpu_cache_t *cache;
+
+  cpu_cpuid(0, 0, regs);
+  *(u32_t *)vendor = regs[_EBX];
+  *(u32_t *)(vendor + 4) = regs[_EDX];
+  *(u32_t *)(vendor + 8) = regs[_ECX];
+  vendor[12] = '\0';
+  cpu_cpuid(1, 0, regs);
+  log_line_format(LOG_LEVEL_INFO, "CPU %s, family %lu, model %lu, stepping %lu",
+      vendor,
+      (u64_t)(((regs[_EAX] >> 8) & 0xf) + ((regs[_EAX] >> 20) & 0xff)),
+      (u64_t)(((regs[_EAX] >> 4) & 0xf) | ((regs[_EAX] >> 12) & 0xf0)),
+      (u64_t)(regs[_EAX] & 0xf));
+
+  _features_read();
+  for (usz_t i = 0; i < CPU_FEATURE_MAX; i++) {
+    if (cpu_has((cpu_feature_t)i)) {
+      log_line_format(LOG_LEVEL_INFO, "CPU feature: %s", _FEATURE_BITS[i].name);
+    }
+  }
+
+  _caches_read(0x4);
+  if (_cache_cnt == 0) {
+    _caches_read(0x8000001d);
+  }
+  for (usz_t i = 0; i < _cache_cnt; i++) {
+    cache = &_caches[i];
+    log_line_format(LOG_LEVEL_INFO,
+        "L%lu %s cache: %lu KB, %lu ways, %lu bytes lines, shared by %lu",
+        (u64_t)cache->level,
+        cache->type == CPU_CACHE_DATA   ? "data"
+        : cache->type == CPU_CACHE_INST ? "instruction"
+                                        : "unified",
+        cache->size / 1024, (u64_t)cache->ways, (u64_t)cache->line,
+        (u64_t)cache->shared_by);
+  }
+
+  _topology_read();
+  log_line_format(LOG_LEVEL_INFO,
+      "CPU topology: %lu threads per core, %lu logical CPUs per package",
+      u64_literal(1) << _smt_bits, u64_literal(1) << _pkg_bits);
+
+  if (_cpuid(0xa, 0, regs)) {
+    _perfmon.version = regs[_EAX] & 0xff;
+    _perfmon.counters = (regs[_EAX] >> 8) & 0xff;
+    _perfmon.width = (regs[_EAX] >> 16) & 0xff;
+    /* EBX tells events absent, for as many bits as EAX bits 24..31 say. */
+    _perfmon.events =
+        ~regs[_EBX] & (u32_t)((u64_literal(1) << (regs[_EAX] >> 24)) - 1);
+  }
+  log_line_format(LOG_LEVEL_INFO,
+      "Performance monitoring version %lu, %lu counters of %lu bits",
+      (u64_t)_perfmon.version, (u64_t)_perfmon.counters,
+      (u64_t)_perfmon.width);
+
+  _copy = cpu_dispatch("copy", _COPY_IMPLS, _IMPL_CNT(_COPY_IMPLS));
+  _zero = cpu_dispatch("zero", _ZERO_IMPLS, _IMPL_CNT(_ZERO_IMPLS));
+}
+
+bo_t cpu_has(cpu_feature_t feature)
+{
+  kernel_assert(feature < CPU_FEATURE_MAX);
+  return (_features & (u64_literal(1) << feature)) != 0;
+}
+
+const cpu_perfmon_t *cpu_perfmon(void)
+{
+  return &_perfmon;
+}
+
+ucnt_t cpu_cache_cnt(void)
+{
+  return _cache_cnt;
+}
+
+const cpu_cache_t *cpu_cache(usz_t idx)
+{
+  kernel_assert(idx < _cache_cnt);
+  return &_caches[idx];
+}
+
+u64_t cpu_cache_size(u32_t level)
+{
+  u64_t size;
+
+  size = 0;
+  for (usz_t i = 0; i < _cache_cnt; i++) {
+    if (_caches[i].level == level && _caches[i].type != CPU_CACHE_INST) {
+      size = _caches[i].size;
+    }
+  }
+  return size;
+}
+
+u32_t cpu_cache_line(void)
+{
+  u32_t line;
+
+  /* Every x86-64 so far, in case CPUID does not tell. */
+  line = 64;
+  for (usz_t i = 0; i < _cache_cnt; i++) {
+    if (_caches[i].level == 1 && _caches[i].type == CPU_CACHE_DATA) {
+      line = _caches[i].line;
+    }
+  }
+  return line;
+}
+
+cpu_topology_t cpu_topology(u32_t apic_id)
+{
+  cpu_topology_t topo;
+
+  topo.thread = apic_id & ((1U << _smt_bits) - 1);
+  topo.core = (apic_id & ((1U << _pkg_bits) - 1)) >> _smt_bits;
+  topo.package = apic_id >> _pkg_bits;
+  return topo;
+}
+
+vptr_t cpu_dispatch(const ch_t *routine, const cpu_impl_t *impls, ucnt_t cnt)
+{
+  const cpu_impl_t *impl;
+
+  kernel_assert(cnt > 0 && impls[cnt - 1].need == CPU_FEATURE_MAX);
+  impl = impls;
+  while (impl->need != CPU_FEATURE_MAX && !cpu_has(impl->need)) {
+    impl++;
+  }
+  log_line_format(
+      LOG_LEVEL_INFO, "Routine %s bound to %s", routine, impl->name);
+  return impl->fn;
+}
+
+void cpu_mem_copy(byte_t *dst, const byte_t *src, usz_t len)
+{
+  _copy(dst, src, len);
+}
+
+void cpu_mem_zero(byte_t *mem, usz_t len)
+{
+  _zero(mem, len);
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#define _TEST_LEN 512
+
+base_private byte_t _test_src[_TEST_LEN + 16];
+base_private byte_t _test_dst[_TEST_LEN + 16];
+
+/* Each implementation, not only the one bound, copies and zeroes exactly the
+ * bytes asked at any alignment, and the topology of this CPU is sane. */
+void test_cpu_info(void)
+{
+  void (*copy)(byte_t *, const byte_t *, usz_t);
+  void (*zero)(byte_t *, usz_t);
+  usz_t lens[] = {0, 1, 7, 8, 9, 63, 127, 128, 129, _TEST_LEN};
+
+  for (usz_t i = 0; i < _TEST_LEN + 16; i++) {
+    _test_src[i] = (byte_t)(i * 7 + 1);
+  }
+  for (usz_t c = 0; c < _IMPL_CNT(_COPY_IMPLS); c++) {
+    copy = _COPY_IMPLS[c].fn;
+    for (usz_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+      for (usz_t off = 0; off < 8; off++) {
+        for (usz_t i = 0; i < _TEST_LEN + 16; i++) {
+          _test_dst[i] = 0xa5;
+        }
+        /* Source misaligned the other way than destination. */
+        copy(_test_dst + off, _test_src + 8 - off, lens[l]);
+        for (usz_t i = 0; i < _TEST_LEN + 16; i++) {
+          kernel_assert(_test_dst[i] == (i >= off && i < off + lens[l]
+                                                ? _test_src[i + 8 - 2 * off]
+                                                : 0xa5));
+        }
+      }
+    }
+  }
+
+  for (usz_t z = 0; z < _IMPL_CNT(_ZERO_IMPLS); z++) {
+    zero = _ZERO_IMPLS[z].fn;
+    for (usz_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+      for (usz_t off = 0; off < 8; off++) {
+        for (usz_t i = 0; i < _TEST_LEN + 16; i++) {
+          _test_dst[i] = 0xa5;
+        }
+        zero(_test_dst + off, lens[l]);
+        for (usz_t i = 0; i < _TEST_LEN + 16; i++) {
+          kernel_assert(_test_dst[i] ==
+                        (i >= off && i < off + lens[l] ? 0 : 0xa5));
+        }
+      }
+    }
+  }
+
+  kernel_assert(cpu_cache_line() >= 16);
+  kernel_assert(_smt_bits <= _pkg_bits);
+  log_builtin_test_pass();
+}
+#endif
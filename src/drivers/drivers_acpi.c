@@ -44,6 +44,130 @@ typedef struct rsdp_descriptor_2 {
   u8_t reserved[3];
 } base_struct_packed rsdp_descriptor_2_t;
 
+/* MADT: Multiple APIC Description Table, signature "APIC". */
+typedef struct madt {
+  sdt_header_t header;
+  u32_t lapic_pa;
+  u32_t flags;
+  /* Variable length interrupt controller structures follows */
+} base_struct_packed madt_t;
+
+typedef enum {
+  _MADT_TYPE_LAPIC = 0,
+  _MADT_TYPE_IOAPIC = 1,
+  _MADT_TYPE_SOURCE_OVERRIDE = 2,
+  _MADT_TYPE_LAPIC_OVERRIDE = 5,
+  _MADT_TYPE_X2APIC = 9,
+} madt_type_t;
+
+/* Processor enabled, or can be enabled while system running. */
+#define _MADT_CPU_ENABLED 0x1
+#define _MADT_CPU_ONLINE_CAPABLE 0x2
+
+base_private uptr_t _lapic_pa;
+base_private u32_t _cpu_apic_ids[ACPI_CPU_MAX];
+base_private ucnt_t _cpu_cnt;
+base_private uptr_t _ioapic_pas[ACPI_IOAPIC_MAX];
+base_private u32_t _ioapic_gsi_bases[ACPI_IOAPIC_MAX];
+base_private ucnt_t _ioapic_cnt;
+/* ISA IRQs are identity mapped to global system interrupts, unless
+ * overridden. */
+base_private u32_t _isa_gsis[ACPI_ISA_IRQ_CNT];
+base_private u16_t _isa_flags[ACPI_ISA_IRQ_CNT];
+
+/* HPET: High Precision Event Timer table, signature "HPET". Registers are
+ * described by a generic address structure, always in memory space. */
+typedef struct {
+  sdt_header_t header;
+  u32_t block_id;
+  u8_t space_id; /* 0 for memory space */
+  u8_t bit_width;
+  u8_t bit_offset;
+  u8_t access_size;
+  u64_t pa;
+  u8_t number;
+  u16_t min_tick;
+  u8_t page_protection;
+} base_struct_packed hpet_table_t;
+
+base_private uptr_t _hpet_pa;
+
+base_private void _init_hpet(const sdt_header_t *h)
+{
+  const hpet_table_t *hpet = (const hpet_table_t *)h;
+
+  if (hpet->space_id == 0) {
+    _hpet_pa = hpet->pa;
+    log_line_format(LOG_LEVEL_INFO, "HPET at %lu", _hpet_pa);
+  }
+}
+
+base_private void _madt_add_cpu(u32_t apic_id, u32_t flags)
+{
+  if ((flags & (_MADT_CPU_ENABLED | _MADT_CPU_ONLINE_CAPABLE)) == 0) {
+    /* Not usable */
+  } else if (_cpu_cnt == ACPI_CPU_MAX) {
+    log_line_format(LOG_LEVEL_WARN, "Too many CPUs, APIC id %lu ignored",
+        (u64_t)apic_id);
+  } else {
+    _cpu_apic_ids[_cpu_cnt] = apic_id;
+    _cpu_cnt++;
+  }
+}
+
+base_private void _init_madt(const sdt_header_t *h)
+{
+  const madt_t *madt = (const madt_t *)h;
+  const byte_t *ent;
+  const byte_t *end;
+
+  _lapic_pa = madt->lapic_pa;
+  for (u8_t irq = 0; irq < ACPI_ISA_IRQ_CNT; irq++) {
+    _isa_gsis[irq] = irq;
+    _isa_flags[irq] = 0;
+  }
+  ent = (const byte_t *)h + sizeof(madt_t);
+  end = (const byte_t *)h + h->len;
+  while (ent + 2 <= end && ent[1] >= 2) {
+    switch (ent[0]) {
+    case _MADT_TYPE_LAPIC:
+      /* ACPI processor id, APIC id, flags */
+      _madt_add_cpu(ent[3], *(const u32_t *)(ent + 4));
+      break;
+    case _MADT_TYPE_IOAPIC:
+      /* I/O APIC id, reserved, address, global system interrupt base */
+      if (_ioapic_cnt == ACPI_IOAPIC_MAX) {
+        log_line_format(LOG_LEVEL_WARN, "Too many I/O APICs, %lu ignored",
+            (u64_t)ent[2]);
+      } else {
+        _ioapic_pas[_ioapic_cnt] = *(const u32_t *)(ent + 4);
+        _ioapic_gsi_bases[_ioapic_cnt] = *(const u32_t *)(ent + 8);
+        _ioapic_cnt++;
+      }
+      break;
+    case _MADT_TYPE_SOURCE_OVERRIDE:
+      /* Bus (always 0, ISA), source IRQ, global system interrupt, flags */
+      if (ent[3] < ACPI_ISA_IRQ_CNT) {
+        _isa_gsis[ent[3]] = *(const u32_t *)(ent + 4);
+        _isa_flags[ent[3]] = *(const u16_t *)(ent + 8);
+      }
+      break;
+    case _MADT_TYPE_LAPIC_OVERRIDE:
+      _lapic_pa = *(const u64_t *)(ent + 4);
+      break;
+    case _MADT_TYPE_X2APIC:
+      _madt_add_cpu(*(const u32_t *)(ent + 4), *(const u32_t *)(ent + 8));
+      break;
+    default:
+      break;
+    }
+    ent += ent[1];
+  }
+  log_line_format(LOG_LEVEL_INFO,
+      "MADT local APIC: %lu, CPUs: %lu, I/O APICs: %lu", _lapic_pa, _cpu_cnt,
+      _ioapic_cnt);
+}
+
 base_private void _init_xsdt(xsdt_t *xsdt)
 {
   usz_t entry_cnt;
@@ -71,6 +195,14 @@ base_private void _init_xsdt(xsdt_t *xsdt)
     if (cmp == 0) {
       d_pcie_bootstrap((const byte_t *)((uptr_t)h + 44), h->len - 44);
     }
+    cmp = mm_compare((byte_t *)(h->signature), (byte_t *)"APIC", 4);
+    if (cmp == 0) {
+      _init_madt(h);
+    }
+    cmp = mm_compare((byte_t *)(h->signature), (byte_t *)"HPET", 4);
+    if (cmp == 0) {
+      _init_hpet(h);
+    }
   }
 }
 
@@ -123,6 +255,14 @@ base_private void _init_rsdt(byte_t *rsdt)
     if (cmp == 0) {
       d_pcie_bootstrap((const byte_t *)((uptr_t)sdt + 44), sdt->len - 44);
     }
+    cmp = mm_compare((byte_t *)(sdt->signature), (byte_t *)"APIC", 4);
+    if (cmp == 0) {
+      _init_madt(sdt);
+    }
+    cmp = mm_compare((byte_t *)(sdt->signature), (byte_t *)"HPET", 4);
+    if (cmp == 0) {
+      _init_hpet(sdt);
+    }
   }
 }
 
@@ -163,3 +303,43 @@ void acpi_bootstrap_32(const byte_t *multi_boot_info, usz_t len)
 
   _init_rsdt((byte_t *)(u64_t)rsdt_addr);
 }
+
+uptr_t acpi_lapic_pa(void)
+{
+  return _lapic_pa;
+}
+
+ucnt_t acpi_cpu_cnt(void)
+{
+  return _cpu_cnt;
+}
+
+u32_t acpi_cpu_apic_id(ucnt_t idx)
+{
+  kernel_assert(idx < _cpu_cnt);
+  return _cpu_apic_ids[idx];
+}
+
+ucnt_t acpi_ioapic_cnt(void)
+{
+  return _ioapic_cnt;
+}
+
+void acpi_ioapic(ucnt_t idx, uptr_t *out_pa, u32_t *out_gsi_base)
+{
+  kernel_assert(idx < _ioapic_cnt);
+  *out_pa = _ioapic_pas[idx];
+  *out_gsi_base = _ioapic_gsi_bases[idx];
+}
+
+u32_t acpi_isa_irq_gsi(u8_t irq, u16_t *out_flags)
+{
+  kernel_assert(irq < ACPI_ISA_IRQ_CNT);
+  *out_flags = _isa_flags[irq];
+  return _isa_gsis[irq];
+}
+
+uptr_t acpi_hpet_pa(void)
+{
+  return _hpet_pa;
+}
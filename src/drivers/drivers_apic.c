@@ -0,0 +1,379 @@
+/* Local APIC and I/O APIC.
+ *
+ * Local APIC is used in x2APIC mode when CPU supports it, registers are then
+ * MSRs and EOI is a single WRMSR, otherwise in xAPIC mode through memory
+ * mapped registers. ISA IRQs are routed by I/O APICs to vector 32 + IRQ, the
+ * same as legacy PIC did, and PIC is masked. */
+#include "drivers_apic.h"
+#include "cpu.h"
+#include "cpu_info.h"
+#include "drivers_acpi.h"
+#include "drivers_time.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem.h"
+
+#define _REGS_LEN 4096
+#define _REG_ID 0x20
+#define _REG_TPR 0x80
+#define _REG_EOI 0xb0
+#define _REG_SVR 0xf0
+#define _REG_ICR_LOW 0x300
+#define _REG_ICR_HIGH 0x310
+#define _REG_LVT_TIMER 0x320
+#define _REG_LVT_PMC 0x340
+#define _REG_TIMER_INIT 0x380
+#define _REG_TIMER_CUR 0x390
+#define _REG_TIMER_DIV 0x3e0
+
+/* Spurious interrupt vector register, bit 8 enables local APIC. */
+#define _SVR_ENABLE 0x100
+
+/* Interrupt command register: delivery mode at bits 8..10, level assert at
+ * bit 14, delivery status at bit 12. */
+#define _ICR_PENDING 0x1000
+#define _ICR_INIT 0x4500
+#define _ICR_STARTUP 0x4600
+#define _ICR_FIXED 0x4000
+
+/* Delivery mode of LVT entries other than timer, at bits 8..10. */
+#define _LVT_NMI 0x400
+#define _LVT_MASKED 0x10000
+
+/* Timer counts down at bus clock divided by 16, the divide configuration
+ * encoding of 16 is 3. Timer mode is bits 17..18 of LVT timer register, 0 for
+ * one-shot and 2 for TSC-deadline, where the timer fires once TSC reaches
+ * the deadline MSR instead of counting down. */
+#define _TIMER_DIV_16 0x3
+#define _TIMER_ONESHOT 0x0
+#define _TIMER_DEADLINE 0x40000
+#define _TIMER_MASKED 0x10000
+#define _MSR_TSC_DEADLINE 0x6e0
+#define _TIMER_CALIBRATE_US 10000
+
+/* In x2APIC mode, register at offset x of xAPIC is MSR 0x800 + x / 16. */
+#define _MSR_APIC_BASE 0x1b
+#define _MSR_APIC_BASE_ENABLE (u64_literal(1) << 11)
+#define _MSR_APIC_BASE_X2APIC (u64_literal(1) << 10)
+#define _MSR_X2APIC_BASE 0x800
+
+/* I/O APIC registers are accessed indirectly, through a select register and
+ * a window register. */
+#define _IOAPIC_REGS_LEN 0x20
+#define _IOAPIC_SEL 0x0
+#define _IOAPIC_WIN 0x10
+#define _IOAPIC_REG_VER 0x1
+#define _IOAPIC_REG_REDIR 0x10
+/* Redirection entry: vector at bits 0..7, fixed delivery mode, physical
+ * destination, polarity at bit 13, trigger mode at bit 15, mask at bit 16,
+ * destination APIC id at bits 56..63. */
+#define _REDIR_ACTIVE_LOW (u64_literal(1) << 13)
+#define _REDIR_LEVEL (u64_literal(1) << 15)
+#define _REDIR_MASKED (u64_literal(1) << 16)
+
+/* IRQ 2 is where the slave PIC was cascaded to, never raised. */
+#define _ISA_IRQ_CASCADE 2
+
+typedef struct {
+  volatile u32_t *regs;
+  u32_t gsi_base;
+  ucnt_t gsi_cnt;
+} ioapic_t;
+
+base_private volatile u32_t *_regs;
+base_private bo_t _x2apic;
+base_private ioapic_t _ioapics[ACPI_IOAPIC_MAX];
+base_private ucnt_t _ioapic_cnt;
+/* Timer counts per second, calibrated once by the first CPU starting its
+ * timer, all CPUs share the same bus clock. */
+base_private volatile u64_t _timer_hz;
+
+base_private u32_t _reg_read(u32_t reg)
+{
+  u32_t val;
+
+  if (_x2apic) {
+    val = (u32_t)cpu_read_msr(_MSR_X2APIC_BASE + reg / 16);
+  } else {
+    val = _regs[reg / 4];
+  }
+  return val;
+}
+
+base_private void _reg_write(u32_t reg, u32_t val)
+{
+  if (_x2apic) {
+    cpu_write_msr(_MSR_X2APIC_BASE + reg / 16, val);
+  } else {
+    _regs[reg / 4] = val;
+  }
+}
+
+base_private void _icr_send(u32_t apic_id, u32_t cmd)
+{
+  if (_x2apic) {
+    /* ICR is one 64 bits MSR, no delivery status to wait for. */
+    cpu_write_msr(
+        _MSR_X2APIC_BASE + _REG_ICR_LOW / 16, ((u64_t)apic_id << 32) | cmd);
+  } else {
+    kernel_assert(apic_id <= U8_MAX);
+    _reg_write(_REG_ICR_HIGH, apic_id << 24);
+    _reg_write(_REG_ICR_LOW, cmd);
+    while ((_reg_read(_REG_ICR_LOW) & _ICR_PENDING) != 0) {
+      cpu_relax();
+    }
+  }
+}
+
+base_private u32_t _ioapic_read(ioapic_t *io, u32_t reg)
+{
+  io->regs[_IOAPIC_SEL / 4] = reg;
+  return io->regs[_IOAPIC_WIN / 4];
+}
+
+base_private void _ioapic_write(ioapic_t *io, u32_t reg, u32_t val)
+{
+  io->regs[_IOAPIC_SEL / 4] = reg;
+  io->regs[_IOAPIC_WIN / 4] = val;
+}
+
+base_private void _ioapic_redir_write(ioapic_t *io, u32_t pin, u64_t entry)
+{
+  /* Mask it first, so that a half written entry never fires. */
+  _ioapic_write(io, _IOAPIC_REG_REDIR + pin * 2, (u32_t)_REDIR_MASKED);
+  _ioapic_write(io, _IOAPIC_REG_REDIR + pin * 2 + 1, (u32_t)(entry >> 32));
+  _ioapic_write(io, _IOAPIC_REG_REDIR + pin * 2, (u32_t)entry);
+}
+
+/* @return I/O APIC serving global system interrupt @gsi, or NULL. */
+base_private ioapic_t *_ioapic_of(u32_t gsi)
+{
+  ioapic_t *res;
+
+  res = NULL;
+  for (usz_t i = 0; i < _ioapic_cnt; i++) {
+    if (gsi >= _ioapics[i].gsi_base &&
+        gsi < _ioapics[i].gsi_base + _ioapics[i].gsi_cnt) {
+      res = &_ioapics[i];
+      break;
+    }
+  }
+  return res;
+}
+
+base_private void _ioapic_bootstrap(void)
+{
+  ioapic_t *io;
+  uptr_t pa;
+  u32_t gsi_base;
+
+  _ioapic_cnt = acpi_ioapic_cnt();
+  for (usz_t i = 0; i < _ioapic_cnt; i++) {
+    io = &_ioapics[i];
+    acpi_ioapic(i, &pa, &gsi_base);
+    io->regs = (volatile u32_t *)mem_mmio_map(pa, _IOAPIC_REGS_LEN);
+    kernel_assert(io->regs != NULL);
+    io->gsi_base = gsi_base;
+    /* Max redirection entry at bits 16..23 of version register. */
+    io->gsi_cnt = ((_ioapic_read(io, _IOAPIC_REG_VER) >> 16) & 0xff) + 1;
+    for (u32_t pin = 0; pin < io->gsi_cnt; pin++) {
+      _ioapic_redir_write(io, pin, _REDIR_MASKED);
+    }
+    log_line_format(LOG_LEVEL_INFO, "I/O APIC at %lu, GSI %lu..%lu", pa,
+        (u64_t)gsi_base, (u64_t)gsi_base + io->gsi_cnt - 1);
+  }
+
+  /* The rest stay masked, they are routed when handlers are registered. */
+  for (u8_t irq = 0; irq < ACPI_ISA_IRQ_CNT; irq++) {
+    if (irq != _ISA_IRQ_CASCADE &&
+        intr_handler_registered((intr_id_t)(INTR_ID_IRQ_TIME + irq))) {
+      d_ioapic_route_isa(irq, (u8_t)(INTR_ID_IRQ_TIME + irq), d_apic_id());
+    }
+  }
+}
+
+void d_apic_bootstrap(void)
+{
+  if (acpi_lapic_pa() == 0) {
+    log_line_format(LOG_LEVEL_WARN, "No local APIC, keep using legacy PIC");
+  } else {
+    _x2apic = cpu_has(CPU_FEATURE_X2APIC);
+    if (!_x2apic) {
+      _regs = (volatile u32_t *)mem_mmio_map(acpi_lapic_pa(), _REGS_LEN);
+      kernel_assert(_regs != NULL);
+    }
+    d_apic_init_cpu();
+    log_line_format(LOG_LEVEL_INFO, "Local APIC in %s mode, id: %lu",
+        _x2apic ? "x2APIC" : "xAPIC", (u64_t)d_apic_id());
+
+    if (acpi_ioapic_cnt() == 0) {
+      log_line_format(LOG_LEVEL_WARN, "No I/O APIC, keep using legacy PIC");
+    } else {
+      _ioapic_bootstrap();
+      intr_pic_disable();
+    }
+  }
+}
+
+bo_t d_apic_ready(void)
+{
+  return _x2apic || _regs != NULL;
+}
+
+void d_apic_init_cpu(void)
+{
+  u64_t base;
+
+  if (_x2apic) {
+    base = cpu_read_msr(_MSR_APIC_BASE);
+    cpu_write_msr(_MSR_APIC_BASE, base | _MSR_APIC_BASE_ENABLE);
+    cpu_write_msr(_MSR_APIC_BASE,
+        base | _MSR_APIC_BASE_ENABLE | _MSR_APIC_BASE_X2APIC);
+  }
+  /* Accept interrupts of all priorities. */
+  _reg_write(_REG_TPR, 0);
+  _reg_write(_REG_SVR, _SVR_ENABLE | INTR_ID_SPURIOUS);
+}
+
+u32_t d_apic_id(void)
+{
+  u32_t id;
+
+  id = _reg_read(_REG_ID);
+  if (!_x2apic) {
+    id >>= 24;
+  }
+  return id;
+}
+
+bo_t d_apic_x2apic(void)
+{
+  return _x2apic;
+}
+
+void d_apic_eoi(void)
+{
+  _reg_write(_REG_EOI, 0);
+}
+
+void d_apic_send_init(u32_t apic_id)
+{
+  _icr_send(apic_id, _ICR_INIT);
+}
+
+void d_apic_send_startup(u32_t apic_id, u8_t vector)
+{
+  _icr_send(apic_id, _ICR_STARTUP | vector);
+}
+
+/* Count timer down against PIT for a while, timer is left stopped. */
+base_private u64_t _timer_calibrate(void)
+{
+  u64_t left;
+
+  _reg_write(_REG_TIMER_DIV, _TIMER_DIV_16);
+  _reg_write(_REG_LVT_TIMER, _TIMER_MASKED);
+  _reg_write(_REG_TIMER_INIT, U32_MAX);
+  time_delay_us(_TIMER_CALIBRATE_US);
+  left = _reg_read(_REG_TIMER_CUR);
+  _reg_write(_REG_TIMER_INIT, 0);
+  return (U32_MAX - left) * (1000000 / _TIMER_CALIBRATE_US);
+}
+
+void d_apic_pmi_nmi(bo_t enable)
+{
+  _reg_write(_REG_LVT_PMC, enable ? _LVT_NMI : _LVT_MASKED);
+}
+
+bo_t d_apic_timer_deadline_ready(void)
+{
+  return d_apic_ready() && cpu_has(CPU_FEATURE_TSC_DEADLINE);
+}
+
+void d_apic_timer_deadline(u8_t vector)
+{
+  _reg_write(_REG_LVT_TIMER, _TIMER_DEADLINE | vector);
+  /* Deadline MSR writes must not pass the mode switch, see Intel SDM
+   * 10.5.4.1. */
+  cpu_mfence();
+  cpu_write_msr(_MSR_TSC_DEADLINE, 0);
+}
+
+void d_apic_timer_deadline_set(u64_t tsc)
+{
+  cpu_write_msr(_MSR_TSC_DEADLINE, tsc);
+}
+
+void d_apic_timer_oneshot(u8_t vector)
+{
+  u64_t timer_hz;
+
+  timer_hz = cpu_atomic_load(&_timer_hz);
+  if (timer_hz == 0) {
+    timer_hz = _timer_calibrate();
+    cpu_atomic_store(&_timer_hz, timer_hz);
+    log_line_format(LOG_LEVEL_INFO, "Local APIC timer at %lu KHz",
+        timer_hz / 1000);
+  }
+  _reg_write(_REG_TIMER_DIV, _TIMER_DIV_16);
+  _reg_write(_REG_LVT_TIMER, _TIMER_ONESHOT | vector);
+}
+
+void d_apic_timer_oneshot_set(u64_t ns)
+{
+  u64_t count;
+
+  kernel_assert(ns <= 1000000000);
+  count = ns * cpu_atomic_load(&_timer_hz) / 1000000000;
+  if (ns > 0 && count == 0) {
+    count = 1;
+  }
+  if (count > U32_MAX) {
+    count = U32_MAX;
+  }
+  /* Writing 0 stops the timer. */
+  _reg_write(_REG_TIMER_INIT, (u32_t)count);
+}
+
+void d_apic_send_ipi(u32_t apic_id, u8_t vector)
+{
+  u64_t flags;
+
+  /* ICR of xAPIC is written in two halves. */
+  flags = intr_irq_save();
+  _icr_send(apic_id, _ICR_FIXED | vector);
+  intr_irq_restore(flags);
+}
+
+void d_ioapic_route(u32_t gsi, u8_t vector, u16_t flags, u32_t apic_id)
+{
+  ioapic_t *io;
+  u64_t entry;
+
+  /* Physical destination mode only takes 8 bits APIC ids. */
+  kernel_assert(apic_id <= U8_MAX);
+  entry = vector | ((u64_t)apic_id << 56);
+  if ((flags & ACPI_IRQ_FLAG_POLARITY_MASK) == ACPI_IRQ_FLAG_ACTIVE_LOW) {
+    entry |= _REDIR_ACTIVE_LOW;
+  }
+  if ((flags & ACPI_IRQ_FLAG_TRIGGER_MASK) == ACPI_IRQ_FLAG_LEVEL) {
+    entry |= _REDIR_LEVEL;
+  }
+
+  io = _ioapic_of(gsi);
+  if (io == NULL) {
+    log_line_format(LOG_LEVEL_WARN, "No I/O APIC serves GSI %lu", (u64_t)gsi);
+  } else {
+    _ioapic_redir_write(io, gsi - io->gsi_base, entry);
+  }
+}
+
+void d_ioapic_route_isa(u8_t irq, u8_t vector, u32_t apic_id)
+{
+  u16_t flags;
+  u32_t gsi;
+
+  gsi = acpi_isa_irq_gsi(irq, &flags);
+  d_ioapic_route(gsi, vector, flags, apic_id);
+}
@@ -0,0 +1,98 @@
+/* High Precision Event Timer.
+ *
+ * Main counter is used as a reference clock, and timer 0 as the clock event
+ * of last resort when there is no local APIC. Timer 0 is routed to ISA IRQ 0
+ * in legacy replacement mode, which saves parsing its routing capabilities,
+ * and replaces PIT channel 0, which is not used anyway. */
+#include "drivers_hpet.h"
+#include "drivers_acpi.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem.h"
+
+#define _REGS_LEN 1024
+#define _REG_CAP 0x0
+#define _REG_CONF 0x10
+#define _REG_COUNTER 0xf0
+#define _REG_T0_CONF 0x100
+#define _REG_T0_COMP 0x108
+
+/* Capabilities: period in femtoseconds at bits 32..63, 64 bits counter at bit
+ * 13, legacy replacement route at bit 15. */
+#define _CAP_COUNTER_64 (u64_literal(1) << 13)
+#define _CAP_LEGACY (u64_literal(1) << 15)
+#define _CONF_ENABLE 0x1
+#define _CONF_LEGACY 0x2
+/* Timer configuration: edge triggered, one-shot, interrupt enabled at bit 2. */
+#define _T_CONF_INT 0x4
+/* Longest legal period, 100 ns, see HPET spec 2.3.4. */
+#define _PERIOD_FS_MAX 100000000
+
+base_private volatile u64_t *_regs;
+base_private u64_t _period_fs;
+base_private bo_t _legacy;
+
+void d_hpet_bootstrap(void)
+{
+  uptr_t pa;
+  u64_t cap;
+
+  pa = acpi_hpet_pa();
+  if (pa == 0) {
+    log_line_format(LOG_LEVEL_WARN, "No HPET");
+  } else {
+    _regs = (volatile u64_t *)mem_mmio_map(pa, _REGS_LEN);
+    kernel_assert(_regs != NULL);
+    cap = _regs[_REG_CAP / 8];
+    _period_fs = cap >> 32;
+    kernel_assert(_period_fs > 0 && _period_fs <= _PERIOD_FS_MAX);
+    if ((cap & _CAP_COUNTER_64) == 0) {
+      /* A 32 bits counter wraps in minutes, not usable as a clock. */
+      log_line_format(LOG_LEVEL_WARN, "HPET counter is 32 bits, not used");
+      _regs = NULL;
+    } else {
+      _legacy = (cap & _CAP_LEGACY) != 0;
+      _regs[_REG_T0_CONF / 8] = 0;
+      _regs[_REG_CONF / 8] = _CONF_ENABLE | (_legacy ? _CONF_LEGACY : 0);
+      log_line_format(LOG_LEVEL_INFO, "HPET period %lu fs, legacy route: %lu",
+          _period_fs, (u64_t)_legacy);
+    }
+  }
+}
+
+bo_t d_hpet_ready(void)
+{
+  return _regs != NULL;
+}
+
+u64_t d_hpet_counter(void)
+{
+  return _regs[_REG_COUNTER / 8];
+}
+
+u64_t d_hpet_period_fs(void)
+{
+  return _period_fs;
+}
+
+bo_t d_hpet_oneshot_ready(void)
+{
+  return _regs != NULL && _legacy;
+}
+
+base_must_check bo_t d_hpet_oneshot(u64_t counter)
+{
+  bo_t armed;
+
+  kernel_assert(d_hpet_oneshot_ready());
+  if (counter == 0) {
+    _regs[_REG_T0_CONF / 8] = 0;
+    armed = true;
+  } else {
+    _regs[_REG_T0_CONF / 8] = _T_CONF_INT;
+    _regs[_REG_T0_COMP / 8] = counter;
+    /* Comparator only matches on equality, one in the past never fires. */
+    armed = d_hpet_counter() < counter;
+  }
+  return armed;
+}
@@ -0,0 +1,356 @@
+/* High resolution timers on top of clock event devices.
+ *
+ * Timers are kept in a list per CPU sorted by expiry, and the clock event
+ * device of a CPU is only armed for the earliest one. There is no periodic
+ * tick, a CPU with no timer pending takes no timer IRQs at all. Expiries are
+ * in TSC cycles, so timers are as precise as the clock event device is, down
+ * to a TSC cycle with TSC-deadline mode. */
+#include "drivers_hrtimer.h"
+#include "cpu.h"
+#include "drivers_apic.h"
+#include "drivers_hpet.h"
+#include "drivers_time.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "sched.h"
+#include "smp.h"
+#include "sync.h"
+
+/* One-shot devices count down from 32 bits counters, longer timeouts fire
+ * early and are armed again. */
+#define _ONESHOT_NS_MAX 1000000000
+
+typedef struct {
+  const ch_t *name;
+  intr_id_t vector;
+  /* Set up device of current CPU, disarmed. */
+  void (*start)(void);
+  /* Raise the vector once TSC reaches @deadline, or a bit later, at once if
+   * passed already. Disarm if @deadline is 0. */
+  void (*arm)(u64_t deadline);
+} clockevent_t;
+
+typedef struct {
+  sync_spin_t lock base_align(64);
+  hrtimer_t *head; /* Sorted by expiry */
+  u64_t armed;     /* Deadline device is armed for, 0 if disarmed */
+} hrtimer_cpu_t;
+
+base_private const clockevent_t *_event;
+base_private hrtimer_cpu_t _cpus[SMP_CPU_MAX];
+
+/* Nanoseconds from now to @deadline, 0 if passed. */
+base_private u64_t _ns_until(u64_t deadline)
+{
+  u64_t now;
+  u64_t cycles;
+
+  now = cpu_read_tsc();
+  cycles = deadline > now ? deadline - now : 0;
+  /* Longer than one-shot devices take anyway, avoids overflows below. */
+  if (cycles > time_ns_to_cycles(_ONESHOT_NS_MAX)) {
+    cycles = time_ns_to_cycles(_ONESHOT_NS_MAX);
+  }
+  return time_cycles_to_ns(cycles);
+}
+
+base_private void _deadline_start(void)
+{
+  d_apic_timer_deadline(INTR_ID_APIC_TIMER);
+}
+
+base_private void _deadline_arm(u64_t deadline)
+{
+  d_apic_timer_deadline_set(deadline);
+}
+
+base_private void _oneshot_start(void)
+{
+  d_apic_timer_oneshot(INTR_ID_APIC_TIMER);
+}
+
+base_private void _oneshot_arm(u64_t deadline)
+{
+  u64_t ns;
+
+  ns = 0;
+  if (deadline != 0) {
+    ns = _ns_until(deadline);
+    if (ns == 0) {
+      ns = 1;
+    }
+  }
+  d_apic_timer_oneshot_set(ns);
+}
+
+/* HPET has only one timer used, so it is only used without local APIC,
+ * where bootstrap processor is the only one. */
+base_private void _hpet_start(void)
+{
+  kernel_assert(smp_cpu_idx() == 0);
+  kernel_assert(d_hpet_oneshot(0));
+}
+
+base_private void _hpet_arm(u64_t deadline)
+{
+  u64_t ticks;
+
+  if (deadline == 0) {
+    kernel_assert(d_hpet_oneshot(0));
+  } else {
+    ticks = _ns_until(deadline) * 1000000 / d_hpet_period_fs() + 1;
+    /* Passed while being armed, try again later. */
+    while (!d_hpet_oneshot(d_hpet_counter() + ticks)) {
+      ticks *= 2;
+    }
+  }
+}
+
+base_private const clockevent_t _deadline = {
+    .name = "local APIC TSC-deadline",
+    .vector = INTR_ID_APIC_TIMER,
+    .start = _deadline_start,
+    .arm = _deadline_arm,
+};
+
+base_private const clockevent_t _oneshot = {
+    .name = "local APIC one-shot",
+    .vector = INTR_ID_APIC_TIMER,
+    .start = _oneshot_start,
+    .arm = _oneshot_arm,
+};
+
+base_private const clockevent_t _hpet = {
+    .name = "HPET",
+    .vector = INTR_ID_IRQ_TIME,
+    .start = _hpet_start,
+    .arm = _hpet_arm,
+};
+
+/* Arm device for the earliest timer, lock of @cpu must be held. */
+base_private void _program(hrtimer_cpu_t *cpu)
+{
+  u64_t deadline;
+
+  deadline = cpu->head == NULL ? 0 : cpu->head->expires;
+  if (_event != NULL && deadline != cpu->armed) {
+    cpu->armed = deadline;
+    _event->arm(deadline);
+  }
+}
+
+/* Run callbacks of timers expired on current CPU. */
+base_private void _irq_handler(intr_id_t id, intr_parameters_t *para)
+{
+  hrtimer_cpu_t *cpu;
+  hrtimer_t *timer;
+
+  (void)(id + para);
+  cpu = &_cpus[smp_cpu_idx()];
+  sync_spin_lock(&cpu->lock);
+  /* Fired, or fired early for a far deadline. */
+  cpu->armed = 0;
+  timer = cpu->head;
+  while (timer != NULL && timer->expires <= cpu_read_tsc()) {
+    cpu->head = timer->next;
+    cpu_atomic_store(&timer->cpu, HRTIMER_CPU_NONE);
+    /* Callback may start timers again. */
+    sync_spin_unlock(&cpu->lock);
+    timer->fn(timer);
+    sync_spin_lock(&cpu->lock);
+    timer = cpu->head;
+  }
+  _program(cpu);
+  sync_spin_unlock(&cpu->lock);
+}
+
+void hrtimer_bootstrap(void)
+{
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    sync_spin_init(&_cpus[i].lock, "hrtimer");
+  }
+
+  if (d_apic_timer_deadline_ready()) {
+    _event = &_deadline;
+  } else if (d_apic_ready()) {
+    _event = &_oneshot;
+  } else if (d_hpet_oneshot_ready()) {
+    _event = &_hpet;
+  }
+
+  if (_event == NULL) {
+    log_line_format(
+        LOG_LEVEL_WARN, "No clock event device, timers never expire");
+  } else {
+    intr_handler_register(_event->vector, _irq_handler);
+    log_line_format(LOG_LEVEL_INFO, "Clock event device: %s", _event->name);
+  }
+}
+
+void hrtimer_init_cpu(void)
+{
+  if (_event != NULL) {
+    _event->start();
+  }
+}
+
+void hrtimer_start(hrtimer_t *timer, u64_t ns)
+{
+  hrtimer_cpu_t *cpu;
+  hrtimer_t **pos;
+  u64_t flags;
+
+  hrtimer_cancel(timer);
+  flags = intr_irq_save();
+  cpu = &_cpus[smp_cpu_idx()];
+  sync_spin_lock(&cpu->lock);
+  timer->expires = cpu_read_tsc() + time_ns_to_cycles(ns);
+  pos = &cpu->head;
+  while (*pos != NULL && (*pos)->expires <= timer->expires) {
+    pos = &(*pos)->next;
+  }
+  timer->next = *pos;
+  *pos = timer;
+  cpu_atomic_store(&timer->cpu, smp_cpu_idx());
+  if (cpu->head == timer) {
+    _program(cpu);
+  }
+  sync_spin_unlock(&cpu->lock);
+  intr_irq_restore(flags);
+}
+
+bo_t hrtimer_cancel(hrtimer_t *timer)
+{
+  hrtimer_cpu_t *cpu;
+  hrtimer_t **pos;
+  u64_t idx;
+  bo_t pending;
+  bo_t done;
+  u64_t flags;
+
+  pending = false;
+  done = false;
+  while (!done) {
+    idx = cpu_atomic_load(&timer->cpu);
+    done = idx == HRTIMER_CPU_NONE;
+    if (!done) {
+      cpu = &_cpus[idx];
+      flags = sync_spin_lock_irqsave(&cpu->lock);
+      /* Otherwise expired or moved meanwhile, look again. */
+      if (cpu_atomic_load(&timer->cpu) == idx) {
+        pos = &cpu->head;
+        while (*pos != timer) {
+          pos = &(*pos)->next;
+        }
+        *pos = timer->next;
+        cpu_atomic_store(&timer->cpu, HRTIMER_CPU_NONE);
+        /* Device armed for it fires early, which does no harm. */
+        pending = true;
+        done = true;
+      }
+      sync_spin_unlock_irqrestore(&cpu->lock, flags);
+    }
+  }
+  return pending;
+}
+
+typedef struct {
+  hrtimer_t timer; /* Must be the first field */
+  sched_thread_t *thread;
+  volatile u64_t done;
+} sleeper_t;
+
+base_private void _sleeper_wake(hrtimer_t *timer)
+{
+  sleeper_t *sleeper = (sleeper_t *)timer;
+  sched_thread_t *thread;
+
+  /* Sleeper may return and be gone once @done is set. */
+  thread = sleeper->thread;
+  cpu_atomic_store(&sleeper->done, 1);
+  sched_thread_wake(thread);
+}
+
+void hrtimer_sleep_ns(u64_t ns)
+{
+  sleeper_t sleeper;
+
+  sleeper.timer = (hrtimer_t)HRTIMER_INIT(_sleeper_wake);
+  sleeper.thread = sched_current();
+  sleeper.done = 0;
+  hrtimer_start(&sleeper.timer, ns);
+  while (cpu_atomic_load(&sleeper.done) == 0) {
+    sched_thread_sleep();
+  }
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#define _TEST_TIMERS 8
+#define _TEST_SLEEPS 100
+#define _TEST_SLEEP_NS 100000
+
+typedef struct {
+  hrtimer_t timer; /* Must be the first field */
+  volatile u64_t fired;
+} test_timer_t;
+
+base_private test_timer_t _test_timers[_TEST_TIMERS];
+base_private volatile u64_t _test_order;
+
+base_private void _test_fire(hrtimer_t *timer)
+{
+  test_timer_t *test = (test_timer_t *)timer;
+
+  kernel_assert(cpu_read_tsc() >= timer->expires);
+  test->fired = cpu_atomic_fetch_add(&_test_order, 1) + 1;
+}
+
+/* Timers started out of order expire in order of expiry, a cancelled one
+ * never fires, and lateness of sleeps is logged. */
+void test_hrtimer(void)
+{
+  u64_t start;
+  u64_t late;
+  u64_t late_max;
+  u64_t expect;
+
+  sched_preempt_disable();
+  for (usz_t i = 0; i < _TEST_TIMERS; i++) {
+    _test_timers[i].timer = (hrtimer_t)HRTIMER_INIT(_test_fire);
+    _test_timers[i].fired = 0;
+    /* 800 us, 700 us, ... 100 us */
+    hrtimer_start(&_test_timers[i].timer, (_TEST_TIMERS - i) * 100000);
+  }
+  kernel_assert(hrtimer_cancel(&_test_timers[0].timer));
+  kernel_assert(!hrtimer_cancel(&_test_timers[0].timer));
+  sched_preempt_enable();
+
+  while (cpu_atomic_load(&_test_order) < _TEST_TIMERS - 1) {
+    sched_yield();
+  }
+  kernel_assert(_test_timers[0].fired == 0);
+  for (usz_t i = 1; i < _TEST_TIMERS; i++) {
+    kernel_assert(_test_timers[i].fired == _TEST_TIMERS - i);
+  }
+
+  late = 0;
+  late_max = 0;
+  expect = time_ns_to_cycles(_TEST_SLEEP_NS);
+  for (usz_t i = 0; i < _TEST_SLEEPS; i++) {
+    start = cpu_read_tsc();
+    hrtimer_sleep_ns(_TEST_SLEEP_NS);
+    start = cpu_read_tsc() - start;
+    kernel_assert(start >= expect);
+    late += start - expect;
+    if (start - expect > late_max) {
+      late_max = start - expect;
+    }
+  }
+  log_line_format(LOG_LEVEL_SELF_TEST,
+      "Sleep of %lu us late by %lu ns on average, %lu ns at most",
+      (u64_t)_TEST_SLEEP_NS / 1000,
+      time_cycles_to_ns(late / _TEST_SLEEPS), time_cycles_to_ns(late_max));
+  log_builtin_test_pass();
+}
+#endif
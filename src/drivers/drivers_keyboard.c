@@ -32,6 +32,7 @@ base_private void _wait_cmd_available(void)
 }
 */
 
+/*
 base_private void _wait_data_available(void)
 {
   byte_t status;
@@ -40,6 +41,7 @@ base_private void _wait_data_available(void)
     status = port_read_byte(PORT_NO_KEYBOARD_CMD);
   } while (_status_data_is_empty(status));
 }
+*/
 
 /*
 base_private void _cmd_send(keyboard_cmd_t cmd)
@@ -58,14 +60,16 @@ base_private byte_t _data_read(void)
   return port_read_byte(PORT_NO_KEYBOARD_DATA);
 }
 
-base_private void keyboard_irq_handler(
-    intr_id_t id base_may_unuse, intr_parameters_t *para base_may_unuse)
-{
-  byte_t data;
-
-  _wait_data_available();
-  data = _data_read();
+/* Scan codes read by IRQ handler, and not handled by tasklet yet. Both run
+ * on the CPU keyboard IRQ is routed to, only the handler writes @_codes_head
+ * and only the tasklet writes @_codes_tail. */
+#define _CODES_CAP 16
+base_private byte_t _codes[_CODES_CAP];
+base_private volatile u64_t _codes_head;
+base_private volatile u64_t _codes_tail;
 
+base_private void _code_handle(byte_t data)
+{
   switch (data) {
   case 0x11:
     screen_write_at('W', 0, 0);
@@ -81,6 +85,36 @@ base_private void keyboard_irq_handler(
   }
 }
 
+base_private void _tasklet_fn(intr_tasklet_t *tasklet base_may_unuse)
+{
+  while (_codes_tail != _codes_head) {
+    _code_handle(_codes[_codes_tail % _CODES_CAP]);
+    _codes_tail++;
+  }
+}
+
+base_private intr_tasklet_t _tasklet = INTR_TASKLET_INIT(_tasklet_fn);
+
+/* Controller raises the IRQ once a byte is ready, so it is read without
+ * waiting, and handled later in tasklet. */
+base_private void keyboard_irq_handler(
+    intr_id_t id base_may_unuse, intr_parameters_t *para base_may_unuse)
+{
+  byte_t status;
+  byte_t data;
+
+  status = port_read_byte(PORT_NO_KEYBOARD_CMD);
+  if (!_status_data_is_empty(status)) {
+    data = _data_read();
+    /* Dropped if tasklet falls behind, like keys pressed too fast. */
+    if (_codes_head - _codes_tail < _CODES_CAP) {
+      _codes[_codes_head % _CODES_CAP] = data;
+      _codes_head++;
+    }
+    intr_tasklet_schedule(&_tasklet);
+  }
+}
+
 void keyboard_init(void)
 {
   intr_handler_register(INTR_ID_IRQ_KEYBOARD, keyboard_irq_handler);
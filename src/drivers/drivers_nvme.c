@@ -5,6 +5,7 @@
 #include "kernel_panic.h"
 #include "log.h"
 #include "mm.h"
+#include "sync.h"
 
 base_private const u8_t _CLASS_CODE_BASE = 0x01;
 base_private const u8_t _CLASS_CODE_SUB = 0x08;
@@ -21,6 +22,7 @@ struct d_nvme_ctrl {
 };
 
 #define _CTRL_CAP 32
+/* Controllers are only appended, and counted after being filled. */
 base_private d_nvme_ctrl_t _ctrls[_CTRL_CAP];
 base_private ucnt_t _ctrl_cnt;
 
@@ -30,7 +32,8 @@ base_private void _ctrl_add(d_pcie_func_t *pcie_fun)
   u32_t bar0;
   byte_t by;
 
-  ctrl = &_ctrls[_ctrl_cnt++];
+  kernel_assert(_ctrl_cnt < _CTRL_CAP);
+  ctrl = &_ctrls[_ctrl_cnt];
   ctrl->mm = mm_allocator_new();
   ctrl->pcie = pcie_fun;
 
@@ -43,6 +46,7 @@ base_private void _ctrl_add(d_pcie_func_t *pcie_fun)
   bar0 = bar0 & _CFG_SPACE_BAR_0_BASE_MASK;
   ctrl->reg_size = mm_align_class((u64_t)bar0);
   log_line_format(LOG_LEVEL_INFO, "bar0 size: %lu", ctrl->reg_size);
+  sync_rcu_assign(_ctrl_cnt, _ctrl_cnt + 1);
 }
 
 void d_nvme_bootstrap(void)
@@ -2,7 +2,11 @@
 #include "containers_string.h"
 #include "kernel_panic.h"
 #include "log.h"
+#include "mem.h"
 #include "mm.h"
+#include "smp.h"
+#include "sync.h"
+#include "trace.h"
 
 /* Currently supports no more than 64 bus groups, it's not limited by PCIe
  * spec. */
@@ -35,6 +39,37 @@ base_private uptr_t _CONFIG_SPACE_SIZE = 4096;
  * 256 buses * 32 devices * 8 functions * 4KB. */
 base_private uptr_t _CONFIG_SPACE_ALIGN = 256 * 32 * 8 * 4 * 1024;
 
+/* Offsets of PCI header. */
+#define _CFG_COMMAND 0x04
+#define _CFG_STATUS 0x06
+#define _CFG_BAR_0 0x10
+#define _CFG_CAP_PTR 0x34
+/* Command register: INTx emulation disabled. */
+#define _COMMAND_INTX_DISABLE 0x400
+/* Status register: capability list is present. */
+#define _STATUS_CAP_LIST 0x10
+/* 192 bytes of capabilities, each takes at least 4 bytes. */
+#define _CAP_WALK_MAX 48
+
+/* MSI capability: message control at +2, followed by message address, upper
+ * address if 64 bits capable, message data, and mask bits if per vector
+ * masking capable. */
+#define _MSI_CTRL_ENABLE 0x1
+#define _MSI_CTRL_MME_MASK 0x70
+#define _MSI_CTRL_64 0x80
+#define _MSI_CTRL_PVM 0x100
+/* MSI-X capability: message control at +2, table offset and BAR indicator at
+ * +4. Each table entry is 4 dwords: address, upper address, data and vector
+ * control, whose bit 0 masks the vector. */
+#define _MSIX_CTRL_SIZE_MASK 0x7ff
+#define _MSIX_CTRL_FUNC_MASK 0x4000
+#define _MSIX_CTRL_ENABLE 0x8000
+#define _MSIX_BIR_MASK 0x7
+#define _MSIX_ENTRY_DWORDS 4
+#define _MSIX_ENTRY_CTRL_MASKED 0x1
+/* Message address of local APIC, physical destination at bits 12..19. */
+#define _MSI_ADDR_BASE 0xfee00000
+
 struct d_pcie_group {
   uptr_t cfg_space_base_pa;
   u16_t group_no;
@@ -56,10 +91,22 @@ struct d_pcie_func {
   u8_t base_class;
   u8_t sub_class;
   u8_t pi;
+  /* Config space mapped by d_pcie_map_cfg(), NULL before it. */
+  volatile byte_t *cfg;
+  /* Offsets of MSI and MSI-X capabilities, 0 if not supported. */
+  u8_t msi_cap;
+  u8_t msix_cap;
+  /* Vectors got by d_pcie_irq_alloc(). */
+  intr_id_t vectors[D_PCIE_IRQ_CAP];
+  ucnt_t vector_cnt;
+  bo_t msix;
+  volatile u32_t *msix_table;
 };
 
 base_private d_pcie_group_t _groups[_GROUP_CAP];
 base_private ucnt_t _gropp_cnt;
+/* Functions are only appended, one is filled before being counted, so that
+ * readers without locks never see it half done. */
 base_private d_pcie_func_t _functions[_FUNCTIONS_CAP];
 base_private ucnt_t _func_cnt;
 
@@ -97,24 +144,6 @@ base_private u16_t _cfg_space_read_word(
   return *(u16_t *)padd;
 }
 
-base_private u32_t _cfg_space_read_dword(
-    d_pcie_group_t *group, u64_t bus, u64_t dev, u64_t fun, u64_t off)
-{
-  kernel_assert(off % 4 == 0);
-  kernel_assert(off <= (_CONFIG_SPACE_SIZE - 4));
-  uptr_t padd = _cfg_space_pa(group, bus, dev, fun, off);
-  return *(u32_t *)padd;
-}
-
-base_private void _cfg_space_write_dword(
-    d_pcie_group_t *group, u64_t bus, u64_t dev, u64_t fun, u64_t off, u32_t val)
-{
-  kernel_assert(off % 4 == 0);
-  kernel_assert(off <= (4096 - 4));
-  uptr_t padd = _cfg_space_pa(group, bus, dev, fun, off);
-  *(u32_t *)padd = val;
-}
-
 /*
 base_private void cfg_space_write_byte(
     group_t *group, u64_t bus, u64_t dev, u64_t fun, u64_t off, byte_t val)
@@ -138,24 +167,309 @@ base_private u16_t cfg_space_write_word(
 
 */
 
+/* @return Address of @off in config space of @fun. */
+base_private volatile byte_t *_func_cfg(d_pcie_func_t *fun, u64_t off)
+{
+  volatile byte_t *p;
+
+  kernel_assert(off < _CONFIG_SPACE_SIZE);
+  if (fun->cfg == NULL) {
+    /* Still identity mapped, see mem_bootstrap_1(). */
+    p = (volatile byte_t *)_cfg_space_pa(
+        fun->group, fun->bus, fun->dev, fun->fun, off);
+  } else {
+    p = fun->cfg + off;
+  }
+  return p;
+}
+
+/* Bus, device and function of @fun packed as in PCI addresses. */
+base_private u16_t _func_bdf(d_pcie_func_t *fun)
+{
+  return (u16_t)(fun->bus << 8 | fun->dev << 3 | fun->fun);
+}
+
 byte_t d_pcie_cfg_space_read_byte(d_pcie_func_t *fun, u64_t off)
 {
-  return _cfg_space_read_byte(fun->group, fun->bus, fun->dev, fun->fun, off);
+  byte_t val;
+
+  val = *_func_cfg(fun, off);
+  trace_pcie_cfg_read(_func_bdf(fun), off, val);
+  return val;
 }
 
 u16_t d_pcie_cfg_space_read_word(d_pcie_func_t *fun, u64_t off)
 {
-  return _cfg_space_read_word(fun->group, fun->bus, fun->dev, fun->fun, off);
+  u16_t val;
+
+  kernel_assert(off % 2 == 0);
+  val = *(volatile u16_t *)_func_cfg(fun, off);
+  trace_pcie_cfg_read(_func_bdf(fun), off, val);
+  return val;
 }
 
 u32_t d_pcie_cfg_space_read_dword(d_pcie_func_t *fun, u64_t off)
 {
-  return _cfg_space_read_dword(fun->group, fun->bus, fun->dev, fun->fun, off);
+  u32_t val;
+
+  kernel_assert(off % 4 == 0);
+  val = *(volatile u32_t *)_func_cfg(fun, off);
+  trace_pcie_cfg_read(_func_bdf(fun), off, val);
+  return val;
+}
+
+void d_pcie_cfg_space_write_word(d_pcie_func_t *fun, u64_t off, u16_t val)
+{
+  kernel_assert(off % 2 == 0);
+  trace_pcie_cfg_write(_func_bdf(fun), off, val);
+  *(volatile u16_t *)_func_cfg(fun, off) = val;
 }
 
 void d_pcie_cfg_space_write_dword(d_pcie_func_t *fun, u64_t off, u32_t val)
 {
-  _cfg_space_write_dword(fun->group, fun->bus, fun->dev, fun->fun, off, val);
+  kernel_assert(off % 4 == 0);
+  trace_pcie_cfg_write(_func_bdf(fun), off, val);
+  *(volatile u32_t *)_func_cfg(fun, off) = val;
+}
+
+u8_t d_pcie_func_cap_find(d_pcie_func_t *fun, u8_t id)
+{
+  u8_t off;
+  u8_t res;
+
+  res = 0;
+  if ((d_pcie_cfg_space_read_word(fun, _CFG_STATUS) & _STATUS_CAP_LIST) != 0) {
+    /* Lowest 2 bits of pointers are reserved. */
+    off = d_pcie_cfg_space_read_byte(fun, _CFG_CAP_PTR) & 0xfc;
+    for (usz_t i = 0; i < _CAP_WALK_MAX && off != 0; i++) {
+      if (d_pcie_cfg_space_read_byte(fun, off) == id) {
+        res = off;
+        break;
+      }
+      off = d_pcie_cfg_space_read_byte(fun, off + 1u) & 0xfc;
+    }
+  }
+  return res;
+}
+
+/* Physical address of memory BAR @bir of @fun. */
+base_private uptr_t _func_bar_pa(d_pcie_func_t *fun, u8_t bir)
+{
+  u32_t lo;
+  uptr_t pa;
+
+  kernel_assert(bir < 6);
+  lo = d_pcie_cfg_space_read_dword(fun, _CFG_BAR_0 + bir * 4u);
+  /* Bit 0 set for I/O space, bits 1..2 equal 2 for 64 bits BAR. */
+  kernel_assert((lo & 0x1) == 0);
+  pa = lo & ~(u32_t)0xf;
+  if ((lo & 0x6) == 0x4) {
+    pa |= (uptr_t)d_pcie_cfg_space_read_dword(
+              fun, _CFG_BAR_0 + bir * 4u + 4)
+          << 32;
+  }
+  return pa;
+}
+
+/* Map MSI-X table of @fun, if not yet.
+ * @return Entries in the table. */
+base_private ucnt_t _msix_table_map(d_pcie_func_t *fun)
+{
+  ucnt_t n;
+  u32_t tab;
+  uptr_t pa;
+
+  n = (d_pcie_cfg_space_read_word(fun, fun->msix_cap + 2u) &
+          _MSIX_CTRL_SIZE_MASK) +
+      1u;
+  if (fun->msix_table == NULL) {
+    tab = d_pcie_cfg_space_read_dword(fun, fun->msix_cap + 4u);
+    pa = _func_bar_pa(fun, (u8_t)(tab & _MSIX_BIR_MASK)) +
+         (tab & ~(u32_t)_MSIX_BIR_MASK);
+    fun->msix_table = (volatile u32_t *)mem_mmio_map(
+        pa, n * _MSIX_ENTRY_DWORDS * sizeof(u32_t));
+    kernel_assert(fun->msix_table != NULL);
+  }
+  return n;
+}
+
+base_private void _msix_program(
+    d_pcie_func_t *fun, ucnt_t idx, u32_t addr, u32_t data)
+{
+  volatile u32_t *ent = fun->msix_table + idx * _MSIX_ENTRY_DWORDS;
+
+  ent[3] = _MSIX_ENTRY_CTRL_MASKED;
+  ent[0] = addr;
+  ent[1] = 0;
+  ent[2] = data;
+  ent[3] = 0;
+}
+
+/* Offset of MSI mask bits, 0 if per vector masking is not supported. */
+base_private u64_t _msi_mask_off(d_pcie_func_t *fun)
+{
+  u16_t ctrl;
+  u64_t off;
+
+  ctrl = d_pcie_cfg_space_read_word(fun, fun->msi_cap + 2u);
+  off = 0;
+  if ((ctrl & _MSI_CTRL_PVM) != 0) {
+    off = fun->msi_cap + ((ctrl & _MSI_CTRL_64) != 0 ? 16u : 12u);
+  }
+  return off;
+}
+
+base_private void _msi_program(d_pcie_func_t *fun, u32_t addr, u32_t data)
+{
+  u16_t ctrl;
+
+  ctrl = d_pcie_cfg_space_read_word(fun, fun->msi_cap + 2u);
+  d_pcie_cfg_space_write_dword(fun, fun->msi_cap + 4u, addr);
+  if ((ctrl & _MSI_CTRL_64) != 0) {
+    d_pcie_cfg_space_write_dword(fun, fun->msi_cap + 8u, 0);
+    d_pcie_cfg_space_write_word(fun, fun->msi_cap + 12u, (u16_t)data);
+  } else {
+    d_pcie_cfg_space_write_word(fun, fun->msi_cap + 8u, (u16_t)data);
+  }
+  /* Single message, multiple messages need a block of aligned vectors. */
+  ctrl &= (u16_t)~_MSI_CTRL_MME_MASK;
+  d_pcie_cfg_space_write_word(
+      fun, fun->msi_cap + 2u, (u16_t)(ctrl | _MSI_CTRL_ENABLE));
+}
+
+/* Index of the @nth online CPU, wrapping around, online CPUs may not be
+ * contiguous. */
+base_private usz_t _irq_cpu(usz_t nth)
+{
+  usz_t idx;
+
+  nth %= smp_cpu_cnt();
+  for (idx = 0; idx < SMP_CPU_MAX; idx++) {
+    if (smp_cpu_online(idx)) {
+      if (nth == 0) {
+        break;
+      }
+      nth--;
+    }
+  }
+  kernel_assert(idx < SMP_CPU_MAX);
+  return idx;
+}
+
+base_must_check ucnt_t d_pcie_irq_alloc(
+    d_pcie_func_t *fun, ucnt_t n, intr_handler_cb handler, usz_t cpu_hint)
+{
+  ucnt_t cnt;
+  u32_t apic_id;
+  u32_t addr;
+  u16_t ctrl;
+
+  kernel_assert(fun->vector_cnt == 0);
+  kernel_assert(n > 0 && n <= D_PCIE_IRQ_CAP);
+
+  fun->msix = fun->msix_cap != 0;
+  if (fun->msix) {
+    cnt = _msix_table_map(fun);
+    n = n < cnt ? n : cnt;
+  } else if (fun->msi_cap != 0) {
+    n = 1;
+  } else {
+    n = 0;
+  }
+
+  cnt = 0;
+  while (cnt < n && intr_vector_alloc(handler, &fun->vectors[cnt])) {
+    cnt++;
+  }
+  fun->vector_cnt = cnt;
+
+  ctrl = 0;
+  if (cnt > 0) {
+    d_pcie_cfg_space_write_word(fun, _CFG_COMMAND,
+        d_pcie_cfg_space_read_word(fun, _CFG_COMMAND) |
+            _COMMAND_INTX_DISABLE);
+    if (fun->msix) {
+      ctrl = d_pcie_cfg_space_read_word(fun, fun->msix_cap + 2u);
+      d_pcie_cfg_space_write_word(fun, fun->msix_cap + 2u,
+          ctrl | _MSIX_CTRL_ENABLE | _MSIX_CTRL_FUNC_MASK);
+    }
+    for (ucnt_t i = 0; i < cnt; i++) {
+      /* Spread vectors over CPUs, starting from the one hinted. */
+      apic_id = smp_cpu_apic_id(_irq_cpu(cpu_hint + i));
+      kernel_assert(apic_id <= U8_MAX);
+      addr = _MSI_ADDR_BASE | (apic_id << 12);
+      if (fun->msix) {
+        _msix_program(fun, i, addr, fun->vectors[i]);
+      } else {
+        _msi_program(fun, addr, fun->vectors[i]);
+      }
+    }
+    if (fun->msix) {
+      d_pcie_cfg_space_write_word(fun, fun->msix_cap + 2u,
+          (ctrl | _MSIX_CTRL_ENABLE) & (u16_t)~_MSIX_CTRL_FUNC_MASK);
+    }
+    log_line_format(LOG_LEVEL_INFO, "[%lu,%lu,%lu]: %lu %s vectors from %lu",
+        fun->bus, fun->dev, fun->fun, cnt, fun->msix ? "MSI-X" : "MSI",
+        (u64_t)fun->vectors[0]);
+  }
+  return cnt;
+}
+
+void d_pcie_irq_free(d_pcie_func_t *fun)
+{
+  u64_t cap;
+
+  if (fun->vector_cnt > 0) {
+    cap = fun->msix ? fun->msix_cap + 2u : fun->msi_cap + 2u;
+    d_pcie_cfg_space_write_word(fun, cap,
+        d_pcie_cfg_space_read_word(fun, cap) &
+            (u16_t)~(fun->msix ? _MSIX_CTRL_ENABLE : _MSI_CTRL_ENABLE));
+    for (ucnt_t i = 0; i < fun->vector_cnt; i++) {
+      intr_vector_free(fun->vectors[i]);
+    }
+    fun->vector_cnt = 0;
+  }
+}
+
+intr_id_t d_pcie_irq_vector(d_pcie_func_t *fun, ucnt_t idx)
+{
+  kernel_assert(idx < fun->vector_cnt);
+  return fun->vectors[idx];
+}
+
+base_private void _irq_mask_set(d_pcie_func_t *fun, ucnt_t idx, bo_t masked)
+{
+  volatile u32_t *ent;
+  u64_t off;
+  u16_t ctrl;
+
+  kernel_assert(idx < fun->vector_cnt);
+  if (fun->msix) {
+    ent = fun->msix_table + idx * _MSIX_ENTRY_DWORDS;
+    ent[3] = masked ? _MSIX_ENTRY_CTRL_MASKED : 0;
+  } else {
+    off = _msi_mask_off(fun);
+    if (off != 0) {
+      d_pcie_cfg_space_write_dword(fun, off, masked ? 1 : 0);
+    } else {
+      /* No per vector masking, the only vector is masked by disabling MSI,
+       * INTx stays disabled meanwhile. */
+      ctrl = d_pcie_cfg_space_read_word(fun, fun->msi_cap + 2u);
+      ctrl = masked ? (u16_t)(ctrl & ~_MSI_CTRL_ENABLE)
+                    : (u16_t)(ctrl | _MSI_CTRL_ENABLE);
+      d_pcie_cfg_space_write_word(fun, fun->msi_cap + 2u, ctrl);
+    }
+  }
+}
+
+void d_pcie_irq_mask(d_pcie_func_t *fun, ucnt_t idx)
+{
+  _irq_mask_set(fun, idx, true);
+}
+
+void d_pcie_irq_unmask(d_pcie_func_t *fun, ucnt_t idx)
+{
+  _irq_mask_set(fun, idx, false);
 }
 
 static const char *device_name_8086(u16_t vendor, u16_t device)
@@ -433,8 +747,11 @@ static const char *class_name(u8_t base, u8_t sub, u8_t pi)
 
 ucnt_t d_pcie_get_func_cnt(void)
 {
-  kernel_assert_d(_func_cnt < _FUNCTIONS_CAP);
-  return _func_cnt;
+  ucnt_t cnt;
+
+  cnt = sync_rcu_deref(_func_cnt);
+  kernel_assert_d(cnt < _FUNCTIONS_CAP);
+  return cnt;
 }
 
 d_pcie_func_t *d_pcie_get_func(ucnt_t idx)
@@ -496,7 +813,8 @@ static void bootstrap_fun(
     const char *dname;
     const char *cname;
 
-    f = &_functions[_func_cnt++];
+    kernel_assert(_func_cnt < _FUNCTIONS_CAP);
+    f = &_functions[_func_cnt];
     f->group = group;
     f->bus = bus;
     f->dev = dev;
@@ -518,7 +836,12 @@ static void bootstrap_fun(
 
     kernel_assert(cname != NULL);
 
-    (void)(_cfg_space_read_dword);
+    f->cfg = NULL;
+    f->msi_cap = d_pcie_func_cap_find(f, D_PCIE_CAP_ID_MSI);
+    f->msix_cap = d_pcie_func_cap_find(f, D_PCIE_CAP_ID_MSIX);
+    f->vector_cnt = 0;
+    f->msix_table = NULL;
+    sync_rcu_assign(_func_cnt, _func_cnt + 1);
   }
 }
 
@@ -568,3 +891,181 @@ void d_pcie_bootstrap(const byte_t *mcfg, usz_t len)
     }
   }
 }
+
+void d_pcie_map_cfg(void)
+{
+  d_pcie_func_t *f;
+
+  for (ucnt_t i = 0; i < _func_cnt; i++) {
+    f = &_functions[i];
+    f->cfg = (volatile byte_t *)mem_mmio_map(
+        _cfg_space_pa(f->group, f->bus, f->dev, f->fun, 0),
+        _CONFIG_SPACE_SIZE);
+    kernel_assert(f->cfg != NULL);
+  }
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+
+/* Capabilities follow the 64 bytes standard header. */
+#define _TEST_CAP_MIN 0x40
+
+/* Walk capability list of @fun on its own, check it is well formed and agrees
+ * with offsets cached at bootstrap. */
+base_private void _test_cap_walk(d_pcie_func_t *fun)
+{
+  u8_t off;
+  u8_t msi;
+  u8_t msix;
+  usz_t i;
+
+  msi = 0;
+  msix = 0;
+  i = 0;
+  if ((d_pcie_cfg_space_read_word(fun, _CFG_STATUS) & _STATUS_CAP_LIST) != 0) {
+    off = d_pcie_cfg_space_read_byte(fun, _CFG_CAP_PTR) & 0xfc;
+    for (; i < _CAP_WALK_MAX && off != 0; i++) {
+      kernel_assert(off >= _TEST_CAP_MIN);
+      if (d_pcie_cfg_space_read_byte(fun, off) == D_PCIE_CAP_ID_MSI &&
+          msi == 0) {
+        msi = off;
+      }
+      if (d_pcie_cfg_space_read_byte(fun, off) == D_PCIE_CAP_ID_MSIX &&
+          msix == 0) {
+        msix = off;
+      }
+      off = d_pcie_cfg_space_read_byte(fun, off + 1u) & 0xfc;
+    }
+  }
+
+  /* A list running out of the walk limit loops. */
+  kernel_assert(i < _CAP_WALK_MAX);
+  kernel_assert(msi == fun->msi_cap);
+  kernel_assert(msix == fun->msix_cap);
+  kernel_assert(d_pcie_func_cap_find(fun, D_PCIE_CAP_ID_MSI) == msi);
+  kernel_assert(d_pcie_func_cap_find(fun, D_PCIE_CAP_ID_MSIX) == msix);
+}
+
+base_private void _test_msi(d_pcie_func_t *fun)
+{
+  u16_t ctrl;
+  u64_t len;
+  u64_t mask;
+
+  ctrl = d_pcie_cfg_space_read_word(fun, fun->msi_cap + 2u);
+  /* Vectors enabled never exceed vectors capable, both are log 2 encoded up
+   * to 32 vectors. */
+  kernel_assert(((ctrl >> 1) & 0x7) <= 5);
+  kernel_assert(((ctrl & _MSI_CTRL_MME_MASK) >> 4) <= ((ctrl >> 1) & 0x7));
+
+  len = (ctrl & _MSI_CTRL_64) != 0 ? 14 : 10;
+  mask = _msi_mask_off(fun);
+  if ((ctrl & _MSI_CTRL_PVM) != 0) {
+    /* Mask bits follow message data, then pending bits. */
+    kernel_assert(mask == fun->msi_cap + len + 2);
+    len += 10;
+  } else {
+    kernel_assert(mask == 0);
+  }
+  kernel_assert(fun->msi_cap + len <= 256);
+}
+
+base_private void _test_msix(d_pcie_func_t *fun)
+{
+  u32_t tab;
+  u32_t pba;
+  u32_t bar;
+
+  kernel_assert(fun->msix_cap + 12u <= 256);
+  tab = d_pcie_cfg_space_read_dword(fun, fun->msix_cap + 4u);
+  pba = d_pcie_cfg_space_read_dword(fun, fun->msix_cap + 8u);
+  kernel_assert((tab & _MSIX_BIR_MASK) < 6);
+  kernel_assert((pba & _MSIX_BIR_MASK) < 6);
+
+  /* Table lives in a memory BAR. */
+  bar = d_pcie_cfg_space_read_dword(
+      fun, _CFG_BAR_0 + (tab & _MSIX_BIR_MASK) * 4u);
+  kernel_assert((bar & 0x1) == 0);
+}
+
+#define _TEST_IRQ_N 4
+
+base_private void _test_irq_handler(
+    intr_id_t id base_may_unuse, intr_parameters_t *para base_may_unuse)
+{
+}
+
+/* Allocate vectors of a MSI-X function, check table entries as they are
+ * masked, unmasked and freed. The function is left disabled, no driver owns
+ * it yet. */
+base_private void _test_msix_irq(d_pcie_func_t *fun)
+{
+  volatile u32_t *ent;
+  ucnt_t n;
+
+  n = d_pcie_irq_alloc(fun, _TEST_IRQ_N, _test_irq_handler, 1);
+  kernel_assert(n > 0 && n <= _TEST_IRQ_N);
+  kernel_assert(fun->msix);
+  kernel_assert((d_pcie_cfg_space_read_word(fun, fun->msix_cap + 2u) &
+                    (_MSIX_CTRL_ENABLE | _MSIX_CTRL_FUNC_MASK)) ==
+                _MSIX_CTRL_ENABLE);
+  for (ucnt_t i = 0; i < n; i++) {
+    ent = fun->msix_table + i * _MSIX_ENTRY_DWORDS;
+    kernel_assert(d_pcie_irq_vector(fun, i) >= INTR_ID_DYN_START &&
+                  d_pcie_irq_vector(fun, i) < INTR_ID_DYN_END);
+    kernel_assert(ent[2] == d_pcie_irq_vector(fun, i));
+    kernel_assert(ent[0] ==
+                  (_MSI_ADDR_BASE | (smp_cpu_apic_id(_irq_cpu(1 + i)) << 12)));
+    kernel_assert((ent[3] & _MSIX_ENTRY_CTRL_MASKED) == 0);
+    d_pcie_irq_mask(fun, i);
+    kernel_assert((ent[3] & _MSIX_ENTRY_CTRL_MASKED) != 0);
+    d_pcie_irq_unmask(fun, i);
+    kernel_assert((ent[3] & _MSIX_ENTRY_CTRL_MASKED) == 0);
+    kernel_assert(intr_handler_registered(d_pcie_irq_vector(fun, i)));
+  }
+
+  d_pcie_irq_free(fun);
+  kernel_assert(fun->vector_cnt == 0);
+  kernel_assert((d_pcie_cfg_space_read_word(fun, fun->msix_cap + 2u) &
+                    _MSIX_CTRL_ENABLE) == 0);
+}
+
+void test_d_pcie(void)
+{
+  d_pcie_func_t *f;
+  d_pcie_func_t *f_irq;
+  ucnt_t n_msi;
+  ucnt_t n_msix;
+
+  n_msi = 0;
+  n_msix = 0;
+  f_irq = NULL;
+  for (ucnt_t i = 0; i < _func_cnt; i++) {
+    f = &_functions[i];
+    _test_cap_walk(f);
+    if (f->msi_cap != 0) {
+      _test_msi(f);
+      n_msi++;
+    }
+    if (f->msix_cap != 0) {
+      _test_msix(f);
+      n_msix++;
+      if (f_irq == NULL && f->vector_cnt == 0) {
+        f_irq = f;
+      }
+    }
+  }
+  log_line_format(LOG_LEVEL_INFO, "pcie: %lu functions, %lu MSI, %lu MSI-X",
+      _func_cnt, n_msi, n_msix);
+
+  if (f_irq != NULL) {
+    _test_msix_irq(f_irq);
+  } else {
+    log_line_format(
+        LOG_LEVEL_INFO, "pcie: no MSI-X function, IRQ test skipped");
+  }
+
+  log_builtin_test_pass();
+}
+
+#endif
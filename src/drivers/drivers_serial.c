@@ -1,6 +1,7 @@
 #include "drivers_serial.h"
 #include "containers_string.h"
 #include "drivers_port.h"
+#include "interrupts.h"
 
 base_private const u16_t _SPEED_115200_BAUDS = 1;
 /* Currently not used */
@@ -28,6 +29,15 @@ void serial_init(void)
   port_write_byte(PORT_NO_SERIAL_COM1_CMD_MODEM, 0x0B);
 }
 
+base_private serial_input_cb _input;
+
+base_private bo_t _fifo_receive_is_empty(void)
+{
+  /* 0x01 = 0000 0001 */
+  byte_t data = port_read_byte(PORT_NO_SERIAL_COM1_STATUS_LINE);
+  return !(data & 0x01);
+}
+
 base_private bo_t _fifo_transmit_is_empty(void)
 {
   /* 0x20 = 0010 0000 */
@@ -48,3 +58,21 @@ void serial_write_str(const ch_t *str, usz_t len)
     _write_char(str[i]);
   }
 }
+
+/* Raised once receive FIFO reaches its threshold or stays idle for a while,
+ * drain all of it. */
+base_private void _irq_handler(
+    intr_id_t id base_may_unuse, intr_parameters_t *para base_may_unuse)
+{
+  while (!_fifo_receive_is_empty()) {
+    _input((ch_t)port_read_byte(PORT_NO_SERIAL_COM1));
+  }
+}
+
+void serial_input_register(serial_input_cb fn)
+{
+  _input = fn;
+  intr_handler_register(INTR_ID_IRQ_COM1, _irq_handler);
+  /* Received data available interrupt only. */
+  port_write_byte(PORT_NO_SERIAL_COM1_INTR_ENABLE, 0x01);
+}
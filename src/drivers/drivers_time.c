@@ -1,13 +1,145 @@
+/* TSC clocksource and PIT delays.
+ *
+ * TSC is the clock of everything, it is read in a few cycles without any
+ * lock. Its rate is calibrated once against HPET main counter, or against
+ * PIT channel 2 without HPET, and cycles are converted to nanoseconds and
+ * back by multiplying with a fixed-point factor of _SHIFT fraction bits. */
 #include "drivers_time.h"
-#include "interrupts.h"
+#include "cpu.h"
+#include "cpu_info.h"
+#include "drivers_hpet.h"
+#include "drivers_port.h"
+#include "log.h"
 
-base_private void _irq_handler(intr_id_t id, intr_parameters_t *para)
+/* Input clock of PIT. */
+#define _PIT_HZ 1193182
+/* PIT counter is 16 bits, so never wait longer than this in one round. */
+#define _PIT_ROUND_US 50000
+
+#define _CALIBRATE_US 10000
+#define _SHIFT 32
+
+/* TSC ticks per millisecond, calibrated on first use. */
+base_private u64_t _tsc_khz;
+/* Nanoseconds per cycle, and cycles per nanosecond, shifted by _SHIFT. */
+base_private u64_t _ns_mult;
+base_private u64_t _cycles_mult;
+base_private bo_t _invariant;
+
+/* Busy wait with PIT channel 2 in mode 0 (interrupt on terminal count), its
+ * output is polled instead of raising any IRQ. Channel 0 is left alone. */
+void time_delay_us(u64_t us)
+{
+  u64_t round;
+  u64_t ticks;
+  byte_t gate;
+
+  while (us > 0) {
+    round = us > _PIT_ROUND_US ? _PIT_ROUND_US : us;
+    ticks = round * _PIT_HZ / 1000000;
+    if (ticks == 0) {
+      ticks = 1;
+    }
+
+    /* Stop counting and silence speaker while programming. */
+    gate = port_read_byte(PORT_NO_PIT_CH2_GATE);
+    gate = (byte_t)(gate & ~0x03);
+    port_write_byte(PORT_NO_PIT_CH2_GATE, gate);
+
+    /* Channel 2, low byte then high byte, mode 0, binary. */
+    port_write_byte(PORT_NO_PIT_CMD, 0xb0);
+    port_write_byte(PORT_NO_PIT_CH2, (byte_t)(ticks & 0xff));
+    port_write_byte(PORT_NO_PIT_CH2, (byte_t)(ticks >> 8));
+
+    port_write_byte(PORT_NO_PIT_CH2_GATE, (byte_t)(gate | 0x01));
+    while ((port_read_byte(PORT_NO_PIT_CH2_GATE) & 0x20) == 0) {
+      cpu_relax();
+    }
+    us -= round;
+  }
+}
+
+base_private u64_t _calibrate_pit(void)
+{
+  u64_t start;
+
+  start = cpu_read_tsc();
+  time_delay_us(_CALIBRATE_US);
+  return (cpu_read_tsc() - start) * 1000 / _CALIBRATE_US;
+}
+
+/* HPET counter is read directly, much more precise than PIT read through
+ * slow port I/O. */
+base_private u64_t _calibrate_hpet(void)
+{
+  u64_t ticks;
+  u64_t counter;
+  u64_t tsc;
+  u64_t ns;
+
+  ticks = _CALIBRATE_US * u64_literal(1000000000) / d_hpet_period_fs();
+  counter = d_hpet_counter();
+  tsc = cpu_read_tsc();
+  while (d_hpet_counter() - counter < ticks) {
+    cpu_relax();
+  }
+  tsc = cpu_read_tsc() - tsc;
+  counter = d_hpet_counter() - counter;
+  ns = counter * d_hpet_period_fs() / 1000000;
+  return tsc * 1000000 / ns;
+}
+
+void time_bootstrap(void)
+{
+  const ch_t *ref;
+  u64_t khz;
+
+  if (_tsc_khz == 0) {
+    _invariant = cpu_has(CPU_FEATURE_INVARIANT_TSC);
+    if (d_hpet_ready()) {
+      ref = "HPET";
+      khz = _calibrate_hpet();
+    } else {
+      ref = "PIT";
+      khz = _calibrate_pit();
+    }
+    _ns_mult = (u64_literal(1000000) << _SHIFT) / khz;
+    _cycles_mult = (khz << _SHIFT) / 1000000;
+    _tsc_khz = khz;
+
+    log_line_format(LOG_LEVEL_INFO, "TSC at %lu KHz against %s, invariant: %lu",
+        khz, ref, (u64_t)_invariant);
+    if (!_invariant) {
+      log_line_format(
+          LOG_LEVEL_WARN, "TSC is not invariant, time drifts with its rate");
+    }
+  }
+}
+
+u64_t time_tsc_khz(void)
+{
+  if (_tsc_khz == 0) {
+    time_bootstrap();
+  }
+  return _tsc_khz;
+}
+
+bo_t time_tsc_invariant(void)
+{
+  return _invariant;
+}
+
+u64_t time_cycles_to_ns(u64_t cycles)
+{
+  return (u64_t)(((u128_t)cycles * _ns_mult) >> _SHIFT);
+}
+
+u64_t time_ns_to_cycles(u64_t ns)
 {
-  (void)(id + para);
-  /* Do nothing now. */
+  return (u64_t)(((u128_t)ns * _cycles_mult) >> _SHIFT);
 }
 
-void time_init(void)
+u64_t time_now_ns(void)
 {
-  intr_handler_register(INTR_ID_IRQ_TIME, _irq_handler);
+  return time_cycles_to_ns(cpu_read_tsc());
 }
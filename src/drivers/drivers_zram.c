@@ -0,0 +1,462 @@
+/* Compressed RAM block device.
+ *
+ * Blocks are LZ4 compressed and saved into a pool of size classes. Each class
+ * holds objects of the same size in slabs of pages from mem_pages_alloc(), a
+ * slab is given back as soon as it is empty. Device meta data lives in one
+ * run of pages, which is freed altogether with the device. Blocks filled with
+ * a single repeated word take no pool memory at all. */
+
+#include "cpu.h"
+#include "drivers_zram.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem.h"
+#include "mm.h"
+#include "util.h"
+
+/* Object sizes of classes are in steps of this, the largest class holds a
+ * whole uncompressed block. */
+#define _CLASS_STEP 64
+#define _CLASS_CNT (D_ZRAM_BLOCK_SIZE / _CLASS_STEP)
+/* Blocks do not compress better than this are saved uncompressed. */
+#define _HUGE_THRESHOLD (D_ZRAM_BLOCK_SIZE * 3 / 4)
+/* Pages of a slab. */
+#define _SLAB_PG 16
+#define _PAGE_SIZE 4096
+
+typedef enum {
+  _SLOT_EMPTY = 0,
+  _SLOT_SAME = 1, /* Every word of the block is the same */
+  _SLOT_LZ4 = 2,
+  _SLOT_HUGE = 3, /* Saved uncompressed */
+} slot_type_t;
+
+typedef struct slab slab_t;
+struct slab {
+  slab_t *next; /* Next slab of the same class */
+  byte_t *free; /* Free objects, linked by their first 8 bytes */
+  usz_t len;    /* Bytes of pages of this slab */
+  ucnt_t n_used;
+  ucnt_t n_obj;
+};
+
+typedef struct {
+  slab_t *slab; /* Slab @data is saved in */
+  byte_t *data;
+  u64_t fill; /* Word repeated in a same filled block */
+  u16_t len;  /* Length of @data */
+  u8_t class;
+  u8_t type;
+} slot_t;
+
+struct d_zram {
+  ucnt_t n_pg; /* Pages of meta data, this structure included */
+  ucnt_t n_block;
+  slot_t *slots;
+  slab_t *classes[_CLASS_CNT];
+  u16_t *lz4_table;
+  byte_t *lz4_buf;
+
+  ucnt_t n_stored;    /* Blocks saved in pool */
+  ucnt_t n_same;      /* Same filled blocks */
+  ucnt_t n_huge;      /* Blocks saved uncompressed */
+  u64_t data_bytes;   /* Bytes of data saved in pool */
+  u64_t pool_bytes;   /* Bytes of all slabs */
+  u64_t compr_cycles; /* Cycles spent in compressing */
+  u64_t compr_bytes;  /* Input bytes of compressing */
+  u64_t decompr_cycles;
+  u64_t decompr_bytes;
+};
+
+base_private usz_t _class_size(u8_t class)
+{
+  kernel_assert_d(class < _CLASS_CNT);
+  return ((usz_t)class + 1) * _CLASS_STEP;
+}
+
+base_private u8_t _class_of(usz_t len)
+{
+  kernel_assert_d(len > 0 && len <= D_ZRAM_BLOCK_SIZE);
+  return (u8_t)((len + _CLASS_STEP - 1) / _CLASS_STEP - 1);
+}
+
+base_private slab_t *_slab_new(d_zram_t *dev, u8_t class)
+{
+  slab_t *slab;
+  usz_t len;
+  usz_t obj_size;
+  byte_t *obj;
+
+  len = _SLAB_PG * _PAGE_SIZE;
+  slab = (slab_t *)mem_pages_alloc(_SLAB_PG);
+  if (slab != NULL) {
+    obj_size = _class_size(class);
+    slab->len = len;
+    slab->n_used = 0;
+    slab->n_obj = (len - sizeof(slab_t)) / obj_size;
+    kernel_assert_d(slab->n_obj > 0);
+
+    slab->free = NULL;
+    obj = (byte_t *)slab + sizeof(slab_t);
+    for (ucnt_t i = 0; i < slab->n_obj; i++) {
+      *(byte_t **)obj = slab->free;
+      slab->free = obj;
+      obj += obj_size;
+    }
+
+    slab->next = dev->classes[class];
+    dev->classes[class] = slab;
+    dev->pool_bytes += len;
+  }
+  return slab;
+}
+
+base_private byte_t *_obj_alloc(d_zram_t *dev, u8_t class, slab_t **out_slab)
+{
+  slab_t *slab;
+  byte_t *obj;
+
+  slab = dev->classes[class];
+  while (slab != NULL && slab->free == NULL) {
+    slab = slab->next;
+  }
+  if (slab == NULL) {
+    slab = _slab_new(dev, class);
+  }
+
+  obj = NULL;
+  if (slab != NULL) {
+    obj = slab->free;
+    slab->free = *(byte_t **)obj;
+    slab->n_used++;
+    (*out_slab) = slab;
+  }
+  return obj;
+}
+
+base_private void _obj_free(
+    d_zram_t *dev, u8_t class, slab_t *slab, byte_t *obj)
+{
+  slab_t **link;
+
+  kernel_assert_d(slab->n_used > 0);
+  *(byte_t **)obj = slab->free;
+  slab->free = obj;
+  slab->n_used--;
+
+  if (slab->n_used == 0) {
+    link = &dev->classes[class];
+    while (*link != slab) {
+      kernel_assert_d(*link != NULL);
+      link = &((*link)->next);
+    }
+    *link = slab->next;
+    dev->pool_bytes -= slab->len;
+    mem_pages_free((uptr_t)slab, slab->len / _PAGE_SIZE);
+  }
+}
+
+base_private void _slot_free(d_zram_t *dev, slot_t *slot)
+{
+  switch (slot->type) {
+  case _SLOT_EMPTY:
+    break;
+  case _SLOT_SAME:
+    dev->n_same--;
+    break;
+  case _SLOT_HUGE:
+    dev->n_huge--;
+    /* Fall through */
+  case _SLOT_LZ4:
+    _obj_free(dev, slot->class, slot->slab, slot->data);
+    dev->n_stored--;
+    dev->data_bytes -= slot->len;
+    break;
+  default:
+    kernel_panic("Invalid zram slot type");
+  }
+  mm_clean(slot, sizeof(slot_t));
+}
+
+/* @return true if @data consists of a single repeated word. */
+base_private bo_t _same_filled(const byte_t *data, u64_t *out_fill)
+{
+  const u64_t *words = (const u64_t *)data;
+  bo_t same = true;
+
+  for (usz_t i = 1; i < D_ZRAM_BLOCK_SIZE / sizeof(u64_t); i++) {
+    if (words[i] != words[0]) {
+      same = false;
+      break;
+    }
+  }
+  (*out_fill) = words[0];
+  return same;
+}
+
+/* Length of meta data of a device with @n_block blocks, with offsets of its
+ * parts, each aligned to 8 bytes. */
+base_private usz_t _meta_len(
+    ucnt_t n_block, usz_t *out_slots, usz_t *out_table, usz_t *out_buf)
+{
+  usz_t len;
+
+  len = mm_align_up(sizeof(d_zram_t), sizeof(u64_t));
+  (*out_slots) = len;
+  len += mm_align_up(sizeof(slot_t) * n_block, sizeof(u64_t));
+  (*out_table) = len;
+  len += mm_align_up(sizeof(u16_t) * UTIL_LZ4_TABLE_LEN, sizeof(u64_t));
+  (*out_buf) = len;
+  len += _HUGE_THRESHOLD;
+  return len;
+}
+
+d_zram_t *d_zram_new(ucnt_t n_block)
+{
+  d_zram_t *dev;
+  usz_t slots;
+  usz_t table;
+  usz_t buf;
+  usz_t len;
+  ucnt_t n_pg;
+
+  kernel_assert(n_block > 0);
+
+  len = _meta_len(n_block, &slots, &table, &buf);
+  n_pg = mm_align_up(len, _PAGE_SIZE) / _PAGE_SIZE;
+  dev = (d_zram_t *)mem_pages_alloc(n_pg);
+  if (dev != NULL) {
+    mm_clean(dev, slots + sizeof(slot_t) * n_block);
+    dev->n_pg = n_pg;
+    dev->n_block = n_block;
+    dev->slots = (slot_t *)((byte_t *)dev + slots);
+    dev->lz4_table = (u16_t *)((byte_t *)dev + table);
+    dev->lz4_buf = (byte_t *)dev + buf;
+  }
+  return dev;
+}
+
+void d_zram_free(d_zram_t *dev)
+{
+  for (u64_t i = 0; i < dev->n_block; i++) {
+    _slot_free(dev, &dev->slots[i]);
+  }
+  kernel_assert(dev->pool_bytes == 0);
+  mem_pages_free((uptr_t)dev, dev->n_pg);
+}
+
+base_must_check bo_t d_zram_write(
+    d_zram_t *dev, u64_t blk, const byte_t *data)
+{
+  slot_t *slot;
+  slot_t next;
+  const byte_t *src;
+  usz_t len;
+  u64_t tsc;
+  byte_t *obj;
+  bo_t ok;
+
+  kernel_assert(blk < dev->n_block);
+  slot = &dev->slots[blk];
+  mm_clean(&next, sizeof(slot_t));
+
+  /* Build the new content aside, the old one is kept if it can not be
+   * stored. */
+  ok = true;
+  if (_same_filled(data, &next.fill)) {
+    next.type = _SLOT_SAME;
+  } else {
+    tsc = cpu_read_tsc();
+    len = util_lz4_compress(data, D_ZRAM_BLOCK_SIZE, dev->lz4_buf,
+        _HUGE_THRESHOLD, dev->lz4_table);
+    dev->compr_cycles += cpu_read_tsc() - tsc;
+    dev->compr_bytes += D_ZRAM_BLOCK_SIZE;
+
+    if (len == 0) {
+      src = data;
+      len = D_ZRAM_BLOCK_SIZE;
+      next.type = _SLOT_HUGE;
+    } else {
+      src = dev->lz4_buf;
+      next.type = _SLOT_LZ4;
+    }
+
+    next.class = _class_of(len);
+    obj = _obj_alloc(dev, next.class, &next.slab);
+    if (obj != NULL) {
+      mm_copy(obj, src, len);
+      next.data = obj;
+      next.len = (u16_t)len;
+    } else {
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    _slot_free(dev, slot);
+    (*slot) = next;
+    switch (next.type) {
+    case _SLOT_SAME:
+      dev->n_same++;
+      break;
+    case _SLOT_HUGE:
+      dev->n_huge++;
+      /* Fall through */
+    case _SLOT_LZ4:
+      dev->n_stored++;
+      dev->data_bytes += next.len;
+      break;
+    default:
+      kernel_panic("Invalid zram slot type");
+    }
+  }
+  return ok;
+}
+
+void d_zram_read(d_zram_t *dev, u64_t blk, byte_t *data)
+{
+  slot_t *slot;
+  u64_t tsc;
+  bo_t ok;
+
+  kernel_assert(blk < dev->n_block);
+  slot = &dev->slots[blk];
+
+  switch (slot->type) {
+  case _SLOT_EMPTY:
+    mm_clean(data, D_ZRAM_BLOCK_SIZE);
+    break;
+  case _SLOT_SAME:
+    for (usz_t i = 0; i < D_ZRAM_BLOCK_SIZE / sizeof(u64_t); i++) {
+      ((u64_t *)data)[i] = slot->fill;
+    }
+    break;
+  case _SLOT_HUGE:
+    mm_copy(data, slot->data, D_ZRAM_BLOCK_SIZE);
+    break;
+  case _SLOT_LZ4:
+    tsc = cpu_read_tsc();
+    ok = util_lz4_decompress(slot->data, slot->len, data, D_ZRAM_BLOCK_SIZE);
+    kernel_assert(ok);
+    dev->decompr_cycles += cpu_read_tsc() - tsc;
+    dev->decompr_bytes += D_ZRAM_BLOCK_SIZE;
+    break;
+  default:
+    kernel_panic("Invalid zram slot type");
+  }
+}
+
+void d_zram_discard(d_zram_t *dev, u64_t blk)
+{
+  kernel_assert(blk < dev->n_block);
+  _slot_free(dev, &dev->slots[blk]);
+}
+
+/* @return Bytes processed per 1000 cycles. */
+base_private u64_t _throughput(u64_t bytes, u64_t cycles)
+{
+  return cycles == 0 ? 0 : bytes * 1000 / cycles;
+}
+
+void d_zram_stats_log(d_zram_t *dev)
+{
+  u64_t orig;
+  u64_t ratio;
+
+  /* Ratio of original data size to pool memory, in percent. */
+  orig = (dev->n_stored + dev->n_same) * D_ZRAM_BLOCK_SIZE;
+  ratio = dev->pool_bytes == 0 ? 0 : orig * 100 / dev->pool_bytes;
+
+  log_line_format(LOG_LEVEL_INFO,
+      "zram: %lu blocks stored, %lu same filled, %lu incompressible",
+      dev->n_stored, dev->n_same, dev->n_huge);
+  log_line_format(LOG_LEVEL_INFO,
+      "zram: orig %lu bytes, compressed %lu bytes, pool %lu bytes, ratio %lu%%",
+      orig, dev->data_bytes, dev->pool_bytes, ratio);
+  log_line_format(LOG_LEVEL_INFO,
+      "zram: compress %lu bytes/kcycle, decompress %lu bytes/kcycle",
+      _throughput(dev->compr_bytes, dev->compr_cycles),
+      _throughput(dev->decompr_bytes, dev->decompr_cycles));
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+
+#define _TEST_BLOCK_CNT 64
+
+base_private byte_t _test_in[D_ZRAM_BLOCK_SIZE];
+base_private byte_t _test_out[D_ZRAM_BLOCK_SIZE];
+
+/* Fill a block in one of several patterns, derived from @seed. */
+base_private void _test_fill(u64_t seed)
+{
+  u64_t rand = seed;
+
+  switch (seed % 4) {
+  case 0: /* Same filled */
+    mm_fill_bytes(_test_in, D_ZRAM_BLOCK_SIZE, (byte_t)seed);
+    break;
+  case 1: /* Random, incompressible */
+    for (usz_t i = 0; i < D_ZRAM_BLOCK_SIZE; i++) {
+      rand = util_rand_int_next(rand);
+      _test_in[i] = (byte_t)(rand >> 16);
+    }
+    break;
+  case 2: /* Text alike */
+    for (usz_t i = 0; i < D_ZRAM_BLOCK_SIZE; i++) {
+      _test_in[i] = (byte_t)('a' + (i * seed) % 17);
+    }
+    break;
+  case 3: /* Mostly zero with some noise */
+    mm_clean(_test_in, D_ZRAM_BLOCK_SIZE);
+    for (usz_t i = 0; i < D_ZRAM_BLOCK_SIZE; i += 64) {
+      rand = util_rand_int_next(rand);
+      _test_in[i] = (byte_t)rand;
+    }
+    break;
+  default:
+    kernel_panic("Invalid pattern");
+  }
+}
+
+void test_d_zram(void)
+{
+  d_zram_t *dev;
+  bo_t ok;
+
+  dev = d_zram_new(_TEST_BLOCK_CNT);
+  kernel_assert(dev != NULL);
+
+  /* Unwritten blocks read as zero */
+  mm_fill_bytes(_test_out, D_ZRAM_BLOCK_SIZE, 0xff);
+  d_zram_read(dev, 0, _test_out);
+  mm_clean(_test_in, D_ZRAM_BLOCK_SIZE);
+  kernel_assert(mm_compare(_test_in, _test_out, D_ZRAM_BLOCK_SIZE) == 0);
+
+  /* Write every block twice, so that overwriting is covered. */
+  for (u64_t round = 0; round < 2; round++) {
+    for (u64_t i = 0; i < _TEST_BLOCK_CNT; i++) {
+      _test_fill(i + round * 3);
+      ok = d_zram_write(dev, i, _test_in);
+      kernel_assert(ok);
+    }
+  }
+
+  for (u64_t i = 0; i < _TEST_BLOCK_CNT; i++) {
+    _test_fill(i + 3);
+    d_zram_read(dev, i, _test_out);
+    kernel_assert(mm_compare(_test_in, _test_out, D_ZRAM_BLOCK_SIZE) == 0);
+  }
+  d_zram_stats_log(dev);
+
+  for (u64_t i = 0; i < _TEST_BLOCK_CNT; i += 2) {
+    d_zram_discard(dev, i);
+    d_zram_read(dev, i, _test_out);
+    mm_clean(_test_in, D_ZRAM_BLOCK_SIZE);
+    kernel_assert(mm_compare(_test_in, _test_out, D_ZRAM_BLOCK_SIZE) == 0);
+  }
+
+  d_zram_free(dev);
+  log_builtin_test_pass();
+}
+
+#endif
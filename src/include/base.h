@@ -22,6 +22,7 @@ typedef unsigned char u8_t;
 typedef unsigned short u16_t;
 typedef uint32_t u32_t;
 typedef uint64_t u64_t;
+typedef unsigned __int128 u128_t;
 typedef u8_t byte_t;
 typedef unsigned int uin_t;
 typedef int in_t;
@@ -71,10 +72,12 @@ typedef uintptr_t uptr_t;
 
 #define base_must_check __attribute__((warn_unused_result))
 #define base_no_return __attribute__((noreturn)) void
+#define base_no_inline __attribute__((noinline))
 #define base_no_null __attribute__((nonnull))
 #define base_private static
 #define base_struct_packed __attribute__((packed))
 #define base_align(unit) __attribute__((aligned(unit)))
+#define base_fallthrough __attribute__((fallthrough))
 #define base_check_format(format_str, args)                                    \
   __attribute__((format(printf, format_str, args)))
 
@@ -0,0 +1,61 @@
+#ifndef ___CONTAINERS_RING
+#define ___CONTAINERS_RING
+
+#include "base.h"
+
+/* Lock-free bounded ring of fixed size elements, on storage given by the
+ * user, see containers_ring.c. Single-producer rings take one producer at a
+ * time, multi-producer rings take any number of them, concurrently from
+ * multiple CPUs and IRQ handlers. Either takes one consumer at a time. */
+typedef struct {
+  /* Written by producers. Next position to reserve in multi-producer rings,
+   * next position to commit otherwise. */
+  volatile u64_t head base_align(64);
+  u64_t tail_seen; /* Single-producer rings, a tail read by producer */
+  /* Written by consumer, next position to take. */
+  volatile u64_t tail base_align(64);
+  u64_t head_seen; /* Single-producer rings, a head read by consumer */
+  /* Read only after ring_init(). */
+  byte_t *slots base_align(64);
+  volatile u64_t *seqs; /* Multi-producer rings, committed position + 1 */
+  usz_t elem;
+  u64_t mask;
+} ring_t;
+
+/* Make an empty ring of @cnt elements of @elem bytes on @slots, @cnt must be
+ * a power of 2 and @slots must have @cnt * @elem bytes. @seqs is NULL for a
+ * single-producer ring, otherwise the ring takes multiple producers and
+ * @seqs must have @cnt entries. */
+void ring_init(ring_t *ring, vptr_t slots, volatile u64_t *seqs, usz_t elem,
+    usz_t cnt);
+usz_t ring_capacity(ring_t *ring);
+/* Elements in @ring, may be stale already when it returns. */
+usz_t ring_len(ring_t *ring);
+
+/* Zero-copy producing: reserve up to @cnt positions from @pos on, fill each
+ * of them through ring_slot(), and commit them all. Positions reserved must
+ * be committed before the next reservation of a single-producer ring, or the
+ * consumer stops at them in a multi-producer ring.
+ * @return Positions reserved, 0 if @ring is full. */
+base_must_check usz_t ring_reserve(ring_t *ring, usz_t cnt, u64_t *pos);
+void ring_commit(ring_t *ring, u64_t pos, usz_t cnt);
+/* Zero-copy consuming: peek up to @cnt elements committed from @pos on, read
+ * each of them through ring_slot(), and release them for reuse.
+ * @return Elements peeked, 0 if @ring is empty. */
+base_must_check usz_t ring_peek(ring_t *ring, usz_t cnt, u64_t *pos);
+void ring_release(ring_t *ring, usz_t cnt);
+/* Element at position @pos of @ring. */
+vptr_t ring_slot(ring_t *ring, u64_t pos);
+
+/* Copy up to @cnt elements from @elems into @ring.
+ * @return Elements copied, fewer than @cnt if @ring is full. */
+usz_t ring_push(ring_t *ring, const byte_t *elems, usz_t cnt);
+/* Copy up to @cnt elements from @ring to @elems.
+ * @return Elements copied, fewer than @cnt if @ring is empty. */
+usz_t ring_pop(ring_t *ring, byte_t *elems, usz_t cnt);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_containers_ring(void);
+#endif
+
+#endif
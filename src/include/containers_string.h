@@ -22,6 +22,11 @@ usz_t str_buf_marshal_uint(ch_t *buf, /* Result string */
     const u64_t val      /* Value to be added */
 );
 
+/* Add unsigned int value in hex with "0x" prefix into result string.
+ * @return Bytes added into result string */
+usz_t str_buf_marshal_uint_in_hex(
+    ch_t *buf, const usz_t buf_off, const usz_t buf_len, const u64_t val);
+
 usz_t str_buf_marshal_uint_in_size(
     ch_t *buf, const usz_t buf_off, const usz_t buf_len, const u64_t val);
 ch_t *str_buf_marshal_uint_in_size_new(mm_allocator_t *all, const u64_t val);
@@ -3,12 +3,53 @@
 
 #include "base.h"
 
+u64_t cpu_read_cr0(void);
+void cpu_write_cr0(u64_t value);
+/* Clear task switched flag of CR0. */
+void cpu_clts(void);
 u64_t cpu_read_cr2(void);
 void cpu_write_cr3(u64_t value);
 u64_t cpu_read_cr3(void);
+u64_t cpu_read_cr4(void);
+void cpu_write_cr4(u64_t value);
+/* Write extended control register @xcr, XCR0 enables XSAVE components. */
+void cpu_write_xcr(u32_t xcr, u64_t value);
+u64_t cpu_read_msr(u32_t msr);
+void cpu_write_msr(u32_t msr, u64_t value);
+/* Execute CPUID with @leaf and @sub leaf, @out gets EAX, EBX, ECX and EDX. */
+void cpu_cpuid(u32_t leaf, u32_t sub, u32_t out[4]);
+/* Flush TLB entry of @va on current CPU. */
+void cpu_invlpg(uptr_t va);
 u64_t cpu_read_rbp(void);
 void cpu_write_rbp(u64_t value);
 u64_t cpu_read_rsp(void);
 void cpu_write_rsp(u64_t value);
+/* Call @fn with @arg on stack whose initial stack pointer is @sp, and switch
+ * back to current stack when it returns. */
+void cpu_call_on_stack(uptr_t sp, void (*fn)(vptr_t), vptr_t arg);
+/* Read time stamp counter. */
+u64_t cpu_read_tsc(void);
+
+/* Atomic operations, all of them are sequentially consistent and are safe to
+ * be used concurrently from multiple CPUs. */
+bo_t cpu_atomic_cas(volatile u64_t *ptr, u64_t expect, u64_t desire);
+u64_t cpu_atomic_load(volatile u64_t *ptr);
+void cpu_atomic_store(volatile u64_t *ptr, u64_t val);
+u64_t cpu_atomic_fetch_add(volatile u64_t *ptr, u64_t val);
+/* Weaker and cheaper load and store, for one side publishing data to the
+ * other: loads and stores before a release store are visible to a CPU once
+ * it sees the store with an acquire load, which are plain moves on x86. */
+u64_t cpu_atomic_load_acquire(volatile u64_t *ptr);
+void cpu_atomic_store_release(volatile u64_t *ptr, u64_t val);
+/* @return Previous value of @ptr */
+u64_t cpu_atomic_swap(volatile u64_t *ptr, u64_t val);
+/* @return Previous value of the bit */
+bo_t cpu_atomic_bit_test_and_set(volatile u64_t *ptr, u8_t bit);
+void cpu_atomic_bit_clear(volatile u64_t *ptr, u8_t bit);
+/* Full barrier, stores before are visible to other CPUs before loads after
+ * are done, which x86 does not ensure otherwise. */
+void cpu_mfence(void);
+/* Hint CPU that we are in a spin-wait loop. */
+void cpu_relax(void);
 
 #endif
@@ -0,0 +1,98 @@
+#ifndef ___CPU_INFO
+#define ___CPU_INFO
+
+#include "base.h"
+
+/* Features reported by CPUID of bootstrap processor, all CPUs are assumed to
+ * have the same. SIMD ones are only usable once enabled in XCR0, and only
+ * between sched_fpu_begin() and sched_fpu_end(). */
+typedef enum {
+  CPU_FEATURE_POPCNT,
+  CPU_FEATURE_MONITOR, /* MONITOR and MWAIT */
+  CPU_FEATURE_X2APIC,
+  CPU_FEATURE_TSC_DEADLINE,
+  CPU_FEATURE_XSAVE,
+  CPU_FEATURE_XSAVEOPT,
+  CPU_FEATURE_AVX,
+  CPU_FEATURE_AVX2,
+  CPU_FEATURE_AVX512F,
+  CPU_FEATURE_BMI2,
+  CPU_FEATURE_ERMS,   /* Enhanced REP MOVSB and STOSB */
+  CPU_FEATURE_FSRM,   /* Fast short REP MOVSB */
+  CPU_FEATURE_INVPCID,
+  CPU_FEATURE_PAGE_1G,
+  CPU_FEATURE_INVARIANT_TSC,
+  CPU_FEATURE_MAX, /* End token, also means no feature needed */
+} cpu_feature_t;
+
+typedef enum {
+  CPU_CACHE_DATA = 1,
+  CPU_CACHE_INST = 2,
+  CPU_CACHE_UNIFIED = 3,
+} cpu_cache_type_t;
+
+typedef struct {
+  cpu_cache_type_t type;
+  u32_t level;
+  u32_t line;
+  u32_t ways;
+  u32_t sets;
+  u32_t shared_by; /* Logical CPUs sharing it, at most */
+  u64_t size;
+} cpu_cache_t;
+
+/* Architectural performance monitoring, from CPUID leaf 0xA. */
+typedef struct {
+  u32_t version; /* 0 if absent, like on QEMU without KVM */
+  u32_t counters; /* General purpose counters of each logical CPU */
+  u32_t width;    /* Bits of each counter */
+  u32_t events;   /* Bit i is set if architectural event i is available */
+} cpu_perfmon_t;
+
+/* Position of a logical CPU, numbered within the one above it. */
+typedef struct {
+  u32_t package;
+  u32_t core;
+  u32_t thread;
+} cpu_topology_t;
+
+/* Read CPUID of bootstrap processor and bind hot routines to the best
+ * implementation for it, before anything else. */
+void cpu_info_bootstrap(void);
+bo_t cpu_has(cpu_feature_t feature);
+
+/* Caches from CPUID leaf 4, or 0x8000001D on AMD, sorted by level. */
+ucnt_t cpu_cache_cnt(void);
+const cpu_cache_t *cpu_cache(usz_t idx);
+/* Size of data or unified cache of @level, 0 if none. */
+u64_t cpu_cache_size(u32_t level);
+/* Line size of the first level data cache. */
+u32_t cpu_cache_line(void);
+
+const cpu_perfmon_t *cpu_perfmon(void);
+
+/* Topology of CPU with local APIC id @apic_id, from CPUID leaf 0x1F or 0xB,
+ * which tell how many bits of the id number threads and cores. */
+cpu_topology_t cpu_topology(u32_t apic_id);
+
+/* An implementation of a hot routine, and the feature it needs. */
+typedef struct {
+  const ch_t *name;
+  cpu_feature_t need; /* CPU_FEATURE_MAX if none */
+  vptr_t fn;
+} cpu_impl_t;
+
+/* Pick the first of @impls the CPU has the feature for, like ifunc. The last
+ * one must need nothing. @routine is only logged. */
+vptr_t cpu_dispatch(const ch_t *routine, const cpu_impl_t *impls, ucnt_t cnt);
+
+/* Hot routines bound by cpu_info_bootstrap(), usable before it. Areas must
+ * not overlap. */
+void cpu_mem_copy(byte_t *dst, const byte_t *src, usz_t len);
+void cpu_mem_zero(byte_t *mem, usz_t len);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_cpu_info(void);
+#endif
+
+#endif
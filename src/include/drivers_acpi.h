@@ -6,4 +6,31 @@
 void acpi_bootstrap_64(const byte_t *multi_boot_info, usz_t len);
 void acpi_bootstrap_32(const byte_t *multi_boot_info, usz_t len);
 
+/* Processors found in MADT, bootstrap processor included. */
+#define ACPI_CPU_MAX 256
+/* Physical address of local APIC registers. */
+uptr_t acpi_lapic_pa(void);
+ucnt_t acpi_cpu_cnt(void);
+u32_t acpi_cpu_apic_id(ucnt_t idx);
+
+#define ACPI_IOAPIC_MAX 8
+ucnt_t acpi_ioapic_cnt(void);
+/* Physical address of registers and first global system interrupt of I/O
+ * APIC @idx. */
+void acpi_ioapic(ucnt_t idx, uptr_t *out_pa, u32_t *out_gsi_base);
+
+/* Interrupt source override flags: polarity at bits 0..1, trigger mode at
+ * bits 2..3, 0 means conforming to the bus, which is active high and edge
+ * triggered for ISA. */
+#define ACPI_ISA_IRQ_CNT 16
+#define ACPI_IRQ_FLAG_ACTIVE_LOW 0x3
+#define ACPI_IRQ_FLAG_POLARITY_MASK 0x3
+#define ACPI_IRQ_FLAG_LEVEL 0xc
+#define ACPI_IRQ_FLAG_TRIGGER_MASK 0xc
+/* Global system interrupt ISA @irq is wired to. */
+u32_t acpi_isa_irq_gsi(u8_t irq, u16_t *out_flags);
+
+/* Physical address of HPET registers, 0 if there is no HPET table. */
+uptr_t acpi_hpet_pa(void);
+
 #endif
@@ -0,0 +1,50 @@
+#ifndef ___DRIVERS_APIC
+#define ___DRIVERS_APIC
+
+#include "base.h"
+
+/* Enable local APIC of bootstrap processor, route ISA IRQs through I/O APICs
+ * and mask legacy PIC. Legacy PIC is kept if ACPI reports no APIC. Must be
+ * called after mem_bootstrap_3, as registers are mapped with
+ * mem_mmio_map(). */
+void d_apic_bootstrap(void);
+/* Local APIC is usable, false if legacy PIC is still in use. */
+bo_t d_apic_ready(void);
+/* Enable local APIC of current CPU, for CPUs other than the bootstrap one. */
+void d_apic_init_cpu(void);
+/* APIC id of current CPU. */
+u32_t d_apic_id(void);
+/* Local APIC is in x2APIC mode, APIC ids are 32 bits then. */
+bo_t d_apic_x2apic(void);
+/* Acknowledge interrupt being handled on current CPU. */
+void d_apic_eoi(void);
+/* Inter-processor interrupts to bring up an application processor. */
+void d_apic_send_init(u32_t apic_id);
+void d_apic_send_startup(u32_t apic_id, u8_t vector);
+/* Send @vector to CPU of @apic_id. */
+void d_apic_send_ipi(u32_t apic_id, u8_t vector);
+
+/* Deliver performance counter overflows of current CPU as NMI, or mask them.
+ * CPU masks them again on each delivery, so handlers call it again. */
+void d_apic_pmi_nmi(bo_t enable);
+
+/* Timer of current CPU supports TSC-deadline mode. */
+bo_t d_apic_timer_deadline_ready(void);
+/* Put timer of current CPU in TSC-deadline mode raising @vector, disarmed. */
+void d_apic_timer_deadline(u8_t vector);
+/* Raise the vector once when TSC reaches @tsc, or disarm if @tsc is 0. */
+void d_apic_timer_deadline_set(u64_t tsc);
+/* Put timer of current CPU in one-shot mode raising @vector, stopped. Timer
+ * is calibrated against PIT the first time, so the first call is slow. */
+void d_apic_timer_oneshot(u8_t vector);
+/* Raise the vector once after @ns, at most a second, or stop if @ns is 0. */
+void d_apic_timer_oneshot_set(u64_t ns);
+
+/* Deliver global system interrupt @gsi as @vector to CPU of @apic_id, @flags
+ * are polarity and trigger mode, see ACPI_IRQ_FLAG_*. */
+void d_ioapic_route(u32_t gsi, u8_t vector, u16_t flags, u32_t apic_id);
+/* Same as d_ioapic_route(), honoring interrupt source overrides of ISA
+ * @irq. */
+void d_ioapic_route_isa(u8_t irq, u8_t vector, u32_t apic_id);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef ___DRIVERS_HPET
+#define ___DRIVERS_HPET
+
+#include "base.h"
+
+/* Map and start HPET found in ACPI, after mem_bootstrap_3. Timer 0 is put in
+ * legacy replacement mode, raising ISA IRQ 0 instead of PIT channel 0. */
+void d_hpet_bootstrap(void);
+/* HPET is found and counting. */
+bo_t d_hpet_ready(void);
+/* Main counter, shared by all CPUs and never stopped. */
+u64_t d_hpet_counter(void);
+/* Period of main counter in femtoseconds. */
+u64_t d_hpet_period_fs(void);
+/* Timer 0 can raise ISA IRQ 0, in legacy replacement mode. */
+bo_t d_hpet_oneshot_ready(void);
+/* Raise ISA IRQ 0 once when main counter reaches @counter, or stop timer 0
+ * if @counter is 0.
+ * @return false if @counter has been passed already, no IRQ is raised. */
+base_must_check bo_t d_hpet_oneshot(u64_t counter);
+
+#endif
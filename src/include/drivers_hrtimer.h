@@ -0,0 +1,44 @@
+#ifndef ___DRIVERS_HRTIMER
+#define ___DRIVERS_HRTIMER
+
+#include "base.h"
+
+/* Timer not queued on any CPU. */
+#define HRTIMER_CPU_NONE U64_MAX
+
+/* High resolution timer, its callback is run once it expires, in IRQ handler
+ * of the CPU started it, with IRQs disabled. */
+typedef struct hrtimer hrtimer_t;
+typedef void (*hrtimer_cb)(hrtimer_t *timer);
+struct hrtimer {
+  hrtimer_t *next;
+  hrtimer_cb fn;
+  u64_t expires;      /* TSC */
+  volatile u64_t cpu; /* CPU queued on, or HRTIMER_CPU_NONE */
+};
+
+#define HRTIMER_INIT(cb)                                                       \
+  {                                                                            \
+    .next = NULL, .fn = (cb), .expires = 0, .cpu = HRTIMER_CPU_NONE            \
+  }
+
+/* Pick clock event device, TSC-deadline mode of local APIC timer if there is,
+ * then one-shot mode of it, then HPET. Must be called after
+ * d_apic_bootstrap() and d_hpet_bootstrap(). */
+void hrtimer_bootstrap(void);
+/* Start clock event device of current CPU, IRQs must be disabled. */
+void hrtimer_init_cpu(void);
+/* Expire @timer @ns nanoseconds later on current CPU, it is restarted if
+ * pending already. */
+void hrtimer_start(hrtimer_t *timer, u64_t ns);
+/* @return true if @timer was pending, otherwise its callback may still be
+ * running. */
+bo_t hrtimer_cancel(hrtimer_t *timer);
+/* Block current thread for at least @ns nanoseconds. */
+void hrtimer_sleep_ns(u64_t ns);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_hrtimer(void);
+#endif
+
+#endif
@@ -2,11 +2,16 @@
 #define ___DRIVERS_PCIE
 
 #include "base.h"
+#include "interrupts.h"
 
 typedef struct d_pcie_group d_pcie_group_t;
 typedef struct d_pcie_func d_pcie_func_t;
 
 void d_pcie_bootstrap(const byte_t *mcfg, usz_t len);
+/* Map config space of functions found to kernel virtual addresses, must be
+ * called after mem_bootstrap_3. Before it config space is reached through
+ * the identity mapping of mem_bootstrap_1. */
+void d_pcie_map_cfg(void);
 ucnt_t d_pcie_group_get_cnt(void);
 uptr_t d_pcie_group_get_cfg_pa(ucnt_t group_idx);
 usz_t d_pcie_group_get_cfg_len(void);
@@ -21,6 +26,32 @@ const ch_t *d_pcie_func_get_device_name(d_pcie_func_t *fun);
 byte_t d_pcie_cfg_space_read_byte(d_pcie_func_t *fun, u64_t off);
 u16_t d_pcie_cfg_space_read_word(d_pcie_func_t *fun, u64_t off);
 u32_t d_pcie_cfg_space_read_dword(d_pcie_func_t *fun, u64_t off);
+void d_pcie_cfg_space_write_word(d_pcie_func_t *fun, u64_t off, u16_t val);
 void d_pcie_cfg_space_write_dword(d_pcie_func_t *fun, u64_t off, u32_t val);
 
+#define D_PCIE_CAP_ID_MSI 0x05
+#define D_PCIE_CAP_ID_MSIX 0x11
+/* Offset of capability @id in config space of @fun, 0 if not found. */
+u8_t d_pcie_func_cap_find(d_pcie_func_t *fun, u8_t id);
+
+/* Max interrupt vectors of one function. */
+#define D_PCIE_IRQ_CAP 32
+/* Allocate up to @n message signaled interrupt vectors for @fun, all of them
+ * are handled by @handler. MSI-X is preferred, MSI only gets one vector.
+ * Vector i is delivered to the (@cpu_hint + i)-th online CPU, wrapping
+ * around, so that each queue of a device can be served by its own CPU.
+ * Vectors are unmasked.
+ * @return Vectors allocated, 0 if @fun supports neither MSI nor MSI-X. */
+base_must_check ucnt_t d_pcie_irq_alloc(
+    d_pcie_func_t *fun, ucnt_t n, intr_handler_cb handler, usz_t cpu_hint);
+void d_pcie_irq_free(d_pcie_func_t *fun);
+intr_id_t d_pcie_irq_vector(d_pcie_func_t *fun, ucnt_t idx);
+void d_pcie_irq_mask(d_pcie_func_t *fun, ucnt_t idx);
+void d_pcie_irq_unmask(d_pcie_func_t *fun, ucnt_t idx);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+/* Built-in tests declarations */
+void test_d_pcie(void);
+#endif
+
 #endif
@@ -8,6 +8,11 @@ typedef enum {
   PORT_NO_PIC_MASTER_DATA = 0x21,
   PORT_NO_PIC_SLAVE_CMD = 0xA0,
   PORT_NO_PIC_SLAVE_DATA = 0xa1,
+  PORT_NO_PIT_CH2 = 0x42,
+  PORT_NO_PIT_CMD = 0x43,
+  /* Keyboard controller port B, bit 0 is the gate of PIT channel 2, bit 1
+   * enables the speaker, and bit 5 reads output of PIT channel 2. */
+  PORT_NO_PIT_CH2_GATE = 0x61,
   PORT_NO_KEYBOARD_CMD = 0x64,
   PORT_NO_KEYBOARD_DATA = 0x60,
   PORT_NO_VGA_CMD = 0x3d4,
@@ -17,6 +22,8 @@ typedef enum {
   PORT_NO_VGA_ATTRIBUTE_READ = 0x3c1,
   PORT_NO_SERIAL_COM1 = 0x3f8,
   PORT_NO_SERIAL_COM1_DATA = 0x03f8 + 1,
+  /* The same port as above once DLAB is disabled. */
+  PORT_NO_SERIAL_COM1_INTR_ENABLE = 0x03f8 + 1,
   PORT_NO_SERIAL_COM1_CMD_FIFO = 0x03f8 + 2,
   PORT_NO_SERIAL_COM1_CMD_LINE = 0x03f8 + 3,
   PORT_NO_SERIAL_COM1_CMD_MODEM = 0x03f8 + 4,
@@ -5,5 +5,8 @@
 
 void serial_init(void);
 void serial_write_str(const ch_t *str, usz_t len);
+/* Call @fn in IRQ handler with each byte received from now on. */
+typedef void (*serial_input_cb)(ch_t ch);
+void serial_input_register(serial_input_cb fn);
 
 #endif
@@ -3,6 +3,23 @@
 
 #include "base.h"
 
-void time_init(void);
+/* Calibrate TSC against HPET if there is, against PIT otherwise. Must be
+ * called after d_hpet_bootstrap(). */
+void time_bootstrap(void);
+/* Busy wait for at least @us microseconds, usable without interrupts. */
+void time_delay_us(u64_t us);
+/* TSC frequency in KHz, calibrated against PIT on first call if
+ * time_bootstrap() is not called yet. */
+u64_t time_tsc_khz(void);
+/* TSC keeps its rate in all power states, see Intel SDM 17.17.1. */
+bo_t time_tsc_invariant(void);
+
+/* Conversion between TSC cycles and nanoseconds, a multiplication and a
+ * shift each. Both are 0 until TSC is calibrated. */
+u64_t time_cycles_to_ns(u64_t cycles);
+u64_t time_ns_to_cycles(u64_t ns);
+/* Monotonic nanoseconds since CPU reset, from TSC, 0 until calibrated. TSCs
+ * of all CPUs are assumed to be in sync. */
+u64_t time_now_ns(void);
 
 #endif
@@ -0,0 +1,33 @@
+#ifndef ___DRIVERS_ZRAM
+#define ___DRIVERS_ZRAM
+
+#include "base.h"
+
+#define D_ZRAM_BLOCK_SIZE 4096
+
+typedef struct d_zram d_zram_t;
+
+/* Create a compressed RAM block device with @n_block blocks, every block is
+ * read as zeros before it is written. Devices are not usable in IRQ handlers,
+ * as pool pages are given back with a TLB shootdown.
+ * @return NULL if out of memory. */
+d_zram_t *d_zram_new(ucnt_t n_block);
+void d_zram_free(d_zram_t *dev);
+
+/* Write a block of @D_ZRAM_BLOCK_SIZE bytes.
+ * @return false if out of memory, the block keeps its old content then. */
+base_must_check bo_t d_zram_write(
+    d_zram_t *dev, u64_t blk, const byte_t *data);
+void d_zram_read(d_zram_t *dev, u64_t blk, byte_t *data);
+/* Drop content of a block, memory it used is given back to the pool. */
+void d_zram_discard(d_zram_t *dev, u64_t blk);
+
+/* Log compression ratio, pool usage and throughput. */
+void d_zram_stats_log(d_zram_t *dev);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+/* Built-in tests declarations */
+void test_d_zram(void);
+#endif
+
+#endif
@@ -7,8 +7,9 @@
  * on stack as arguments to ISR, see:
  * https://os.phil-opp.com/cpu-exceptions/#the-interrupt-stack-frame
  *
- * And then, all registers are pushed onto stack and to be restored later by
- * isr_common_stub or irq_common_stub.
+ * And then, error code and vector id are pushed, and it points to the vector
+ * id. Registers pushed below it by isr_common_stub or irq_common_stub differ,
+ * see intr_error_code() and intr_fault_ip() for what is above.
  *
  * And finally note that stack grows downward. */
 typedef byte_t intr_parameters_t;
@@ -45,18 +46,127 @@ typedef enum {
   INTR_ID_IRQ_LPT2 = 37,
   INTR_ID_IRQ_FLOPPY = 38,
   INTR_ID_IRQ_LPT1 = 39, /* Unreliable "spurious" interrupt (usually) */
-  INTR_ID_MAX            /* End token, not a valid interrupt ID */
+  /* 40..47 are the rest of ISA IRQs, ISA IRQ n is always on vector 32 + n,
+   * both with legacy PIC and with I/O APIC. */
+  INTR_ID_IRQ_ISA_END = 48,
+  /* Handed out by intr_vector_alloc(). */
+  INTR_ID_DYN_START = 48,
+  INTR_ID_DYN_END = 240,
+  /* 240..254 is reserved for local APIC timer and inter-processor
+   * interrupts. */
+  INTR_ID_APIC_TIMER = 240,
+  INTR_ID_APIC_RESCHED = 241, /* Makes an idle CPU look for threads */
+  INTR_ID_APIC_CALL = 242,    /* Runs calls queued by smp_call_async() */
+  INTR_ID_SPURIOUS = 255, /* Local APIC spurious interrupt, no EOI needed */
+  INTR_ID_MAX             /* End token, not a valid interrupt ID */
 } intr_id_t;
 typedef void (*intr_handler_cb)(intr_id_t id, intr_parameters_t *para);
 
 /* Initialize interrupt module, after this initialization is finished, IRQs
  * will be in disabled state, enable with intr_irq_enable(). */
 void intr_init(void);
+/* Initialize interrupts on application processor @cpu_idx, IDT is shared by
+ * all CPUs, but each of them has its own TSS, exception and IRQ stacks. */
+void intr_init_ap(usz_t cpu_idx);
+
+/* Mask legacy PIC and acknowledge IRQs through local APIC from now on, called
+ * once I/O APIC takes over ISA IRQs. */
+void intr_pic_disable(void);
 
 void intr_irq_enable(void);
 void intr_irq_disable(void);
+/* Disable IRQs on current CPU.
+ * @return Flags to be passed to intr_irq_restore(). */
+u64_t intr_irq_save(void);
+/* Enable IRQs again if they were enabled when @flags was saved. */
+void intr_irq_restore(u64_t flags);
+bo_t intr_irq_enabled(void);
+/* Handler of exceptions. A registered handler returning means the exception
+ * is resolved, and the faulting instruction is retried. */
 void intr_isr_handler(u64_t id, uptr_t stack_addr);
 void intr_irq_handler(u64_t id, uptr_t stack_addr);
+/* ISA IRQs are masked until their handlers are registered. */
 void intr_handler_register(intr_id_t id, intr_handler_cb handler);
+bo_t intr_handler_registered(intr_id_t id);
+/* Register @handler on a free vector of [INTR_ID_DYN_START,
+ * INTR_ID_DYN_END), for devices not wired to ISA IRQs, like MSI.
+ * @return false if all of them are taken. */
+base_must_check bo_t intr_vector_alloc(
+    intr_handler_cb handler, intr_id_t *out_id);
+/* Unregister handler of vector @id, got from intr_vector_alloc(). */
+void intr_vector_free(intr_id_t id);
+
+/* Log time spent in handler of each IRQ vector and each softirq. */
+void intr_time_report(void);
+/* Start storm detection, and dumping statistics of IRQ vectors on serial
+ * command, after sched_work_bootstrap(). See interrupts_stat.c. */
+void intr_stat_bootstrap(void);
+/* Flag vectors taken more than @per_sec times per second on a CPU as
+ * storming, keep the rate if @per_sec is 0.
+ * @return Rate before, 0 if none was set yet. */
+u64_t intr_stat_storm_rate(u64_t per_sec);
+/* Log runs and latency of @top vectors taken most, on all CPUs. */
+void intr_stat_report(usz_t top);
+
+/* Deferred work of IRQ handlers, run with IRQs enabled once the outermost
+ * handler returns, see interrupts_softirq.c. Softirqs are raised on current
+ * CPU, and run on the same CPU. */
+typedef enum {
+  INTR_SOFTIRQ_TASKLET,
+  INTR_SOFTIRQ_MAX,
+} intr_softirq_t;
+typedef void (*intr_softirq_cb)(void);
+
+/* Start softirq thread of each CPU, after sched_bootstrap(). */
+void intr_softirq_bootstrap(void);
+void intr_softirq_register(intr_softirq_t id, intr_softirq_cb fn);
+/* Mark @id pending on current CPU, usable from IRQ handlers. */
+void intr_softirq_raise(intr_softirq_t id);
+
+/* Tasklet is a callback run once in softirq of the CPU scheduled it,
+ * scheduling it again before it runs does nothing. Scheduled again from
+ * another CPU while running, it may run on both at once. */
+typedef struct intr_tasklet intr_tasklet_t;
+typedef void (*intr_tasklet_cb)(intr_tasklet_t *tasklet);
+struct intr_tasklet {
+  intr_tasklet_t *next;
+  intr_tasklet_cb fn;
+  volatile u64_t queued;
+};
+
+#define INTR_TASKLET_INIT(cb)                                                  \
+  {                                                                            \
+    .next = NULL, .fn = (cb), .queued = 0                                      \
+  }
+
+void intr_tasklet_schedule(intr_tasklet_t *tasklet);
+/* Current CPU is running an IRQ handler or a softirq. */
+bo_t intr_in_irq(void);
+
+/* Error code and faulting instruction of exceptions, error code is 0 for
+ * exceptions without one. */
+u64_t intr_error_code(intr_parameters_t *para);
+uptr_t intr_fault_ip(intr_parameters_t *para);
+
+/* Where interrupted code was, @bp is a frame pointer only in code built with
+ * them, see BUILD_DEBUG_ENABLED. */
+typedef struct {
+  uptr_t ip;
+  uptr_t sp;
+  uptr_t bp;
+} intr_context_t;
+
+/* Context interrupted by exception of @para, like NMI. */
+void intr_fault_context(intr_parameters_t *para, intr_context_t *ctx);
+/* Context interrupted by the outermost IRQ handler running on current CPU,
+ * for its handler. IRQs must be disabled.
+ * @return false if none is running. */
+bo_t intr_irq_context(intr_context_t *ctx);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_intr(void);
+void test_intr_softirq(void);
+void test_intr_stat(void);
+#endif
 
 #endif
@@ -13,7 +13,7 @@
 #ifdef BUILD_DEBUG_ENABLED
 #define kernel_assert_d(expr) kernel_assert(expr)
 #else
-#define kernel_assert_d(expr) expr
+#define kernel_assert_d(expr) ((void)(expr))
 #endif
 
 #define kernel_expect(expr) kernel_assert_d(expr)
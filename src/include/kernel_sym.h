@@ -0,0 +1,27 @@
+#ifndef ___KERNEL_SYM
+#define ___KERNEL_SYM
+
+#include "base.h"
+
+/* Bytes kernel_sym_marshal() writes at most. */
+#define KERNEL_SYM_LEN_MAX 64
+
+/* Index text symbols of kernel image, after mem_bootstrap_2(). */
+void kernel_sym_bootstrap(void);
+/* Find function or code label containing @addr, usable from IRQ handlers.
+ * @return false if @addr is in none of them. */
+bo_t kernel_sym_lookup(uptr_t addr, const ch_t **out_name, u64_t *out_off);
+/* Add "name+0x1F" of @addr into result string, or @addr in hex if it is in
+ * no symbol, names too long are cut.
+ * @return Bytes added, at most KERNEL_SYM_LEN_MAX */
+usz_t kernel_sym_marshal(
+    ch_t *buf, const usz_t buf_off, const usz_t buf_len, uptr_t addr);
+/* Log callers of current function, walking frame pointers, which only debug
+ * builds keep. */
+void kernel_sym_backtrace(void);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_kernel_sym(void);
+#endif
+
+#endif
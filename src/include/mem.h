@@ -5,6 +5,7 @@
 #include "base.h"
 
 typedef struct pa_list pa_list_t;
+typedef struct mem_stack mem_stack_t;
 
 void mem_bootstrap_1(
     const byte_t *mb_elf,  /* Multiboot kernel elf sections info */
@@ -13,16 +14,70 @@ void mem_bootstrap_1(
     usz_t mb_mmap_len      /* Length of @mb_mmap */
 );
 void mem_bootstrap_2(void);
+/* Must be called after interrupts are initialized, as kernel stacks are
+ * backed by page fault handler. */
 void mem_bootstrap_3(void);
 
+/* Log static memory footprint of kernel image, and frames used by page
+ * tables. */
+void mem_footprint_report(void);
+
+/* Function or code label of kernel image at @addr of @len bytes, @len is 0 if
+ * unknown. */
+typedef void (*mem_ker_sym_cb)(
+    uptr_t addr, usz_t len, const ch_t *name, vptr_t arg);
+/* Call @fn on each text symbol of kernel image, from symbol table kept loaded
+ * by multiboot loader, after mem_bootstrap_2(). Names stay valid for good.
+ * @return false if symbol table is not loaded. */
+bo_t mem_ker_text_syms(mem_ker_sym_cb fn, vptr_t arg);
+
 void mem_page_map(uptr_t va, /* Start of virtual address to be mapped */
     ucnt_t n_pg,             /* Page count of virtual address to be mapped */
     pa_list_t *pa            /* Physical address to be mapped */
 );
 
+/* Allocate virtual addresses of @n_pg pages, not backed by any frame. */
+base_must_check bo_t mem_va_alloc(ucnt_t n_pg, uptr_t *out_va);
+void mem_va_free(uptr_t va, ucnt_t n_pg);
+bo_t mem_va_owns(uptr_t va);
+/* Pages allocated from virtual address allocator. */
+ucnt_t mem_va_used(void);
+
+/* Map @len bytes of device registers at physical address @pa, uncached.
+ * @return Virtual address of @pa, or 0 if out of virtual addresses. */
+base_must_check uptr_t mem_mmio_map(uptr_t pa, usz_t len);
+
+/* Allocate @n_pg pages of kernel memory, backed by frames at once, not
+ * zeroed.
+ * @return Virtual address of the pages, or 0 if out of frames or virtual
+ * addresses. */
+base_must_check uptr_t mem_pages_alloc(ucnt_t n_pg);
+/* Give back pages of mem_pages_alloc(), IRQs must be enabled. */
+void mem_pages_free(uptr_t va, ucnt_t n_pg);
+
+/* Allocate a kernel stack with @n_pg usable pages, pages are backed on first
+ * touch. @name must outlive the stack.
+ * @return NULL if out of virtual addresses or stack slots. */
+base_must_check mem_stack_t *mem_stack_new(const ch_t *name, ucnt_t n_pg);
+/* Free @stack, TLB of every CPU is flushed for it, IRQs must be enabled. */
+void mem_stack_free(mem_stack_t *stack);
+/* Initial stack pointer of @stack. */
+uptr_t mem_stack_bottom(mem_stack_t *stack);
+/* Deepest usage of @stack so far in bytes. */
+usz_t mem_stack_depth_peak(mem_stack_t *stack);
+ucnt_t mem_stack_mapped_pages(mem_stack_t *stack);
+/* Log reserved, backed and peak depth of all stacks, for tuning their sizes. */
+void mem_stack_report(void);
+
 void mem_clean(byte_t *mem, usz_t size);
 bo_t mem_align_check(uptr_t p, u64_t align);
 uptr_t mem_align_up(uptr_t p, u64_t align);
 uptr_t mem_align_down(uptr_t p, u64_t align);
 
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_mem_va(void);
+void test_mem_stack(void);
+void test_mem_page(void);
+#endif
+
 #endif
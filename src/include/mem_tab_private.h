@@ -0,0 +1,31 @@
+/* Private to page table code of mem and mm, each has its own packed entry
+ * type. */
+#ifndef ___MEM_TAB_PRIVATE
+#define ___MEM_TAB_PRIVATE
+
+#include "base.h"
+
+/* Define, for packed 8 bytes page table entry type @type:
+ * - _tab_entry_word(), entry as a word, for atomic updates. Entries are
+ *   always 8 bytes aligned in a table, though the type is packed.
+ * - _tab_entry_bits(), bits of an entry by value, without aliasing it. */
+#define MEM_TAB_ENTRY_HELPERS(type)                                            \
+  base_private volatile u64_t *_tab_entry_word(type *entry)                    \
+  {                                                                            \
+    uptr_t addr = (uptr_t)entry;                                               \
+                                                                               \
+    return (volatile u64_t *)addr;                                             \
+  }                                                                            \
+                                                                               \
+  base_private u64_t _tab_entry_bits(type entry)                               \
+  {                                                                            \
+    union {                                                                    \
+      type entry;                                                              \
+      u64_t bits;                                                              \
+    } u;                                                                       \
+                                                                               \
+    u.entry = entry;                                                           \
+    return u.bits;                                                             \
+  }
+
+#endif
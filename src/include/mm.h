@@ -28,15 +28,33 @@ void mm_early_bootstrap(const byte_t *kernel_elf_info,
 
 void mm_bootstrap(uptr_t boot_stack_bottom, uptr_t boot_stack_top);
 
+/* Allocate a block of at least @len bytes, actual length is saved in
+ * @all_len. */
+vptr_t mm_heap_alloc(usz_t len, usz_t *all_len);
+vptr_t mm_heap_alloc_minimum(usz_t *all_len);
+void mm_heap_free(vptr_t block_user);
+
 mm_allocator_t *mm_allocator_new(void);
 vptr_t mm_allocate(mm_allocator_t *all, usz_t size, usz_t align);
 void mm_allocator_free(mm_allocator_t *all);
 
 bo_t mm_page_map(uptr_t va, uptr_t pa);
 
+#ifdef BUILD_MM_TRACE_ENABLED
+/* Start recording heap and allocator calls, previous records are dropped. */
+void mm_trace_start(void);
+void mm_trace_stop(void);
+/* Dump records over serial, one hex encoded record each line, to be replayed
+ * by tools/mm_replay. */
+void mm_trace_dump(void);
+#endif
+
 #ifdef BUILD_SELF_TEST_ENABLED
 /* Built-in tests declarations */
 void test_mm(void);
+#ifdef BUILD_MM_TRACE_ENABLED
+void test_mm_trace(void);
+#endif
 #endif
 
 #endif
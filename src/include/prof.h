@@ -0,0 +1,31 @@
+#ifndef ___PROF
+#define ___PROF
+
+#include "base.h"
+
+/* Architectural events counted while profiling, see prof.c. */
+typedef enum {
+  PROF_EVENT_CYCLES,
+  PROF_EVENT_INSTRUCTIONS,
+  PROF_EVENT_LLC_MISSES,
+  PROF_EVENT_MAX,
+} prof_event_t;
+
+/* Probe performance counters, after smp_call_bootstrap(). */
+void prof_bootstrap(void);
+/* Start sampling on each CPU online in bit mask @cpus, every @period of
+ * @event, or every @period ns of timer if counters or @event are absent.
+ * Samples taken before are dropped.
+ * @return false if sampling by timer. */
+bo_t prof_start(u64_t cpus, prof_event_t event, u64_t period);
+/* Stop sampling, and log events counted since prof_start(). */
+void prof_stop(void);
+/* Write samples taken so far over serial as folded stacks, one caller at a
+ * time. */
+void prof_dump(void);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_prof(void);
+#endif
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef ___SCHED
+#define ___SCHED
+
+#include "base.h"
+
+/* Thread may run on any CPU, see sched_thread_new(). */
+#define SCHED_CPU_ANY U64_MAX
+
+typedef struct sched_thread sched_thread_t;
+typedef void (*sched_entry_cb)(vptr_t arg);
+
+/* Turn current context of bootstrap processor into the first thread, start
+ * timer ticks of it and enable IRQs, threads are preempted from now on. Must
+ * be called after smp_bootstrap(), returns after all CPUs online are taking
+ * threads. */
+void sched_bootstrap(void);
+/* Called by each application processor once it is online, its context
+ * becomes the idle thread of it. */
+base_no_return sched_ap_main(void);
+
+/* Create a thread running @entry with @arg, on CPU @cpu or SCHED_CPU_ANY.
+ * Threads of SCHED_CPU_ANY start on current CPU, and are stolen by idle ones.
+ * @name must outlive the thread.
+ * @return NULL if out of thread slots or stacks. */
+base_must_check sched_thread_t *sched_thread_new(
+    const ch_t *name, sched_entry_cb entry, vptr_t arg, usz_t cpu);
+/* Stop current thread, the same as returning from its entry. */
+base_no_return sched_thread_exit(void);
+/* Give up CPU to another thread ready to run, if any. */
+void sched_yield(void);
+/* Block current thread until woken by sched_thread_wake(), return at once if
+ * woken since the last return. Callers check their condition again after
+ * return, preemption must be enabled. */
+void sched_thread_sleep(void);
+/* Wake @thread blocked in sched_thread_sleep(), usable from IRQ handlers. */
+void sched_thread_wake(sched_thread_t *thread);
+sched_thread_t *sched_current(void);
+const ch_t *sched_thread_name(sched_thread_t *thread);
+/* CPU @cpu is taking threads. */
+bo_t sched_cpu_online(usz_t cpu);
+/* Log idle residency, and latency of waking each CPU up from idle. */
+void sched_idle_report(void);
+
+/* Current thread is not preempted until the same number of
+ * sched_preempt_enable() calls, it may still be interrupted by IRQs. */
+void sched_preempt_disable(void);
+void sched_preempt_enable(void);
+/* @return true if current thread may be preempted, or scheduler is not
+ * ready yet. */
+bo_t sched_preempt_enabled(void);
+/* Section of current thread using SIMD registers, with inline assembly or
+ * functions built for them, kernel is built without them otherwise. Current
+ * thread is not preempted in between, and its registers are kept from one
+ * section to the next, saved when another thread uses them. Not usable in
+ * IRQ handlers or softirqs. */
+void sched_fpu_begin(void);
+void sched_fpu_end(void);
+/* Called at the end of IRQ handling, switch to another thread if current
+ * one used up its time slice. */
+void sched_irq_exit(void);
+
+/* Work run by a worker thread of the CPU queued it, unlike softirqs it may
+ * sleep, see sched_work.c. */
+typedef struct sched_work sched_work_t;
+typedef void (*sched_work_cb)(sched_work_t *work);
+struct sched_work {
+  sched_work_t *next;
+  sched_work_cb fn;
+  volatile u64_t queued;
+};
+
+#define SCHED_WORK_INIT(cb)                                                    \
+  {                                                                            \
+    .next = NULL, .fn = (cb), .queued = 0                                      \
+  }
+
+/* Start worker thread of each CPU, after sched_bootstrap(). */
+void sched_work_bootstrap(void);
+/* Queue @work to worker of current CPU, usable from IRQ handlers.
+ * @return false if it is queued already and has not started yet. */
+bo_t sched_work_queue(sched_work_t *work);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_sched(void);
+void test_sched_work(void);
+#endif
+
+#endif
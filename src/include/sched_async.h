@@ -0,0 +1,104 @@
+#ifndef ___SCHED_ASYNC
+#define ___SCHED_ASYNC
+
+#include "base.h"
+#include "kernel_panic.h"
+
+/* Stackless async tasks, see sched_async.c.
+ *
+ * A task is a function resumed by the executor of its CPU each time it can
+ * make progress, and it returns at each wait instead of blocking. Waits are
+ * written inline with the macros below, which resume the function right
+ * after the wait it returned at, so locals do not survive a wait, keep state
+ * in a struct embedding the task. A task costs a few words instead of a
+ * thread and its stack, so drivers may keep thousands of I/Os in flight. */
+
+typedef enum {
+  SCHED_ASYNC_PENDING, /* Waiting for a future, requeued once it completes */
+  SCHED_ASYNC_YIELD,   /* Requeued at once, after other tasks ready */
+  SCHED_ASYNC_DONE,
+} sched_async_t;
+
+typedef struct sched_task sched_task_t;
+typedef sched_async_t (*sched_task_cb)(sched_task_t *task);
+
+/* Result of an operation completing later, typically in an IRQ handler.
+ * Awaited by at most one task at a time. */
+typedef struct {
+  volatile u64_t state; /* Pending, done, or task waiting for it */
+  u64_t result;
+} sched_future_t;
+
+struct sched_task {
+  sched_task_t *next;
+  sched_task_cb fn;
+  u64_t cpu;            /* Executor it runs on */
+  u64_t resume;         /* Where to resume fn, 0 to start over */
+  volatile u64_t queued;
+  sched_future_t done;  /* Completed with 0 once fn returns done */
+};
+
+#define SCHED_FUTURE_INIT                                                      \
+  {                                                                            \
+    .state = 0, .result = 0                                                    \
+  }
+
+#define SCHED_TASK_INIT(cb)                                                    \
+  {                                                                            \
+    .next = NULL, .fn = (cb), .cpu = 0, .resume = 0, .queued = 0,              \
+    .done = SCHED_FUTURE_INIT                                                  \
+  }
+
+/* Body of a task function is put between these two. */
+#define SCHED_ASYNC_BEGIN(task)                                                \
+  switch ((task)->resume) {                                                    \
+  case 0:
+
+#define SCHED_ASYNC_END(task)                                                  \
+  break;                                                                       \
+  default:                                                                     \
+    kernel_panic("Async task resumed at bad point.");                          \
+    break;                                                                     \
+  }                                                                            \
+  (task)->resume = 0;                                                          \
+  return SCHED_ASYNC_DONE
+
+/* Return from task until @future completes, at most one wait per line. */
+#define SCHED_ASYNC_AWAIT(task, future)                                        \
+  do {                                                                         \
+    (task)->resume = __LINE__;                                                 \
+    base_fallthrough;                                                          \
+  case __LINE__:                                                               \
+    if (!sched_future_poll((future), (task))) {                                \
+      return SCHED_ASYNC_PENDING;                                              \
+    }                                                                          \
+  } while (0)
+
+/* Let other tasks of this CPU run, and resume after them. */
+#define SCHED_ASYNC_YIELD(task)                                                \
+  do {                                                                         \
+    (task)->resume = __LINE__;                                                 \
+    return SCHED_ASYNC_YIELD;                                                  \
+  case __LINE__:;                                                              \
+  } while (0)
+
+/* Start executor thread of each CPU, after sched_bootstrap(). */
+void sched_async_bootstrap(void);
+/* Queue @task to run from its beginning on executor of CPU @cpu, it must not
+ * be running or awaited. */
+void sched_task_spawn(sched_task_t *task, usz_t cpu);
+
+void sched_future_init(sched_future_t *future);
+/* Set result of @future and wake task awaiting it, usable from IRQ handlers.
+ * A future completes only once until initialized again. */
+void sched_future_complete(sched_future_t *future, u64_t result);
+/* @return true if @future completed, otherwise @task is queued again once it
+ * does. */
+bo_t sched_future_poll(sched_future_t *future, sched_task_t *task);
+bo_t sched_future_done(sched_future_t *future);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_sched_async(void);
+#endif
+
+#endif
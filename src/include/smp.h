@@ -0,0 +1,54 @@
+#ifndef ___SMP
+#define ___SMP
+
+#include "base.h"
+
+/* Max CPUs supported, bootstrap processor included. */
+#define SMP_CPU_MAX 64
+
+/* Bring up application processors found in ACPI MADT, each of them gets its
+ * own GDT, TSS, stack and per CPU area. Must be called after
+ * d_apic_bootstrap(). */
+void smp_bootstrap(void);
+/* Index of current CPU, read from per CPU area through GS base, bootstrap
+ * processor is always 0. */
+usz_t smp_cpu_idx(void);
+/* CPUs online, bootstrap processor included. */
+ucnt_t smp_cpu_cnt(void);
+bo_t smp_cpu_online(usz_t idx);
+u32_t smp_cpu_apic_id(usz_t idx);
+
+/* Remote function calls, run in IPI handler of the target CPU with IRQs
+ * disabled, see smp_call.c. */
+typedef void (*smp_call_cb)(vptr_t arg);
+typedef struct smp_call smp_call_t;
+struct smp_call {
+  smp_call_t *next;
+  smp_call_cb fn;
+  vptr_t arg;
+  volatile u64_t done;
+};
+
+#define SMP_CALL_INIT(cb, a)                                                   \
+  {                                                                            \
+    .next = NULL, .fn = (cb), .arg = (a), .done = 0                            \
+  }
+
+/* Take remote calls on each CPU, after smp_bootstrap(). */
+void smp_call_bootstrap(void);
+/* Run @fn with @arg on CPU @cpu and return after it finishes, at once if it
+ * is current CPU. IRQs must be enabled, so that two CPUs calling each other
+ * do not wait for each other forever. */
+void smp_call_function_single(usz_t cpu, smp_call_cb fn, vptr_t arg);
+/* The same on each CPU online in bit mask @cpus, remote ones in parallel. */
+void smp_call_function_many(u64_t cpus, smp_call_cb fn, vptr_t arg);
+/* Queue @call to CPU @cpu and return, @call must stay until
+ * smp_call_done() tells it finished, usable with IRQs disabled. */
+void smp_call_async(usz_t cpu, smp_call_t *call);
+bo_t smp_call_done(smp_call_t *call);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_smp_call(void);
+#endif
+
+#endif
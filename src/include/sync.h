@@ -0,0 +1,176 @@
+/* Public header of synchronization primitives. */
+#ifndef ___SYNC
+#define ___SYNC
+
+#include "base.h"
+
+#ifdef BUILD_LOCK_STAT_ENABLED
+/* Contention statistics of a lock, it is listed in sync_stat_report() since
+ * first acquired. */
+typedef struct sync_stat {
+  const ch_t *name;
+  struct sync_stat *next;
+  volatile u64_t listed;
+  volatile u64_t acquired;
+  volatile u64_t contended;  /* Acquisitions which had to wait */
+  volatile u64_t wait_total; /* In TSC cycles */
+  volatile u64_t wait_max;
+} sync_stat_t;
+
+#define _SYNC_STAT sync_stat_t stat;
+#define _SYNC_STAT_INIT(lock_name) .stat = {.name = (lock_name)}
+#else
+#define _SYNC_STAT
+#define _SYNC_STAT_INIT(lock_name)
+#endif
+
+/* Ticket spin lock, CPUs get the lock in the order they ask for it. Current
+ * thread is not preempted while holding it. */
+typedef struct {
+  volatile u64_t next;  /* Ticket of the next CPU asking */
+  volatile u64_t owner; /* Ticket of the CPU holding it */
+  _SYNC_STAT
+} sync_spin_t;
+
+#define SYNC_SPIN_INIT(lock_name)                                              \
+  {                                                                            \
+    .next = 0, .owner = 0, _SYNC_STAT_INIT(lock_name)                          \
+  }
+
+void sync_spin_init(sync_spin_t *lock, const ch_t *name);
+void sync_spin_lock(sync_spin_t *lock);
+void sync_spin_unlock(sync_spin_t *lock);
+base_must_check bo_t sync_spin_try_lock(sync_spin_t *lock);
+/* Variants disabling IRQs, for locks also taken by IRQ handlers.
+ * @return Flags to be passed to sync_spin_unlock_irqrestore(). */
+u64_t sync_spin_lock_irqsave(sync_spin_t *lock);
+void sync_spin_unlock_irqrestore(sync_spin_t *lock, u64_t flags);
+
+/* MCS queue lock, each waiter spins on its own node instead of the shared
+ * lock word, so a contended lock does not bounce one cache line among all
+ * waiters. Node must stay alive until unlocked, stack of caller is fine. */
+typedef struct sync_mcs_node {
+  struct sync_mcs_node *volatile next;
+  volatile u64_t waiting;
+} sync_mcs_node_t;
+
+typedef struct {
+  volatile u64_t tail; /* Node of the last waiter, 0 if free */
+  _SYNC_STAT
+} sync_mcs_t;
+
+#define SYNC_MCS_INIT(lock_name)                                               \
+  {                                                                            \
+    .tail = 0, _SYNC_STAT_INIT(lock_name)                                      \
+  }
+
+void sync_mcs_init(sync_mcs_t *lock, const ch_t *name);
+void sync_mcs_lock(sync_mcs_t *lock, sync_mcs_node_t *node);
+void sync_mcs_unlock(sync_mcs_t *lock, sync_mcs_node_t *node);
+u64_t sync_mcs_lock_irqsave(sync_mcs_t *lock, sync_mcs_node_t *node);
+void sync_mcs_unlock_irqrestore(
+    sync_mcs_t *lock, sync_mcs_node_t *node, u64_t flags);
+
+/* Reader writer spin lock, a writer waiting blocks new readers so that
+ * writers are not starved. */
+typedef struct {
+  volatile u64_t state; /* Readers count, and a bit for writer */
+  _SYNC_STAT
+} sync_rw_t;
+
+#define SYNC_RW_INIT(lock_name)                                                \
+  {                                                                            \
+    .state = 0, _SYNC_STAT_INIT(lock_name)                                     \
+  }
+
+void sync_rw_init(sync_rw_t *lock, const ch_t *name);
+void sync_rw_read_lock(sync_rw_t *lock);
+void sync_rw_read_unlock(sync_rw_t *lock);
+void sync_rw_write_lock(sync_rw_t *lock);
+void sync_rw_write_unlock(sync_rw_t *lock);
+u64_t sync_rw_read_lock_irqsave(sync_rw_t *lock);
+void sync_rw_read_unlock_irqrestore(sync_rw_t *lock, u64_t flags);
+u64_t sync_rw_write_lock_irqsave(sync_rw_t *lock);
+void sync_rw_write_unlock_irqrestore(sync_rw_t *lock, u64_t flags);
+
+/* Sequence lock, readers never block writers, but retry if a write happened
+ * meanwhile:
+ *
+ *   do {
+ *     seq = sync_seq_read_begin(&lock);
+ *     ... copy data out ...
+ *   } while (sync_seq_read_retry(&lock, seq));
+ */
+typedef struct {
+  volatile u64_t seq; /* Odd while being written */
+  sync_spin_t writer; /* Serializes writers */
+} sync_seq_t;
+
+#define SYNC_SEQ_INIT(lock_name)                                               \
+  {                                                                            \
+    .seq = 0, .writer = SYNC_SPIN_INIT(lock_name)                              \
+  }
+
+void sync_seq_init(sync_seq_t *lock, const ch_t *name);
+u64_t sync_seq_read_begin(sync_seq_t *lock);
+bo_t sync_seq_read_retry(sync_seq_t *lock, u64_t seq);
+void sync_seq_write_begin(sync_seq_t *lock);
+void sync_seq_write_end(sync_seq_t *lock);
+u64_t sync_seq_write_begin_irqsave(sync_seq_t *lock);
+void sync_seq_write_end_irqrestore(sync_seq_t *lock, u64_t flags);
+
+/* Read copy update, for tables read all the time but rarely updated. Read
+ * sections only disable preemption, and must not sleep or yield. IRQ
+ * handlers are read sections as a whole.
+ *
+ *   sync_rcu_read_lock();
+ *   p = sync_rcu_deref(table);
+ *   ... read @p ...
+ *   sync_rcu_read_unlock();
+ *
+ * Writers serialize among themselves with a lock, publish a new copy with
+ * sync_rcu_assign(), and free the old one after sync_rcu_synchronize(), or
+ * from a sync_rcu_call() callback. */
+typedef struct sync_rcu_head sync_rcu_head_t;
+typedef void (*sync_rcu_cb)(sync_rcu_head_t *head);
+struct sync_rcu_head {
+  sync_rcu_head_t *next;
+  sync_rcu_cb fn;
+};
+
+/* Stores before are seen by readers no later than @val, plain moves on x86,
+ * the same as loads of sync_rcu_deref(). */
+#define sync_rcu_assign(ptr, val)                                              \
+  __atomic_store_n(&(ptr), val, __ATOMIC_RELEASE)
+#define sync_rcu_deref(ptr) __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE)
+
+void sync_rcu_read_lock(void);
+void sync_rcu_read_unlock(void);
+/* Wait until all read sections already started end, must be called from a
+ * thread with preemption enabled. */
+void sync_rcu_synchronize(void);
+/* Call @fn with @head after all read sections already started end, usable
+ * from IRQ handlers. @head is usually embedded in the object to free. */
+void sync_rcu_call(sync_rcu_head_t *head, sync_rcu_cb fn);
+/* Called by scheduler on current CPU, never in a read section. */
+void sync_rcu_qs(void);
+/* Called by idle thread around waiting for IRQs, a CPU waiting is in
+ * quiescent state all the time. */
+void sync_rcu_idle_enter(void);
+void sync_rcu_idle_exit(void);
+/* Called on IRQ entry, IRQ handlers of an idle CPU are read sections. */
+void sync_rcu_irq_enter(void);
+/* Run callbacks whose grace periods ended, and start the next one. */
+void sync_rcu_poll(void);
+
+#ifdef BUILD_LOCK_STAT_ENABLED
+/* Log statistics of @top_n locks waited the longest in total. */
+void sync_stat_report(ucnt_t top_n);
+#endif
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_sync(void);
+void test_sync_rcu(void);
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef ___TRACE
+#define ___TRACE
+
+#include "base.h"
+
+/* Events of tracepoints, see trace.c for their fields. */
+typedef enum {
+  TRACE_EVENT_HEAP_ALLOC,
+  TRACE_EVENT_HEAP_FREE,
+  TRACE_EVENT_FRAME_ALLOC,
+  TRACE_EVENT_FRAME_FREE,
+  TRACE_EVENT_PAGE_MAP,
+  TRACE_EVENT_IRQ_ENTRY,
+  TRACE_EVENT_IRQ_EXIT,
+  TRACE_EVENT_PCIE_CFG_READ,
+  TRACE_EVENT_PCIE_CFG_WRITE,
+  TRACE_EVENT_MAX,
+} trace_event_t;
+
+/* Bit of each event enabled, read by tracepoints directly, so that one
+ * disabled costs a load and a branch predicted not taken. */
+extern volatile u64_t trace_events_on;
+
+/* Record @event with its fields on current CPU, use tracepoints below. */
+void trace_record(trace_event_t event, u64_t f0, u64_t f1, u64_t f2);
+
+#define trace_point(event, f0, f1, f2)                                         \
+  do {                                                                         \
+    if (base_unlikely(                                                         \
+            (trace_events_on & (u64_literal(1) << (event))) != 0)) {           \
+      trace_record((event), (u64_t)(f0), (u64_t)(f1), (u64_t)(f2));            \
+    }                                                                          \
+  } while (0)
+
+/* Tracepoints, each converts its fields from the type given. */
+#define trace_heap_alloc(block, len)                                           \
+  trace_point(TRACE_EVENT_HEAP_ALLOC, (uptr_t)(block), (usz_t)(len), 0)
+#define trace_heap_free(block)                                                 \
+  trace_point(TRACE_EVENT_HEAP_FREE, (uptr_t)(block), 0, 0)
+#define trace_frame_alloc(frame)                                               \
+  trace_point(TRACE_EVENT_FRAME_ALLOC, (uptr_t)(frame), 0, 0)
+#define trace_frame_free(frame)                                                \
+  trace_point(TRACE_EVENT_FRAME_FREE, (uptr_t)(frame), 0, 0)
+#define trace_page_map(va, pa, n_pg)                                           \
+  trace_point(TRACE_EVENT_PAGE_MAP, (uptr_t)(va), (uptr_t)(pa), (ucnt_t)(n_pg))
+#define trace_irq_entry(vector, ip)                                            \
+  trace_point(TRACE_EVENT_IRQ_ENTRY, (u8_t)(vector), (uptr_t)(ip), 0)
+#define trace_irq_exit(vector, cycles)                                         \
+  trace_point(TRACE_EVENT_IRQ_EXIT, (u8_t)(vector), (u64_t)(cycles), 0)
+/* @bdf is bus, device and function packed as in PCI addresses. */
+#define trace_pcie_cfg_read(bdf, off, val)                                     \
+  trace_point(TRACE_EVENT_PCIE_CFG_READ, (u16_t)(bdf), (u64_t)(off),          \
+      (u32_t)(val))
+#define trace_pcie_cfg_write(bdf, off, val)                                    \
+  trace_point(TRACE_EVENT_PCIE_CFG_WRITE, (u16_t)(bdf), (u64_t)(off),         \
+      (u32_t)(val))
+
+/* Set up buffer of each CPU, before any event is enabled. */
+void trace_bootstrap(void);
+void trace_enable(trace_event_t event, bo_t on);
+/* Write records so far over serial, to be decoded by tools/trace_decode,
+ * one caller at a time. */
+void trace_dump(void);
+
+#ifdef BUILD_SELF_TEST_ENABLED
+void test_trace(void);
+#endif
+
+#endif
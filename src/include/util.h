@@ -16,4 +16,25 @@ bo_t util_math_is_pow2(u64_t n);
 
 u64_t util_rand_int_next(u64_t curr);
 
+/* Entry count of hash table needed by @util_lz4_compress. */
+#define UTIL_LZ4_TABLE_LEN 4096
+/* Max input length of @util_lz4_compress. */
+#define UTIL_LZ4_SRC_MAX 65534
+/* Worst case output length of @util_lz4_compress. */
+#define UTIL_LZ4_BOUND(len) ((len) + ((len) / 255) + 16)
+
+/* Compress @src into LZ4 block format.
+ * @return Compressed length, or 0 if @dst_cap is not enough. */
+usz_t util_lz4_compress(const byte_t *src,
+    usz_t src_len,
+    byte_t *dst,
+    usz_t dst_cap,
+    u16_t *table /* Work space of @UTIL_LZ4_TABLE_LEN entries */
+);
+
+/* Decompress a LZ4 block, the output must be exactly @dst_len bytes.
+ * @return false if @src is malformed. */
+bo_t util_lz4_decompress(
+    const byte_t *src, usz_t src_len, byte_t *dst, usz_t dst_len);
+
 #endif
@@ -1,8 +1,17 @@
-#include "interrupts.h"
+#include "interrupts_private.h"
 #include "containers_string.h"
+#include "cpu.h"
+#include "drivers_apic.h"
 #include "drivers_port.h"
 #include "drivers_screen.h"
+#include "drivers_time.h"
 #include "kernel_panic.h"
+#include "log.h"
+#include "mem.h"
+#include "sched.h"
+#include "smp.h"
+#include "sync.h"
+#include "trace.h"
 
 /* Forwarded declarations */
 extern void isr0(void);
@@ -37,231 +46,9 @@ extern void isr28(void);
 extern void isr29(void);
 extern void isr30(void);
 extern void isr31(void);
-extern void irq0(void);
-extern void irq1(void);
-extern void irq2(void);
-extern void irq3(void);
-extern void irq4(void);
-
-extern void isr37(void);
-extern void isr38(void);
-extern void isr39(void);
-extern void isr40(void);
-extern void isr41(void);
-extern void isr42(void);
-extern void isr43(void);
-extern void isr44(void);
-extern void isr45(void);
-extern void isr46(void);
-extern void isr47(void);
-extern void isr48(void);
-extern void isr49(void);
-extern void isr50(void);
-extern void isr51(void);
-extern void isr52(void);
-extern void isr53(void);
-extern void isr54(void);
-extern void isr55(void);
-extern void isr56(void);
-extern void isr57(void);
-extern void isr58(void);
-extern void isr59(void);
-extern void isr60(void);
-extern void isr61(void);
-extern void isr62(void);
-extern void isr63(void);
-extern void isr64(void);
-extern void isr65(void);
-extern void isr66(void);
-extern void isr67(void);
-extern void isr68(void);
-extern void isr69(void);
-extern void isr70(void);
-extern void isr71(void);
-extern void isr72(void);
-extern void isr73(void);
-extern void isr74(void);
-extern void isr75(void);
-extern void isr76(void);
-extern void isr77(void);
-extern void isr78(void);
-extern void isr79(void);
-extern void isr80(void);
-extern void isr81(void);
-extern void isr82(void);
-extern void isr83(void);
-extern void isr84(void);
-extern void isr85(void);
-extern void isr86(void);
-extern void isr87(void);
-extern void isr88(void);
-extern void isr89(void);
-extern void isr90(void);
-extern void isr91(void);
-extern void isr92(void);
-extern void isr93(void);
-extern void isr94(void);
-extern void isr95(void);
-extern void isr96(void);
-extern void isr97(void);
-extern void isr98(void);
-extern void isr99(void);
-extern void isr100(void);
-extern void isr101(void);
-extern void isr102(void);
-extern void isr103(void);
-extern void isr104(void);
-extern void isr105(void);
-extern void isr106(void);
-extern void isr107(void);
-extern void isr108(void);
-extern void isr109(void);
-extern void isr110(void);
-extern void isr111(void);
-extern void isr112(void);
-extern void isr113(void);
-extern void isr114(void);
-extern void isr115(void);
-extern void isr116(void);
-extern void isr117(void);
-extern void isr118(void);
-extern void isr119(void);
-extern void isr120(void);
-extern void isr121(void);
-extern void isr122(void);
-extern void isr123(void);
-extern void isr124(void);
-extern void isr125(void);
-extern void isr126(void);
-extern void isr127(void);
-extern void isr128(void);
-extern void isr129(void);
-extern void isr130(void);
-extern void isr131(void);
-extern void isr132(void);
-extern void isr133(void);
-extern void isr134(void);
-extern void isr135(void);
-extern void isr136(void);
-extern void isr137(void);
-extern void isr138(void);
-extern void isr139(void);
-extern void isr140(void);
-extern void isr141(void);
-extern void isr142(void);
-extern void isr143(void);
-extern void isr144(void);
-extern void isr145(void);
-extern void isr146(void);
-extern void isr147(void);
-extern void isr148(void);
-extern void isr149(void);
-extern void isr150(void);
-extern void isr151(void);
-extern void isr152(void);
-extern void isr153(void);
-extern void isr154(void);
-extern void isr155(void);
-extern void isr156(void);
-extern void isr157(void);
-extern void isr158(void);
-extern void isr159(void);
-extern void isr160(void);
-extern void isr161(void);
-extern void isr162(void);
-extern void isr163(void);
-extern void isr164(void);
-extern void isr165(void);
-extern void isr166(void);
-extern void isr167(void);
-extern void isr168(void);
-extern void isr169(void);
-extern void isr170(void);
-extern void isr171(void);
-extern void isr172(void);
-extern void isr173(void);
-extern void isr174(void);
-extern void isr175(void);
-extern void isr176(void);
-extern void isr177(void);
-extern void isr178(void);
-extern void isr179(void);
-extern void isr180(void);
-extern void isr181(void);
-extern void isr182(void);
-extern void isr183(void);
-extern void isr184(void);
-extern void isr185(void);
-extern void isr186(void);
-extern void isr187(void);
-extern void isr188(void);
-extern void isr189(void);
-extern void isr190(void);
-extern void isr191(void);
-extern void isr192(void);
-extern void isr193(void);
-extern void isr194(void);
-extern void isr195(void);
-extern void isr196(void);
-extern void isr197(void);
-extern void isr198(void);
-extern void isr199(void);
-extern void isr200(void);
-extern void isr201(void);
-extern void isr202(void);
-extern void isr203(void);
-extern void isr204(void);
-extern void isr205(void);
-extern void isr206(void);
-extern void isr207(void);
-extern void isr208(void);
-extern void isr209(void);
-extern void isr210(void);
-extern void isr211(void);
-extern void isr212(void);
-extern void isr213(void);
-extern void isr214(void);
-extern void isr215(void);
-extern void isr216(void);
-extern void isr217(void);
-extern void isr218(void);
-extern void isr219(void);
-extern void isr220(void);
-extern void isr221(void);
-extern void isr222(void);
-extern void isr223(void);
-extern void isr224(void);
-extern void isr225(void);
-extern void isr226(void);
-extern void isr227(void);
-extern void isr228(void);
-extern void isr229(void);
-extern void isr230(void);
-extern void isr231(void);
-extern void isr232(void);
-extern void isr233(void);
-extern void isr234(void);
-extern void isr235(void);
-extern void isr236(void);
-extern void isr237(void);
-extern void isr238(void);
-extern void isr239(void);
-extern void isr240(void);
-extern void isr241(void);
-extern void isr242(void);
-extern void isr243(void);
-extern void isr244(void);
-extern void isr245(void);
-extern void isr246(void);
-extern void isr247(void);
-extern void isr248(void);
-extern void isr249(void);
-extern void isr250(void);
-extern void isr251(void);
-extern void isr252(void);
-extern void isr253(void);
-extern void isr254(void);
-extern void isr255(void);
+/* Entries of vectors from IRQ_HANDLER_BASE up to the last one, see
+ * interrupts_definations.asm. */
+extern const uptr_t irq_stubs[];
 
 /* There are basically two kinds of code execution interruption: when it is
  * caused by a faulty instruction, or when it caused by an unrelated event.
@@ -295,11 +82,72 @@ typedef enum { IDT_GATE_TYPE_INTERRUPT, IDT_GATE_TYPE_TRAP } idt_gate_type_t;
  */
 base_private const u16_t GDT_CODE_SEGMENT_OFFSET = 0x08;
 
+/* Per CPU GDT replacing the one set up by boot/boot.asm, to have a TSS. Code
+ * and data segments keep the same selectors, so segment registers need no
+ * reloading. Each entry is 8 bytes, except the TSS descriptor which takes
+ * two. */
+#define _GDT_ENTRY_COUNT 5
+base_private const u16_t GDT_TSS_SEGMENT_OFFSET = 0x18;
+base_private u64_t _gdt[SMP_CPU_MAX][_GDT_ENTRY_COUNT] base_align(16);
+
+/* 64-bit Task State Segment, only used for its Interrupt Stack Table. */
+typedef struct {
+  u32_t reserved_0;
+  u64_t rsp[3];
+  u64_t reserved_1;
+  u64_t ist[7];
+  u64_t reserved_2;
+  u16_t reserved_3;
+  u16_t iomap_base;
+} base_struct_packed tss_t;
+
+base_private tss_t _tss[SMP_CPU_MAX] base_align(16);
+
+/* Exceptions which may be raised when current stack is not usable, e.g. page
+ * faults on a stack not backed yet or on its guard page, always switch to
+ * their own stacks. So do NMIs and machine checks, which may come at any
+ * instruction, even in the middle of a switch of stack. */
+#define _IST_STACK_LEN (16 * 1024)
+typedef enum {
+  _IST_PF = 1,
+  _IST_DF = 2,
+  _IST_NMI = 3,
+  _IST_MC = 4,
+  _IST_MAX = 4,
+} ist_idx_t;
+base_private byte_t _ist_stacks[SMP_CPU_MAX][_IST_MAX][_IST_STACK_LEN]
+    base_align(16);
+
+/* IRQ handlers run on a stack of their own CPU, so that they add nothing to
+ * depth of thread stacks. Handlers run with IRQs disabled, and they never
+ * nest on it. */
+#define _IRQ_STACK_LEN (16 * 1024)
+base_private byte_t _irq_stacks[SMP_CPU_MAX][_IRQ_STACK_LEN] base_align(16);
+base_private bo_t _irq_stack_used[SMP_CPU_MAX];
+/* Interrupted by the handler on IRQ stack of each CPU. */
+base_private intr_context_t _irq_contexts[SMP_CPU_MAX];
+
+/* Interrupt enable flag of RFLAGS. */
+#define _RFLAGS_IF 0x200
+
+/* Frame above vector id, see interrupts_definations.asm. */
+#define _FRAME_ERROR_CODE 1
+#define _FRAME_IP 2
+#define _FRAME_SP 5
+/* Below vector id, only saved by exceptions. */
+#define _FRAME_ISR_BP (-7)
+
 /* Interrupt Descriptor Table, has 256 gates, and 18 bytes len each */
 base_private byte_t _idt[IDT_GATE_LEN * IDT_GATE_COUNT];
 
 /* 1 to 1 mapping from IDT gate to interrupt handler */
 base_private intr_handler_cb handlers[IDT_GATE_COUNT];
+/* Protects registering of @handlers. */
+base_private sync_spin_t _handlers_lock = SYNC_SPIN_INIT("intr_handlers");
+/* IRQs are acknowledged through local APIC instead of legacy PIC. */
+base_private bo_t _pic_disabled;
+/* Mask of legacy PIC, slave in higher 8 bits. */
+base_private u16_t _pic_mask;
 
 /*
  ******************************************************************************
@@ -353,9 +201,9 @@ base_private const byte_t *_idt_gate_encode(
    */
   gate[4] = 0;
   if (type == IDT_GATE_TYPE_INTERRUPT) {
-    gate[5] = 0x8f;
-  } else if (type == IDT_GATE_TYPE_TRAP) {
     gate[5] = 0x8e;
+  } else if (type == IDT_GATE_TYPE_TRAP) {
+    gate[5] = 0x8f;
   } else {
     kernel_panic("Invalid IDT gate type");
   }
@@ -372,6 +220,58 @@ base_private const byte_t *_idt_gate_encode(
   return gate;
 }
 
+/* Switch to stack @ist on entry of gate @gate_idx. */
+base_private void _idt_gate_set_ist(usz_t gate_idx, ist_idx_t ist)
+{
+  kernel_assert(gate_idx < IDT_GATE_COUNT);
+  kernel_assert(ist <= _IST_MAX);
+  _idt[gate_idx * IDT_GATE_LEN + 4] = (byte_t)ist;
+}
+
+base_private void _intr_init_tss(usz_t cpu)
+{
+  tss_t *tss;
+  u64_t *gdt;
+  uptr_t base;
+  u64_t limit;
+  byte_t gdt_register[10];
+
+  kernel_assert(cpu < SMP_CPU_MAX);
+  tss = &_tss[cpu];
+  gdt = _gdt[cpu];
+
+  mem_clean((byte_t *)tss, sizeof(*tss));
+  for (usz_t i = 0; i < _IST_MAX; i++) {
+    /* x86 stack grows downward. */
+    tss->ist[i] = (uptr_t)_ist_stacks[cpu][i] + _IST_STACK_LEN;
+  }
+  /* No I/O permission bitmap. */
+  tss->iomap_base = (u16_t)sizeof(*tss);
+
+  gdt[0] = 0;
+  /* Same code and data segments as boot/boot.asm. */
+  gdt[1] = (u64_literal(1) << 44) | (u64_literal(1) << 47) |
+           (u64_literal(1) << 41) | (u64_literal(1) << 43) |
+           (u64_literal(1) << 53);
+  gdt[2] = (u64_literal(1) << 44) | (u64_literal(1) << 47) |
+           (u64_literal(1) << 41);
+
+  /* TSS descriptor: limit 0..15, base 16..39, type 40..43 (0x9, available
+   * 64-bit TSS), present 47, limit 48..51, base 56..63, and higher 32 bits of
+   * base in the next entry. */
+  base = (uptr_t)tss;
+  limit = sizeof(*tss) - 1;
+  gdt[3] = (limit & 0xffff) | ((base & 0xffffff) << 16) |
+           (u64_literal(0x9) << 40) | (u64_literal(1) << 47) |
+           (((limit >> 16) & 0xf) << 48) | (((base >> 24) & 0xff) << 56);
+  gdt[4] = base >> 32;
+
+  *(u16_t *)gdt_register = (u16_t)(sizeof(_gdt[cpu]) - 1);
+  *(vptr_t *)(gdt_register + 2) = (vptr_t)gdt;
+  __asm__ volatile("lgdt %0" : : "m"(gdt_register) : "memory");
+  __asm__ volatile("ltr %0" : : "r"(GDT_TSS_SEGMENT_OFFSET));
+}
+
 base_private void _intr_init_pic_8259(void)
 {
   /* Start initialization */
@@ -394,9 +294,26 @@ base_private void _intr_init_pic_8259(void)
   port_write_byte(PORT_NO_PIC_MASTER_DATA, 0x01);
   port_write_byte(PORT_NO_PIC_SLAVE_DATA, 0x01);
 
-  /* Enable all IRQs */
-  port_write_byte(PORT_NO_PIC_MASTER_DATA, 0x00);
-  port_write_byte(PORT_NO_PIC_SLAVE_DATA, 0x00);
+  /* Mask all IRQs but the cascade one, each of them is unmasked when its
+   * handler is registered. */
+  _pic_mask = 0xfffb;
+  port_write_byte(PORT_NO_PIC_MASTER_DATA, (byte_t)_pic_mask);
+  port_write_byte(PORT_NO_PIC_SLAVE_DATA, (byte_t)(_pic_mask >> 8));
+}
+
+/* Let ISA IRQ of vector @id through, once it has a handler. */
+base_private void _isa_irq_unmask(intr_id_t id)
+{
+  u8_t irq;
+
+  irq = (u8_t)(id - IRQ_HANDLER_BASE);
+  if (_pic_disabled) {
+    d_ioapic_route_isa(irq, (u8_t)id, d_apic_id());
+  } else {
+    _pic_mask &= (u16_t) ~(1u << irq);
+    port_write_byte(PORT_NO_PIC_MASTER_DATA, (byte_t)_pic_mask);
+    port_write_byte(PORT_NO_PIC_SLAVE_DATA, (byte_t)(_pic_mask >> 8));
+  }
 }
 
 base_private void _intr_init_idt(void)
@@ -434,235 +351,15 @@ base_private void _intr_init_idt(void)
   _idt_gate_encode(30, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr30);
   _idt_gate_encode(31, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr31);
 
-  _idt_gate_encode(IRQ_HANDLER_BASE, IDT_GATE_TYPE_INTERRUPT, (uptr_t)irq0);
-  _idt_gate_encode(
-      (byte_t)(IRQ_HANDLER_BASE + 1), IDT_GATE_TYPE_INTERRUPT, (uptr_t)irq1);
-  _idt_gate_encode(
-      (byte_t)(IRQ_HANDLER_BASE + 2), IDT_GATE_TYPE_INTERRUPT, (uptr_t)irq2);
-  _idt_gate_encode(
-      (byte_t)(IRQ_HANDLER_BASE + 3), IDT_GATE_TYPE_INTERRUPT, (uptr_t)irq3);
-  _idt_gate_encode(
-      (byte_t)(IRQ_HANDLER_BASE + 4), IDT_GATE_TYPE_INTERRUPT, (uptr_t)irq4);
-
-  _idt_gate_encode(37, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr37);
-  _idt_gate_encode(38, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr38);
-  _idt_gate_encode(39, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr39);
-  _idt_gate_encode(40, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr40);
-  _idt_gate_encode(41, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr41);
-  _idt_gate_encode(42, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr42);
-  _idt_gate_encode(43, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr43);
-  _idt_gate_encode(44, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr44);
-  _idt_gate_encode(45, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr45);
-  _idt_gate_encode(46, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr46);
-  _idt_gate_encode(47, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr47);
-  _idt_gate_encode(48, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr48);
-  _idt_gate_encode(49, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr49);
-  _idt_gate_encode(50, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr50);
-  _idt_gate_encode(51, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr51);
-  _idt_gate_encode(52, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr52);
-  _idt_gate_encode(53, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr53);
-  _idt_gate_encode(54, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr54);
-  _idt_gate_encode(55, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr55);
-  _idt_gate_encode(56, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr56);
-  _idt_gate_encode(57, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr57);
-  _idt_gate_encode(58, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr58);
-  _idt_gate_encode(59, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr59);
-  _idt_gate_encode(60, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr60);
-  _idt_gate_encode(61, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr61);
-  _idt_gate_encode(62, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr62);
-  _idt_gate_encode(63, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr63);
-  _idt_gate_encode(64, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr64);
-  _idt_gate_encode(65, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr65);
-  _idt_gate_encode(66, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr66);
-  _idt_gate_encode(67, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr67);
-  _idt_gate_encode(68, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr68);
-  _idt_gate_encode(69, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr69);
-  _idt_gate_encode(70, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr70);
-  _idt_gate_encode(71, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr71);
-  _idt_gate_encode(72, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr72);
-  _idt_gate_encode(73, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr73);
-  _idt_gate_encode(74, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr74);
-  _idt_gate_encode(75, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr75);
-  _idt_gate_encode(76, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr76);
-  _idt_gate_encode(77, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr77);
-  _idt_gate_encode(78, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr78);
-  _idt_gate_encode(79, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr79);
-  _idt_gate_encode(80, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr80);
-  _idt_gate_encode(81, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr81);
-  _idt_gate_encode(82, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr82);
-  _idt_gate_encode(83, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr83);
-  _idt_gate_encode(84, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr84);
-  _idt_gate_encode(85, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr85);
-  _idt_gate_encode(86, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr86);
-  _idt_gate_encode(87, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr87);
-  _idt_gate_encode(88, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr88);
-  _idt_gate_encode(89, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr89);
-  _idt_gate_encode(90, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr90);
-  _idt_gate_encode(91, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr91);
-  _idt_gate_encode(92, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr92);
-  _idt_gate_encode(93, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr93);
-  _idt_gate_encode(94, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr94);
-  _idt_gate_encode(95, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr95);
-  _idt_gate_encode(96, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr96);
-  _idt_gate_encode(97, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr97);
-  _idt_gate_encode(98, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr98);
-  _idt_gate_encode(99, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr99);
-  _idt_gate_encode(100, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr100);
-  _idt_gate_encode(101, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr101);
-  _idt_gate_encode(102, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr102);
-  _idt_gate_encode(103, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr103);
-  _idt_gate_encode(104, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr104);
-  _idt_gate_encode(105, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr105);
-  _idt_gate_encode(106, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr106);
-  _idt_gate_encode(107, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr107);
-  _idt_gate_encode(108, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr108);
-  _idt_gate_encode(109, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr109);
-  _idt_gate_encode(110, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr110);
-  _idt_gate_encode(111, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr111);
-  _idt_gate_encode(112, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr112);
-  _idt_gate_encode(113, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr113);
-  _idt_gate_encode(114, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr114);
-  _idt_gate_encode(115, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr115);
-  _idt_gate_encode(116, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr116);
-  _idt_gate_encode(117, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr117);
-  _idt_gate_encode(118, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr118);
-  _idt_gate_encode(119, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr119);
-  _idt_gate_encode(120, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr120);
-  _idt_gate_encode(121, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr121);
-  _idt_gate_encode(122, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr122);
-  _idt_gate_encode(123, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr123);
-  _idt_gate_encode(124, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr124);
-  _idt_gate_encode(125, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr125);
-  _idt_gate_encode(126, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr126);
-  _idt_gate_encode(127, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr127);
-  _idt_gate_encode(128, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr128);
-  _idt_gate_encode(129, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr129);
-  _idt_gate_encode(130, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr130);
-  _idt_gate_encode(131, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr131);
-  _idt_gate_encode(132, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr132);
-  _idt_gate_encode(133, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr133);
-  _idt_gate_encode(134, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr134);
-  _idt_gate_encode(135, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr135);
-  _idt_gate_encode(136, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr136);
-  _idt_gate_encode(137, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr137);
-  _idt_gate_encode(138, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr138);
-  _idt_gate_encode(139, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr139);
-  _idt_gate_encode(140, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr140);
-  _idt_gate_encode(141, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr141);
-  _idt_gate_encode(142, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr142);
-  _idt_gate_encode(143, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr143);
-  _idt_gate_encode(144, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr144);
-  _idt_gate_encode(145, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr145);
-  _idt_gate_encode(146, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr146);
-  _idt_gate_encode(147, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr147);
-  _idt_gate_encode(148, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr148);
-  _idt_gate_encode(149, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr149);
-  _idt_gate_encode(150, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr150);
-  _idt_gate_encode(151, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr151);
-  _idt_gate_encode(152, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr152);
-  _idt_gate_encode(153, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr153);
-  _idt_gate_encode(154, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr154);
-  _idt_gate_encode(155, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr155);
-  _idt_gate_encode(156, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr156);
-  _idt_gate_encode(157, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr157);
-  _idt_gate_encode(158, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr158);
-  _idt_gate_encode(159, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr159);
-  _idt_gate_encode(160, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr160);
-  _idt_gate_encode(161, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr161);
-  _idt_gate_encode(162, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr162);
-  _idt_gate_encode(163, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr163);
-  _idt_gate_encode(164, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr164);
-  _idt_gate_encode(165, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr165);
-  _idt_gate_encode(166, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr166);
-  _idt_gate_encode(167, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr167);
-  _idt_gate_encode(168, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr168);
-  _idt_gate_encode(169, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr169);
-  _idt_gate_encode(170, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr170);
-  _idt_gate_encode(171, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr171);
-  _idt_gate_encode(172, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr172);
-  _idt_gate_encode(173, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr173);
-  _idt_gate_encode(174, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr174);
-  _idt_gate_encode(175, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr175);
-  _idt_gate_encode(176, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr176);
-  _idt_gate_encode(177, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr177);
-  _idt_gate_encode(178, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr178);
-  _idt_gate_encode(179, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr179);
-  _idt_gate_encode(180, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr180);
-  _idt_gate_encode(181, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr181);
-  _idt_gate_encode(182, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr182);
-  _idt_gate_encode(183, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr183);
-  _idt_gate_encode(184, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr184);
-  _idt_gate_encode(185, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr185);
-  _idt_gate_encode(186, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr186);
-  _idt_gate_encode(187, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr187);
-  _idt_gate_encode(188, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr188);
-  _idt_gate_encode(189, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr189);
-  _idt_gate_encode(190, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr190);
-  _idt_gate_encode(191, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr191);
-  _idt_gate_encode(192, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr192);
-  _idt_gate_encode(193, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr193);
-  _idt_gate_encode(194, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr194);
-  _idt_gate_encode(195, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr195);
-  _idt_gate_encode(196, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr196);
-  _idt_gate_encode(197, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr197);
-  _idt_gate_encode(198, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr198);
-  _idt_gate_encode(199, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr199);
-  _idt_gate_encode(200, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr200);
-  _idt_gate_encode(201, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr201);
-  _idt_gate_encode(202, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr202);
-  _idt_gate_encode(203, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr203);
-  _idt_gate_encode(204, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr204);
-  _idt_gate_encode(205, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr205);
-  _idt_gate_encode(206, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr206);
-  _idt_gate_encode(207, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr207);
-  _idt_gate_encode(208, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr208);
-  _idt_gate_encode(209, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr209);
-  _idt_gate_encode(210, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr210);
-  _idt_gate_encode(211, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr211);
-  _idt_gate_encode(212, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr212);
-  _idt_gate_encode(213, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr213);
-  _idt_gate_encode(214, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr214);
-  _idt_gate_encode(215, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr215);
-  _idt_gate_encode(216, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr216);
-  _idt_gate_encode(217, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr217);
-  _idt_gate_encode(218, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr218);
-  _idt_gate_encode(219, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr219);
-  _idt_gate_encode(220, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr220);
-  _idt_gate_encode(221, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr221);
-  _idt_gate_encode(222, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr222);
-  _idt_gate_encode(223, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr223);
-  _idt_gate_encode(224, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr224);
-  _idt_gate_encode(225, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr225);
-  _idt_gate_encode(226, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr226);
-  _idt_gate_encode(227, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr227);
-  _idt_gate_encode(228, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr228);
-  _idt_gate_encode(229, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr229);
-  _idt_gate_encode(230, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr230);
-  _idt_gate_encode(231, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr231);
-  _idt_gate_encode(232, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr232);
-  _idt_gate_encode(233, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr233);
-  _idt_gate_encode(234, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr234);
-  _idt_gate_encode(235, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr235);
-  _idt_gate_encode(236, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr236);
-  _idt_gate_encode(237, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr237);
-  _idt_gate_encode(238, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr238);
-  _idt_gate_encode(239, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr239);
-  _idt_gate_encode(240, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr240);
-  _idt_gate_encode(241, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr241);
-  _idt_gate_encode(242, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr242);
-  _idt_gate_encode(243, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr243);
-  _idt_gate_encode(244, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr244);
-  _idt_gate_encode(245, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr245);
-  _idt_gate_encode(246, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr246);
-  _idt_gate_encode(247, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr247);
-  _idt_gate_encode(248, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr248);
-  _idt_gate_encode(249, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr249);
-  _idt_gate_encode(250, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr250);
-  _idt_gate_encode(251, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr251);
-  _idt_gate_encode(252, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr252);
-  _idt_gate_encode(253, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr253);
-  _idt_gate_encode(254, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr254);
-  _idt_gate_encode(255, IDT_GATE_TYPE_INTERRUPT, (uptr_t)isr255);
+  for (usz_t i = IRQ_HANDLER_BASE; i < IDT_GATE_COUNT; i++) {
+    _idt_gate_encode(
+        i, IDT_GATE_TYPE_INTERRUPT, irq_stubs[i - IRQ_HANDLER_BASE]);
+  }
+
+  _idt_gate_set_ist(INTR_ID_EX_FAULT_PF, _IST_PF);
+  _idt_gate_set_ist(INTR_ID_EX_ABORT_DF, _IST_DF);
+  _idt_gate_set_ist(INTR_ID_EX_INTERRUPT_NMI, _IST_NMI);
+  _idt_gate_set_ist(INTR_ID_EX_ABORT_MC, _IST_MC);
 }
 
 base_private void _intr_load_idt_register(void)
@@ -680,6 +377,8 @@ base_private void _intr_load_idt_register(void)
 
 void intr_init(void)
 {
+  /* Bootstrap processor is always CPU 0. */
+  _intr_init_tss(0);
   _intr_init_idt();
   _intr_load_idt_register();
   _intr_init_pic_8259();
@@ -689,6 +388,19 @@ void intr_init(void)
   }
 }
 
+void intr_init_ap(usz_t cpu_idx)
+{
+  _intr_init_tss(cpu_idx);
+  _intr_load_idt_register();
+}
+
+void intr_pic_disable(void)
+{
+  port_write_byte(PORT_NO_PIC_MASTER_DATA, 0xff);
+  port_write_byte(PORT_NO_PIC_SLAVE_DATA, 0xff);
+  _pic_disabled = true;
+}
+
 void intr_irq_enable(void)
 {
   __asm__("sti");
@@ -699,70 +411,320 @@ void intr_irq_disable(void)
   __asm__("cli");
 }
 
+u64_t intr_irq_save(void)
+{
+  u64_t flags;
+
+  __asm__ volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+void intr_irq_restore(u64_t flags)
+{
+  if ((flags & _RFLAGS_IF) != 0) {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
+
+bo_t intr_irq_enabled(void)
+{
+  u64_t flags;
+
+  __asm__ volatile("pushfq; popq %0" : "=r"(flags));
+  return (flags & _RFLAGS_IF) != 0;
+}
+
 void intr_isr_handler(u64_t id, uptr_t stack_addr)
 {
-  intr_id_t iid;
+  intr_parameters_t *paras;
+  intr_handler_cb hand;
   const usz_t MSG_CAP = 128;
   ch_t msg[MSG_CAP];
   const ch_t *msg_part;
   usz_t msg_len;
 
   kernel_assert(id < INTR_ID_MAX);
-  iid = (intr_id_t)id;
+  paras = (intr_parameters_t *)stack_addr;
+  hand = sync_rcu_deref(handlers[id]);
 
-  msg_len = 0;
-  msg_part = "TODO: intr_isr_handler, id = ";
-  msg_len +=
-      str_buf_marshal_str(msg, msg_len, MSG_CAP, msg_part, str_len(msg_part));
-  msg_len += str_buf_marshal_uint(msg, msg_len, MSG_CAP, iid);
-  msg_len += str_buf_marshal_terminator(msg, msg_len, MSG_CAP);
-  kernel_panic(msg);
+  if (hand == NULL) {
+    msg_len = 0;
+    msg_part = "Unhandled exception, id: ";
+    msg_len +=
+        str_buf_marshal_str(msg, msg_len, MSG_CAP, msg_part, str_len(msg_part));
+    msg_len += str_buf_marshal_uint(msg, msg_len, MSG_CAP, id);
+    msg_part = ", error code: ";
+    msg_len +=
+        str_buf_marshal_str(msg, msg_len, MSG_CAP, msg_part, str_len(msg_part));
+    msg_len +=
+        str_buf_marshal_uint(msg, msg_len, MSG_CAP, intr_error_code(paras));
+    msg_part = ", ip: ";
+    msg_len +=
+        str_buf_marshal_str(msg, msg_len, MSG_CAP, msg_part, str_len(msg_part));
+    msg_len +=
+        str_buf_marshal_uint(msg, msg_len, MSG_CAP, intr_fault_ip(paras));
+    msg_len += str_buf_marshal_terminator(msg, msg_len, MSG_CAP);
+    kernel_panic(msg);
+  } else {
+    (*hand)((intr_id_t)id, paras);
+  }
+}
 
-  (void)(stack_addr);
+u64_t intr_error_code(intr_parameters_t *para)
+{
+  return *(u64_t *)(para + _FRAME_ERROR_CODE * sizeof(u64_t));
 }
 
-void intr_irq_handler(u64_t id, uptr_t stack_addr)
+uptr_t intr_fault_ip(intr_parameters_t *para)
 {
-  intr_id_t iid;
-  intr_parameters_t *paras;
+  return *(uptr_t *)(para + _FRAME_IP * sizeof(u64_t));
+}
+
+void intr_fault_context(intr_parameters_t *para, intr_context_t *ctx)
+{
+  ctx->ip = intr_fault_ip(para);
+  ctx->sp = *(uptr_t *)(para + _FRAME_SP * sizeof(u64_t));
+  ctx->bp = *(uptr_t *)(para + _FRAME_ISR_BP * (i64_t)sizeof(u64_t));
+}
+
+bo_t intr_irq_context(intr_context_t *ctx)
+{
+  usz_t cpu;
+
+  cpu = smp_cpu_idx();
+  if (_irq_stack_used[cpu]) {
+    *ctx = _irq_contexts[cpu];
+  }
+  return _irq_stack_used[cpu];
+}
+
+base_private void _irq_eoi(u64_t id)
+{
+  if (_pic_disabled) {
+    d_apic_eoi();
+  } else {
+    /* End Of Interrupt (EOI, code 0x20) command is issued to the PIC chips
+     * at the end of an IRQ-based interrupt routine. If the IRQ came from the
+     * Master PIC, it is sufficient to issue this command only to the Master
+     * PIC; however if the IRQ came from the Slave PIC, it is necessary to
+     * issue the command to both PIC chips. */
+    if (id >= 40) {
+      port_write_byte(PORT_NO_PIC_SLAVE_CMD, 0x20);
+    }
+    port_write_byte(PORT_NO_PIC_MASTER_CMD, 0x20);
+  }
+}
+
+typedef struct {
+  intr_id_t id;
   intr_handler_cb hand;
+  intr_parameters_t *paras;
+} irq_call_t;
+
+base_private void _irq_call(vptr_t arg)
+{
+  irq_call_t *call = arg;
+  u64_t start;
+  u64_t end;
+
+  start = cpu_read_tsc();
+  trace_irq_entry(call->id, intr_fault_ip(call->paras));
+  _irq_eoi(call->id);
+  (*call->hand)(call->id, call->paras);
+  end = cpu_read_tsc();
+  intr_stat_record(call->id, start, end);
+  trace_irq_exit(call->id, end - start);
+}
+
+void intr_irq_handler(u64_t id, uptr_t stack_addr)
+{
+  irq_call_t call;
+  usz_t cpu;
   const usz_t MSG_CAP = 128;
   ch_t msg[MSG_CAP];
   const ch_t *msg_part;
   usz_t msg_len;
 
-  /* End Of Interrupt (EOI, code 0x20) command is issued to the PIC chips at 
-   * the end of an IRQ-based interrupt routine. If the IRQ came from the Master 
-   * PIC, it is sufficient to issue this command only to the Master PIC; 
-   * however if the IRQ came from the Slave PIC, it is necessary to issue the 
-   * command to both PIC chips. */
-  if (id >= 40) {
-    port_write_byte(PORT_NO_PIC_SLAVE_CMD, 0x20);
-  }
-  port_write_byte(PORT_NO_PIC_MASTER_CMD, 0x20);
-
   kernel_assert(id < INTR_ID_MAX);
-  iid = (intr_id_t)id;
-  hand = handlers[iid];
+  call.id = (intr_id_t)id;
+  sync_rcu_irq_enter();
+  call.hand = sync_rcu_deref(handlers[call.id]);
 
-  if (hand == NULL) {
+  if (call.id == INTR_ID_SPURIOUS) {
+    /* Never acknowledged, see Intel SDM 10.9. */
+  } else if (call.hand == NULL) {
     msg_len = 0;
     msg_part = "Unhandled IRQ, id: ";
     msg_len =
         str_buf_marshal_str(msg, msg_len, MSG_CAP, msg_part, str_len(msg_part));
-    msg_len += str_buf_marshal_uint(msg, msg_len, MSG_CAP, (u64_t)iid);
+    msg_len += str_buf_marshal_uint(msg, msg_len, MSG_CAP, (u64_t)call.id);
     msg_len += str_buf_marshal_terminator(msg, msg_len, MSG_CAP);
     kernel_panic(msg);
   } else {
-    paras = (intr_parameters_t *)stack_addr;
-    (*hand)(id, paras);
+    call.paras = (intr_parameters_t *)stack_addr;
+    intr_softirq_irq_enter();
+    cpu = smp_cpu_idx();
+    if (_irq_stack_used[cpu]) {
+      /* A handler enabled IRQs, stay on the IRQ stack. */
+      _irq_call(&call);
+    } else {
+      _irq_contexts[cpu].ip = intr_fault_ip(call.paras);
+      _irq_contexts[cpu].sp =
+          *(uptr_t *)(call.paras + _FRAME_SP * sizeof(u64_t));
+      /* Entry stub leaves RBP alone, so it is still the one interrupted when
+       * pushed by this function. */
+      _irq_contexts[cpu].bp = *(uptr_t *)__builtin_frame_address(0);
+      _irq_stack_used[cpu] = true;
+      cpu_call_on_stack(
+          (uptr_t)_irq_stacks[cpu] + _IRQ_STACK_LEN, _irq_call, &call);
+      _irq_stack_used[cpu] = false;
+    }
+    /* Bottom halves run with IRQs enabled, before switching thread, both on
+     * stack of current thread, which nested IRQs do not touch. */
+    intr_softirq_irq_exit();
+    sched_irq_exit();
+  }
+}
+
+void intr_time_record(intr_time_t *time, u64_t cycles)
+{
+  u64_t max;
+
+  cpu_atomic_fetch_add(&time->count, 1);
+  cpu_atomic_fetch_add(&time->cycles, cycles);
+  max = cpu_atomic_load(&time->max);
+  while (cycles > max && !cpu_atomic_cas(&time->max, max, cycles)) {
+    max = cpu_atomic_load(&time->max);
   }
 }
 
+void intr_time_log(const ch_t *kind, u64_t idx, intr_time_t *time)
+{
+  u64_t count;
+
+  count = cpu_atomic_load(&time->count);
+  if (count > 0) {
+    log_line_format(LOG_LEVEL_INFO, "%s %lu: %lu runs, avg %lu ns, max %lu ns",
+        kind, idx, count, time_cycles_to_ns(time->cycles / count),
+        time_cycles_to_ns(time->max));
+  }
+}
+
+void intr_time_report(void)
+{
+  intr_stat_report(INTR_ID_MAX);
+  intr_softirq_time_report();
+}
+
+base_private void _handlers_lock_acquire(void)
+{
+  sync_spin_lock(&_handlers_lock);
+}
+
+base_private void _handlers_lock_release(void)
+{
+  sync_spin_unlock(&_handlers_lock);
+}
+
 void intr_handler_register(intr_id_t id, intr_handler_cb handler)
 {
   kernel_assert(id < INTR_ID_MAX);
+  kernel_assert(handler != NULL);
+  _handlers_lock_acquire();
   kernel_assert(handlers[id] == NULL);
+  sync_rcu_assign(handlers[id], handler);
+  _handlers_lock_release();
+
+  if (id >= IRQ_HANDLER_BASE && id < INTR_ID_IRQ_ISA_END) {
+    _isa_irq_unmask(id);
+  }
+}
+
+bo_t intr_handler_registered(intr_id_t id)
+{
+  kernel_assert(id < INTR_ID_MAX);
+  return handlers[id] != NULL;
+}
+
+base_must_check bo_t intr_vector_alloc(
+    intr_handler_cb handler, intr_id_t *out_id)
+{
+  bo_t ok;
+
   kernel_assert(handler != NULL);
-  handlers[id] = handler;
+  ok = false;
+  _handlers_lock_acquire();
+  for (usz_t i = INTR_ID_DYN_START; i < INTR_ID_DYN_END; i++) {
+    if (handlers[i] == NULL) {
+      sync_rcu_assign(handlers[i], handler);
+      *out_id = (intr_id_t)i;
+      ok = true;
+      break;
+    }
+  }
+  _handlers_lock_release();
+  return ok;
+}
+
+void intr_vector_free(intr_id_t id)
+{
+  kernel_assert(id >= INTR_ID_DYN_START && id < INTR_ID_DYN_END);
+  _handlers_lock_acquire();
+  kernel_assert(handlers[id] != NULL);
+  sync_rcu_assign(handlers[id], NULL);
+  _handlers_lock_release();
+  /* Handler may still be running on other CPUs. */
+  sync_rcu_synchronize();
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#define _TEST_IPIS 1000
+
+base_private volatile u64_t _test_irqs;
+base_private volatile u64_t _test_off_stack;
+
+base_private void _test_handler(
+    intr_id_t id base_may_unuse, intr_parameters_t *para)
+{
+  uptr_t sp;
+  uptr_t base;
+
+  sp = cpu_read_rsp();
+  base = (uptr_t)_irq_stacks[smp_cpu_idx()];
+  if (sp < base || sp >= base + _IRQ_STACK_LEN ||
+      *(u64_t *)(para + (_FRAME_IP + 1) * sizeof(u64_t)) !=
+          GDT_CODE_SEGMENT_OFFSET) {
+    cpu_atomic_fetch_add(&_test_off_stack, 1);
+  }
+  cpu_atomic_fetch_add(&_test_irqs, 1);
+}
+
+/* IRQs run on the IRQ stack of their CPU and see the frame pushed by CPU,
+ * and round trip cycles of a self IPI are logged. */
+void test_intr(void)
+{
+  intr_id_t id;
+  u64_t start;
+  u64_t cycles;
+
+  if (d_apic_ready()) {
+    kernel_assert(intr_vector_alloc(_test_handler, &id));
+    cycles = 0;
+    for (u64_t i = 0; i < _TEST_IPIS; i++) {
+      sched_preempt_disable();
+      start = cpu_read_tsc();
+      d_apic_send_ipi(d_apic_id(), (u8_t)id);
+      while (cpu_atomic_load(&_test_irqs) == i) {
+        cpu_relax();
+      }
+      cycles += cpu_read_tsc() - start;
+      sched_preempt_enable();
+    }
+    kernel_assert(cpu_atomic_load(&_test_off_stack) == 0);
+    intr_vector_free(id);
+    log_line_format(LOG_LEVEL_SELF_TEST, "Self IPI round trip: %lu cycles",
+        cycles / _TEST_IPIS);
+  }
+  log_builtin_test_pass();
 }
+#endif
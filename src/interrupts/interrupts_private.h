@@ -0,0 +1,27 @@
+/* Private header of interrupts module. */
+#ifndef ___INTERRUPTS_PRIVATE
+#define ___INTERRUPTS_PRIVATE
+
+#include "interrupts.h"
+
+/* Time spent in a handler since boot, in TSC cycles. */
+typedef struct {
+  volatile u64_t count;
+  volatile u64_t cycles;
+  volatile u64_t max;
+} intr_time_t;
+
+void intr_time_record(intr_time_t *time, u64_t cycles);
+/* Log @time of handler @idx of @kind, if it ever ran. */
+void intr_time_log(const ch_t *kind, u64_t idx, intr_time_t *time);
+/* Record a run of handler of IRQ vector @id on current CPU, from TSC @start
+ * to @end. IRQs must be disabled. */
+void intr_stat_record(intr_id_t id, u64_t start, u64_t end);
+
+/* Called around IRQ handlers, softirqs raised by them are run on exit of the
+ * outermost one. IRQs must be disabled. */
+void intr_softirq_irq_enter(void);
+void intr_softirq_irq_exit(void);
+void intr_softirq_time_report(void);
+
+#endif
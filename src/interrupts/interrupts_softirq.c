@@ -0,0 +1,287 @@
+/* Softirqs and tasklets, the deferred halves of IRQ handlers.
+ *
+ * An IRQ handler only does what can not wait, like reading a device register
+ * before it is overwritten, and raises a softirq for the rest. Pending
+ * softirqs are run on exit of the outermost IRQ handler, with IRQs enabled
+ * again, so that a slow bottom half does not delay other IRQs. Softirqs raised
+ * outside of IRQ handlers, or raised again and again so that IRQ exit gives
+ * up on them, are run by the softirq thread of that CPU.
+ *
+ * Softirqs of one CPU never run concurrently, and never on another CPU than
+ * the one raised them. They must not sleep, and locks shared with them are
+ * taken with IRQs disabled. */
+#include "cpu.h"
+#include "interrupts_private.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "sched.h"
+#include "smp.h"
+
+/* Rounds of pending softirqs run on IRQ exit, before the rest is left to the
+ * softirq thread. */
+#define _RESTART_MAX 8
+
+typedef struct {
+  volatile u64_t pending base_align(64); /* Bit of each intr_softirq_t */
+  u64_t irq_depth;      /* Nesting of IRQ handlers running */
+  bo_t running;         /* Softirqs are being run */
+  intr_tasklet_t *head; /* Tasklets scheduled */
+  intr_tasklet_t *tail;
+  sched_thread_t *thread;
+} softirq_cpu_t;
+
+base_private softirq_cpu_t _cpus[SMP_CPU_MAX];
+base_private intr_softirq_cb _vectors[INTR_SOFTIRQ_MAX];
+base_private intr_time_t _times[INTR_SOFTIRQ_MAX];
+
+/* IRQs must be disabled. */
+base_private softirq_cpu_t *_cpu_this(void)
+{
+  return &_cpus[smp_cpu_idx()];
+}
+
+/* Run softirqs pending on current CPU with IRQs enabled, IRQs must be
+ * disabled on entry, and they are disabled again on return.
+ * @return true if some are still pending. */
+base_private bo_t _run(softirq_cpu_t *cpu, ucnt_t rounds)
+{
+  u64_t pending;
+  u64_t start;
+
+  /* Nested IRQs must not switch thread away in the middle. */
+  sched_preempt_disable();
+  cpu->running = true;
+  for (ucnt_t r = 0; r < rounds && cpu->pending != 0; r++) {
+    pending = cpu->pending;
+    cpu->pending = 0;
+    intr_irq_enable();
+    for (usz_t i = 0; i < INTR_SOFTIRQ_MAX; i++) {
+      if ((pending & (u64_literal(1) << i)) != 0) {
+        start = cpu_read_tsc();
+        _vectors[i]();
+        intr_time_record(&_times[i], cpu_read_tsc() - start);
+      }
+    }
+    intr_irq_disable();
+  }
+  cpu->running = false;
+  /* IRQs are still disabled, so this never switches thread. */
+  sched_preempt_enable();
+  return cpu->pending != 0;
+}
+
+/* Softirq thread of CPU @arg. */
+base_private void _thread_main(vptr_t arg)
+{
+  softirq_cpu_t *cpu;
+  bo_t more;
+  u64_t flags;
+
+  cpu = &_cpus[(usz_t)arg];
+  while (1) {
+    more = false;
+    flags = intr_irq_save();
+    if (!cpu->running && cpu->pending != 0) {
+      more = _run(cpu, _RESTART_MAX);
+    }
+    intr_irq_restore(flags);
+
+    if (more) {
+      /* Let other threads of this CPU run in between. */
+      sched_yield();
+    } else {
+      sched_thread_sleep();
+    }
+  }
+}
+
+/* Softirqs of tasklets. */
+base_private void _tasklet_run(void)
+{
+  intr_tasklet_t *list;
+  intr_tasklet_t *tasklet;
+  softirq_cpu_t *cpu;
+  u64_t flags;
+
+  flags = intr_irq_save();
+  cpu = _cpu_this();
+  list = cpu->head;
+  cpu->head = NULL;
+  cpu->tail = NULL;
+  intr_irq_restore(flags);
+
+  while (list != NULL) {
+    tasklet = list;
+    list = tasklet->next;
+    /* Scheduled again from now on runs it once more. */
+    cpu_atomic_store(&tasklet->queued, 0);
+    tasklet->fn(tasklet);
+  }
+}
+
+void intr_softirq_bootstrap(void)
+{
+  softirq_cpu_t *cpu;
+
+  intr_softirq_register(INTR_SOFTIRQ_TASKLET, _tasklet_run);
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (sched_cpu_online(i)) {
+      cpu = &_cpus[i];
+      cpu->thread = sched_thread_new("softirq", _thread_main, (vptr_t)i, i);
+      kernel_assert(cpu->thread != NULL);
+    }
+  }
+}
+
+void intr_softirq_register(intr_softirq_t id, intr_softirq_cb fn)
+{
+  kernel_assert(id < INTR_SOFTIRQ_MAX);
+  kernel_assert(_vectors[id] == NULL);
+  _vectors[id] = fn;
+}
+
+void intr_softirq_raise(intr_softirq_t id)
+{
+  softirq_cpu_t *cpu;
+  u64_t flags;
+
+  kernel_assert(id < INTR_SOFTIRQ_MAX && _vectors[id] != NULL);
+  flags = intr_irq_save();
+  cpu = _cpu_this();
+  cpu->pending |= u64_literal(1) << id;
+  /* Run on IRQ exit, or by a softirq being run already. */
+  if (cpu->irq_depth == 0 && !cpu->running && cpu->thread != NULL) {
+    sched_thread_wake(cpu->thread);
+  }
+  intr_irq_restore(flags);
+}
+
+void intr_tasklet_schedule(intr_tasklet_t *tasklet)
+{
+  softirq_cpu_t *cpu;
+  u64_t flags;
+
+  if (cpu_atomic_cas(&tasklet->queued, 0, 1)) {
+    flags = intr_irq_save();
+    cpu = _cpu_this();
+    tasklet->next = NULL;
+    if (cpu->tail == NULL) {
+      cpu->head = tasklet;
+    } else {
+      cpu->tail->next = tasklet;
+    }
+    cpu->tail = tasklet;
+    intr_softirq_raise(INTR_SOFTIRQ_TASKLET);
+    intr_irq_restore(flags);
+  }
+}
+
+bo_t intr_in_irq(void)
+{
+  softirq_cpu_t *cpu;
+  bo_t in;
+  u64_t flags;
+
+  flags = intr_irq_save();
+  cpu = _cpu_this();
+  in = cpu->irq_depth > 0 || cpu->running;
+  intr_irq_restore(flags);
+  return in;
+}
+
+void intr_softirq_irq_enter(void)
+{
+  _cpu_this()->irq_depth++;
+}
+
+void intr_softirq_irq_exit(void)
+{
+  softirq_cpu_t *cpu;
+
+  cpu = _cpu_this();
+  kernel_assert(cpu->irq_depth > 0);
+  cpu->irq_depth--;
+  if (cpu->irq_depth == 0 && !cpu->running && cpu->pending != 0) {
+    if (_run(cpu, _RESTART_MAX) && cpu->thread != NULL) {
+      sched_thread_wake(cpu->thread);
+    }
+  }
+}
+
+void intr_softirq_time_report(void)
+{
+  for (usz_t i = 0; i < INTR_SOFTIRQ_MAX; i++) {
+    intr_time_log("softirq", i, &_times[i]);
+  }
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "drivers_time.h"
+
+#define _TEST_ROUNDS 1000
+
+base_private volatile u64_t _test_runs;
+base_private volatile u64_t _test_cpu_bad;
+base_private usz_t _test_cpu;
+
+base_private void _test_tasklet_fn(intr_tasklet_t *tasklet base_may_unuse)
+{
+  u64_t flags;
+
+  flags = intr_irq_save();
+  if (smp_cpu_idx() != _test_cpu) {
+    cpu_atomic_fetch_add(&_test_cpu_bad, 1);
+  }
+  intr_irq_restore(flags);
+  cpu_atomic_fetch_add(&_test_runs, 1);
+}
+
+base_private intr_tasklet_t _test_tasklet = INTR_TASKLET_INIT(_test_tasklet_fn);
+
+base_private void _test_wait(u64_t runs)
+{
+  while (cpu_atomic_load(&_test_runs) < runs) {
+    sched_yield();
+  }
+}
+
+/* Tasklets scheduled twice before running run once, on the CPU scheduled
+ * them, and latency of waking softirq thread up is logged. */
+void test_intr_softirq(void)
+{
+  u64_t flags;
+  u64_t start;
+  u64_t cycles;
+
+  sched_preempt_disable();
+  flags = intr_irq_save();
+  _test_cpu = smp_cpu_idx();
+  intr_tasklet_schedule(&_test_tasklet);
+  intr_tasklet_schedule(&_test_tasklet);
+  intr_irq_restore(flags);
+  sched_preempt_enable();
+  _test_wait(1);
+  for (usz_t i = 0; i < 16; i++) {
+    sched_yield();
+  }
+  kernel_assert(cpu_atomic_load(&_test_runs) == 1);
+
+  cycles = 0;
+  for (u64_t i = 0; i < _TEST_ROUNDS; i++) {
+    start = cpu_read_tsc();
+    sched_preempt_disable();
+    flags = intr_irq_save();
+    _test_cpu = smp_cpu_idx();
+    intr_irq_restore(flags);
+    intr_tasklet_schedule(&_test_tasklet);
+    sched_preempt_enable();
+    _test_wait(i + 2);
+    cycles += cpu_read_tsc() - start;
+  }
+  kernel_assert(cpu_atomic_load(&_test_cpu_bad) == 0);
+
+  log_line_format(LOG_LEVEL_SELF_TEST, "Tasklet round trip: %lu ns",
+      time_cycles_to_ns(cycles / _TEST_ROUNDS));
+  log_builtin_test_pass();
+}
+#endif
@@ -0,0 +1,283 @@
+/* Per-CPU statistics of IRQ vectors.
+ *
+ * Each CPU counts runs and cycles of handlers of each vector on its own, with
+ * IRQs disabled, so recording takes no atomic operations and moves no cache
+ * lines. Cycles are also kept in a histogram of log buckets, each power of 2
+ * split into _HIST_SUBS linear ones, which is precise to a few tens percent
+ * in a few hundred bytes, like HDR histograms.
+ *
+ * A vector taken more than the storm rate in a window on a CPU is flagged as
+ * storming, which is logged the first time, like a device raising a level
+ * triggered IRQ it never clears. Statistics are dumped at the end of boot, or
+ * by sending 'i' to the serial port. */
+#include "cpu.h"
+#include "drivers_serial.h"
+#include "drivers_time.h"
+#include "interrupts_private.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "sched.h"
+#include "smp.h"
+
+/* Vectors below are exceptions, not going through IRQ handlers. */
+#define _VEC_BASE INTR_ID_IRQ_TIME
+#define _VEC_CNT (INTR_ID_MAX - _VEC_BASE)
+/* Bucket 0 takes cycles below 1 << _HIST_MIN_SHIFT, the last one takes all
+ * above the others. */
+#define _HIST_MIN_SHIFT 7
+#define _HIST_SUB_SHIFT 1
+#define _HIST_SUBS (1 << _HIST_SUB_SHIFT)
+#define _HIST_BUCKETS 32
+#define _STORM_WINDOW_NS 10000000
+#define _STORM_RATE_DEFAULT 100000
+/* Vectors dumped by serial command. */
+#define _DUMP_TOP 8
+
+typedef struct {
+  u64_t count;
+  u64_t cycles;
+  u64_t max;
+  u64_t window_tsc; /* Start of current storm window */
+  u64_t window_count;
+  u64_t storms;
+  u32_t hist[_HIST_BUCKETS];
+} vec_stat_t;
+
+typedef struct {
+  vec_stat_t vecs[_VEC_CNT];
+} cpu_stat_t;
+
+base_private cpu_stat_t _cpus[SMP_CPU_MAX];
+/* In cycles, nothing storms before intr_stat_bootstrap() sets them. */
+base_private volatile u64_t _storm_window;
+base_private volatile u64_t _storm_limit; /* Runs in a window to storm */
+/* Bit of each vector ever storming, logged once. */
+base_private volatile u64_t _storm_logged[(_VEC_CNT + 63) / 64];
+
+base_private void _dump_work_fn(sched_work_t *work base_may_unuse)
+{
+  intr_stat_report(_DUMP_TOP);
+}
+
+base_private sched_work_t _dump_work = SCHED_WORK_INIT(_dump_work_fn);
+
+base_private void _serial_input(ch_t ch)
+{
+  if (ch == 'i') {
+    sched_work_queue(&_dump_work);
+  }
+}
+
+base_private usz_t _bucket(u64_t cycles)
+{
+  usz_t msb;
+  usz_t bucket;
+
+  bucket = 0;
+  if (cycles >= (u64_literal(1) << _HIST_MIN_SHIFT)) {
+    msb = (usz_t)(63 - __builtin_clzll(cycles));
+    bucket = (msb - _HIST_MIN_SHIFT) * _HIST_SUBS + 1 +
+             ((cycles >> (msb - _HIST_SUB_SHIFT)) & (_HIST_SUBS - 1));
+    if (bucket >= _HIST_BUCKETS) {
+      bucket = _HIST_BUCKETS - 1;
+    }
+  }
+  return bucket;
+}
+
+/* Lowest cycles of @bucket. */
+base_private u64_t _bucket_low(usz_t bucket)
+{
+  usz_t msb;
+  u64_t low;
+
+  low = 0;
+  if (bucket > 0) {
+    msb = (bucket - 1) / _HIST_SUBS + _HIST_MIN_SHIFT;
+    low = (_HIST_SUBS + (bucket - 1) % _HIST_SUBS)
+          << (msb - _HIST_SUB_SHIFT);
+  }
+  return low;
+}
+
+void intr_stat_record(intr_id_t id, u64_t start, u64_t end)
+{
+  vec_stat_t *stat;
+  u64_t cycles;
+  usz_t vec;
+
+  vec = id - _VEC_BASE;
+  stat = &_cpus[smp_cpu_idx()].vecs[vec];
+  cycles = end - start;
+  stat->count++;
+  stat->cycles += cycles;
+  if (cycles > stat->max) {
+    stat->max = cycles;
+  }
+  stat->hist[_bucket(cycles)]++;
+
+  if (end - stat->window_tsc >= _storm_window) {
+    stat->window_tsc = end;
+    stat->window_count = 0;
+  }
+  stat->window_count++;
+  if (stat->window_count == _storm_limit) {
+    stat->storms++;
+    if (!cpu_atomic_bit_test_and_set(&_storm_logged[vec / 64], vec % 64)) {
+      log_line_format(LOG_LEVEL_WARN,
+          "IRQ storm on vector %lu of CPU %lu, over %lu runs per second",
+          (u64_t)id, smp_cpu_idx(),
+          (_storm_limit - 1) * 1000000000 / _STORM_WINDOW_NS);
+    }
+  }
+}
+
+void intr_stat_bootstrap(void)
+{
+  intr_stat_storm_rate(_STORM_RATE_DEFAULT);
+  serial_input_register(_serial_input);
+}
+
+u64_t intr_stat_storm_rate(u64_t per_sec)
+{
+  u64_t limit;
+  u64_t before;
+
+  /* No limit before bootstrap. */
+  limit = cpu_atomic_load(&_storm_limit);
+  before = limit == 0 ? 0 : (limit - 1) * 1000000000 / _STORM_WINDOW_NS;
+  if (per_sec != 0) {
+    /* Limit first, so that a window never ends up with no limit. */
+    cpu_atomic_store(&_storm_limit,
+        per_sec * _STORM_WINDOW_NS / 1000000000 + 1);
+    cpu_atomic_store(&_storm_window, time_ns_to_cycles(_STORM_WINDOW_NS));
+  }
+  return before;
+}
+
+/* Sum statistics of vector @vec on all CPUs into @sum. */
+base_private void _sum(usz_t vec, vec_stat_t *sum)
+{
+  vec_stat_t *stat;
+
+  *sum = (vec_stat_t){ 0 };
+  for (usz_t c = 0; c < SMP_CPU_MAX; c++) {
+    stat = &_cpus[c].vecs[vec];
+    sum->count += stat->count;
+    sum->cycles += stat->cycles;
+    sum->storms += stat->storms;
+    if (stat->max > sum->max) {
+      sum->max = stat->max;
+    }
+    for (usz_t b = 0; b < _HIST_BUCKETS; b++) {
+      sum->hist[b] += stat->hist[b];
+    }
+  }
+}
+
+/* Upper bound in ns of @permille of runs in @sum. */
+base_private u64_t _percentile(vec_stat_t *sum, u64_t permille)
+{
+  u64_t seen;
+  u64_t want;
+  usz_t b;
+
+  seen = 0;
+  want = (sum->count * permille + 999) / 1000;
+  for (b = 0; b < _HIST_BUCKETS - 1 && seen + sum->hist[b] < want; b++) {
+    seen += sum->hist[b];
+  }
+  /* The last bucket has no upper bound but the max. */
+  return time_cycles_to_ns(
+      b == _HIST_BUCKETS - 1 ? sum->max : _bucket_low(b + 1));
+}
+
+void intr_stat_report(usz_t top)
+{
+  u64_t counts[_VEC_CNT];
+  vec_stat_t sum;
+  usz_t best;
+
+  for (usz_t v = 0; v < _VEC_CNT; v++) {
+    _sum(v, &sum);
+    counts[v] = sum.count;
+  }
+  for (usz_t i = 0; i < top; i++) {
+    best = 0;
+    for (usz_t v = 1; v < _VEC_CNT; v++) {
+      if (counts[v] > counts[best]) {
+        best = v;
+      }
+    }
+    if (counts[best] == 0) {
+      break;
+    }
+    counts[best] = 0;
+    _sum(best, &sum);
+    log_line_format(LOG_LEVEL_INFO,
+        "IRQ %lu: %lu runs, avg %lu ns, p50 %lu ns, p99 %lu ns, max %lu ns, "
+        "%lu storms",
+        (u64_t)(best + _VEC_BASE), sum.count,
+        time_cycles_to_ns(sum.cycles / sum.count), _percentile(&sum, 500),
+        _percentile(&sum, 990), time_cycles_to_ns(sum.max), sum.storms);
+  }
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "drivers_apic.h"
+
+#define _TEST_IPIS 200
+#define _TEST_STORM_RATE 1000
+
+base_private volatile u64_t _test_irqs;
+
+base_private void _test_handler(
+    intr_id_t id base_may_unuse, intr_parameters_t *para base_may_unuse)
+{
+  cpu_atomic_fetch_add(&_test_irqs, 1);
+}
+
+/* Buckets hold what they cover, runs of a vector are counted on the CPU
+ * taking them, and a burst over the storm rate is flagged. */
+void test_intr_stat(void)
+{
+  intr_id_t id;
+  vec_stat_t before;
+  vec_stat_t sum;
+  u64_t hist;
+  u64_t rate;
+
+  for (u64_t c = 0; c < 1 << 24; c = c * 3 + 1) {
+    kernel_assert(_bucket_low(_bucket(c)) <= c);
+    kernel_assert(
+        _bucket(c) == _HIST_BUCKETS - 1 || _bucket_low(_bucket(c) + 1) > c);
+  }
+
+  if (d_apic_ready()) {
+    kernel_assert(intr_vector_alloc(_test_handler, &id));
+    /* Vector may be taken by another test before. */
+    _sum(id - _VEC_BASE, &before);
+    rate = intr_stat_storm_rate(_TEST_STORM_RATE);
+    for (u64_t i = 0; i < _TEST_IPIS; i++) {
+      sched_preempt_disable();
+      d_apic_send_ipi(d_apic_id(), (u8_t)id);
+      while (cpu_atomic_load(&_test_irqs) == i) {
+        cpu_relax();
+      }
+      sched_preempt_enable();
+    }
+    intr_stat_storm_rate(rate);
+    intr_vector_free(id);
+
+    _sum(id - _VEC_BASE, &sum);
+    hist = 0;
+    for (usz_t b = 0; b < _HIST_BUCKETS; b++) {
+      hist += sum.hist[b] - before.hist[b];
+    }
+    kernel_assert(sum.count - before.count == _TEST_IPIS);
+    kernel_assert(hist == _TEST_IPIS && sum.storms > before.storms);
+    intr_stat_report(4);
+  }
+  log_builtin_test_pass();
+}
+#endif
@@ -1,16 +1,31 @@
+#include "containers_ring.h"
 #include "containers_string.h"
 #include "cpu.h"
+#include "cpu_info.h"
 #include "drivers_acpi.h"
+#include "drivers_apic.h"
+#include "drivers_hpet.h"
+#include "drivers_hrtimer.h"
 #include "drivers_keyboard.h"
 #include "drivers_nvme.h"
+#include "drivers_pcie.h"
 #include "drivers_port.h"
 #include "drivers_serial.h"
 #include "drivers_time.h"
+#include "drivers_zram.h"
 #include "drivers_vesa.h"
 #include "interrupts.h"
 #include "kernel_panic.h"
+#include "kernel_sym.h"
 #include "log.h"
 #include "mem.h"
+#include "mm.h"
+#include "prof.h"
+#include "sched.h"
+#include "sched_async.h"
+#include "smp.h"
+#include "sync.h"
+#include "trace.h"
 #include "tui.h"
 #include "video.h"
 
@@ -38,6 +53,7 @@ typedef struct {
 } multi_boot_info_t;
 
 base_private multi_boot_info_t _boot_info;
+base_private mem_stack_t *_main_stack;
 
 base_private const byte_t *_multi_boot_info_save_tag(
     multi_boot_info_t *info, const byte_t *ptr, u32_t type, u32_t size)
@@ -142,20 +158,72 @@ base_private void _multi_boot_info_save(
   kernel_assert(((uptr_t)ptr - ((uptr_t)info->info)) == (info->total_size));
 }
 
-base_private base_no_return _kernel_halt(void)
-{
-  while (1) {
-    __asm__("hlt");
-  }
-}
+/* Usable pages of stack kernel_main continues on, backed on demand. */
+#define _MAIN_STACK_PG 64
 
-base_private void _test_stack_overflow(void)
+/* Rest of kernel_main, running on a stack allocated from mem subsystem. */
+base_private void _kernel_main_2(vptr_t arg base_may_unuse)
 {
-  byte_t stack_data[1000];
+  d_pcie_map_cfg();
+  d_apic_bootstrap();
+  d_hpet_bootstrap();
+  time_bootstrap();
+  hrtimer_bootstrap();
+  smp_bootstrap();
+  smp_call_bootstrap();
+  trace_bootstrap();
+  sched_bootstrap();
+  intr_softirq_bootstrap();
+  sched_work_bootstrap();
+  sched_async_bootstrap();
+  intr_stat_bootstrap();
+  prof_bootstrap();
+
+#ifdef BUILD_SELF_TEST_ENABLED
+  test_cpu_info();
+  test_d_pcie();
+  test_mem_va();
+  test_mem_stack();
+  test_mem_page();
+  test_intr();
+  test_smp_call();
+  test_sched();
+  test_sched_work();
+  test_sched_async();
+  test_containers_ring();
+  test_hrtimer();
+  test_intr_softirq();
+  test_intr_stat();
+  test_prof();
+  test_trace();
+  test_kernel_sym();
+  test_sync();
+  test_sync_rcu();
+  test_d_zram();
+#ifdef BUILD_MM_TRACE_ENABLED
+  test_mm_trace();
+#endif
+#endif
 
-  if (((uptr_t)stack_data - 2048) > mm_va_stack_top()) {
-    _test_stack_overflow();
-  }
+  //#ifdef BUILD_SELF_TEST_ENABLED
+  //  test_mm();
+  //#endif
+  //
+  //  d_nvme_bootstrap();
+  //
+  //  tui_start();
+  //
+
+  mem_stack_report();
+  intr_time_report();
+  sched_idle_report();
+#ifdef BUILD_LOCK_STAT_ENABLED
+  sync_stat_report(16);
+#endif
+  log_line_format(LOG_LEVEL_INFO, "cold_spot ended.");
+
+  /* Bootstrap processor idles like the others from now on. */
+  sched_thread_exit();
 }
 
 void kernal_main(uptr_t multi_boot_info)
@@ -164,6 +232,7 @@ void kernal_main(uptr_t multi_boot_info)
 
   log_line_format(LOG_LEVEL_INFO, "cold_spot started..");
   log_line_format(LOG_LEVEL_INFO, "git revision: %s", BUILD_GIT_REVISION);
+  cpu_info_bootstrap();
 
   _multi_boot_info_save(&_boot_info, (const byte_t *)multi_boot_info);
 
@@ -178,16 +247,6 @@ void kernal_main(uptr_t multi_boot_info)
 
   log_enable_video_write();
 
-  //  uptr_t rbp;
-  //  uptr_t rsp;
-  //  u64_t rbp_off;
-  //  u64_t rsp_off;
-  //  uptr_t new_rsp;
-  //  uptr_t new_rbp;
-  //  uptr_t curr_stack_top;
-  //  uptr_t curr_stack_bottom;
-  //  usz_t curr_stack_len;
-
   kernel_assert(_boot_info.ptrs[_MULTI_BOOT_TAG_TYPE_FRAME_BUFFER] != NULL);
   kernel_assert(_boot_info.lens[_MULTI_BOOT_TAG_TYPE_FRAME_BUFFER] != 0);
   d_vesa_bootstrap(_boot_info.ptrs[_MULTI_BOOT_TAG_TYPE_FRAME_BUFFER],
@@ -210,49 +269,14 @@ void kernal_main(uptr_t multi_boot_info)
       (uptr_t)&boot_stack_bottom, (uptr_t)&boot_stack_top);
 
   mem_bootstrap_2();
+  mem_footprint_report();
+  kernel_sym_bootstrap();
 
-  //mem_bootstrap_3();
-
-  //  /* Switching from boot time stack to new stack in high half.
-  //   * It is safer to do it in kernel_main as it is the entry function of C code,
-  //   * and will never get return. */
-  //  curr_stack_top = (uptr_t)&boot_stack_top;
-  //  curr_stack_bottom = (uptr_t)&boot_stack_bottom;
-  //
-  //  /* Read from register RSP and RBP */
-  //  __asm__("movq %%rbp, %0" : "=r"(rbp) :);
-  //  __asm__("movq %%rsp, %0" : "=r"(rsp) :);
-  //
-  //  rbp_off = (curr_stack_bottom - rbp);
-  //  rsp_off = (curr_stack_bottom - rsp);
-  //
-  //  new_rbp = mm_va_stack_bottom() - rbp_off;
-  //  new_rsp = mm_va_stack_bottom() - rsp_off;
-  //
-  //  curr_stack_len = curr_stack_bottom - curr_stack_top;
-  //
-  //  /* Copy everything from old stack to new stack */
-  //  mm_copy((byte_t *)(mm_va_stack_bottom() - curr_stack_len),
-  //      (byte_t *)curr_stack_top, curr_stack_len);
-  //
-  //  /* Set register RSP and RBP to new value, after here we switch to work on
-  //   * new stack. */
-  //  __asm__("movq %0, %%rbp" : /* no output */ : "r"(new_rbp));
-  //  __asm__("movq %0, %%rsp" : /* no output */ : "r"(new_rsp));
-  //  _test_stack_overflow();
-  //
-  //#ifdef BUILD_SELF_TEST_ENABLED
-  //  test_mm();
-  //#endif
-  //
-  //  d_nvme_bootstrap();
-  //
-  //  tui_start();
-  //
-
-  (void)(_test_stack_overflow);
-
-  log_line_format(LOG_LEVEL_INFO, "cold_spot ended.");
+  mem_bootstrap_3();
 
-  _kernel_halt();
+  /* Leave the 4KB boot stack for good. */
+  _main_stack = mem_stack_new("main", _MAIN_STACK_PG);
+  kernel_assert(_main_stack != NULL);
+  cpu_call_on_stack(mem_stack_bottom(_main_stack), _kernel_main_2, NULL);
+  kernel_panic("kernel_main returned");
 }
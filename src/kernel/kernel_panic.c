@@ -1,7 +1,21 @@
 #include "kernel_panic.h"
 #include "drivers_screen.h"
+#include "kernel_sym.h"
 #include "log.h"
 
+/* Log caller of the panicking function, and its callers if frame pointers are
+ * kept. */
+base_private void _backtrace_log(uptr_t ip)
+{
+  ch_t sym[KERNEL_SYM_LEN_MAX + 1];
+  usz_t len;
+
+  len = kernel_sym_marshal(sym, 0, sizeof(sym), ip);
+  sym[len] = '\0';
+  log_line_format(LOG_LEVEL_FATAL, "Called from: %s", sym);
+  kernel_sym_backtrace();
+}
+
 base_private void _unsigned_to_str(usz_t uval, char *buf, usz_t buf_cap)
 {
   usz_t buf_off;
@@ -70,6 +84,7 @@ base_no_return _kernel_panic(const char *file, usz_t line, const char *msg)
 
   log_line_format(LOG_LEVEL_FATAL, "Kernel panic! %s", msg);
   log_line_format(LOG_LEVEL_FATAL, "File: %s, line:%lu ", file, line);
+  _backtrace_log((uptr_t)__builtin_return_address(0));
 
   while (1) {
     __asm__("hlt");
@@ -100,6 +115,7 @@ base_no_return _kernel_assert_fail(
   log_line_format(
       LOG_LEVEL_FATAL, "Kernel assertion failure! Expression: %s", expr);
   log_line_format(LOG_LEVEL_FATAL, "File: %s, line: %lu", file, line);
+  _backtrace_log((uptr_t)__builtin_return_address(0));
 
   while (1) {
     __asm__("hlt");
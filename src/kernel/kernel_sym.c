@@ -0,0 +1,356 @@
+/* Symbolizing kernel addresses, into function and offset.
+ *
+ * Text symbols of the symbol table kept loaded by multiboot loader are sorted
+ * by address once at boot, so that a lookup is a binary search over an array
+ * of addresses only. Each CPU keeps the last few addresses looked up, most
+ * recent first, since profiler samples and IRQ tracepoints hit the same few
+ * over and over. */
+#include "kernel_sym.h"
+#include "containers_string.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem.h"
+#include "smp.h"
+
+#define _SYM_CAP 4096
+#define _CACHE_WAYS 8
+/* Bytes of a name kept by kernel_sym_marshal(), the rest is offset. */
+#define _NAME_LEN_MAX 40
+/* Bytes above the first frame callers are looked for. */
+#define _UNWIND_SPAN (16 * 1024)
+#define _UNWIND_DEPTH 16
+
+typedef struct {
+  uptr_t addr;
+  u64_t idx;
+} cache_way_t;
+
+/* Recently looked up addresses found, most recent first. */
+typedef struct {
+  cache_way_t ways[_CACHE_WAYS] base_align(64);
+  ucnt_t cnt;
+  u64_t hits;
+  u64_t misses;
+} sym_cache_t;
+
+/* Sorted by address, lengths of symbols with none run up to the next one. */
+base_private uptr_t _addrs[_SYM_CAP];
+base_private u32_t _lens[_SYM_CAP];
+base_private const ch_t *_names[_SYM_CAP];
+base_private usz_t _cnt;
+base_private usz_t _skipped;
+base_private sym_cache_t _caches[SMP_CPU_MAX];
+
+base_private void _collect(
+    uptr_t addr, usz_t len, const ch_t *name, vptr_t arg base_may_unuse)
+{
+  if (_cnt < _SYM_CAP) {
+    _addrs[_cnt] = addr;
+    _lens[_cnt] = len > U32_MAX ? U32_MAX : (u32_t)len;
+    _names[_cnt] = name;
+    _cnt++;
+  } else {
+    _skipped++;
+  }
+}
+
+base_private void _swap(usz_t a, usz_t b)
+{
+  uptr_t addr;
+  u32_t len;
+  const ch_t *name;
+
+  addr = _addrs[a];
+  _addrs[a] = _addrs[b];
+  _addrs[b] = addr;
+  len = _lens[a];
+  _lens[a] = _lens[b];
+  _lens[b] = len;
+  name = _names[a];
+  _names[a] = _names[b];
+  _names[b] = name;
+}
+
+/* Symbol @a goes after @b, of the same address, sized ones go first. */
+base_private bo_t _after(usz_t a, usz_t b)
+{
+  return _addrs[a] > _addrs[b] ||
+         (_addrs[a] == _addrs[b] && _lens[a] < _lens[b]);
+}
+
+base_private void _sift_down(usz_t root, usz_t end)
+{
+  usz_t child;
+
+  while (root * 2 + 1 < end) {
+    child = root * 2 + 1;
+    if (child + 1 < end && _after(child + 1, child)) {
+      child++;
+    }
+    if (!_after(child, root)) {
+      break;
+    }
+    _swap(root, child);
+    root = child;
+  }
+}
+
+/* Heap sort, symbol table is in no particular order. */
+base_private void _sort(void)
+{
+  for (usz_t i = _cnt / 2; i > 0; i--) {
+    _sift_down(i - 1, _cnt);
+  }
+  for (usz_t end = _cnt; end > 1; end--) {
+    _swap(0, end - 1);
+    _sift_down(0, end - 1);
+  }
+}
+
+/* Drop aliases of the same address, and bound symbols with no size. */
+base_private void _dedup(void)
+{
+  usz_t n;
+
+  n = 0;
+  for (usz_t i = 0; i < _cnt; i++) {
+    if (n == 0 || _addrs[i] != _addrs[n - 1]) {
+      _addrs[n] = _addrs[i];
+      _lens[n] = _lens[i];
+      _names[n] = _names[i];
+      n++;
+    }
+  }
+  _cnt = n;
+  for (usz_t i = 0; i + 1 < _cnt; i++) {
+    if (_lens[i] == 0 && _addrs[i + 1] - _addrs[i] <= U32_MAX) {
+      _lens[i] = (u32_t)(_addrs[i + 1] - _addrs[i]);
+    }
+  }
+}
+
+void kernel_sym_bootstrap(void)
+{
+  if (!mem_ker_text_syms(_collect, NULL)) {
+    log_line_format(LOG_LEVEL_WARN, "No symbol table, addresses stay raw");
+  } else {
+    _sort();
+    _dedup();
+    if (_skipped > 0) {
+      log_line_format(
+          LOG_LEVEL_WARN, "Symbol table full, %lu symbols skipped", _skipped);
+    }
+    log_line_format(LOG_LEVEL_INFO, "Kernel symbols: %lu", _cnt);
+  }
+}
+
+/* @return Index of the last symbol starting at or below @addr, _cnt if
+ * none. */
+base_private usz_t _search(uptr_t addr)
+{
+  usz_t lo;
+  usz_t hi;
+  usz_t mid;
+
+  /* Invariant: symbols below @lo start at or below @addr, ones from @hi on
+   * above it. */
+  lo = 0;
+  hi = _cnt;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (_addrs[mid] <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo == 0 ? _cnt : lo - 1;
+}
+
+/* @return Index of symbol containing @addr, _cnt if none. */
+base_private usz_t _find(uptr_t addr)
+{
+  usz_t idx;
+
+  idx = _search(addr);
+  /* The last symbol with no size has no bound. */
+  if (idx < _cnt && _lens[idx] != 0 && addr - _addrs[idx] >= _lens[idx]) {
+    idx = _cnt;
+  }
+  return idx;
+}
+
+/* Look @addr up in cache of current CPU, IRQs must be disabled. */
+base_private usz_t _find_cached(sym_cache_t *cache, uptr_t addr)
+{
+  cache_way_t way;
+  usz_t idx;
+  usz_t i;
+
+  i = 0;
+  while (i < cache->cnt && cache->ways[i].addr != addr) {
+    i++;
+  }
+  if (i < cache->cnt) {
+    cache->hits++;
+    way = cache->ways[i];
+    idx = way.idx;
+  } else {
+    cache->misses++;
+    idx = _find(addr);
+    way.addr = addr;
+    way.idx = idx;
+    if (cache->cnt < _CACHE_WAYS) {
+      cache->cnt++;
+    }
+    i = cache->cnt - 1;
+  }
+  /* Move it to the front, the least recent one falls off the end. */
+  for (; i > 0; i--) {
+    cache->ways[i] = cache->ways[i - 1];
+  }
+  cache->ways[0] = way;
+  return idx;
+}
+
+bo_t kernel_sym_lookup(uptr_t addr, const ch_t **out_name, u64_t *out_off)
+{
+  usz_t idx;
+  u64_t flags;
+
+  idx = _cnt;
+  if (_cnt > 0) {
+    /* CPU local data is set up once any CPU is online. */
+    if (smp_cpu_cnt() == 0) {
+      idx = _find(addr);
+    } else {
+      flags = intr_irq_save();
+      idx = _find_cached(&_caches[smp_cpu_idx()], addr);
+      intr_irq_restore(flags);
+    }
+  }
+  if (idx < _cnt) {
+    *out_name = _names[idx];
+    *out_off = addr - _addrs[idx];
+  }
+  return idx < _cnt;
+}
+
+usz_t kernel_sym_marshal(
+    ch_t *buf, const usz_t buf_off, const usz_t buf_len, uptr_t addr)
+{
+  const ch_t *name;
+  u64_t off;
+  usz_t len;
+  usz_t n;
+
+  kernel_assert(buf_len - buf_off > KERNEL_SYM_LEN_MAX);
+  if (kernel_sym_lookup(addr, &name, &off)) {
+    n = 0;
+    while (n < _NAME_LEN_MAX && name[n] != '\0') {
+      n++;
+    }
+    len = str_buf_marshal_str(buf, buf_off, buf_len, name, n);
+    buf[buf_off + len++] = '+';
+    len += str_buf_marshal_uint_in_hex(buf, buf_off + len, buf_len, off);
+  } else {
+    len = str_buf_marshal_uint_in_hex(buf, buf_off, buf_len, addr);
+  }
+  return len;
+}
+
+void kernel_sym_backtrace(void)
+{
+#ifdef BUILD_DEBUG_ENABLED
+  ch_t sym[KERNEL_SYM_LEN_MAX + 1];
+  uptr_t bp;
+  uptr_t bp_0;
+  uptr_t ip;
+  usz_t len;
+
+  /* Each frame has caller frame pointer, then return address above it, and
+   * frames of callers are further up. */
+  bp_0 = (uptr_t)__builtin_frame_address(0);
+  bp = bp_0;
+  for (usz_t d = 0; d < _UNWIND_DEPTH; d++) {
+    if (bp == 0 || bp % sizeof(uptr_t) != 0 ||
+        bp + 2 * sizeof(uptr_t) > bp_0 + _UNWIND_SPAN) {
+      break;
+    }
+    ip = *(uptr_t *)(bp + sizeof(uptr_t));
+    if (ip == 0) {
+      break;
+    }
+    len = kernel_sym_marshal(sym, 0, sizeof(sym), ip);
+    sym[len] = '\0';
+    log_line_format(LOG_LEVEL_FATAL, "  #%lu %s", (u64_t)d, sym);
+    bp = *(uptr_t *)bp > bp ? *(uptr_t *)bp : 0;
+  }
+#endif
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "cpu.h"
+
+#define _TEST_ROUNDS 1000
+
+base_private bo_t _test_name_is(const ch_t *name, const ch_t *expect)
+{
+  usz_t len;
+
+  len = str_len(expect);
+  return str_len(name) == len &&
+         mm_compare((const byte_t *)name, (const byte_t *)expect, len) == 0;
+}
+
+/* Addresses in functions resolve to them with offsets, addresses in none do
+ * not, the index is sorted, and cost of lookups is logged. */
+void test_kernel_sym(void)
+{
+  ch_t buf[KERNEL_SYM_LEN_MAX + 1];
+  const ch_t *name;
+  u64_t off;
+  u64_t start;
+  u64_t cached;
+  u64_t uncached;
+  usz_t found;
+  usz_t len;
+
+  kernel_assert(_cnt > 0);
+  for (usz_t i = 1; i < _cnt; i++) {
+    kernel_assert(_addrs[i - 1] < _addrs[i]);
+  }
+
+  kernel_assert(kernel_sym_lookup((uptr_t)kernel_sym_lookup, &name, &off));
+  kernel_assert(_test_name_is(name, "kernel_sym_lookup") && off == 0);
+  kernel_assert(kernel_sym_lookup((uptr_t)_search + 5, &name, &off));
+  kernel_assert(_test_name_is(name, "_search") && off == 5);
+  kernel_assert(!kernel_sym_lookup(0x10, &name, &off));
+
+  len = kernel_sym_marshal(buf, 0, sizeof(buf), (uptr_t)test_kernel_sym + 31);
+  buf[len] = '\0';
+  kernel_assert(_test_name_is(buf, "test_kernel_sym+0x1F"));
+  len = kernel_sym_marshal(buf, 0, sizeof(buf), 0x10);
+  buf[len] = '\0';
+  kernel_assert(_test_name_is(buf, "0x10"));
+
+  start = cpu_read_tsc();
+  for (usz_t i = 0; i < _TEST_ROUNDS; i++) {
+    kernel_assert(kernel_sym_lookup((uptr_t)_search + i % 4, &name, &off));
+  }
+  cached = (cpu_read_tsc() - start) / _TEST_ROUNDS;
+  found = 0;
+  start = cpu_read_tsc();
+  for (usz_t i = 0; i < _TEST_ROUNDS; i++) {
+    found += _find(_addrs[(i * 7919) % _cnt]) < _cnt;
+  }
+  uncached = (cpu_read_tsc() - start) / _TEST_ROUNDS;
+  kernel_assert(found == _TEST_ROUNDS);
+
+  log_line_format(LOG_LEVEL_SELF_TEST,
+      "Symbol lookup of %lu symbols: %lu cycles cached, %lu cycles uncached",
+      (u64_t)_cnt, cached, uncached);
+  log_builtin_test_pass();
+}
+#endif
@@ -1,7 +1,9 @@
 #include "log.h"
 #include "containers_string.h"
 #include "drivers_serial.h"
+#include "drivers_time.h"
 #include "kernel_panic.h"
+#include "sync.h"
 #include "video.h"
 
 base_private const ch_t *_LINE_PREFIX_LEVEL[LOG_LEVEL_FATAL + 1] = { "[STE]",
@@ -13,6 +15,9 @@ base_private usz_t _screen_col = 0;
 
 base_private bo_t _write_screen = false;
 
+/* Keeps lines of CPUs from interleaving, IRQ handlers log as well. */
+base_private sync_spin_t _lock = SYNC_SPIN_INIT("log");
+
 void log_enable_video_write(void)
 {
   _write_screen = true;
@@ -53,6 +58,20 @@ base_private void log_uint(log_level_t lv, u64_t uval)
   log_str_len(lv, msg, msg_len);
 }
 
+/* Log @uval with at least @width digits, padded at left by @pad. */
+base_private void _log_uint_pad(
+    log_level_t lv, u64_t uval, usz_t width, ch_t pad)
+{
+  const usz_t _MSG_CAP = 64;
+  ch_t msg[_MSG_CAP];
+  usz_t msg_len = str_buf_marshal_uint(msg, 0, _MSG_CAP, uval);
+
+  for (usz_t i = msg_len; i < width; i++) {
+    log_str_len(lv, &pad, 1);
+  }
+  log_str_len(lv, msg, msg_len);
+}
+
 base_private const ch_t *_file_strip(const ch_t *file)
 {
   const ch_t *res = file;
@@ -120,8 +139,16 @@ base_private const ch_t *_file_strip(const ch_t *file)
 
 base_private void _log_line_start(log_level_t lv, const ch_t *file, usz_t line)
 {
+  u64_t ns;
+
+  /* Monotonic time since reset, 0 until TSC is calibrated. */
+  ns = time_now_ns();
   log_str_len(lv, _LINE_PREFIX_LEVEL[lv], _LINE_PREFIX_LEVEL_LEN);
-  log_str_len(lv, " ", 1);
+  log_str_len(lv, " [", 2);
+  _log_uint_pad(lv, ns / 1000000000, 5, ' ');
+  log_str_len(lv, ".", 1);
+  _log_uint_pad(lv, ns % 1000000000 / 1000, 6, '0');
+  log_str_len(lv, "] ", 2);
   log_str(lv, _file_strip(file));
   log_str_len(lv, ":", 1);
   log_uint(lv, line);
@@ -140,10 +167,14 @@ base_private void _log_line_end(log_level_t lv)
 
 void _log_builtin_test_pass(const ch_t *test_name, const ch_t *file, usz_t line)
 {
+  u64_t flags;
+
+  flags = sync_spin_lock_irqsave(&_lock);
   _log_line_start(LOG_LEVEL_SELF_TEST, file, line);
   log_str(LOG_LEVEL_SELF_TEST, test_name);
   log_str(LOG_LEVEL_SELF_TEST, " .. Passed.");
   _log_line_end(LOG_LEVEL_SELF_TEST);
+  sync_spin_unlock_irqrestore(&_lock, flags);
 }
 
 void _log_line_format_v(
@@ -153,15 +184,16 @@ void _log_line_format_v(
   ch_t buf[BUF_CAP];
   usz_t buf_len;
   va_list list;
-
-  _log_line_start(lv, file, line);
+  u64_t flags;
 
   va_start(list, format);
   buf_len =
       str_buf_marshal_format_v(buf, 0, BUF_CAP, format, str_len(format), list);
   va_end(list);
 
+  flags = sync_spin_lock_irqsave(&_lock);
+  _log_line_start(lv, file, line);
   log_str_len(lv, buf, buf_len);
-
   _log_line_end(lv);
+  sync_spin_unlock_irqrestore(&_lock, flags);
 }
@@ -1,4 +1,5 @@
 /* Memory management subsystem. */
+#include "cpu_info.h"
 #include "kernel_panic.h"
 #include "mem_private.h"
 #include "util.h"
@@ -27,15 +28,15 @@ void mem_bootstrap_2(void)
 void mem_bootstrap_3(void)
 {
   kernel_assert(boot_stage == MEM_BOOTSTRAP_STAGE_2);
+  mem_va_bootstrap_3();
+  mem_stack_bootstrap_3();
   boot_stage = MEM_BOOTSTRAP_STAGE_3;
 }
 
 void mem_clean(byte_t *mem, usz_t size)
 {
   kernel_assert(size > 0);
-  for (usz_t i = 0; i < size; i++) {
-    (mem)[i] = (byte_t)0;
-  }
+  cpu_mem_zero(mem, size);
 }
 
 bo_t mem_align_check(uptr_t p, u64_t align)
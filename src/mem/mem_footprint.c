@@ -0,0 +1,270 @@
+/* Static memory footprint report of kernel image, and its text symbols.
+ *
+ * Derived from ELF section headers and symbol table saved by multiboot loader,
+ * so that regressions of static memory usage are visible on every boot. */
+
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem_private.h"
+
+/* ELF section types and flags. */
+#define _SHT_SYMTAB 2
+#define _SHT_NOBITS 8
+#define _SHF_ALLOC 0x2
+#define _SHF_EXECINSTR 0x4
+/* ELF symbol types. */
+#define _STT_NOTYPE 0
+#define _STT_OBJECT 1
+#define _STT_FUNC 2
+
+/* Number of largest static objects to report. */
+#define _TOP_OBJ_CAP 12
+
+/* ELF 64 symbol table entry. */
+typedef struct {
+  u32_t name;
+  u8_t info;
+  u8_t other;
+  u16_t shndx;
+  u64_t value;
+  u64_t size;
+} base_struct_packed elf_sym_t;
+
+typedef enum {
+  _GROUP_TEXT = 0,
+  _GROUP_RODATA,
+  _GROUP_DATA,
+  _GROUP_BSS,
+  _GROUP_OTHER,
+  _GROUP_CNT,
+} group_t;
+
+base_private const ch_t *_GROUP_NAMES[_GROUP_CNT] = {
+  ".text",
+  ".rodata",
+  ".data",
+  ".bss",
+  "other",
+};
+
+base_private const mb_elf_sec_entry_t *_sec_get(
+    const mb_tag_elf_secs_t *secs, usz_t idx)
+{
+  kernel_assert_d(idx < secs->num);
+  return (const mb_elf_sec_entry_t *)(((uptr_t)secs->sections) +
+                                      idx * secs->section_size);
+}
+
+/* @return Name of section, or NULL if section name table is not loaded. */
+base_private const ch_t *_sec_name(
+    const mb_tag_elf_secs_t *secs, const mb_elf_sec_entry_t *sec)
+{
+  const mb_elf_sec_entry_t *names;
+  const ch_t *name;
+
+  name = NULL;
+  if (secs->shndx < secs->num) {
+    names = _sec_get(secs, secs->shndx);
+    if (names->addr != 0 && sec->name < names->size) {
+      name = (const ch_t *)(names->addr + sec->name);
+    }
+  }
+  return name;
+}
+
+base_private bo_t _name_has_prefix(const ch_t *name, const ch_t *prefix)
+{
+  usz_t i;
+
+  for (i = 0; prefix[i] != '\0'; i++) {
+    if (name[i] != prefix[i]) {
+      break;
+    }
+  }
+  return prefix[i] == '\0';
+}
+
+base_private group_t _sec_group(const ch_t *name)
+{
+  group_t group = _GROUP_OTHER;
+
+  if (name != NULL) {
+    for (usz_t i = 0; i < _GROUP_OTHER; i++) {
+      if (_name_has_prefix(name, _GROUP_NAMES[i])) {
+        group = (group_t)i;
+        break;
+      }
+    }
+  }
+  return group;
+}
+
+base_private void _report_sections(const mb_tag_elf_secs_t *secs)
+{
+  usz_t groups[_GROUP_CNT];
+  usz_t total;
+
+  for (usz_t i = 0; i < _GROUP_CNT; i++) {
+    groups[i] = 0;
+  }
+
+  for (usz_t i = 0; i < secs->num; i++) {
+    const mb_elf_sec_entry_t *sec = _sec_get(secs, i);
+    const ch_t *name = _sec_name(secs, sec);
+
+    if ((sec->flags & _SHF_ALLOC) == 0 || sec->size == 0) {
+      continue;
+    }
+    groups[_sec_group(name)] += sec->size;
+    log_line_format(LOG_LEVEL_INFO, "Footprint section %s: %lu bytes%s",
+        name == NULL ? "?" : name, sec->size,
+        sec->type == _SHT_NOBITS ? " (no bits)" : "");
+  }
+
+  total = 0;
+  for (usz_t i = 0; i < _GROUP_CNT; i++) {
+    total += groups[i];
+    log_line_format(LOG_LEVEL_INFO, "Footprint %s: %lu KiB", _GROUP_NAMES[i],
+        groups[i] / 1024);
+  }
+  log_line_format(
+      LOG_LEVEL_INFO, "Footprint kernel image: %lu KiB", total / 1024);
+}
+
+/* Log @_TOP_OBJ_CAP largest data objects in symbol table. */
+base_private void _report_top_objects(const mb_tag_elf_secs_t *secs,
+    const mb_elf_sec_entry_t *symtab,
+    const mb_elf_sec_entry_t *strtab)
+{
+  const elf_sym_t *top[_TOP_OBJ_CAP];
+  usz_t top_cnt;
+  usz_t sym_cnt;
+
+  kernel_assert(symtab->entry_size == sizeof(elf_sym_t));
+
+  /* Keep largest objects in @top, sorted by size descending. */
+  top_cnt = 0;
+  sym_cnt = symtab->size / sizeof(elf_sym_t);
+  for (usz_t i = 0; i < sym_cnt; i++) {
+    const elf_sym_t *sym = (const elf_sym_t *)symtab->addr + i;
+    usz_t pos;
+
+    if ((sym->info & 0xf) != _STT_OBJECT || sym->size == 0) {
+      continue;
+    }
+    pos = top_cnt;
+    while (pos > 0 && top[pos - 1]->size < sym->size) {
+      if (pos < _TOP_OBJ_CAP) {
+        top[pos] = top[pos - 1];
+      }
+      pos--;
+    }
+    if (pos < _TOP_OBJ_CAP) {
+      top[pos] = sym;
+      if (top_cnt < _TOP_OBJ_CAP) {
+        top_cnt++;
+      }
+    }
+  }
+
+  for (usz_t i = 0; i < top_cnt; i++) {
+    const ch_t *name = "?";
+    const ch_t *sec_name = NULL;
+
+    if (strtab->addr != 0 && top[i]->name < strtab->size) {
+      name = (const ch_t *)(strtab->addr + top[i]->name);
+    }
+    if (top[i]->shndx < secs->num) {
+      sec_name = _sec_name(secs, _sec_get(secs, top[i]->shndx));
+    }
+    log_line_format(LOG_LEVEL_INFO, "Footprint object %s: %lu KiB (%s)", name,
+        top[i]->size / 1024, sec_name == NULL ? "?" : sec_name);
+  }
+}
+
+/* @return false if symbol table, or its string table, is not loaded. */
+base_private bo_t _symtab_find(const mb_tag_elf_secs_t *secs,
+    const mb_elf_sec_entry_t **out_symtab,
+    const mb_elf_sec_entry_t **out_strtab)
+{
+  const mb_elf_sec_entry_t *symtab;
+  bo_t found;
+
+  symtab = NULL;
+  for (usz_t i = 0; i < secs->num; i++) {
+    const mb_elf_sec_entry_t *sec = _sec_get(secs, i);
+    if (sec->type == _SHT_SYMTAB) {
+      symtab = sec;
+      break;
+    }
+  }
+  found = symtab != NULL && symtab->addr != 0 && symtab->link < secs->num;
+  if (found) {
+    *out_symtab = symtab;
+    *out_strtab = _sec_get(secs, symtab->link);
+    found = (*out_strtab)->addr != 0;
+  }
+  return found;
+}
+
+base_private void _report_objects(const mb_tag_elf_secs_t *secs)
+{
+  const mb_elf_sec_entry_t *symtab;
+  const mb_elf_sec_entry_t *strtab;
+
+  if (!_symtab_find(secs, &symtab, &strtab)) {
+    log_line_format(LOG_LEVEL_WARN, "Footprint: no symbol table loaded");
+  } else {
+    _report_top_objects(secs, symtab, strtab);
+  }
+}
+
+bo_t mem_ker_text_syms(mem_ker_sym_cb fn, vptr_t arg)
+{
+  const mb_tag_elf_secs_t *secs;
+  const mb_elf_sec_entry_t *symtab;
+  const mb_elf_sec_entry_t *strtab;
+  const elf_sym_t *sym;
+  u8_t type;
+  bo_t found;
+
+  kernel_assert(boot_stage >= MEM_BOOTSTRAP_STAGE_2);
+
+  secs = mem_ker_elf_secs();
+  found = _symtab_find(secs, &symtab, &strtab);
+  if (found) {
+    kernel_assert(symtab->entry_size == sizeof(elf_sym_t));
+    for (usz_t i = 0; i < symtab->size / sizeof(elf_sym_t); i++) {
+      sym = (const elf_sym_t *)symtab->addr + i;
+      type = sym->info & 0xf;
+      /* Labels of assembly code have no type, and no size. */
+      if ((type == _STT_FUNC || type == _STT_NOTYPE) && sym->value != 0 &&
+          sym->shndx < secs->num && sym->name != 0 &&
+          sym->name < strtab->size &&
+          (_sec_get(secs, sym->shndx)->flags & _SHF_EXECINSTR) != 0) {
+        fn(sym->value, sym->size, (const ch_t *)(strtab->addr + sym->name),
+            arg);
+      }
+    }
+  }
+  return found;
+}
+
+void mem_footprint_report(void)
+{
+  const mb_tag_elf_secs_t *secs;
+  ucnt_t tab_frames;
+
+  kernel_assert(boot_stage >= MEM_BOOTSTRAP_STAGE_2);
+
+  secs = mem_ker_elf_secs();
+  _report_sections(secs);
+  _report_objects(secs);
+
+  tab_frames = mem_page_tab_frame_cnt();
+  log_line_format(LOG_LEVEL_INFO, "Footprint page tables: %lu frames, %lu KiB",
+      tab_frames, tab_frames * PAGE_SIZE_4K / 1024);
+  log_line_format(LOG_LEVEL_INFO,
+      "Footprint bootstrap frames: %lu of %lu used",
+      mem_frame_bootstrap_used(), mem_frame_bootstrap_cap());
+}
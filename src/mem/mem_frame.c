@@ -1,10 +1,12 @@
 /* Physical memory management. */
 
+#include "cpu.h"
 #include "drivers_pcie.h"
 #include "drivers_vesa.h"
 #include "kernel_panic.h"
 #include "log.h"
 #include "mem_private.h"
+#include "trace.h"
 
 /* Describes a section of available physical memory. */
 typedef struct {
@@ -12,31 +14,6 @@ typedef struct {
   usz_t len;
 } section_t;
 
-/*
- * Multiboot ELF sections, Reference:
- * https://en.wikipedia.org/wiki/Executable_and_Linkable_Format#Section_header
- */
-typedef struct mb_elf_sec_entry {
-  uint32_t name;
-  uint32_t type;
-  uint64_t flags;
-  uint64_t addr;
-  uint64_t offset;
-  uint64_t size;
-  uint32_t link;
-  uint32_t info;
-  uint64_t alignment;
-  uint64_t entry_size;
-} base_struct_packed mb_elf_sec_entry_t;
-
-/* Multiboot ELF sections tag. */
-typedef struct mb_tag_elf_secs {
-  uint32_t num;
-  uint32_t section_size;
-  uint32_t shndx;
-  mb_elf_sec_entry_t sections[];
-} base_struct_packed mb_tag_elf_secs_t;
-
 /* A list of physical address ranges. */
 struct pa_list {
   ucnt_t n;     /* Address range count */
@@ -57,13 +34,21 @@ base_private usz_t _pmem_size;
 
 base_private uptr_t _kern_start_pa;
 base_private uptr_t _kern_end_pa;
+/* Kernel ELF sections saved by multiboot loader. */
+base_private const mb_tag_elf_secs_t *_kern_elf_secs;
 
 /* Frames can be used during stage 1 of mem subsystem bootstrap. */
 #define _FRAME_CAP_BOOTSTRAP 16 * 1024
 byte_t _frame_pool_bootstrap[_FRAME_CAP_BOOTSTRAP * PAGE_SIZE_4K] base_align(
     PAGE_SIZE_VALUE_4K);
-/* Frames used in early stage. */
-base_private usz_t _frame_count_bootstrap;
+/* Frames used in early stage, bumped with atomic operations. */
+base_private volatile u64_t _frame_count_bootstrap;
+/* Stack of bootstrap frames given back by @mem_frame_free. Lower 32 bits is
+ * the index plus 1 of the top frame (0 means empty), higher 32 bits is a tag
+ * increased on every push and pop, to avoid ABA problem. Each free frame saves
+ * lower 32 bits of the previous top in its first 8 bytes. */
+base_private volatile u64_t _frame_free_bootstrap;
+#define _FRAME_FREE_IDX_MASK u64_literal(0xffffffff)
 
 #define _PA_LIST_CAP_BOOTSTRAP 1024
 base_private byte_t _pa_list_bootstrap_pool[_PA_LIST_CAP_BOOTSTRAP];
@@ -145,6 +130,7 @@ base_private void _bootstrap_kernel_elf_symbols(
   kernel_assert(boot_stage == MEM_BOOTSTRAP_STAGE_0);
 
   secs = (mb_tag_elf_secs_t *)elf_info;
+  _kern_elf_secs = secs;
   sec_cnt = secs->num;
   sec_size = secs->section_size;
 
@@ -183,29 +169,91 @@ void mem_frame_bootstrap_1(const byte_t *mb_elf,
   kernel_assert(boot_stage == MEM_BOOTSTRAP_STAGE_0);
 
   _frame_count_bootstrap = 0;
+  _frame_free_bootstrap = 0;
   _pa_list_bootstrap_next = _pa_list_bootstrap_pool;
 
   _bootstrap_mmap_info(mb_mmap, mb_mmap_len);
   _bootstrap_kernel_elf_symbols(mb_elf, mb_elf_len);
 }
 
+/* Pop a frame from bootstrap frames given back. */
+base_private bo_t _frame_pop_bootstrap(byte_t **out_frame)
+{
+  u64_t head;
+  u64_t next;
+  u64_t tag;
+  byte_t *frame;
+  bo_t ok;
+
+  ok = false;
+  head = cpu_atomic_load(&_frame_free_bootstrap);
+  while ((head & _FRAME_FREE_IDX_MASK) != 0) {
+    frame = _frame_pool_bootstrap +
+            ((head & _FRAME_FREE_IDX_MASK) - 1) * PAGE_SIZE_4K;
+    /* The frame may be popped and reused by others at this moment, the value
+     * read out is garbage then, but the tag makes sure the CAS fails. */
+    next = *(volatile u64_t *)frame;
+    tag = (head >> 32) + 1;
+    ok = cpu_atomic_cas(&_frame_free_bootstrap, head,
+        (tag << 32) | (next & _FRAME_FREE_IDX_MASK));
+    if (ok) {
+      (*out_frame) = frame;
+      break;
+    }
+    head = cpu_atomic_load(&_frame_free_bootstrap);
+  }
+  return ok;
+}
+
+/* Frames are safe to be allocated and freed concurrently by multiple CPUs. */
 base_must_check bo_t mem_frame_alloc(byte_t **out_frame)
 {
+  u64_t cnt;
   bo_t ok;
 
   kernel_assert(boot_stage < MEM_BOOTSTRAP_STAGE_FINISH);
 
-  if (_frame_count_bootstrap < _FRAME_CAP_BOOTSTRAP) {
-    (*out_frame) =
-        _frame_pool_bootstrap + _frame_count_bootstrap * PAGE_SIZE_4K;
-    _frame_count_bootstrap++;
-    ok = true;
-  } else {
-    ok = false;
+  ok = _frame_pop_bootstrap(out_frame);
+  if (!ok) {
+    cnt = cpu_atomic_load(&_frame_count_bootstrap);
+    while (cnt < _FRAME_CAP_BOOTSTRAP) {
+      ok = cpu_atomic_cas(&_frame_count_bootstrap, cnt, cnt + 1);
+      if (ok) {
+        (*out_frame) = _frame_pool_bootstrap + cnt * PAGE_SIZE_4K;
+        break;
+      }
+      cnt = cpu_atomic_load(&_frame_count_bootstrap);
+    }
+  }
+  if (ok) {
+    trace_frame_alloc(*out_frame);
   }
   return ok;
 }
 
+void mem_frame_free(byte_t *frame)
+{
+  u64_t idx;
+  u64_t head;
+  u64_t tag;
+  bo_t ok;
+
+  kernel_assert(boot_stage < MEM_BOOTSTRAP_STAGE_FINISH);
+  kernel_assert(frame >= _frame_pool_bootstrap);
+  kernel_assert(
+      frame < _frame_pool_bootstrap + _FRAME_CAP_BOOTSTRAP * PAGE_SIZE_4K);
+  kernel_assert(mem_align_check((uptr_t)frame, PAGE_SIZE_4K));
+  trace_frame_free(frame);
+
+  idx = (u64_t)(frame - _frame_pool_bootstrap) / PAGE_SIZE_4K + 1;
+  do {
+    head = cpu_atomic_load(&_frame_free_bootstrap);
+    *(volatile u64_t *)frame = head & _FRAME_FREE_IDX_MASK;
+    tag = (head >> 32) + 1;
+    ok = cpu_atomic_cas(&_frame_free_bootstrap, head, (tag << 32) | idx);
+  } while (!ok);
+}
+
 /*
 base_private mem_heap_t *_heaps[_SECTION_CAP];
 base_private usz_t _heap_cnt;
@@ -358,6 +406,22 @@ uptr_t mem_pa_ker_end(void)
   return _kern_end_pa;
 }
 
+const mb_tag_elf_secs_t *mem_ker_elf_secs(void)
+{
+  kernel_assert_d(_kern_elf_secs != NULL);
+  return _kern_elf_secs;
+}
+
+ucnt_t mem_frame_bootstrap_used(void)
+{
+  return cpu_atomic_load(&_frame_count_bootstrap);
+}
+
+ucnt_t mem_frame_bootstrap_cap(void)
+{
+  return _FRAME_CAP_BOOTSTRAP;
+}
+
 pa_list_t *pa_list_new_bootstrap(u64_t n_range)
 {
   pa_list_t *res;
@@ -4,6 +4,10 @@
 #include "kernel_panic.h"
 #include "log.h"
 #include "mem_private.h"
+#include "mem_tab_private.h"
+#include "sched.h"
+#include "smp.h"
+#include "trace.h"
 
 typedef struct {
   bo_t present : 1;
@@ -21,6 +25,8 @@ typedef struct {
   bo_t no_exe : 1;
 } base_struct_packed tab_entry_t;
 
+MEM_TAB_ENTRY_HELPERS(tab_entry_t)
+
 typedef enum {
   TAB_LEV_4 = 4,
   TAB_LEV_3 = 3,
@@ -39,6 +45,9 @@ base_private tab_entry_t _tab_4_bootstrap[_TAB_ENTRY_COUNT] base_align(
 base_private tab_entry_t _tab_4[_TAB_ENTRY_COUNT] base_align(
     PAGE_SIZE_VALUE_4K);
 
+/* Frames allocated as page tables. */
+base_private volatile u64_t _tab_frame_cnt;
+
 base_private void _tab_load_root(tab_entry_t *p4)
 {
   u64_t val;
@@ -150,6 +159,7 @@ base_private bo_t _map_bootstrap(tab_entry_t *root, uptr_t va, uptr_t pa)
         kernel_assert(frame != NULL);
         _tab_entry_init(entry, lv, true, true, (uptr_t)frame, PAGE_SIZE_4K);
         _tab_zero((tab_entry_t *)frame);
+        cpu_atomic_fetch_add(&_tab_frame_cnt, 1);
       } else {
         break;
       }
@@ -201,43 +211,82 @@ void mem_page_bootstrap_1(void)
   _tab_load_root(_tab_4_bootstrap);
 }
 
-base_private void _map_page(tab_entry_t *root, uptr_t va, uptr_t pa)
+/* Bit 9 of a level 2 entry is ignored by MMU, we use it to lock the level 1
+ * table it points to. Leaf entries are only updated with this lock held, so
+ * CPUs mapping different 2MB ranges never contend with each other. Page
+ * fault handler takes it as well to back kernel stacks, so holders are never
+ * preempted, and never fault on their own stack: that fault would spin on the
+ * lock its own context holds. */
+#define _TAB_ENTRY_BIT_LOCK 9
+/* Stack used while a table lock is held, with a good margin. */
+#define _TAB_LOCK_STACK 512
+
+base_private void _tab_lock(tab_entry_t *entry)
+{
+  /* Touch stack below, a page not backed yet faults here with no lock
+   * held. */
+  (void)*(volatile byte_t *)((uptr_t)__builtin_frame_address(0) -
+                             _TAB_LOCK_STACK);
+  sched_preempt_disable();
+  while (cpu_atomic_bit_test_and_set(
+      _tab_entry_word(entry), _TAB_ENTRY_BIT_LOCK)) {
+    cpu_relax();
+  }
+}
+
+base_private void _tab_unlock(tab_entry_t *entry)
+{
+  cpu_atomic_bit_clear(_tab_entry_word(entry), _TAB_ENTRY_BIT_LOCK);
+  sched_preempt_enable();
+}
+
+/* Install a zeroed table as next level of @entry. Multiple CPUs may race to
+ * install a table for the same entry, the table is zeroed before it is
+ * published, so that walkers never see garbage in it. Losers of the race give
+ * their frame back. */
+base_private void _tab_install(tab_entry_t *entry, tab_lev_t level)
+{
+  tab_entry_t val;
+  byte_t *frame;
+  bo_t ok;
+
+  frame = NULL;
+  ok = mem_frame_alloc(&frame);
+  kernel_assert(ok);
+  kernel_assert(frame != NULL);
+  _tab_zero((tab_entry_t *)frame);
+
+  _tab_entry_init(&val, level, true, true, (uptr_t)frame, PAGE_SIZE_4K);
+  ok = cpu_atomic_cas(_tab_entry_word(entry), 0, _tab_entry_bits(val));
+  if (ok) {
+    cpu_atomic_fetch_add(&_tab_frame_cnt, 1);
+  } else {
+    mem_frame_free(frame);
+  }
+  kernel_assert(_tab_entry_present(entry));
+}
+
+/* Walk the page table hierarchy for @va, install missing tables on the way.
+ * @return Level 2 entry pointing to level 1 table of @va. */
+base_private tab_entry_t *_tab_walk(tab_entry_t *root, uptr_t va)
 {
   tab_entry_t *tab;
-  u16_t entry_idx;
   tab_entry_t *entry;
 
-  kernel_assert(mem_align_check(va, PAGE_SIZE_4K));
-  kernel_assert(mem_align_check(pa, PAGE_SIZE_4K));
-
   tab = root;
+  entry = NULL;
   for (tab_lev_t lv = _TAB_LEV_HIGHEST; lv > TAB_LEV_1; lv--) {
-    entry_idx = _tab_entry_idx(va, lv);
-    entry = &(tab[entry_idx]);
+    entry = &(tab[_tab_entry_idx(va, lv)]);
 
     if (!_tab_entry_present(entry)) {
-      bo_t ok;
-      byte_t *frame;
-
-      kernel_assert(_tab_entry_is_zero(entry));
-
-      frame = NULL;
-      ok = mem_frame_alloc(&frame);
-      kernel_assert(ok);
-      kernel_assert(frame != NULL);
-
-      _tab_entry_init(entry, lv, true, true, (uptr_t)frame, PAGE_SIZE_4K);
-      _tab_zero((tab_entry_t *)frame);
+      _tab_install(entry, lv);
     }
+    kernel_assert(!entry->huge);
 
     /* Iterate to next level of page table. */
     tab = (tab_entry_t *)_tab_entry_get_pa(entry);
   }
-
-  entry_idx = _tab_entry_idx(va, TAB_LEV_1);
-  entry = &(tab[entry_idx]);
-  kernel_assert(_tab_entry_is_zero(entry));
-  _tab_entry_init(entry, TAB_LEV_1, true, true, (uptr_t)pa, PAGE_SIZE_4K);
+  return entry;
 }
 
 base_private void _map_impl(tab_entry_t *root, /*Root of page table hierachy */
@@ -248,24 +297,76 @@ base_private void _map_impl(tab_entry_t *root, /*Root of page table hierachy */
 {
   u64_t pa_idx;
   u64_t pa_page;
+  tab_entry_t *locked;
+  tab_entry_t *tab;
+  tab_entry_t *entry;
+
   kernel_assert(mem_align_check(va, PAGE_SIZE_4K));
   kernel_assert_d(n_pg == pa_list_n_page(pa));
 
   pa_idx = 0;
   pa_page = 0;
+  locked = NULL;
+  tab = NULL;
   for (u64_t i = 0; i < n_pg;) {
     kernel_assert_d(pa_idx < pa_list_n_range(pa));
     if (pa_page < pa_list_range_n_page(pa, pa_idx)) {
       uptr_t pg_va = va + i * PAGE_SIZE_4K;
       uptr_t pg_pa = pa_list_range_pa(pa, pa_idx) + pa_page * PAGE_SIZE_4K;
-      _map_page(root, pg_va, pg_pa);
+
+      /* Hold the lock of a level 1 table for all pages mapped by it. */
+      if (locked == NULL) {
+        locked = _tab_walk(root, pg_va);
+        _tab_lock(locked);
+        tab = (tab_entry_t *)_tab_entry_get_pa(locked);
+      }
+
+      entry = &(tab[_tab_entry_idx(pg_va, TAB_LEV_1)]);
+      kernel_assert(_tab_entry_is_zero(entry));
+      _tab_entry_init(entry, TAB_LEV_1, true, true, pg_pa, PAGE_SIZE_4K);
       i++;
       pa_page++;
+
+      if (i == n_pg || mem_align_check(pg_va + PAGE_SIZE_4K, PAGE_SIZE_2M)) {
+        _tab_unlock(locked);
+        locked = NULL;
+        tab = NULL;
+      }
     } else {
       pa_idx++;
       pa_page = 0;
     }
   }
+  kernel_assert(locked == NULL);
+}
+
+/* Like @_tab_walk, but never installs tables.
+ * @return Level 2 entry of @va, or NULL if @va is not covered by any level 1
+ * table. */
+base_private tab_entry_t *_tab_lookup(tab_entry_t *root, uptr_t va)
+{
+  tab_entry_t *tab;
+  tab_entry_t *entry;
+
+  tab = root;
+  entry = NULL;
+  for (tab_lev_t lv = _TAB_LEV_HIGHEST; lv > TAB_LEV_1 && tab != NULL; lv--) {
+    entry = &(tab[_tab_entry_idx(va, lv)]);
+
+    if (_tab_entry_present(entry)) {
+      kernel_assert(!entry->huge);
+      tab = (tab_entry_t *)_tab_entry_get_pa(entry);
+    } else {
+      tab = NULL;
+      entry = NULL;
+    }
+  }
+  return entry;
+}
+
+ucnt_t mem_page_tab_frame_cnt(void)
+{
+  return cpu_atomic_load(&_tab_frame_cnt);
 }
 
 void mem_page_map(uptr_t va, /* Start of virtual address to be mapped */
@@ -277,6 +378,187 @@ void mem_page_map(uptr_t va, /* Start of virtual address to be mapped */
   _map_impl(_tab_4, va, n_pg, pa);
 }
 
+base_private bo_t _map_one(uptr_t va, uptr_t pa, bo_t no_cache)
+{
+  tab_entry_t *locked;
+  tab_entry_t *entry;
+  bo_t ok;
+
+  kernel_assert_d(boot_stage >= MEM_BOOTSTRAP_STAGE_2);
+  kernel_assert(mem_align_check(va, PAGE_SIZE_4K));
+  kernel_assert(mem_align_check(pa, PAGE_SIZE_4K));
+
+  locked = _tab_walk(_tab_4, va);
+  _tab_lock(locked);
+  entry = (tab_entry_t *)_tab_entry_get_pa(locked);
+  entry = &(entry[_tab_entry_idx(va, TAB_LEV_1)]);
+  ok = _tab_entry_is_zero(entry);
+  if (ok) {
+    _tab_entry_init(entry, TAB_LEV_1, true, true, pa, PAGE_SIZE_4K);
+    if (no_cache) {
+      entry->no_cache = 1;
+      entry->write_through = 1;
+    }
+  }
+  _tab_unlock(locked);
+  if (ok) {
+    trace_page_map(va, pa, 1);
+  }
+  return ok;
+}
+
+base_must_check bo_t mem_page_map_one(uptr_t va, uptr_t pa)
+{
+  return _map_one(va, pa, false);
+}
+
+base_must_check uptr_t mem_mmio_map(uptr_t pa, usz_t len)
+{
+  uptr_t pa_0;
+  uptr_t va;
+  ucnt_t n_pg;
+  bo_t ok;
+
+  pa_0 = mem_align_down(pa, PAGE_SIZE_4K);
+  n_pg = (mem_align_up(pa + len, PAGE_SIZE_4K) - pa_0) / PAGE_SIZE_4K;
+  ok = mem_va_alloc(n_pg, &va);
+  if (ok) {
+    for (ucnt_t i = 0; i < n_pg; i++) {
+      ok = _map_one(va + i * PAGE_SIZE_VALUE_4K,
+          pa_0 + i * PAGE_SIZE_VALUE_4K, true);
+      kernel_assert(ok);
+    }
+    va += pa - pa_0;
+  } else {
+    va = 0;
+  }
+  return va;
+}
+
+/* Only TLB of current CPU is flushed. */
+uptr_t mem_page_unmap_one(uptr_t va)
+{
+  tab_entry_t *locked;
+  tab_entry_t *entry;
+  uptr_t pa;
+
+  kernel_assert_d(boot_stage >= MEM_BOOTSTRAP_STAGE_2);
+  kernel_assert(mem_align_check(va, PAGE_SIZE_4K));
+
+  pa = 0;
+  locked = _tab_lookup(_tab_4, va);
+  if (locked != NULL) {
+    _tab_lock(locked);
+    entry = (tab_entry_t *)_tab_entry_get_pa(locked);
+    entry = &(entry[_tab_entry_idx(va, TAB_LEV_1)]);
+    if (_tab_entry_present(entry)) {
+      pa = _tab_entry_get_pa(entry);
+      *(u64_t *)entry = 0;
+      cpu_invlpg(va);
+    }
+    _tab_unlock(locked);
+  }
+  return pa;
+}
+
+/* Past this many pages, flushing whole TLB is cheaper than page by page. */
+#define _TLB_FLUSH_ALL_PG 32
+
+typedef struct {
+  uptr_t va;
+  ucnt_t n_pg;
+} tlb_range_t;
+
+base_private void _tlb_flush(vptr_t arg)
+{
+  tlb_range_t *range = arg;
+
+  if (range->n_pg > _TLB_FLUSH_ALL_PG) {
+    cpu_write_cr3(cpu_read_cr3());
+  } else {
+    for (ucnt_t i = 0; i < range->n_pg; i++) {
+      cpu_invlpg(range->va + i * PAGE_SIZE_VALUE_4K);
+    }
+  }
+}
+
+void mem_tlb_shootdown(uptr_t va, ucnt_t n_pg)
+{
+  tlb_range_t range;
+
+  kernel_assert(mem_align_check(va, PAGE_SIZE_4K));
+  range.va = va;
+  range.n_pg = n_pg;
+  smp_call_function_many(U64_MAX, _tlb_flush, &range);
+}
+
+void mem_page_unmap_free(uptr_t va, ucnt_t n_pg)
+{
+  uptr_t frames;
+  uptr_t pa;
+
+  /* Frames are chained through their first word, reached at their physical
+   * addresses. */
+  frames = 0;
+  for (ucnt_t i = 0; i < n_pg; i++) {
+    pa = mem_page_unmap_one(va + i * PAGE_SIZE_VALUE_4K);
+    if (pa != 0) {
+      *(uptr_t *)pa = frames;
+      frames = pa;
+    }
+  }
+
+  /* Other CPUs may still cache translations of the pages, whoever reuses the
+   * addresses would write through them into frames owned by someone else. */
+  mem_tlb_shootdown(va, n_pg);
+  while (frames != 0) {
+    pa = frames;
+    frames = *(uptr_t *)pa;
+    mem_frame_free((byte_t *)pa);
+  }
+}
+
+base_must_check uptr_t mem_pages_alloc(ucnt_t n_pg)
+{
+  byte_t *frame;
+  uptr_t va;
+  ucnt_t i;
+  bo_t ok;
+
+  ok = mem_va_alloc(n_pg, &va);
+  if (ok) {
+    for (i = 0; i < n_pg; i++) {
+      frame = NULL;
+      ok = mem_frame_alloc(&frame);
+      if (!ok) {
+        break;
+      }
+      ok = mem_page_map_one(va + i * PAGE_SIZE_VALUE_4K, (uptr_t)frame);
+      kernel_assert(ok);
+    }
+    if (!ok) {
+      /* Pages never touched by any CPU yet, flushing the local TLB is
+       * enough. */
+      while (i > 0) {
+        i--;
+        mem_frame_free((byte_t *)mem_page_unmap_one(
+            va + i * PAGE_SIZE_VALUE_4K));
+      }
+      mem_va_free(va, n_pg);
+      va = 0;
+    }
+  } else {
+    va = 0;
+  }
+  return va;
+}
+
+void mem_pages_free(uptr_t va, ucnt_t n_pg)
+{
+  mem_page_unmap_free(va, n_pg);
+  mem_va_free(va, n_pg);
+}
+
 void mem_page_bootstrap_2(void)
 {
   uptr_t ker_0_va;
@@ -318,3 +600,118 @@ void mem_page_bootstrap_2(void)
 
   _tab_load_root(_tab_4);
 }
+
+#ifdef BUILD_SELF_TEST_ENABLED
+
+/* Pages each thread maps in a range of 2MB. */
+#define _TEST_PG 32
+#define _TEST_ROUNDS 2
+#define _TEST_RANGE_PG (PAGE_SIZE_2M / PAGE_SIZE_4K)
+
+/* A shared 2MB range, followed by a range of each thread. */
+base_private uptr_t _test_va;
+base_private u64_t _test_threads;
+base_private volatile u64_t _test_running;
+
+/* Page @k of thread @t, interleaved with other threads in shared range. */
+base_private uptr_t _test_page(u64_t t, u64_t k, bo_t shared)
+{
+  uptr_t va;
+
+  if (shared) {
+    va = _test_va + (k * _test_threads + t) * PAGE_SIZE_4K;
+  } else {
+    va = _test_va + (t + 1) * PAGE_SIZE_2M + k * PAGE_SIZE_4K;
+  }
+  return va;
+}
+
+base_private u64_t _test_word(u64_t t, u64_t k, u64_t round, bo_t shared)
+{
+  return (round << 48) | ((u64_t)shared << 40) | (t << 16) | k;
+}
+
+/* Map pages of both ranges with frames allocated meanwhile by other CPUs,
+ * and check no frame or page table entry is taken twice. */
+base_private void _test_map(vptr_t arg)
+{
+  u64_t t = (u64_t)arg;
+  u64_t n_shared;
+  u64_t *word;
+  byte_t *frame;
+  uptr_t va;
+  uptr_t pa;
+  bo_t ok;
+
+  n_shared = _TEST_RANGE_PG / _test_threads;
+  if (n_shared > _TEST_PG) {
+    n_shared = _TEST_PG;
+  }
+  for (u64_t round = 0; round < _TEST_ROUNDS; round++) {
+    for (u64_t k = 0; k < _TEST_PG * 2; k++) {
+      if (k % 2 == 0 || k / 2 < n_shared) {
+        va = _test_page(t, k / 2, k % 2 != 0);
+        frame = NULL;
+        ok = mem_frame_alloc(&frame);
+        kernel_assert(ok);
+        ok = mem_page_map_one(va, (uptr_t)frame);
+        kernel_assert(ok);
+        *(u64_t *)va = _test_word(t, k / 2, round, k % 2 != 0);
+      }
+    }
+    for (u64_t k = 0; k < _TEST_PG * 2; k++) {
+      if (k % 2 == 0 || k / 2 < n_shared) {
+        va = _test_page(t, k / 2, k % 2 != 0);
+        word = (u64_t *)va;
+        kernel_assert(*word == _test_word(t, k / 2, round, k % 2 != 0));
+        pa = mem_page_unmap_one(va);
+        /* Frames are reached at their physical addresses as well. */
+        kernel_assert(pa != 0 && *(u64_t *)pa == *word);
+        mem_frame_free((byte_t *)pa);
+      }
+    }
+  }
+  cpu_atomic_fetch_add(&_test_running, U64_MAX);
+}
+
+/* Threads on every CPU map pages in a 2MB range of their own, and in one
+ * shared by all of them, racing to install tables and take table locks. */
+void test_mem_page(void)
+{
+  sched_thread_t *thread;
+  ucnt_t n_pg;
+  uptr_t va;
+  u64_t t;
+  bo_t ok;
+
+  _test_threads = 0;
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (sched_cpu_online(i)) {
+      _test_threads++;
+    }
+  }
+
+  /* Room to align ranges to 2MB, so that they get level 1 tables of their
+   * own. */
+  n_pg = (_test_threads + 2) * _TEST_RANGE_PG;
+  ok = mem_va_alloc(n_pg, &va);
+  kernel_assert(ok);
+  _test_va = mem_align_up(va, PAGE_SIZE_2M);
+
+  _test_running = _test_threads;
+  t = 0;
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (sched_cpu_online(i)) {
+      thread = sched_thread_new("mem_page_test", _test_map, (vptr_t)t, i);
+      kernel_assert(thread != NULL);
+      t++;
+    }
+  }
+  while (cpu_atomic_load(&_test_running) != 0) {
+    sched_yield();
+  }
+  mem_va_free(va, n_pg);
+
+  log_builtin_test_pass();
+}
+#endif
@@ -21,21 +21,17 @@ typedef enum {
  |VA_48_LOW_END              |0x00007FFFFFFFFFFF     |
  +---------------------------+-----------------------+
  |VA_48_HIGH_START           |0xFFFF800000000000     |
- |(VA_48_STACK_BP_TOP_GUARD) |                       |
  +---------------------------+-----------------------+
- |VA_48_STACK_BP_TOP         |+1 page                |
- +---------------------------+-----------------------+
- |VA_48_STACK_BP_BOTTOM      |+253 pages             |
- +---------------------------+-----------------------+
- |VA_48_STACK_BP_BOTTOM_GUARD|+1 page                |
- +---------------------------+-----------------------+
- |VA_48_FRAME_BUFFER         |+1 page                |
+ |VA_48_FRAME_BUFFER         |+256 pages             |
  +---------------------------+-----------------------+
  |VA_48_PCIE_CFG_START       |High start + 4096 pages|
  +---------------------------+-----------------------+
- |VA_48_GRIP_PAGE            |+1M pages              |
+ |VA_48_VMAP_START           |+1M pages              |
  |(VA_48_PCIE_CFG_END)       |                       |
  +---------------------------+-----------------------+
+ |VA_48_GRIP_PAGE            |+256K pages            |
+ |(VA_48_VMAP_END)           |                       |
+ +---------------------------+-----------------------+
  |VA_48_HEAP                 |+1 pages               |
  +---------------------------+-----------------------+
  |VA_48_HIGH_END             |0xFFFFFFFFFFFFFFFF     |
@@ -44,17 +40,16 @@ typedef enum {
 #define VA_48_LOW_START u64_literal(0)
 #define VA_48_LOW_END u64_literal(0x00007FFFFFFFFFFF)
 #define VA_48_HIGH_START u64_literal(0xFFFF800000000000)
-#define VA_48_STACK_TOP_GUARD VA_48_HIGH_START
-#define VA_48_STACK_TOP (VA_48_HIGH_START + PAGE_SIZE_VALUE_4K)
-/* x86 stack grows downward, so this is the page start of the stack bottom. */
-#define VA_48_STACK_BOTTOM (VA_48_STACK_TOP + 253 * PAGE_SIZE_VALUE_4K)
-#define VA_48_STACK_BOTTOM_GUARD (VA_48_STACK_BOTTOM + PAGE_SIZE_VALUE_4K)
-#define VA_48_FRAME_BUFFER (VA_48_STACK_BOTTOM_GUARD + PAGE_SIZE_VALUE_4K)
+#define VA_48_FRAME_BUFFER (VA_48_HIGH_START + 256 * PAGE_SIZE_VALUE_4K)
 #define VA_48_FRAME_BUFFER_END (VA_48_HIGH_START + 4096 * PAGE_SIZE_VALUE_4K)
 #define VA_48_PCIE_CFG_START VA_48_FRAME_BUFFER_END
 #define VA_48_PCIE_CFG_END                                                     \
   (VA_48_PCIE_CFG_START + u64_literal(1024) * 1024 * PAGE_SIZE_VALUE_4K)
-#define VA_48_GRIP_PAGE VA_48_PCIE_CFG_END
+/* Virtual addresses handed out by mem_va_alloc, kernel stacks live here. */
+#define VA_48_VMAP_START VA_48_PCIE_CFG_END
+#define VA_48_VMAP_END                                                         \
+  (VA_48_VMAP_START + u64_literal(256) * 1024 * PAGE_SIZE_VALUE_4K)
+#define VA_48_GRIP_PAGE VA_48_VMAP_END
 #define VA_48_HEAP (VA_48_GRIP_PAGE + PAGE_SIZE_VALUE_4K)
 #define VA_48_HIGH_END u64_literal(0xFFFFFFFFFFFFFFFF)
 
@@ -62,12 +57,37 @@ typedef enum {
   MEM_BOOTSTRAP_STAGE_0 = 0,
   MEM_BOOTSTRAP_STAGE_1 = 1,
   MEM_BOOTSTRAP_STAGE_2 = 2,
-  MEM_BOOTSTRAP_STAGE_3 = 2,
+  MEM_BOOTSTRAP_STAGE_3 = 3,
   MEM_BOOTSTRAP_STAGE_FINISH = 99,
 } mem_bootstrap_stage_t;
 
 typedef struct mem_heap mem_heap_t;
 
+/*
+ * Multiboot ELF sections, Reference:
+ * https://en.wikipedia.org/wiki/Executable_and_Linkable_Format#Section_header
+ */
+typedef struct mb_elf_sec_entry {
+  uint32_t name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t addr;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+  uint32_t info;
+  uint64_t alignment;
+  uint64_t entry_size;
+} base_struct_packed mb_elf_sec_entry_t;
+
+/* Multiboot ELF sections tag. */
+typedef struct mb_tag_elf_secs {
+  uint32_t num;
+  uint32_t section_size;
+  uint32_t shndx;
+  mb_elf_sec_entry_t sections[];
+} base_struct_packed mb_tag_elf_secs_t;
+
 void mem_frame_bootstrap_1(const byte_t *mb_elf,
     usz_t mb_elf_len,
     const byte_t *mb_mmap,
@@ -78,6 +98,8 @@ void mem_frame_bootstrap_2(void);
 void mem_frame_bootstrap_3(void);
 
 base_must_check bo_t mem_frame_alloc(byte_t **out_frame);
+/* Give back a frame allocated by @mem_frame_alloc. */
+void mem_frame_free(byte_t *frame);
 
 /* Initialize memory heap on a preallocated memroy area. 
  * @return true for succ, or false for failure. */
@@ -100,6 +122,28 @@ bo_t mem_pa_range_valid(uptr_t start, uptr_t end);
 bo_t pa_range_overlaps(uptr_t a1, usz_t len1, uptr_t a2, usz_t len2);
 uptr_t mem_pa_ker_start(void);
 uptr_t mem_pa_ker_end(void);
+const mb_tag_elf_secs_t *mem_ker_elf_secs(void);
+/* Frames taken from bootstrap frame pool so far. */
+ucnt_t mem_frame_bootstrap_used(void);
+ucnt_t mem_frame_bootstrap_cap(void);
+/* Frames used by page tables, root tables excluded. */
+ucnt_t mem_page_tab_frame_cnt(void);
+
+/* Map a single page, safe to be called from page fault handler.
+ * @return false if @va is already mapped. */
+base_must_check bo_t mem_page_map_one(uptr_t va, uptr_t pa);
+/* Unmap a single page and flush its TLB entry.
+ * @return Physical address @va was mapped to, or 0 if it was not mapped. */
+uptr_t mem_page_unmap_one(uptr_t va);
+/* Flush TLB entries of @n_pg pages since @va on every CPU online, before the
+ * pages or their frames are reused. IRQs must be enabled. */
+void mem_tlb_shootdown(uptr_t va, ucnt_t n_pg);
+/* Unmap @n_pg pages since @va, pages not mapped are skipped, and give back
+ * their frames once TLB of every CPU is flushed. IRQs must be enabled. */
+void mem_page_unmap_free(uptr_t va, ucnt_t n_pg);
+
+void mem_va_bootstrap_3(void);
+void mem_stack_bootstrap_3(void);
 
 pa_list_t *pa_list_new_bootstrap(u64_t n_range);
 void pa_list_free_bootstrap(pa_list_t *list);
@@ -0,0 +1,301 @@
+/* Kernel stacks.
+ *
+ * Virtual addresses of a stack are reserved from mem_va_alloc with a guard
+ * page at each end, but frames are only mapped when pages are touched, by
+ * page fault handler. So a stack only costs memory as deep as it actually
+ * goes, and an overflow faults on guard page instead of corrupting memory
+ * below it. Page faults are handled on their own IST stack, see interrupts.c.
+ *
+ * Stack pages are zeroed when mapped, so peak depth of a stack is found by
+ * scanning for the lowest non zero word. */
+#include "containers_string.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem_private.h"
+#include "sync.h"
+
+#define _STACK_CAP 256
+/* Pages mapped below the faulting one. An interrupt frame pushed right below
+ * current stack pointer then never lands on a page not backed yet, which can
+ * not be resolved while delivering the interrupt. */
+#define _STACK_PREFAULT_PG 1
+/* Error code bit of page fault, set for protection violations. */
+#define _PF_ERR_PRESENT 1
+
+struct mem_stack {
+  const ch_t *name;
+  uptr_t va;                /* Start of reserved range, the lower guard page */
+  ucnt_t n_pg;              /* Usable pages, guard pages excluded */
+  volatile u64_t n_mapped;  /* Pages backed so far */
+  volatile u64_t lowest;    /* Lowest page backed */
+  bo_t used;
+};
+
+base_private mem_stack_t _stacks[_STACK_CAP];
+/* Protects allocating of @_stacks. */
+base_private sync_spin_t _lock = SYNC_SPIN_INIT("mem_stack");
+/* Deepest usage among stacks already freed. */
+base_private usz_t _depth_peak_freed;
+
+/* Lowest usable address of @stack. */
+base_private uptr_t _stack_top(mem_stack_t *stack)
+{
+  return stack->va + PAGE_SIZE_VALUE_4K;
+}
+
+uptr_t mem_stack_bottom(mem_stack_t *stack)
+{
+  return _stack_top(stack) + stack->n_pg * PAGE_SIZE_VALUE_4K;
+}
+
+/* Back page @pg of @stack with a zeroed frame, if not yet. */
+base_private void _stack_back(mem_stack_t *stack, uptr_t pg)
+{
+  byte_t *frame;
+  bo_t ok;
+
+  kernel_assert_d(pg >= _stack_top(stack) && pg < mem_stack_bottom(stack));
+
+  frame = NULL;
+  ok = mem_frame_alloc(&frame);
+  if (!ok) {
+    kernel_panic("Out of frames for kernel stack");
+  }
+  mem_clean(frame, PAGE_SIZE_VALUE_4K);
+  if (mem_page_map_one(pg, (uptr_t)frame)) {
+    cpu_atomic_fetch_add(&stack->n_mapped, 1);
+    for (u64_t low = cpu_atomic_load(&stack->lowest); pg < low;
+         low = cpu_atomic_load(&stack->lowest)) {
+      if (cpu_atomic_cas(&stack->lowest, low, pg)) {
+        break;
+      }
+    }
+  } else {
+    mem_frame_free(frame);
+  }
+}
+
+/* Back @pg and a few pages below it. */
+base_private void _stack_grow(mem_stack_t *stack, uptr_t pg)
+{
+  for (ucnt_t i = 0; i <= _STACK_PREFAULT_PG; i++) {
+    if (pg < _stack_top(stack)) {
+      break;
+    }
+    _stack_back(stack, pg);
+    pg -= PAGE_SIZE_VALUE_4K;
+  }
+}
+
+/* @return Stack whose reserved range covers @va, or NULL. */
+base_private mem_stack_t *_stack_of(uptr_t va)
+{
+  mem_stack_t *res;
+  mem_stack_t *s;
+
+  res = NULL;
+  for (usz_t i = 0; i < _STACK_CAP; i++) {
+    s = &_stacks[i];
+    if (s->used && va >= s->va &&
+        va < s->va + (s->n_pg + 2) * PAGE_SIZE_VALUE_4K) {
+      res = s;
+      break;
+    }
+  }
+  return res;
+}
+
+base_private void _stack_fault_panic(
+    const ch_t *what, const ch_t *name, uptr_t va, intr_parameters_t *para)
+{
+  const usz_t MSG_CAP = 160;
+  ch_t msg[MSG_CAP];
+  usz_t msg_len;
+
+  msg_len = 0;
+  msg_len += str_buf_marshal_str(msg, msg_len, MSG_CAP, what, str_len(what));
+  msg_len += str_buf_marshal_str(msg, msg_len, MSG_CAP, name, str_len(name));
+  msg_len += str_buf_marshal_str(msg, msg_len, MSG_CAP, ", address: ", 11);
+  msg_len += str_buf_marshal_uint(msg, msg_len, MSG_CAP, va);
+  msg_len += str_buf_marshal_str(msg, msg_len, MSG_CAP, ", error code: ", 14);
+  msg_len += str_buf_marshal_uint(msg, msg_len, MSG_CAP, intr_error_code(para));
+  msg_len += str_buf_marshal_str(msg, msg_len, MSG_CAP, ", ip: ", 6);
+  msg_len += str_buf_marshal_uint(msg, msg_len, MSG_CAP, intr_fault_ip(para));
+  msg_len += str_buf_marshal_terminator(msg, msg_len, MSG_CAP);
+  kernel_panic(msg);
+}
+
+base_private void _stack_fault(intr_id_t id, intr_parameters_t *para)
+{
+  mem_stack_t *stack;
+  uptr_t va;
+  uptr_t pg;
+
+  kernel_assert(id == INTR_ID_EX_FAULT_PF);
+  va = cpu_read_cr2();
+  pg = mem_align_down(va, PAGE_SIZE_VALUE_4K);
+  stack = _stack_of(va);
+
+  if (stack == NULL || (intr_error_code(para) & _PF_ERR_PRESENT) != 0) {
+    _stack_fault_panic("Page fault", "", va, para);
+  } else if (pg < _stack_top(stack) || pg >= mem_stack_bottom(stack)) {
+    _stack_fault_panic("Kernel stack overflow: ", stack->name, va, para);
+  } else {
+    _stack_grow(stack, pg);
+  }
+}
+
+base_must_check mem_stack_t *mem_stack_new(const ch_t *name, ucnt_t n_pg)
+{
+  mem_stack_t *stack;
+  uptr_t va;
+  bo_t ok;
+
+  kernel_assert(boot_stage >= MEM_BOOTSTRAP_STAGE_3);
+  kernel_assert(n_pg > _STACK_PREFAULT_PG);
+
+  stack = NULL;
+  ok = mem_va_alloc(n_pg + 2, &va);
+  if (ok) {
+    sync_spin_lock(&_lock);
+    for (usz_t i = 0; i < _STACK_CAP; i++) {
+      if (!_stacks[i].used) {
+        stack = &_stacks[i];
+        stack->name = name;
+        stack->va = va;
+        stack->n_pg = n_pg;
+        stack->n_mapped = 0;
+        stack->lowest = va + (n_pg + 1) * PAGE_SIZE_VALUE_4K;
+        stack->used = true;
+        break;
+      }
+    }
+    sync_spin_unlock(&_lock);
+
+    if (stack == NULL) {
+      mem_va_free(va, n_pg + 2);
+    } else {
+      /* Where execution starts, faulting here is just a waste. */
+      _stack_grow(stack, mem_stack_bottom(stack) - PAGE_SIZE_VALUE_4K);
+    }
+  }
+  return stack;
+}
+
+void mem_stack_free(mem_stack_t *stack)
+{
+  uptr_t va;
+  ucnt_t n_pg;
+  usz_t depth;
+
+  kernel_assert(stack->used);
+
+  depth = mem_stack_depth_peak(stack);
+  va = stack->va;
+  n_pg = stack->n_pg;
+
+  /* Slot is released before its addresses, so that page fault handler never
+   * takes a stack for addresses reused by another one. The slot may be
+   * reused at once, only copies of its fields are used below. */
+  sync_spin_lock(&_lock);
+  if (depth > _depth_peak_freed) {
+    _depth_peak_freed = depth;
+  }
+  stack->used = false;
+  sync_spin_unlock(&_lock);
+
+  mem_page_unmap_free(va + PAGE_SIZE_VALUE_4K, n_pg);
+  mem_va_free(va, n_pg + 2);
+}
+
+usz_t mem_stack_depth_peak(mem_stack_t *stack)
+{
+  u64_t *word;
+  u64_t *end;
+
+  /* Pages between lowest backed one and bottom are almost always backed, as
+   * stack grows downward. A function with a frame larger than a page may
+   * skip one, scanning it then just backs it. */
+  end = (u64_t *)mem_stack_bottom(stack);
+  word = (u64_t *)cpu_atomic_load(&stack->lowest);
+  while (word < end && *word == 0) {
+    word++;
+  }
+  return (usz_t)((uptr_t)end - (uptr_t)word);
+}
+
+ucnt_t mem_stack_mapped_pages(mem_stack_t *stack)
+{
+  return cpu_atomic_load(&stack->n_mapped);
+}
+
+void mem_stack_report(void)
+{
+  mem_stack_t *s;
+
+  for (usz_t i = 0; i < _STACK_CAP; i++) {
+    s = &_stacks[i];
+    if (s->used) {
+      log_line_format(LOG_LEVEL_INFO,
+          "Stack %s: reserved %lu KB, backed %lu KB, peak depth %lu bytes",
+          s->name, s->n_pg * PAGE_SIZE_VALUE_4K / 1024,
+          mem_stack_mapped_pages(s) * PAGE_SIZE_VALUE_4K / 1024,
+          mem_stack_depth_peak(s));
+    }
+  }
+  log_line_format(LOG_LEVEL_INFO, "Stacks freed, peak depth %lu bytes",
+      _depth_peak_freed);
+}
+
+void mem_stack_bootstrap_3(void)
+{
+  kernel_assert(boot_stage == MEM_BOOTSTRAP_STAGE_2);
+  intr_handler_register(INTR_ID_EX_FAULT_PF, _stack_fault);
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+base_private void _test_recurse(vptr_t arg)
+{
+  volatile byte_t buf[512];
+  ucnt_t *left = (ucnt_t *)arg;
+
+  buf[0] = 1;
+  buf[sizeof(buf) - 1] = 1;
+  if (*left > 0) {
+    (*left)--;
+    _test_recurse(arg);
+  }
+}
+
+base_private void _test_lazy_backing(void)
+{
+  mem_stack_t *stack;
+  ucnt_t depth;
+  usz_t peak;
+
+  stack = mem_stack_new("test", 64);
+  kernel_assert(stack != NULL);
+  kernel_assert(mem_stack_mapped_pages(stack) == 1 + _STACK_PREFAULT_PG);
+  kernel_assert(mem_stack_depth_peak(stack) == 0);
+
+  depth = 16;
+  cpu_call_on_stack(mem_stack_bottom(stack), _test_recurse, &depth);
+  kernel_assert(depth == 0);
+
+  peak = mem_stack_depth_peak(stack);
+  kernel_assert(peak >= 16 * 512);
+  kernel_assert(peak <= mem_stack_mapped_pages(stack) * PAGE_SIZE_VALUE_4K);
+  /* Only pages touched, not all 64 pages reserved, are backed. */
+  kernel_assert(mem_stack_mapped_pages(stack) <
+                peak / PAGE_SIZE_VALUE_4K + 2 + _STACK_PREFAULT_PG);
+  mem_stack_free(stack);
+}
+
+void test_mem_stack(void)
+{
+  _test_lazy_backing();
+  log_builtin_test_pass();
+}
+#endif
@@ -0,0 +1,171 @@
+/* Kernel virtual address allocator.
+ *
+ * Hands out page ranges of [VA_48_VMAP_START, VA_48_VMAP_END), one bit per
+ * page. Only virtual addresses are managed here, callers decide when and how
+ * the pages get backed. */
+#include "cpu.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem_private.h"
+#include "sync.h"
+
+#define _PAGE_CNT ((VA_48_VMAP_END - VA_48_VMAP_START) / PAGE_SIZE_VALUE_4K)
+#define _WORD_BITS 64
+#define _WORD_CNT (_PAGE_CNT / _WORD_BITS)
+
+/* Bit set for pages allocated. */
+base_private u64_t _map[_WORD_CNT];
+/* Page to start searching from, ranges are handed out in address order until
+ * the end of region is reached, so that recently freed addresses are not
+ * reused immediately. */
+base_private u64_t _hint;
+base_private ucnt_t _used;
+base_private sync_spin_t _lock = SYNC_SPIN_INIT("mem_va");
+
+base_private void _va_lock(void)
+{
+  sync_spin_lock(&_lock);
+}
+
+base_private void _va_unlock(void)
+{
+  sync_spin_unlock(&_lock);
+}
+
+base_private bo_t _page_used(u64_t pg)
+{
+  return (_map[pg / _WORD_BITS] & (u64_literal(1) << (pg % _WORD_BITS))) != 0;
+}
+
+base_private void _pages_set(u64_t pg, ucnt_t n_pg, bo_t used)
+{
+  for (u64_t i = pg; i < pg + n_pg; i++) {
+    kernel_assert_d(_page_used(i) != used);
+    if (used) {
+      _map[i / _WORD_BITS] |= u64_literal(1) << (i % _WORD_BITS);
+    } else {
+      _map[i / _WORD_BITS] &= ~(u64_literal(1) << (i % _WORD_BITS));
+    }
+  }
+}
+
+/* First fit search of @n_pg free pages in [@from, @to).
+ * @return First page of the range, or @_PAGE_CNT if not found. */
+base_private u64_t _search(u64_t from, u64_t to, ucnt_t n_pg)
+{
+  u64_t run;
+  u64_t pg;
+  u64_t res;
+
+  res = _PAGE_CNT;
+  run = 0;
+  pg = from;
+  while (pg < to) {
+    if (_map[pg / _WORD_BITS] == U64_MAX) {
+      /* Skip full words quickly. */
+      run = 0;
+      pg = (pg / _WORD_BITS + 1) * _WORD_BITS;
+    } else if (_page_used(pg)) {
+      run = 0;
+      pg++;
+    } else {
+      run++;
+      pg++;
+      if (run == n_pg) {
+        res = pg - n_pg;
+        break;
+      }
+    }
+  }
+  return res;
+}
+
+base_must_check bo_t mem_va_alloc(ucnt_t n_pg, uptr_t *out_va)
+{
+  u64_t pg;
+  bo_t ok;
+
+  kernel_assert(n_pg > 0);
+
+  _va_lock();
+  pg = _search(_hint, _PAGE_CNT, n_pg);
+  if (pg == _PAGE_CNT) {
+    pg = _search(0, _PAGE_CNT, n_pg);
+  }
+  ok = pg != _PAGE_CNT;
+  if (ok) {
+    _pages_set(pg, n_pg, true);
+    _hint = pg + n_pg;
+    _used += n_pg;
+    *out_va = VA_48_VMAP_START + pg * PAGE_SIZE_VALUE_4K;
+  }
+  _va_unlock();
+  return ok;
+}
+
+void mem_va_free(uptr_t va, ucnt_t n_pg)
+{
+  kernel_assert(mem_align_check(va, PAGE_SIZE_4K));
+  kernel_assert(va >= VA_48_VMAP_START);
+  kernel_assert(va + n_pg * PAGE_SIZE_VALUE_4K <= VA_48_VMAP_END);
+
+  _va_lock();
+  _pages_set((va - VA_48_VMAP_START) / PAGE_SIZE_VALUE_4K, n_pg, false);
+  _used -= n_pg;
+  _va_unlock();
+}
+
+bo_t mem_va_owns(uptr_t va)
+{
+  return va >= VA_48_VMAP_START && va < VA_48_VMAP_END;
+}
+
+ucnt_t mem_va_used(void)
+{
+  return _used;
+}
+
+void mem_va_bootstrap_3(void)
+{
+  kernel_assert(boot_stage == MEM_BOOTSTRAP_STAGE_2);
+  for (usz_t i = 0; i < _WORD_CNT; i++) {
+    _map[i] = 0;
+  }
+  _hint = 0;
+  _used = 0;
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+base_private void _test_alloc_free(void)
+{
+  uptr_t a;
+  uptr_t b;
+  uptr_t c;
+  ucnt_t used;
+  bo_t ok;
+
+  used = mem_va_used();
+  ok = mem_va_alloc(3, &a);
+  kernel_assert(ok);
+  ok = mem_va_alloc(1, &b);
+  kernel_assert(ok);
+  kernel_assert(mem_va_owns(a) && mem_va_owns(b));
+  kernel_assert(b == a + 3 * PAGE_SIZE_VALUE_4K);
+  kernel_assert(mem_va_used() == used + 4);
+
+  mem_va_free(a, 3);
+  ok = mem_va_alloc(2, &c);
+  kernel_assert(ok);
+  /* Freed range is not reused immediately. */
+  kernel_assert(c == b + PAGE_SIZE_VALUE_4K);
+  mem_va_free(b, 1);
+  mem_va_free(c, 2);
+  kernel_assert(mem_va_used() == used);
+}
+
+void test_mem_va(void)
+{
+  _test_alloc_free();
+  log_builtin_test_pass();
+}
+#endif
@@ -1,6 +1,7 @@
 /* Memory management subsystem. */
 
 #include "containers_string.h"
+#include "cpu_info.h"
 #include "kernel_panic.h"
 #include "log.h"
 #include "mm_private.h"
@@ -38,9 +39,7 @@ base_private inline bo_t _math_is_pow2(u64_t n)
 
 void mm_copy(byte_t *dest, const byte_t *src, usz_t copy_len)
 {
-  for (usz_t i = 0; i < copy_len; i++) {
-    dest[i] = src[i];
-  }
+  cpu_mem_copy(dest, src, copy_len);
 }
 
 void mm_clean(vptr_t mem, usz_t size)
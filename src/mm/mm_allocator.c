@@ -52,7 +52,7 @@ mm_allocator_t *mm_allocator_new(void)
 
   if (all == NULL) {
     usz_t heap_len;
-    uptr_t heap = (uptr_t)mm_heap_alloc_minimum(&heap_len);
+    uptr_t heap = (uptr_t)mm_heap_block_alloc(1, &heap_len);
     all = (mm_allocator_t *)mm_align_up(heap, sizeof(mm_allocator_t *));
     kernel_assert_d(((uptr_t)all + sizeof(mm_allocator_t) - heap) <= heap_len);
 
@@ -75,6 +75,7 @@ mm_allocator_t *mm_allocator_new(void)
 
   _allocator_init(all);
 
+  mm_trace(MM_TRACE_OP_ALLOCATOR_NEW, all, 0, 1, NULL);
   return all;
 }
 
@@ -87,7 +88,7 @@ base_private area_t *_allocator_new_area(mm_allocator_t *all, usz_t block_min)
 
   need_size = block_min + sizeof(area_t) + sizeof(mm_allocator_t *);
 
-  area = mm_heap_alloc(need_size, &block_size);
+  area = mm_heap_block_alloc(need_size, &block_size);
   area->block = (byte_t *)((uptr_t)area + sizeof(area_t));
 
   guard =
@@ -145,12 +146,15 @@ vptr_t mm_allocate(mm_allocator_t *all, usz_t size, usz_t align)
 
   kernel_assert_d(area->use_len < area->block_len);
   kernel_assert_d(mm_align_check(ret, align));
+  mm_trace(MM_TRACE_OP_ALLOCATE, (vptr_t)ret, size, align, all);
   return (vptr_t)ret;
 }
 
 void mm_allocator_free(mm_allocator_t *all)
 {
   area_t *a = all->list;
+
+  mm_trace(MM_TRACE_OP_ALLOCATOR_FREE, all, 0, 1, NULL);
   while (a != NULL) {
     vptr_t free_ptr;
     mm_allocator_t **guard = (mm_allocator_t **)_area_block_end(a);
@@ -159,7 +163,7 @@ void mm_allocator_free(mm_allocator_t *all)
 
     free_ptr = a;
     a = a->prev_area;
-    mm_heap_free(free_ptr);
+    mm_heap_block_free(free_ptr);
   }
 
   all->list = NULL;
@@ -192,7 +196,7 @@ base_private bo_t _test_unit_free(test_allocator_unit_t *unit)
     mem = unit->mems[i];
     len = unit->mem_lens[i];
     by = (byte_t)(i % BYTE_MAX);
-    for (usz_t by_idx; by_idx < len; by_idx++) {
+    for (usz_t by_idx = 0; by_idx < len; by_idx++) {
       kernel_assert(mem[by_idx] == by);
     }
   }
@@ -2,6 +2,7 @@
 #include "kernel_panic.h"
 #include "log.h"
 #include "mm_private.h"
+#include "sync.h"
 
 /* Describes a section of available physical memory. */
 typedef struct {
@@ -40,6 +41,8 @@ base_private bo_t _is_early_stage;
  * Every 4K frame can be cast to frame_free_t and linked with next pointer. */
 base_private uptr_t _free_head;
 base_private ucnt_t _free_count;
+/* Protects free frame list, and the direct access mapping used to walk it. */
+base_private sync_spin_t _lock = SYNC_SPIN_INIT("mm_frame");
 
 /* Initialize avaliable physical memory sections according to Multiboot memory 
  * map. */
@@ -135,6 +138,7 @@ base_must_check bo_t mm_frame_alloc(uptr_t *out_frame)
 
   kernel_assert(!_is_early_stage);
 
+  sync_spin_lock(&_lock);
   if (_free_head == 0) {
     ok = false;
   } else {
@@ -149,6 +153,7 @@ base_must_check bo_t mm_frame_alloc(uptr_t *out_frame)
     mm_page_direct_access_reset();
     ok = true;
   }
+  sync_spin_unlock(&_lock);
   return ok;
 }
 
@@ -157,10 +162,11 @@ void mm_frame_free(byte_t *frame_va, uptr_t frame_pa)
   frame_free_t *free;
 
   free = (frame_free_t *)frame_va;
+  sync_spin_lock(&_lock);
   free->next = _free_head;
-
   _free_head = frame_pa;
   _free_count++;
+  sync_spin_unlock(&_lock);
 }
 
 ucnt_t mm_frame_free_count(void)
@@ -1,6 +1,8 @@
 #include "kernel_panic.h"
 #include "log.h"
 #include "mm_private.h"
+#include "sync.h"
+#include "trace.h"
 #include "util.h"
 
 /*
@@ -22,6 +24,8 @@ typedef struct block {
 
 base_private block_t *_free_list[_BLOCK_MAX_CLASS];
 base_private uptr_t _heap_end;
+/* Protects @_free_list and @_heap_end. */
+base_private sync_spin_t _lock = SYNC_SPIN_INIT("mm_heap");
 
 #ifdef BUILD_SELF_TEST_ENABLED
 
@@ -278,7 +282,7 @@ base_private block_t *_coalescing_block(block_t *block)
   return block;
 }
 
-vptr_t mm_heap_alloc(usz_t len, usz_t *all_len)
+vptr_t mm_heap_block_alloc(usz_t len, usz_t *all_len)
 {
   u8_t free_class;
   block_t *free;
@@ -296,6 +300,7 @@ vptr_t mm_heap_alloc(usz_t len, usz_t *all_len)
   }
   kernel_assert(free_class < _BLOCK_MAX_CLASS);
 
+  sync_spin_lock(&_lock);
   free = _free_list_dequeue(free_class);
 
   if (free == NULL) {
@@ -323,20 +328,48 @@ vptr_t mm_heap_alloc(usz_t len, usz_t *all_len)
   } else {
     kernel_assert_d(free == NULL);
   }
+  sync_spin_unlock(&_lock);
 
   return (byte_t *)free;
 }
 
+void mm_heap_block_free(vptr_t block_user)
+{
+  block_t *block;
+
+  sync_spin_lock(&_lock);
+  block = _block_check_in(block_user);
+  block = _coalescing_block(block);
+  _free_list_enqueue(block, block->class);
+  sync_spin_unlock(&_lock);
+}
+
+vptr_t mm_heap_alloc(usz_t len, usz_t *all_len)
+{
+  vptr_t block = mm_heap_block_alloc(len, all_len);
+  mm_trace(MM_TRACE_OP_HEAP_ALLOC, block, len, 1, NULL);
+  trace_heap_alloc(block, len);
+  return block;
+}
+
 vptr_t mm_heap_alloc_minimum(usz_t *all_len)
 {
-  return mm_heap_alloc(1, all_len);
+  vptr_t block = mm_heap_block_alloc(1, all_len);
+  mm_trace(MM_TRACE_OP_HEAP_ALLOC, block, 1, 1, NULL);
+  trace_heap_alloc(block, 1);
+  return block;
 }
 
 void mm_heap_free(vptr_t block_user)
 {
-  block_t *block = _block_check_in(block_user);
-  block = _coalescing_block(block);
-  _free_list_enqueue(block, block->class);
+  mm_trace(MM_TRACE_OP_HEAP_FREE, block_user, 0, 1, NULL);
+  trace_heap_free(block_user);
+  mm_heap_block_free(block_user);
+}
+
+usz_t mm_heap_mapped_len(void)
+{
+  return _heap_end - VA_48_HEAP;
 }
 
 void mm_heap_bootstrap(void)
@@ -454,6 +487,7 @@ base_private void _test_random_alloc_free(usz_t op_total, usz_t mems_cap)
 
   mems_cnt = 0;
   free_cnt = 0;
+  op = 0;
   len = 0;
   len_class = 0;
   for (usz_t i = 0; i < op_total; i++) {
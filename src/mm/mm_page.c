@@ -3,7 +3,10 @@
 #include "drivers_vesa.h"
 #include "kernel_panic.h"
 #include "log.h"
+#include "mem_tab_private.h"
 #include "mm_private.h"
+#include "sched.h"
+#include "smp.h"
 #include "video.h"
 
 typedef u64_t page_no_t;
@@ -34,6 +37,8 @@ typedef struct {
   bo_t no_exe : 1;
 } base_struct_packed tab_entry_t;
 
+MEM_TAB_ENTRY_HELPERS(tab_entry_t)
+
 #define _TAB_ENTRY_LEN 8
 #define _TAB_ENTRY_COUNT 512
 base_private tab_entry_t _tab_4[_TAB_ENTRY_COUNT] base_align(
@@ -41,6 +46,8 @@ base_private tab_entry_t _tab_4[_TAB_ENTRY_COUNT] base_align(
 
 base_private uptr_t _early_map_end;
 
+/* Each CPU has a direct access page of its own, so that CPUs mapping pages or
+ * allocating frames at the same time never overwrite each other's window. */
 base_private vptr_t _direct_vadd;
 /* Table entries to establish the direct mapping,
  * level 3..1 table entries here  */
@@ -51,6 +58,7 @@ base_private tab_entry_t *_direct_tab[3];
 base_private tab_entry_t *_direct_tab_entry;
 
 /* Forwarded declaration of functions */
+base_private usz_t _direct_cpu(void);
 base_private tab_entry_index_t _vadd_tab_index(uptr_t va, tab_level_t level);
 base_private bo_t _direct_access_is_reset(void);
 base_private usz_t _vadd_page_offset(uptr_t va, tab_level_t lv);
@@ -213,6 +221,9 @@ base_private bo_t _map_early(uptr_t va, uptr_t pa)
   return ok;
 }
 
+/* Intermediate tables and the leaf entry are installed with compare and swap,
+ * so concurrent mappers never overwrite each other's tables, and each of them
+ * reaches tables through the direct access page of its own CPU. */
 bo_t mm_page_map(uptr_t va, uptr_t pa)
 {
   uptr_t tab_pa;
@@ -224,6 +235,7 @@ bo_t mm_page_map(uptr_t va, uptr_t pa)
   bo_t present;
   uptr_t frame_pa;
   byte_t *frame_va;
+  tab_entry_t leaf;
 
   /* We only supports 4K sized pages */
   kernel_assert(mm_align_check(va, PAGE_SIZE_4K));
@@ -254,11 +266,18 @@ bo_t mm_page_map(uptr_t va, uptr_t pa)
     present = _tab_entry_is_present(entry);
 
     if (!present) {
-      kernel_assert(_tab_entry_is_zero(entry));
+      tab_entry_t val;
+
       kernel_assert(frame_pa != UPTR_NULL);
 
-      _tab_entry_init(entry, lv, true, true, frame_pa, PAGE_SIZE_4K);
-      frame_pa = UPTR_NULL;
+      /* Another CPU may install a table for the same entry at the same time,
+       * only one of us wins. The loser keeps its zeroed frame for next level,
+       * or gives it back at the end. */
+      _tab_entry_init(&val, lv, true, true, frame_pa, PAGE_SIZE_4K);
+      if (cpu_atomic_cas(_tab_entry_word(entry), 0, _tab_entry_bits(val))) {
+        frame_pa = UPTR_NULL;
+      }
+      kernel_assert(_tab_entry_is_present(entry));
     }
 
     tab_pa = _tab_entry_get_padd(entry);
@@ -274,8 +293,9 @@ bo_t mm_page_map(uptr_t va, uptr_t pa)
     entry_idx = _vadd_tab_index(va, TAB_LEVEL_1);
     entry = &(tab_va[entry_idx]);
 
-    kernel_assert(_tab_entry_is_zero(entry));
-    _tab_entry_init(entry, lv, true, true, (uptr_t)pa, PAGE_SIZE_4K);
+    _tab_entry_init(&leaf, lv, true, true, (uptr_t)pa, PAGE_SIZE_4K);
+    ok = cpu_atomic_cas(_tab_entry_word(entry), 0, _tab_entry_bits(leaf));
+    kernel_assert(ok); /* Mapping an already mapped page is a bug */
     mm_page_direct_access_reset();
   }
 
@@ -481,24 +501,41 @@ base_private void _init_direct_access(void)
   }
 
   en_idx = _vadd_tab_index((uptr_t)_direct_vadd, TAB_LEVEL_1);
+  kernel_assert(en_idx + SMP_CPU_MAX <= _TAB_ENTRY_COUNT);
   _direct_tab_entry = &(_direct_tab[TAB_LEVEL_1 - 1][en_idx]);
-  _tab_entry_zero(_direct_tab_entry);
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    _tab_entry_zero(_direct_tab_entry + i);
+  }
+}
+
+/* Only bootstrap processor runs before smp_bootstrap(). */
+base_private usz_t _direct_cpu(void)
+{
+  return smp_cpu_cnt() == 0 ? 0 : smp_cpu_idx();
 }
 
 vptr_t mm_page_direct_access_setup(uptr_t padd)
 {
+  tab_entry_t *entry;
+
   kernel_assert(mm_align_check(padd, PAGE_SIZE_4K));
-  kernel_assert(_tab_entry_is_zero(_direct_tab_entry));
-  _tab_entry_init(
-      _direct_tab_entry, TAB_LEVEL_1, true, true, padd, PAGE_SIZE_4K);
-  return _direct_vadd;
+  /* Window of current CPU is kept until reset. */
+  sched_preempt_disable();
+  entry = _direct_tab_entry + _direct_cpu();
+  kernel_assert(_tab_entry_is_zero(entry));
+  _tab_entry_init(entry, TAB_LEVEL_1, true, true, padd, PAGE_SIZE_4K);
+  return (byte_t *)_direct_vadd + _direct_cpu() * PAGE_SIZE_4K;
 }
 
 void mm_page_direct_access_reset(void)
 {
-  kernel_assert(_tab_entry_is_present(_direct_tab_entry));
-  _tab_entry_zero(_direct_tab_entry);
-  _tlb_flush(_direct_vadd);
+  tab_entry_t *entry;
+
+  entry = _direct_tab_entry + _direct_cpu();
+  kernel_assert(_tab_entry_is_present(entry));
+  _tab_entry_zero(entry);
+  _tlb_flush((byte_t *)_direct_vadd + _direct_cpu() * PAGE_SIZE_4K);
+  sched_preempt_enable();
 }
 
 /*
@@ -513,9 +550,10 @@ base_private uptr_t _direct_access_get_padd(vptr_t va)
 
 base_private bo_t _direct_access_is_reset(void)
 {
-  bo_t present = _tab_entry_is_present(_direct_tab_entry);
+  tab_entry_t *entry = _direct_tab_entry + _direct_cpu();
+  bo_t present = _tab_entry_is_present(entry);
   if (!present) {
-    kernel_assert(_tab_entry_is_zero(_direct_tab_entry));
+    kernel_assert(_tab_entry_is_zero(entry));
   }
   return present == false;
 }
@@ -2,6 +2,7 @@
 #define ___MM_PRIVATE
 
 #include "mm.h"
+#include "smp.h"
 
 #define PAGE_SIZE_VALUE_LOG_4K 12
 #define PAGE_SIZE_VALUE_4K 4096
@@ -35,7 +36,7 @@ typedef enum {
  |VA_48_DIRECT_ACCESS_PAGE   |+1M pages              |
  |(VA_48_PCIE_CFG_END)       |                       |
  +---------------------------+-----------------------+
- |VA_48_HEAP                 |+1 page                |
+ |VA_48_HEAP                 |+SMP_CPU_MAX pages     |
  +---------------------------+-----------------------+
  |VA_48_HIGH_END             |0xFFFFFFFFFFFFFFFF     |
  +---------------------------+-----------------------+
@@ -52,8 +53,15 @@ typedef enum {
 #define VA_48_PCIE_CFG_START (VA_48_HIGH_START + 4096 * PAGE_SIZE_VALUE_4K)
 #define VA_48_PCIE_CFG_END                                                     \
   (VA_48_PCIE_CFG_START + u64_literal(1024) * 1024 * PAGE_SIZE_VALUE_4K)
+/* Direct access page of each CPU. */
 #define VA_48_DIRECT_ACCESS_PAGE VA_48_PCIE_CFG_END
-#define VA_48_HEAP (VA_48_DIRECT_ACCESS_PAGE + PAGE_SIZE_VALUE_4K)
+#ifdef BUILD_HOST_REPLAY
+/* Allocator replayer on host can only use user space addresses. */
+#define VA_48_HEAP u64_literal(0x0000200000000000)
+#else
+#define VA_48_HEAP                                                             \
+  (VA_48_DIRECT_ACCESS_PAGE + SMP_CPU_MAX * PAGE_SIZE_VALUE_4K)
+#endif
 #define VA_48_HIGH_END u64_literal(0xFFFFFFFFFFFFFFFF)
 
 bo_t vadd_get_padd(vptr_t va, uptr_t *out_pa);
@@ -103,9 +111,49 @@ vptr_t mm_page_direct_access_setup(uptr_t padd);
 void mm_page_direct_access_reset(void);
 
 void mm_heap_bootstrap(void);
-vptr_t mm_heap_alloc(usz_t len, usz_t *all_len);
-vptr_t mm_heap_alloc_minimum(usz_t *all_len);
-void mm_heap_free(vptr_t block_user);
+/* Heap allocation without tracing, used inside mm itself. */
+vptr_t mm_heap_block_alloc(usz_t len, usz_t *all_len);
+void mm_heap_block_free(vptr_t block_user);
+/* Length of virtual address space backed by heap. */
+usz_t mm_heap_mapped_len(void);
+
+/* Allocator operations recorded by allocator tracing. */
+typedef enum {
+  MM_TRACE_OP_HEAP_ALLOC = 1,
+  MM_TRACE_OP_HEAP_FREE = 2,
+  MM_TRACE_OP_ALLOCATOR_NEW = 3,
+  MM_TRACE_OP_ALLOCATE = 4,
+  MM_TRACE_OP_ALLOCATOR_FREE = 5,
+} mm_trace_op_t;
+
+/* Binary record of allocator tracing, dumped as is in hex. */
+typedef struct {
+  u64_t tsc;   /* Time stamp counter */
+  u64_t site;  /* Return address of the caller */
+  u64_t addr;  /* Block allocated or freed, or the allocator */
+  u64_t arena; /* Allocator of @MM_TRACE_OP_ALLOCATE */
+  u32_t size;  /* Requested size */
+  u16_t align_log;
+  u8_t op;
+  u8_t version;
+} base_struct_packed mm_trace_rec_t;
+
+#define MM_TRACE_REC_VERSION 1
+
+#ifdef BUILD_MM_TRACE_ENABLED
+void mm_trace_record(mm_trace_op_t op,
+    vptr_t addr,
+    usz_t size,
+    usz_t align,
+    vptr_t arena,
+    vptr_t site);
+#define mm_trace(op, addr, size, align, arena)                                 \
+  mm_trace_record(op, addr, size, align, arena, __builtin_return_address(0))
+#else
+#define mm_trace(op, addr, size, align, arena)                                 \
+  do {                                                                         \
+  } while (0)
+#endif
 
 void mm_allocator_bootstrap(void);
 
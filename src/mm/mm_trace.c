@@ -0,0 +1,161 @@
+/* Allocator tracing.
+ *
+ * Every heap and allocator call is recorded into a ring buffer of compact
+ * binary records, which can be dumped over serial and replayed on host by
+ * tools/mm_replay. Only built when BUILD_MM_TRACE_ENABLED is on. */
+
+#include "containers_string.h"
+#include "cpu.h"
+#include "drivers_serial.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mm_private.h"
+#include "util.h"
+
+#ifdef BUILD_MM_TRACE_ENABLED
+
+/* Oldest records are overwritten once ring buffer is full. */
+#define _REC_CAP 8192
+#define _LINE_PREFIX "MM_TRACE "
+
+base_private mm_trace_rec_t _recs[_REC_CAP];
+/* Total records ever recorded since started, every recorder claims its slot
+ * by an atomic increment so that CPUs never share one. */
+base_private volatile u64_t _rec_cnt;
+base_private bo_t _enabled;
+
+void mm_trace_start(void)
+{
+  _rec_cnt = 0;
+  _enabled = true;
+}
+
+void mm_trace_stop(void)
+{
+  _enabled = false;
+}
+
+void mm_trace_record(mm_trace_op_t op,
+    vptr_t addr,
+    usz_t size,
+    usz_t align,
+    vptr_t arena,
+    vptr_t site)
+{
+  mm_trace_rec_t *rec;
+  u64_t idx;
+
+  if (_enabled) {
+    kernel_assert_d(size <= U32_MAX);
+    kernel_assert_d(align > 0);
+
+    idx = cpu_atomic_fetch_add(&_rec_cnt, 1);
+    rec = &_recs[idx % _REC_CAP];
+    rec->tsc = cpu_read_tsc();
+    rec->site = (u64_t)site;
+    rec->addr = (u64_t)addr;
+    rec->arena = (u64_t)arena;
+    rec->size = (u32_t)size;
+    rec->align_log = (u16_t)util_math_log_2_up(align);
+    rec->op = (u8_t)op;
+    rec->version = MM_TRACE_REC_VERSION;
+  }
+}
+
+void mm_trace_dump(void)
+{
+  ch_t line[sizeof(_LINE_PREFIX) + sizeof(mm_trace_rec_t) * 3 + 2];
+  u64_t first;
+  u64_t cnt;
+  usz_t len;
+  bo_t enabled;
+
+  /* Allocations made while dumping are not interesting. */
+  enabled = _enabled;
+  _enabled = false;
+
+  cnt = cpu_atomic_load(&_rec_cnt);
+  first = cnt > _REC_CAP ? cnt - _REC_CAP : 0;
+  len = str_buf_marshal_format(line, 0, sizeof(line),
+      _LINE_PREFIX "BEGIN %lu %lu\n", cnt - first, first);
+  serial_write_str(line, len);
+
+  for (u64_t i = first; i < cnt; i++) {
+    len = str_buf_marshal_str(
+        line, 0, sizeof(line), _LINE_PREFIX, sizeof(_LINE_PREFIX) - 1);
+    len += str_buf_marshal_bytes_in_hex(line, len, sizeof(line),
+        (const byte_t *)&_recs[i % _REC_CAP], sizeof(mm_trace_rec_t));
+    line[len++] = '\n';
+    serial_write_str(line, len);
+  }
+
+  len = str_buf_marshal_format(line, 0, sizeof(line), _LINE_PREFIX "END\n");
+  serial_write_str(line, len);
+
+  _enabled = enabled;
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+
+/* Records of each CPU, all of them fit in ring buffer. */
+#define _TEST_PER_CPU 64
+#define _TEST_ARENA 0x7e57
+
+/* Record allocations tagged with current CPU and their order. */
+base_private void _test_record(vptr_t arg base_may_unuse)
+{
+  u64_t cpu = smp_cpu_idx();
+
+  for (u64_t i = 0; i < _TEST_PER_CPU; i++) {
+    mm_trace_record(MM_TRACE_OP_ALLOCATE, (vptr_t)((cpu << 32) | i), 100, 16,
+        (vptr_t)_TEST_ARENA, NULL);
+  }
+}
+
+/* Every CPU records at the same time, each record gets a slot of its own. The
+ * mm heap is not set up on the boot path, so records are made directly. */
+void test_mm_trace(void)
+{
+  u64_t next[SMP_CPU_MAX];
+  mm_trace_rec_t *rec;
+  u64_t first;
+  u64_t end;
+  u64_t cpu;
+  bo_t enabled;
+
+  kernel_assert(smp_cpu_cnt() * _TEST_PER_CPU <= _REC_CAP);
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    next[i] = 0;
+  }
+
+  /* Records are appended to whatever is being traced. */
+  enabled = _enabled;
+  first = cpu_atomic_load(&_rec_cnt);
+  _enabled = true;
+  smp_call_function_many(U64_MAX, _test_record, NULL);
+  _enabled = enabled;
+  end = cpu_atomic_load(&_rec_cnt);
+  kernel_assert(end - first >= smp_cpu_cnt() * _TEST_PER_CPU);
+  kernel_assert(end - first <= _REC_CAP);
+
+  for (u64_t i = first; i < end; i++) {
+    rec = &_recs[i % _REC_CAP];
+    if (rec->op == MM_TRACE_OP_ALLOCATE && rec->arena == _TEST_ARENA) {
+      cpu = rec->addr >> 32;
+      kernel_assert(cpu < SMP_CPU_MAX);
+      kernel_assert((rec->addr & U32_MAX) == next[cpu]);
+      kernel_assert(rec->size == 100 && rec->align_log == 4);
+      kernel_assert(rec->version == MM_TRACE_REC_VERSION);
+      next[cpu]++;
+    }
+  }
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    kernel_assert(next[i] == (smp_cpu_online(i) ? _TEST_PER_CPU : 0));
+  }
+
+  log_builtin_test_pass();
+}
+
+#endif
+
+#endif
@@ -0,0 +1,361 @@
+/* Sampling profiler.
+ *
+ * With architectural performance counters, each CPU counts cycles,
+ * instructions and last level cache misses, and the counter of the event
+ * sampled raises an NMI each time it overflows after a period. NMIs hit even
+ * code running with IRQs disabled, so time spent there is seen as well.
+ * Without counters, like on QEMU without KVM, a timer of each CPU samples
+ * code interrupted by it instead.
+ *
+ * Samples are kept in a ring of each CPU, dropped once it is full. Each is
+ * the interrupted instruction and its callers by frame pointers, in builds
+ * with them, and they are written over serial as folded stacks, a line of
+ * "PROF " followed by functions and offsets, or addresses not in any, from
+ * the outermost caller on, separated by ';', and a count, which flame graph
+ * tools take after the prefix is cut. */
+#include "prof.h"
+#include "containers_ring.h"
+#include "containers_string.h"
+#include "cpu.h"
+#include "cpu_info.h"
+#include "drivers_apic.h"
+#include "drivers_hrtimer.h"
+#include "drivers_serial.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "kernel_sym.h"
+#include "log.h"
+#include "smp.h"
+
+#define _MSR_PMC0 0xc1
+#define _MSR_EVTSEL0 0x186
+#define _MSR_GLOBAL_STATUS 0x38e
+#define _MSR_GLOBAL_CTRL 0x38f
+#define _MSR_GLOBAL_OVF_CTRL 0x390
+/* Event select register: event and unit mask at bits 0..15, counting in
+ * user and kernel mode, interrupt on overflow, and enable. */
+#define _EVTSEL_USR (1U << 16)
+#define _EVTSEL_OS (1U << 17)
+#define _EVTSEL_INT (1U << 20)
+#define _EVTSEL_EN (1U << 22)
+/* Counters are written with low 32 bits sign extended. */
+#define _PERIOD_MAX 0x7fffffff
+
+#define _DEPTH 15
+#define _SAMPLES 256
+/* Callers are only looked for this far above the interrupted stack
+ * pointer, which is mapped as it has been used. */
+#define _UNWIND_SPAN (16 * 1024)
+#define _LINE_PREFIX "PROF "
+
+typedef struct {
+  const ch_t *name;
+  u32_t select; /* Unit mask and event */
+  u32_t bit;    /* Of cpu_perfmon_t events */
+} event_t;
+
+/* Indexed by prof_event_t, each counted by the general purpose counter of
+ * the same index. */
+base_private const event_t _EVENTS[PROF_EVENT_MAX] = {
+    {"cycles", 0x003c, 0},
+    {"instructions", 0x00c0, 1},
+    {"LLC misses", 0x412e, 4},
+};
+
+typedef struct {
+  u64_t depth;
+  uptr_t ips[_DEPTH]; /* Interrupted one first, then its callers */
+} sample_t;
+
+typedef struct {
+  hrtimer_t timer; /* Must be the first field */
+  ring_t ring;
+  u64_t overflows; /* Of the counter sampled */
+  u64_t drops;
+  volatile u64_t on;
+} prof_cpu_t;
+
+base_private prof_cpu_t _cpus[SMP_CPU_MAX];
+base_private sample_t _samples[SMP_CPU_MAX][_SAMPLES];
+/* Bit of each event counters take. */
+base_private u32_t _usable;
+base_private bo_t _pmu;
+base_private prof_event_t _event;
+base_private u64_t _period;
+base_private u64_t _cpus_on;
+base_private volatile u64_t _totals[PROF_EVENT_MAX];
+
+#ifdef BUILD_DEBUG_ENABLED
+/* Frame at @bp is within where callers of @ctx are looked for. */
+base_private bo_t _frame_ok(intr_context_t *ctx, uptr_t bp)
+{
+  return bp != 0 && bp % sizeof(uptr_t) == 0 && bp >= ctx->sp &&
+         bp + 2 * sizeof(uptr_t) <= ctx->sp + _UNWIND_SPAN;
+}
+#endif
+
+base_private void _record(prof_cpu_t *cpu, intr_context_t *ctx)
+{
+  sample_t *sample;
+  u64_t pos;
+  uptr_t bp base_may_unuse;
+
+  if (ring_reserve(&cpu->ring, 1, &pos) == 0) {
+    cpu->drops++;
+  } else {
+    sample = ring_slot(&cpu->ring, pos);
+    sample->ips[0] = ctx->ip;
+    sample->depth = 1;
+#ifdef BUILD_DEBUG_ENABLED
+    /* Each frame has caller frame pointer, then return address above it,
+     * and frames of callers are further up. */
+    bp = ctx->bp;
+    while (sample->depth < _DEPTH && _frame_ok(ctx, bp)) {
+      sample->ips[sample->depth++] = *(uptr_t *)(bp + sizeof(uptr_t));
+      bp = *(uptr_t *)bp > bp ? *(uptr_t *)bp : 0;
+    }
+#endif
+    ring_commit(&cpu->ring, pos, 1);
+  }
+}
+
+base_private void _nmi_handler(intr_id_t id, intr_parameters_t *para)
+{
+  prof_cpu_t *cpu;
+  intr_context_t ctx;
+  u64_t status;
+
+  (void)id;
+  cpu = &_cpus[smp_cpu_idx()];
+  /* NMIs are not only raised by counters. */
+  if (_pmu && cpu->on) {
+    status = cpu_read_msr(_MSR_GLOBAL_STATUS);
+    if ((status & (u64_literal(1) << _event)) != 0) {
+      cpu->overflows++;
+      intr_fault_context(para, &ctx);
+      _record(cpu, &ctx);
+      cpu_write_msr(_MSR_PMC0 + _event, (u64_t)-(i64_t)_period);
+    }
+    cpu_write_msr(_MSR_GLOBAL_OVF_CTRL, status);
+    d_apic_pmi_nmi(true);
+  }
+}
+
+base_private void _timer_fire(hrtimer_t *timer)
+{
+  prof_cpu_t *cpu = (prof_cpu_t *)timer;
+  intr_context_t ctx;
+
+  if (cpu->on) {
+    if (intr_irq_context(&ctx)) {
+      _record(cpu, &ctx);
+    }
+    hrtimer_start(timer, _period);
+  }
+}
+
+/* Run on each CPU sampled, with IRQs disabled. */
+base_private void _start_cpu(vptr_t arg base_may_unuse)
+{
+  prof_cpu_t *cpu;
+  usz_t idx;
+  u32_t select;
+
+  idx = smp_cpu_idx();
+  cpu = &_cpus[idx];
+  ring_init(&cpu->ring, _samples[idx], NULL, sizeof(sample_t), _SAMPLES);
+  cpu->overflows = 0;
+  cpu->drops = 0;
+  cpu->on = true;
+  if (_pmu) {
+    cpu_write_msr(_MSR_GLOBAL_CTRL, 0);
+    for (u32_t i = 0; i < PROF_EVENT_MAX; i++) {
+      if ((_usable & (1U << i)) != 0) {
+        select = _EVENTS[i].select | _EVTSEL_USR | _EVTSEL_OS | _EVTSEL_EN;
+        select |= i == _event ? _EVTSEL_INT : 0;
+        cpu_write_msr(_MSR_EVTSEL0 + i, 0);
+        cpu_write_msr(
+            _MSR_PMC0 + i, i == _event ? (u64_t)-(i64_t)_period : 0);
+        cpu_write_msr(_MSR_EVTSEL0 + i, select);
+      }
+    }
+    d_apic_pmi_nmi(true);
+    cpu_write_msr(_MSR_GLOBAL_CTRL, _usable);
+  } else {
+    cpu->timer = (hrtimer_t)HRTIMER_INIT(_timer_fire);
+    hrtimer_start(&cpu->timer, _period);
+  }
+}
+
+base_private void _stop_cpu(vptr_t arg base_may_unuse)
+{
+  prof_cpu_t *cpu;
+  u64_t count;
+  u64_t mask;
+
+  cpu = &_cpus[smp_cpu_idx()];
+  cpu->on = false;
+  if (_pmu) {
+    cpu_write_msr(_MSR_GLOBAL_CTRL, 0);
+    d_apic_pmi_nmi(false);
+    mask = (u64_literal(1) << cpu_perfmon()->width) - 1;
+    for (u32_t i = 0; i < PROF_EVENT_MAX; i++) {
+      if ((_usable & (1U << i)) != 0) {
+        count = cpu_read_msr(_MSR_PMC0 + i);
+        /* Counter sampled starts a period below overflow each time. */
+        if (i == _event) {
+          count = cpu->overflows * _period + ((count + _period) & mask);
+        }
+        cpu_atomic_fetch_add(&_totals[i], count);
+        cpu_write_msr(_MSR_EVTSEL0 + i, 0);
+      }
+    }
+  } else {
+    hrtimer_cancel(&cpu->timer);
+  }
+}
+
+void prof_bootstrap(void)
+{
+  const cpu_perfmon_t *perfmon;
+
+  perfmon = cpu_perfmon();
+  /* Global control and overflow status registers are from version 2 on. */
+  if (perfmon->version >= 2 && d_apic_ready()) {
+    for (u32_t i = 0; i < PROF_EVENT_MAX; i++) {
+      if (i < perfmon->counters &&
+          (perfmon->events & (1U << _EVENTS[i].bit)) != 0) {
+        _usable |= 1U << i;
+      }
+    }
+  }
+  if (_usable != 0) {
+    intr_handler_register(INTR_ID_EX_INTERRUPT_NMI, _nmi_handler);
+  } else {
+    log_line_format(
+        LOG_LEVEL_INFO, "No performance counters, profile by timer");
+  }
+}
+
+bo_t prof_start(u64_t cpus, prof_event_t event, u64_t period)
+{
+  kernel_assert(event < PROF_EVENT_MAX && period > 0);
+  kernel_assert(_cpus_on == 0);
+  _event = event;
+  _pmu = (_usable & (1U << event)) != 0;
+  _period = _pmu && period > _PERIOD_MAX ? _PERIOD_MAX : period;
+  for (usz_t i = 0; i < PROF_EVENT_MAX; i++) {
+    _totals[i] = 0;
+  }
+  _cpus_on = cpus;
+  smp_call_function_many(cpus, _start_cpu, NULL);
+  return _pmu;
+}
+
+void prof_stop(void)
+{
+  u64_t samples;
+  u64_t drops;
+
+  smp_call_function_many(_cpus_on, _stop_cpu, NULL);
+  samples = 0;
+  drops = 0;
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if ((_cpus_on & (u64_literal(1) << i)) != 0 && smp_cpu_online(i)) {
+      samples += ring_len(&_cpus[i].ring);
+      drops += _cpus[i].drops;
+    }
+  }
+  _cpus_on = 0;
+  log_line_format(LOG_LEVEL_INFO, "Profiled %lu samples by %s, %lu dropped",
+      samples, _pmu ? _EVENTS[_event].name : "timer", drops);
+  for (usz_t i = 0; _pmu && i < PROF_EVENT_MAX; i++) {
+    if ((_usable & (1U << i)) != 0) {
+      log_line_format(LOG_LEVEL_INFO, "Counted %lu %s", _totals[i],
+          _EVENTS[i].name);
+    }
+  }
+}
+
+void prof_dump(void)
+{
+  ch_t line[sizeof(_LINE_PREFIX) + _DEPTH * (KERNEL_SYM_LEN_MAX + 1) + 4];
+  sample_t *sample;
+  u64_t pos;
+  usz_t len;
+
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    while (ring_peek(&_cpus[i].ring, 1, &pos) == 1) {
+      sample = ring_slot(&_cpus[i].ring, pos);
+      len = str_buf_marshal_str(
+          line, 0, sizeof(line), _LINE_PREFIX, sizeof(_LINE_PREFIX) - 1);
+      for (usz_t d = sample->depth; d > 0; d--) {
+        len += kernel_sym_marshal(line, len, sizeof(line), sample->ips[d - 1]);
+        line[len++] = d > 1 ? ';' : ' ';
+      }
+      line[len++] = '1';
+      line[len++] = '\n';
+      serial_write_str(line, len);
+      ring_release(&_cpus[i].ring, 1);
+    }
+  }
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "sched.h"
+
+#define _TEST_PERIOD 200000
+#define _TEST_SPINS 20000000
+/* Bytes of _test_spin() its loop is surely within. */
+#define _TEST_SPIN_LEN 256
+
+base_private volatile u64_t _test_sink;
+
+/* Calls nothing, so samples of it are interrupted in it. */
+base_private base_no_inline void _test_spin(void)
+{
+  for (u64_t i = 0; i < _TEST_SPINS; i++) {
+    _test_sink += i;
+  }
+}
+
+/* Most samples of a CPU spinning in a function are taken in it. */
+void test_prof(void)
+{
+  ring_t *ring;
+  sample_t *sample;
+  u64_t pos;
+  usz_t cnt;
+  usz_t hits;
+  usz_t cpu;
+  u64_t flags;
+  uptr_t spin;
+
+  sched_preempt_disable();
+  flags = intr_irq_save();
+  cpu = smp_cpu_idx();
+  intr_irq_restore(flags);
+  prof_start(u64_literal(1) << cpu, PROF_EVENT_CYCLES, _TEST_PERIOD);
+  _test_spin();
+  prof_stop();
+  sched_preempt_enable();
+
+  ring = &_cpus[cpu].ring;
+  spin = (uptr_t)_test_spin;
+  cnt = ring_peek(ring, _SAMPLES, &pos);
+  hits = 0;
+  for (usz_t i = 0; i < cnt; i++) {
+    sample = ring_slot(ring, pos + i);
+    kernel_assert(sample->depth > 0 && sample->depth <= _DEPTH);
+    if (sample->ips[0] >= spin && sample->ips[0] < spin + _TEST_SPIN_LEN) {
+      hits++;
+    }
+  }
+  kernel_assert(cnt > 0 && hits * 2 > cnt);
+  log_line_format(LOG_LEVEL_SELF_TEST, "%lu of %lu samples in spin loop",
+      hits, cnt);
+  prof_dump();
+  kernel_assert(ring_len(ring) == 0);
+  log_builtin_test_pass();
+}
+#endif
@@ -0,0 +1,1130 @@
+/* Preemptive kernel threads.
+ *
+ * Each CPU has its own run queue, a FIFO of threads ready to run, and an
+ * idle thread running when the queue is empty. A CPU whose queue runs empty
+ * steals a thread from the busiest other queue before going idle, threads
+ * pinned to a CPU are never stolen. A timer of _SLICE_NS ends time slice of
+ * current thread, which is switched out at the end of the IRQ, see
+ * sched_irq_exit(). There is no timer while idle thread runs, so an idle CPU
+ * sleeps until it gets an IRQ, and CPUs queueing a thread kick it. With
+ * MONITOR and MWAIT an idle CPU waits on a flag of its run queue, and a kick
+ * is a mere store to it, otherwise it halts and a kick is an IPI.
+ *
+ * Context switch only saves callee saved registers on stack of the thread
+ * switched out, the rest are saved by the C function calling _switch(), or by
+ * IRQ entry stubs. FPU and SIMD state is restored lazily: CR0.TS is set on
+ * switch, and the first FPU instruction of a thread faults with #NM, which
+ * loads its state. State of a thread using FPU is saved when it is switched
+ * out, with XSAVEOPT, XSAVE or FXSAVE, whichever CPU has, so it may resume on
+ * any CPU. Kernel is built without SIMD registers, threads only use them
+ * between sched_fpu_begin() and sched_fpu_end(). Run queues and FPU are only
+ * touched with IRQs disabled. */
+#include "sched.h"
+#include "cpu.h"
+#include "cpu_info.h"
+#include "drivers_apic.h"
+#include "drivers_hrtimer.h"
+#include "drivers_time.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem.h"
+#include "smp.h"
+#include "sync.h"
+
+#define _THREAD_CAP 128
+#define _THREAD_STACK_PG 16
+#define _SLICE_NS 10000000
+/* XSAVE area of x87, SSE and AVX, must be 64 bytes aligned. It starts with
+ * the 512 bytes FXSAVE area, followed by a 64 bytes header. */
+#define _FPU_LEN 1024
+#define _FPU_LEGACY_LEN 512
+#define _FPU_HEADER_LEN 64
+/* Default FPU control word and MXCSR, all exceptions masked. */
+#define _FCW_DEFAULT 0x37f
+#define _MXCSR_DEFAULT 0x1f80
+#define _FPU_MXCSR_OFFSET 24
+#define _CR0_MP 0x2
+#define _CR0_EM 0x4
+#define _CR0_TS 0x8
+#define _CR4_OSFXSR (1U << 9)
+#define _CR4_OSXMMEXCPT (1U << 10)
+#define _CR4_OSXSAVE (1U << 18)
+#define _CPUID_XSAVE 0xd
+#define _XCR0_X87 0x1
+#define _XCR0_SSE 0x2
+#define _XCR0_AVX 0x4
+#define _RFLAGS_IF 0x200
+
+typedef enum {
+  _THREAD_READY,
+  _THREAD_RUNNING,
+  _THREAD_BLOCKED, /* In sched_thread_sleep(), not in any run queue */
+  _THREAD_DEAD,
+} thread_state_t;
+
+struct sched_thread {
+  byte_t fpu[_FPU_LEN] base_align(64);
+  uptr_t sp; /* Saved stack pointer while not running */
+  const ch_t *name;
+  mem_stack_t *stack; /* NULL if the stack is not owned, freed on exit */
+  sched_entry_cb entry;
+  vptr_t arg;
+  struct sched_thread *next; /* In a run queue or zombie list */
+  usz_t pin;                 /* CPU pinned to, or SCHED_CPU_ANY */
+  usz_t cpu;                 /* CPU it runs on, or ran on the last time */
+  usz_t fpu_cpu;             /* CPU whose FPU registers last loaded @fpu */
+  volatile u64_t on_cpu;     /* Stack in use, must not be run elsewhere */
+  u64_t preempt_cnt;
+  thread_state_t state;
+  bo_t fpu_valid; /* @fpu is saved, otherwise FPU is initialized on use */
+  bo_t woken;     /* Woken while not blocked, next sleep returns at once */
+  bo_t used;
+};
+
+typedef struct {
+  sync_spin_t lock base_align(64);
+  sched_thread_t *head;
+  sched_thread_t *tail;
+  volatile u64_t nr;          /* Threads in queue */
+  volatile u64_t nr_unpinned; /* Threads in queue may be stolen */
+  sched_thread_t *curr;
+  sched_thread_t *idle;
+  sched_thread_t *prev;      /* Switched out, until _switch_finish() */
+  sched_thread_t *fpu_owner; /* Thread whose state FPU registers hold */
+  hrtimer_t slice;           /* Ends time slice of current thread */
+  usz_t idx;
+  u64_t switches;
+  bo_t need_resched;
+  volatile u64_t online;
+  /* 1 while idle in MWAIT, cleared to wake it up. Alone in its cache line,
+   * so that only a kick wakes it. */
+  volatile u64_t sleeping base_align(64);
+  volatile u64_t kick_tsc; /* When kicked while idle, 0 if not */
+  /* Idle statistics. */
+  u64_t start_tsc;
+  u64_t idle_cycles;
+  u64_t wakes;      /* Kicked out of idle */
+  u64_t wake_cycles; /* From kick to idle loop running again */
+  u64_t wake_max;
+  volatile u64_t ipis;
+} rq_t;
+
+typedef enum {
+  _FPU_FXSAVE,
+  _FPU_XSAVE,
+  _FPU_XSAVEOPT,
+} fpu_save_t;
+
+base_private fpu_save_t _fpu_save_by;
+/* XSAVE components enabled. */
+base_private u64_t _fpu_xcr0;
+/* Initial state loaded for threads using FPU the first time. */
+base_private byte_t _fpu_init[_FPU_LEN] base_align(64);
+
+base_private rq_t _rqs[SMP_CPU_MAX];
+base_private sched_thread_t _threads[_THREAD_CAP];
+/* Protects allocating of @_threads and @_zombies. */
+base_private sync_spin_t _threads_lock = SYNC_SPIN_INIT("sched_threads");
+/* Protects blocking and waking of threads, taken before run queue locks. */
+base_private sync_spin_t _wait_lock = SYNC_SPIN_INIT("sched_wait");
+/* Threads exited, with stacks to be freed. */
+base_private sched_thread_t *_zombies;
+/* Set once bootstrap processor is taking threads. */
+base_private volatile u64_t _ready;
+base_private volatile u64_t _rq_online;
+/* Idle CPUs wait with MWAIT, instead of HLT. */
+base_private bo_t _mwait;
+
+/* Save callee saved registers on current stack and store stack pointer to
+ * @prev_sp, then switch to stack @next_sp and pop its registers. */
+extern void _switch(uptr_t *prev_sp, uptr_t next_sp);
+/* Where new threads start, thread in RBX and _thread_main in R12. */
+extern byte_t _thread_start[];
+
+__asm__(".pushsection .text\n"
+        "_switch:\n"
+        "  pushq %rbp\n"
+        "  pushq %rbx\n"
+        "  pushq %r12\n"
+        "  pushq %r13\n"
+        "  pushq %r14\n"
+        "  pushq %r15\n"
+        "  movq %rsp, (%rdi)\n"
+        "  movq %rsi, %rsp\n"
+        "  popq %r15\n"
+        "  popq %r14\n"
+        "  popq %r13\n"
+        "  popq %r12\n"
+        "  popq %rbx\n"
+        "  popq %rbp\n"
+        "  retq\n"
+        "_thread_start:\n"
+        "  movq %rbx, %rdi\n"
+        "  callq *%r12\n"
+        "  ud2\n"
+        ".popsection\n");
+
+/* Registers popped by _switch(), then return address. */
+typedef struct {
+  u64_t r15;
+  u64_t r14;
+  u64_t r13;
+  u64_t r12;
+  u64_t rbx;
+  u64_t rbp;
+  u64_t ret;
+} switch_frame_t;
+
+/* Run queue of current CPU, IRQs must be disabled. */
+base_private rq_t *_rq_this(void)
+{
+  return &_rqs[smp_cpu_idx()];
+}
+
+base_private void _rq_push(rq_t *rq, sched_thread_t *thread)
+{
+  thread->state = _THREAD_READY;
+  thread->next = NULL;
+  if (rq->tail == NULL) {
+    rq->head = thread;
+  } else {
+    rq->tail->next = thread;
+  }
+  rq->tail = thread;
+  rq->nr++;
+  if (thread->pin == SCHED_CPU_ANY) {
+    rq->nr_unpinned++;
+  }
+}
+
+/* Unlink @thread following @before, or the head if @before is NULL. */
+base_private void _rq_unlink(
+    rq_t *rq, sched_thread_t *before, sched_thread_t *thread)
+{
+  if (before == NULL) {
+    rq->head = thread->next;
+  } else {
+    before->next = thread->next;
+  }
+  if (rq->tail == thread) {
+    rq->tail = before;
+  }
+  thread->next = NULL;
+  rq->nr--;
+  if (thread->pin == SCHED_CPU_ANY) {
+    rq->nr_unpinned--;
+  }
+}
+
+/* Wake CPU of @rq up if it is idle, after a thread pinned to @pin is queued
+ * to it, or another idle CPU which may steal the thread. */
+base_private void _rq_kick(rq_t *rq, usz_t pin)
+{
+  rq_t *idle;
+
+  /* Queued before reading curr, see _idle_loop(). */
+  cpu_mfence();
+  idle = NULL;
+  if (rq->curr == rq->idle) {
+    idle = rq;
+  } else if (pin == SCHED_CPU_ANY) {
+    for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+      if (_rqs[i].online && _rqs[i].curr == _rqs[i].idle) {
+        idle = &_rqs[i];
+        break;
+      }
+    }
+  }
+  if (idle != NULL) {
+    cpu_atomic_cas(&idle->kick_tsc, 0, cpu_read_tsc());
+    /* Store to the flag monitored is enough to wake MWAIT up. */
+    if (!cpu_atomic_cas(&idle->sleeping, 1, 0) && d_apic_ready()) {
+      d_apic_send_ipi(smp_cpu_apic_id(idle->idx), INTR_ID_APIC_RESCHED);
+      cpu_atomic_fetch_add(&idle->ipis, 1);
+    }
+  }
+}
+
+base_private sched_thread_t *_rq_pop(rq_t *rq)
+{
+  sched_thread_t *thread;
+
+  thread = rq->head;
+  if (thread != NULL) {
+    _rq_unlink(rq, NULL, thread);
+  }
+  return thread;
+}
+
+/* Take a thread not pinned from queue with the most of them. Counters are
+ * read without locks, they only pick a victim. */
+base_private sched_thread_t *_rq_steal(rq_t *rq)
+{
+  rq_t *victim;
+  sched_thread_t *thread;
+  sched_thread_t *before;
+  u64_t most;
+  u64_t flags;
+
+  victim = NULL;
+  most = 0;
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (&_rqs[i] != rq && _rqs[i].online && _rqs[i].nr_unpinned > most) {
+      victim = &_rqs[i];
+      most = victim->nr_unpinned;
+    }
+  }
+
+  thread = NULL;
+  if (victim != NULL) {
+    flags = sync_spin_lock_irqsave(&victim->lock);
+    before = NULL;
+    for (thread = victim->head; thread != NULL; thread = thread->next) {
+      /* A thread just switched out may still be on its stack. */
+      if (thread->pin == SCHED_CPU_ANY &&
+          cpu_atomic_load(&thread->on_cpu) == 0) {
+        _rq_unlink(victim, before, thread);
+        break;
+      }
+      before = thread;
+    }
+    sync_spin_unlock_irqrestore(&victim->lock, flags);
+  }
+  return thread;
+}
+
+/* Pick the way FPU state is saved, and the components of it. */
+base_private void _fpu_probe(void)
+{
+  u32_t cpuid[4];
+  u32_t len;
+
+  _fpu_save_by = _FPU_FXSAVE;
+  if (cpu_has(CPU_FEATURE_XSAVE)) {
+    _fpu_xcr0 = _XCR0_X87 | _XCR0_SSE;
+    if (cpu_has(CPU_FEATURE_AVX)) {
+      _fpu_xcr0 |= _XCR0_AVX;
+    }
+    _fpu_save_by = _FPU_XSAVE;
+    if (cpu_has(CPU_FEATURE_XSAVEOPT)) {
+      _fpu_save_by = _FPU_XSAVEOPT;
+    }
+  }
+
+  *(u16_t *)_fpu_init = _FCW_DEFAULT;
+  *(u32_t *)(_fpu_init + _FPU_MXCSR_OFFSET) = _MXCSR_DEFAULT;
+
+  len = _FPU_LEGACY_LEN;
+  if (_fpu_save_by != _FPU_FXSAVE) {
+    /* Size of area for components enabled in XCR0 of this CPU. */
+    cpu_write_cr4(cpu_read_cr4() | _CR4_OSXSAVE);
+    cpu_write_xcr(0, _fpu_xcr0);
+    cpu_cpuid(_CPUID_XSAVE, 0, cpuid);
+    len = cpuid[1];
+  }
+  kernel_assert(len <= _FPU_LEN);
+  log_line_format(LOG_LEVEL_INFO, "FPU state saved by %s, %lu bytes, AVX: %lu",
+      _fpu_save_by == _FPU_FXSAVE  ? "FXSAVE"
+      : _fpu_save_by == _FPU_XSAVE ? "XSAVE"
+                                   : "XSAVEOPT",
+      (u64_t)len, (u64_t)((_fpu_xcr0 & _XCR0_AVX) != 0));
+}
+
+/* Enable FPU and SSE on current CPU, and XSAVE if there is. */
+base_private void _fpu_init_cpu(void)
+{
+  u64_t cr4;
+
+  cpu_write_cr0((cpu_read_cr0() & ~(u64_t)_CR0_EM) | _CR0_MP | _CR0_TS);
+  cr4 = cpu_read_cr4() | _CR4_OSFXSR | _CR4_OSXMMEXCPT;
+  if (_fpu_save_by != _FPU_FXSAVE) {
+    cr4 |= _CR4_OSXSAVE;
+  }
+  cpu_write_cr4(cr4);
+  if (_fpu_save_by != _FPU_FXSAVE) {
+    cpu_write_xcr(0, _fpu_xcr0);
+  }
+}
+
+/* Load @area into FPU registers, TS flag must be clear. */
+base_private void _fpu_restore(byte_t *area)
+{
+  if (_fpu_save_by == _FPU_FXSAVE) {
+    __asm__ volatile("fxrstor64 %0" : : "m"(*(byte_t(*)[_FPU_LEN])area));
+  } else {
+    /* Components not saved in @area are set to their initial state. */
+    __asm__ volatile("xrstor64 %0"
+                     :
+                     : "m"(*(byte_t(*)[_FPU_LEN])area), "a"((u32_t)_fpu_xcr0),
+                     "d"((u32_t)(_fpu_xcr0 >> 32)));
+  }
+}
+
+/* Save FPU state of @thread being switched out, if it used FPU in this time
+ * slice, TS flag is still set otherwise. XSAVEOPT skips components not
+ * modified since they were loaded from the same area. */
+base_private void _fpu_switch_out(sched_thread_t *thread)
+{
+  u32_t lo;
+  u32_t hi;
+
+  if ((cpu_read_cr0() & _CR0_TS) == 0) {
+    lo = (u32_t)_fpu_xcr0;
+    hi = (u32_t)(_fpu_xcr0 >> 32);
+    if (_fpu_save_by == _FPU_FXSAVE) {
+      __asm__ volatile("fxsave64 %0" : "=m"(thread->fpu));
+    } else if (_fpu_save_by == _FPU_XSAVE) {
+      __asm__ volatile("xsave64 %0" : "+m"(thread->fpu) : "a"(lo), "d"(hi));
+    } else {
+      __asm__ volatile("xsaveopt64 %0" : "+m"(thread->fpu) : "a"(lo), "d"(hi));
+    }
+    thread->fpu_valid = true;
+  }
+}
+
+/* FPU registers still hold state of @thread if nobody else loaded them since
+ * it was switched out, then it is not reloaded. */
+base_private void _fpu_switch_in(rq_t *rq, sched_thread_t *thread)
+{
+  if (rq->fpu_owner == thread && thread->fpu_cpu == rq->idx) {
+    cpu_clts();
+  } else {
+    cpu_write_cr0(cpu_read_cr0() | _CR0_TS);
+  }
+}
+
+/* #NM raised by the first FPU instruction of current thread since switched
+ * in. */
+base_private void _fpu_fault(intr_id_t id, intr_parameters_t *para)
+{
+  sched_thread_t *thread;
+  rq_t *rq;
+
+  (void)(id + para);
+  cpu_clts();
+  rq = _rq_this();
+  thread = rq->curr;
+  _fpu_restore(thread->fpu_valid ? thread->fpu : _fpu_init);
+  rq->fpu_owner = thread;
+  thread->fpu_cpu = rq->idx;
+}
+
+/* Rest of a switch, on stack of the thread switched in, which may be on
+ * another CPU than when it was switched out. */
+base_private void _switch_finish(void)
+{
+  rq_t *rq;
+  sched_thread_t *prev;
+  u64_t flags;
+
+  rq = _rq_this();
+  prev = rq->prev;
+  rq->prev = NULL;
+  cpu_atomic_store(&prev->on_cpu, 0);
+  if (prev->state == _THREAD_DEAD) {
+    /* Its stack may be in use until now, free it later. */
+    flags = sync_spin_lock_irqsave(&_threads_lock);
+    prev->next = _zombies;
+    _zombies = prev;
+    sync_spin_unlock_irqrestore(&_threads_lock, flags);
+  }
+  _fpu_switch_in(rq, rq->curr);
+}
+
+/* Switch to next thread ready to run, IRQs must be disabled. Current thread
+ * is queued again if it is still running. */
+base_private void _schedule(void)
+{
+  rq_t *rq;
+  sched_thread_t *prev;
+  sched_thread_t *next;
+  u64_t flags;
+
+  rq = _rq_this();
+  prev = rq->curr;
+  rq->need_resched = false;
+  sync_rcu_qs();
+
+  flags = sync_spin_lock_irqsave(&rq->lock);
+  if (prev->state == _THREAD_RUNNING && prev != rq->idle) {
+    _rq_push(rq, prev);
+  }
+  next = _rq_pop(rq);
+  sync_spin_unlock_irqrestore(&rq->lock, flags);
+  if (next == NULL) {
+    next = _rq_steal(rq);
+  }
+  if (next == NULL) {
+    next = rq->idle;
+  }
+
+  next->state = _THREAD_RUNNING;
+  next->cpu = rq->idx;
+  if (next == rq->idle) {
+    hrtimer_cancel(&rq->slice);
+  } else {
+    hrtimer_start(&rq->slice, _SLICE_NS);
+  }
+  if (next != prev) {
+    _fpu_switch_out(prev);
+    cpu_atomic_store(&next->on_cpu, 1);
+    rq->curr = next;
+    rq->prev = prev;
+    rq->switches++;
+    _switch(&prev->sp, next->sp);
+    _switch_finish();
+  }
+}
+
+base_private void _thread_main(sched_thread_t *thread)
+{
+  _switch_finish();
+  intr_irq_enable();
+  thread->entry(thread->arg);
+  sched_thread_exit();
+}
+
+base_private sched_thread_t *_thread_alloc(const ch_t *name, usz_t pin)
+{
+  sched_thread_t *thread;
+  u64_t flags;
+
+  thread = NULL;
+  flags = sync_spin_lock_irqsave(&_threads_lock);
+  for (usz_t i = 0; i < _THREAD_CAP; i++) {
+    if (!_threads[i].used) {
+      thread = &_threads[i];
+      thread->used = true;
+      break;
+    }
+  }
+  sync_spin_unlock_irqrestore(&_threads_lock, flags);
+
+  if (thread != NULL) {
+    thread->sp = 0;
+    thread->name = name;
+    thread->stack = NULL;
+    thread->entry = NULL;
+    thread->arg = NULL;
+    thread->next = NULL;
+    thread->pin = pin;
+    thread->cpu = smp_cpu_idx();
+    thread->fpu_cpu = SMP_CPU_MAX;
+    thread->on_cpu = 0;
+    thread->preempt_cnt = 0;
+    thread->state = _THREAD_READY;
+    thread->fpu_valid = false;
+    /* XRSTOR faults unless reserved bytes of the header are 0. */
+    mem_clean(thread->fpu + _FPU_LEGACY_LEN, _FPU_HEADER_LEN);
+    thread->woken = false;
+  }
+  return thread;
+}
+
+/* Free stacks and slots of threads exited. */
+base_private void _zombies_reap(void)
+{
+  sched_thread_t *list;
+  sched_thread_t *thread;
+  u64_t flags;
+
+  flags = sync_spin_lock_irqsave(&_threads_lock);
+  list = _zombies;
+  _zombies = NULL;
+  sync_spin_unlock_irqrestore(&_threads_lock, flags);
+
+  while (list != NULL) {
+    thread = list;
+    list = thread->next;
+    if (thread->stack != NULL) {
+      mem_stack_free(thread->stack);
+    }
+    flags = sync_spin_lock_irqsave(&_threads_lock);
+    thread->used = false;
+    sync_spin_unlock_irqrestore(&_threads_lock, flags);
+  }
+}
+
+/* Set up a thread to start from @entry on stack of its own. */
+base_private sched_thread_t *_thread_create(
+    const ch_t *name, sched_entry_cb entry, vptr_t arg, usz_t pin)
+{
+  sched_thread_t *thread;
+  switch_frame_t *frame;
+  uptr_t bottom;
+  u64_t flags;
+
+  thread = _thread_alloc(name, pin);
+  if (thread != NULL) {
+    thread->stack = mem_stack_new(name, _THREAD_STACK_PG);
+    if (thread->stack == NULL) {
+      flags = sync_spin_lock_irqsave(&_threads_lock);
+      thread->used = false;
+      sync_spin_unlock_irqrestore(&_threads_lock, flags);
+      thread = NULL;
+    }
+  }
+
+  if (thread != NULL) {
+    thread->entry = entry;
+    thread->arg = arg;
+    /* _thread_main is entered with stack aligned the same as a call. */
+    bottom = mem_stack_bottom(thread->stack);
+    frame = (switch_frame_t *)(bottom - sizeof(switch_frame_t));
+    frame->r15 = 0;
+    frame->r14 = 0;
+    frame->r13 = 0;
+    frame->r12 = (uptr_t)_thread_main;
+    frame->rbx = (uptr_t)thread;
+    frame->rbp = 0;
+    frame->ret = (uptr_t)_thread_start;
+    thread->sp = (uptr_t)frame;
+  }
+  return thread;
+}
+
+base_private base_no_return _idle_loop(void)
+{
+  rq_t *rq;
+  u64_t start;
+  u64_t now;
+  u64_t kick;
+  bo_t slept;
+
+  while (1) {
+    _zombies_reap();
+    sync_rcu_poll();
+    intr_irq_disable();
+    _schedule();
+    /* Back with nothing to run, wait for an IRQ or a kick. A thread queued
+     * since is seen here, or its waker sees us idle and kicks us, as both
+     * sides have a barrier between their store and load. */
+    rq = _rq_this();
+    sync_rcu_idle_enter();
+    if (_mwait) {
+      cpu_atomic_store(&rq->sleeping, 1);
+      __asm__ volatile("monitor"
+                       :
+                       : "a"(&rq->sleeping), "c"(0), "d"(0)
+                       : "memory");
+    }
+    start = cpu_read_tsc();
+    slept = cpu_atomic_load(&rq->nr) == 0;
+    if (slept && _mwait && cpu_atomic_load(&rq->sleeping) == 1) {
+      /* STI takes effect after MWAIT starts, an IRQ wakes it up. */
+      __asm__ volatile("sti; mwait" : : "a"(0), "c"(0) : "memory");
+    } else if (slept && !_mwait) {
+      __asm__ volatile("sti; hlt" : : : "memory");
+    } else {
+      intr_irq_enable();
+    }
+    /* IRQ handlers woke us up have run, and may have queued threads. */
+    intr_irq_disable();
+    now = cpu_read_tsc();
+    cpu_atomic_store(&rq->sleeping, 0);
+    kick = cpu_atomic_swap(&rq->kick_tsc, 0);
+    if (slept) {
+      rq->idle_cycles += now - start;
+      if (kick != 0 && kick >= start && now >= kick) {
+        rq->wakes++;
+        rq->wake_cycles += now - kick;
+        if (now - kick > rq->wake_max) {
+          rq->wake_max = now - kick;
+        }
+      }
+    }
+    intr_irq_enable();
+    sync_rcu_idle_exit();
+  }
+}
+
+base_private void _idle_main(vptr_t arg base_may_unuse)
+{
+  _idle_loop();
+}
+
+base_private void _slice_end(hrtimer_t *timer base_may_unuse)
+{
+  _rq_this()->need_resched = true;
+}
+
+/* IPI of _rq_kick(), nothing to do but returning from HLT or MWAIT. */
+base_private void _resched_ipi(intr_id_t id, intr_parameters_t *para)
+{
+  (void)(id + para);
+  _rq_this()->need_resched = true;
+}
+
+/* Take threads on current CPU from now on, IRQs must be disabled. */
+base_private void _rq_start(rq_t *rq)
+{
+  rq->idx = smp_cpu_idx();
+  sync_spin_init(&rq->lock, "sched_rq");
+  _fpu_init_cpu();
+  rq->start_tsc = cpu_read_tsc();
+  rq->slice = (hrtimer_t)HRTIMER_INIT(_slice_end);
+  hrtimer_init_cpu();
+  cpu_atomic_store(&rq->online, 1);
+  cpu_atomic_fetch_add(&_rq_online, 1);
+}
+
+void sched_bootstrap(void)
+{
+  sched_thread_t *thread;
+  rq_t *rq;
+
+  kernel_assert(!intr_irq_enabled());
+  kernel_assert(smp_cpu_idx() == 0);
+  rq = _rq_this();
+
+  /* Current context goes on as a thread, on stack not owned by it. */
+  thread = _thread_alloc("main", SCHED_CPU_ANY);
+  kernel_assert(thread != NULL);
+  thread->state = _THREAD_RUNNING;
+  thread->on_cpu = 1;
+  rq->curr = thread;
+
+  rq->idle = _thread_create("idle0", _idle_main, NULL, 0);
+  kernel_assert(rq->idle != NULL);
+
+  _fpu_probe();
+  _mwait = cpu_has(CPU_FEATURE_MONITOR);
+  intr_handler_register(INTR_ID_EX_FAULT_NM, _fpu_fault);
+  if (d_apic_ready()) {
+    intr_handler_register(INTR_ID_APIC_RESCHED, _resched_ipi);
+  }
+  _rq_start(rq);
+  cpu_atomic_store(&_ready, 1);
+  intr_irq_enable();
+
+  while (cpu_atomic_load(&_rq_online) < smp_cpu_cnt()) {
+    cpu_relax();
+  }
+  log_line_format(LOG_LEVEL_INFO,
+      "Scheduler started on %lu CPUs, time slice %lu us, idle by %s",
+      cpu_atomic_load(&_rq_online), (u64_t)_SLICE_NS / 1000,
+      _mwait ? "MWAIT" : "HLT");
+}
+
+base_no_return sched_ap_main(void)
+{
+  sched_thread_t *thread;
+  rq_t *rq;
+
+  while (cpu_atomic_load(&_ready) == 0) {
+    cpu_relax();
+  }
+
+  /* Current context becomes the idle thread, its stack is owned by smp. */
+  rq = _rq_this();
+  thread = _thread_alloc("idle", smp_cpu_idx());
+  kernel_assert(thread != NULL);
+  thread->state = _THREAD_RUNNING;
+  thread->on_cpu = 1;
+  rq->curr = thread;
+  rq->idle = thread;
+  _rq_start(rq);
+  _idle_loop();
+}
+
+base_must_check sched_thread_t *sched_thread_new(
+    const ch_t *name, sched_entry_cb entry, vptr_t arg, usz_t cpu)
+{
+  sched_thread_t *thread;
+  rq_t *rq;
+  u64_t flags;
+
+  kernel_assert(cpu_atomic_load(&_ready) != 0);
+  kernel_assert(cpu == SCHED_CPU_ANY ||
+                (cpu < SMP_CPU_MAX && _rqs[cpu].online));
+
+  _zombies_reap();
+  thread = _thread_create(name, entry, arg, cpu);
+  if (thread != NULL) {
+    /* Any queue is fine if migrated meanwhile. */
+    rq = &_rqs[cpu == SCHED_CPU_ANY ? smp_cpu_idx() : cpu];
+    flags = sync_spin_lock_irqsave(&rq->lock);
+    _rq_push(rq, thread);
+    sync_spin_unlock_irqrestore(&rq->lock, flags);
+    _rq_kick(rq, cpu);
+  }
+  return thread;
+}
+
+base_no_return sched_thread_exit(void)
+{
+  intr_irq_disable();
+  _rq_this()->curr->state = _THREAD_DEAD;
+  _schedule();
+  kernel_panic("Thread exited is switched back");
+}
+
+void sched_yield(void)
+{
+  u64_t flags;
+
+  flags = intr_irq_save();
+  _schedule();
+  intr_irq_restore(flags);
+}
+
+sched_thread_t *sched_current(void)
+{
+  sched_thread_t *thread;
+  u64_t flags;
+
+  flags = intr_irq_save();
+  thread = _rq_this()->curr;
+  intr_irq_restore(flags);
+  return thread;
+}
+
+void sched_thread_sleep(void)
+{
+  sched_thread_t *thread;
+  bo_t blocked;
+  u64_t flags;
+  u64_t wait_flags;
+
+  flags = intr_irq_save();
+  thread = _rq_this()->curr;
+  kernel_assert(thread->preempt_cnt == 0);
+  kernel_assert(thread != _rq_this()->idle);
+
+  wait_flags = sync_spin_lock_irqsave(&_wait_lock);
+  blocked = !thread->woken;
+  thread->woken = false;
+  if (blocked) {
+    thread->state = _THREAD_BLOCKED;
+  }
+  sync_spin_unlock_irqrestore(&_wait_lock, wait_flags);
+
+  /* May be queued again by a waker already, then it just goes on. */
+  if (blocked) {
+    _schedule();
+  }
+  intr_irq_restore(flags);
+}
+
+void sched_thread_wake(sched_thread_t *thread)
+{
+  rq_t *rq;
+  u64_t flags;
+  u64_t rq_flags;
+
+  flags = sync_spin_lock_irqsave(&_wait_lock);
+  if (thread->state == _THREAD_BLOCKED) {
+    /* Back to where it blocked, it may still be on the stack there. */
+    rq = &_rqs[thread->cpu];
+    rq_flags = sync_spin_lock_irqsave(&rq->lock);
+    _rq_push(rq, thread);
+    sync_spin_unlock_irqrestore(&rq->lock, rq_flags);
+    _rq_kick(rq, thread->pin);
+  } else {
+    thread->woken = true;
+  }
+  sync_spin_unlock_irqrestore(&_wait_lock, flags);
+}
+
+void sched_idle_report(void)
+{
+  rq_t *rq;
+  u64_t total;
+
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    rq = &_rqs[i];
+    if (rq->online) {
+      total = cpu_read_tsc() - rq->start_tsc;
+      log_line_format(LOG_LEVEL_INFO,
+          "CPU %lu idle %lu%%, %lu wakeups in %lu ns avg, %lu ns max, %lu IPIs",
+          (u64_t)i, rq->idle_cycles * 100 / total, rq->wakes,
+          rq->wakes == 0 ? 0 : time_cycles_to_ns(rq->wake_cycles / rq->wakes),
+          time_cycles_to_ns(rq->wake_max), rq->ipis);
+    }
+  }
+}
+
+bo_t sched_cpu_online(usz_t cpu)
+{
+  kernel_assert(cpu < SMP_CPU_MAX);
+  return _rqs[cpu].online != 0;
+}
+
+const ch_t *sched_thread_name(sched_thread_t *thread)
+{
+  return thread->name;
+}
+
+void sched_fpu_begin(void)
+{
+  sched_preempt_disable();
+  /* IRQs may come in the middle of a thread section, and do not save
+   * SIMD registers. */
+  kernel_assert(!intr_in_irq());
+}
+
+void sched_fpu_end(void)
+{
+  sched_preempt_enable();
+}
+
+void sched_preempt_disable(void)
+{
+  if (cpu_atomic_load(&_ready) != 0) {
+    sched_current()->preempt_cnt++;
+  }
+}
+
+void sched_preempt_enable(void)
+{
+  sched_thread_t *thread;
+  u64_t flags;
+
+  if (cpu_atomic_load(&_ready) != 0) {
+    flags = intr_irq_save();
+    thread = _rq_this()->curr;
+    kernel_assert(thread->preempt_cnt > 0);
+    thread->preempt_cnt--;
+    /* Time slice may have ended while preemption was disabled. */
+    if (thread->preempt_cnt == 0 && _rq_this()->need_resched &&
+        (flags & _RFLAGS_IF) != 0) {
+      _schedule();
+    }
+    intr_irq_restore(flags);
+  }
+}
+
+bo_t sched_preempt_enabled(void)
+{
+  bo_t enabled;
+
+  enabled = true;
+  if (cpu_atomic_load(&_ready) != 0) {
+    enabled = sched_current()->preempt_cnt == 0;
+  }
+  return enabled;
+}
+
+void sched_irq_exit(void)
+{
+  rq_t *rq;
+
+  if (cpu_atomic_load(&_ready) != 0) {
+    rq = _rq_this();
+    if (rq->online && rq->need_resched && rq->curr->preempt_cnt == 0) {
+      _schedule();
+    }
+  }
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#define _TEST_LOOPS 100000
+#define _TEST_BENCH_SWITCHES 20000
+#define _TEST_WAKES 100
+
+base_private volatile u64_t _test_sum;
+base_private volatile u64_t _test_done;
+base_private volatile u64_t _test_cpus;
+base_private volatile u64_t _test_flag;
+base_private volatile u64_t _test_round;
+base_private volatile u64_t _test_acks;
+
+/* Last CPU taking threads, the bootstrap one if it is the only one. */
+base_private usz_t _test_cpu_last(void)
+{
+  usz_t cpu;
+
+  cpu = 0;
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (_rqs[i].online) {
+      cpu = i;
+    }
+  }
+  return cpu;
+}
+
+base_private void _test_wait_done(u64_t n)
+{
+  while (cpu_atomic_load(&_test_done) < n) {
+    sched_yield();
+  }
+  cpu_atomic_store(&_test_done, 0);
+}
+
+base_private void _test_add(vptr_t arg base_may_unuse)
+{
+  u64_t expect;
+  u64_t xmm;
+
+  /* Keep a value of its own in XMM0 across yields, to catch FPU state mixed
+   * up between threads. */
+  expect = (uptr_t)sched_current();
+  sched_fpu_begin();
+  __asm__ volatile("movq %0, %%xmm0" : : "r"(expect));
+  sched_fpu_end();
+  for (usz_t i = 0; i < _TEST_LOOPS; i++) {
+    cpu_atomic_fetch_add(&_test_sum, 1);
+    if (i % 1000 == 0) {
+      sched_yield();
+      sched_fpu_begin();
+      __asm__ volatile("movq %%xmm0, %0" : "=r"(xmm));
+      kernel_assert(xmm == expect);
+      expect += i;
+      __asm__ volatile("movq %0, %%xmm0" : : "r"(expect));
+      sched_fpu_end();
+    }
+  }
+  sched_preempt_disable();
+  cpu_atomic_fetch_add(&_test_cpus, u64_literal(1) << (smp_cpu_idx() % 64));
+  sched_preempt_enable();
+  cpu_atomic_fetch_add(&_test_done, 1);
+}
+
+/* Threads not pinned run on all CPUs, and run to the end. */
+base_private void _test_concurrent(void)
+{
+  sched_thread_t *thread;
+  ucnt_t n;
+  ucnt_t cpus;
+
+  n = smp_cpu_cnt() * 2;
+  for (usz_t i = 0; i < n; i++) {
+    thread = sched_thread_new("test", _test_add, NULL, SCHED_CPU_ANY);
+    kernel_assert(thread != NULL);
+  }
+  _test_wait_done(n);
+  kernel_assert(_test_sum == n * _TEST_LOOPS);
+
+  cpus = 0;
+  for (u64_t m = _test_cpus; m != 0; m &= m - 1) {
+    cpus++;
+  }
+  log_line_format(LOG_LEVEL_SELF_TEST, "%lu threads ran on %lu CPUs", n, cpus);
+}
+
+base_private void _test_spin(vptr_t arg base_may_unuse)
+{
+  while (cpu_atomic_load(&_test_flag) == 0) {
+    cpu_relax();
+  }
+  cpu_atomic_fetch_add(&_test_done, 1);
+}
+
+base_private void _test_set(vptr_t arg base_may_unuse)
+{
+  cpu_atomic_store(&_test_flag, 1);
+  cpu_atomic_fetch_add(&_test_done, 1);
+}
+
+/* A thread spinning without yielding is preempted, or the other one pinned
+ * to the same CPU never runs. */
+base_private void _test_preempt(void)
+{
+  sched_thread_t *thread;
+  usz_t cpu;
+
+  cpu = _test_cpu_last();
+  thread = sched_thread_new("test_spin", _test_spin, NULL, cpu);
+  kernel_assert(thread != NULL);
+  thread = sched_thread_new("test_set", _test_set, NULL, cpu);
+  kernel_assert(thread != NULL);
+  _test_wait_done(2);
+}
+
+base_private void _test_ping_pong(vptr_t arg)
+{
+  u64_t *cycles = (u64_t *)arg;
+  rq_t *rq;
+  u64_t switches;
+  u64_t start;
+
+  /* Pinned, so run queue stays the same. */
+  rq = _rq_this();
+  switches = rq->switches;
+  start = cpu_read_tsc();
+  for (usz_t i = 0; i < _TEST_BENCH_SWITCHES / 2; i++) {
+    sched_yield();
+  }
+  if (cycles != NULL) {
+    *cycles = (cpu_read_tsc() - start) / (rq->switches - switches);
+  }
+  cpu_atomic_fetch_add(&_test_done, 1);
+}
+
+/* Two threads pinned to one CPU yield to each other. */
+base_private void _test_switch_latency(void)
+{
+  sched_thread_t *thread;
+  u64_t cycles;
+  usz_t cpu;
+
+  cpu = _test_cpu_last();
+  cycles = 0;
+  thread = sched_thread_new("test_ping", _test_ping_pong, &cycles, cpu);
+  kernel_assert(thread != NULL);
+  thread = sched_thread_new("test_pong", _test_ping_pong, NULL, cpu);
+  kernel_assert(thread != NULL);
+  _test_wait_done(2);
+  kernel_assert(cycles > 0);
+  log_line_format(LOG_LEVEL_SELF_TEST,
+      "Context switch: %lu cycles, %lu ns", cycles, time_cycles_to_ns(cycles));
+}
+
+base_private void _test_sleeper(vptr_t arg base_may_unuse)
+{
+  for (u64_t i = 0; i < _TEST_WAKES; i++) {
+    while (cpu_atomic_load(&_test_round) <= i) {
+      sched_thread_sleep();
+    }
+    cpu_atomic_fetch_add(&_test_acks, 1);
+  }
+  cpu_atomic_fetch_add(&_test_done, 1);
+}
+
+/* A thread sleeping on another CPU is woken each time that CPU went idle,
+ * and latency of waking it is logged. */
+base_private void _test_idle_wake(void)
+{
+  sched_thread_t *thread;
+  rq_t *rq;
+  u64_t wakes;
+  u64_t cycles;
+  usz_t cpu;
+
+  cpu = _test_cpu_last();
+  rq = &_rqs[cpu];
+  wakes = rq->wakes;
+  cycles = rq->wake_cycles;
+  thread = sched_thread_new("test_sleeper", _test_sleeper, NULL, cpu);
+  kernel_assert(thread != NULL);
+  for (u64_t i = 0; i < _TEST_WAKES; i++) {
+    /* Wait for it to go idle, unless it is this CPU. */
+    while (cpu != 0 && cpu_atomic_load(&rq->sleeping) == 0 &&
+           rq->curr != rq->idle) {
+      cpu_relax();
+    }
+    cpu_atomic_store(&_test_round, i + 1);
+    sched_thread_wake(thread);
+    while (cpu_atomic_load(&_test_acks) <= i) {
+      sched_yield();
+    }
+  }
+  _test_wait_done(1);
+  if (rq->wakes > wakes) {
+    log_line_format(LOG_LEVEL_SELF_TEST,
+        "Wake up from idle: %lu ns avg by %s",
+        time_cycles_to_ns((rq->wake_cycles - cycles) / (rq->wakes - wakes)),
+        _mwait ? "MWAIT" : "IPI");
+  }
+}
+
+void test_sched(void)
+{
+  _test_concurrent();
+  _test_preempt();
+  _test_switch_latency();
+  _test_idle_wake();
+  log_builtin_test_pass();
+}
+#endif
@@ -0,0 +1,235 @@
+/* Executors of stackless async tasks.
+ *
+ * Each CPU has an executor thread pinned to it, running tasks queued to it
+ * one after another. A task always runs on the CPU it is spawned on, so a
+ * task woken while it is still running is only run again after it returns.
+ * Futures are completed from anywhere, IRQ handlers included, and queue the
+ * task awaiting them back to its executor. */
+#include "sched_async.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "log.h"
+#include "sched.h"
+#include "smp.h"
+#include "sync.h"
+
+/* Future state besides a task awaiting it, tasks are never at address 1. */
+#define _FUTURE_PENDING 0
+#define _FUTURE_DONE 1
+
+typedef struct {
+  sync_spin_t lock base_align(64);
+  sched_task_t *head;
+  sched_task_t *tail;
+  sched_thread_t *thread;
+} executor_t;
+
+base_private executor_t _executors[SMP_CPU_MAX];
+
+base_private void _queue(sched_task_t *task)
+{
+  executor_t *executor;
+  u64_t flags;
+
+  if (cpu_atomic_cas(&task->queued, 0, 1)) {
+    executor = &_executors[task->cpu];
+    flags = sync_spin_lock_irqsave(&executor->lock);
+    task->next = NULL;
+    if (executor->tail == NULL) {
+      executor->head = task;
+    } else {
+      executor->tail->next = task;
+    }
+    executor->tail = task;
+    sync_spin_unlock_irqrestore(&executor->lock, flags);
+    sched_thread_wake(executor->thread);
+  }
+}
+
+base_private void _executor_main(vptr_t arg)
+{
+  executor_t *executor;
+  sched_task_t *task;
+  sched_async_t res;
+  u64_t flags;
+
+  executor = arg;
+  while (1) {
+    flags = sync_spin_lock_irqsave(&executor->lock);
+    task = executor->head;
+    if (task != NULL) {
+      executor->head = task->next;
+      if (executor->head == NULL) {
+        executor->tail = NULL;
+      }
+    }
+    sync_spin_unlock_irqrestore(&executor->lock, flags);
+
+    if (task == NULL) {
+      sched_thread_sleep();
+    } else {
+      /* Woken from now on runs it once more. */
+      cpu_atomic_store(&task->queued, 0);
+      res = task->fn(task);
+      if (res == SCHED_ASYNC_YIELD) {
+        _queue(task);
+      } else if (res == SCHED_ASYNC_DONE) {
+        /* Task may be spawned again or be gone after this. */
+        sched_future_complete(&task->done, 0);
+      }
+    }
+  }
+}
+
+void sched_async_bootstrap(void)
+{
+  executor_t *executor;
+
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (sched_cpu_online(i)) {
+      executor = &_executors[i];
+      sync_spin_init(&executor->lock, "sched_async");
+      executor->thread = sched_thread_new("async", _executor_main, executor, i);
+      kernel_assert(executor->thread != NULL);
+    }
+  }
+}
+
+void sched_task_spawn(sched_task_t *task, usz_t cpu)
+{
+  kernel_assert(cpu < SMP_CPU_MAX && _executors[cpu].thread != NULL);
+  task->cpu = cpu;
+  task->resume = 0;
+  task->queued = 0;
+  sched_future_init(&task->done);
+  _queue(task);
+}
+
+void sched_future_init(sched_future_t *future)
+{
+  future->result = 0;
+  cpu_atomic_store(&future->state, _FUTURE_PENDING);
+}
+
+void sched_future_complete(sched_future_t *future, u64_t result)
+{
+  u64_t prev;
+
+  future->result = result;
+  /* Swap is a full barrier, @result is visible once it is done. */
+  prev = cpu_atomic_swap(&future->state, _FUTURE_DONE);
+  kernel_assert(prev != _FUTURE_DONE);
+  if (prev != _FUTURE_PENDING) {
+    _queue((sched_task_t *)prev);
+  }
+}
+
+bo_t sched_future_poll(sched_future_t *future, sched_task_t *task)
+{
+  u64_t state;
+  bo_t done;
+
+  state = cpu_atomic_load(&future->state);
+  done = state == _FUTURE_DONE;
+  if (!done) {
+    kernel_assert(state == _FUTURE_PENDING || state == (u64_t)task);
+    /* Fails only if completed meanwhile, then no one queues the task. */
+    done = !cpu_atomic_cas(&future->state, state, (u64_t)task);
+  }
+  return done;
+}
+
+bo_t sched_future_done(sched_future_t *future)
+{
+  return cpu_atomic_load(&future->state) == _FUTURE_DONE;
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "drivers_hrtimer.h"
+#include "drivers_time.h"
+
+#define _TEST_TASKS 1024
+#define _TEST_ROUNDS 4
+#define _TEST_IO_NS 200000
+
+/* An I/O completed by a timer IRQ, as a device would complete it. */
+typedef struct {
+  sched_task_t task;
+  hrtimer_t timer;
+  sched_future_t io;
+  u64_t round;
+  u64_t sum;
+} test_io_t;
+
+base_private test_io_t _test_ios[_TEST_TASKS];
+base_private volatile u64_t _test_in_flight;
+base_private volatile u64_t _test_in_flight_max;
+
+base_private void _test_io_irq(hrtimer_t *timer)
+{
+  test_io_t *io;
+
+  io = (test_io_t *)((uptr_t)timer - offsetof(test_io_t, timer));
+  cpu_atomic_fetch_add(&_test_in_flight, (u64_t)-1);
+  sched_future_complete(&io->io, io->round + 1);
+}
+
+base_private sched_async_t _test_io_task(sched_task_t *task)
+{
+  test_io_t *io = (test_io_t *)task;
+  u64_t n;
+
+  SCHED_ASYNC_BEGIN(task);
+  for (io->round = 0; io->round < _TEST_ROUNDS; io->round++) {
+    sched_future_init(&io->io);
+    n = cpu_atomic_fetch_add(&_test_in_flight, 1) + 1;
+    /* Racy, but only a statistic. */
+    if (n > cpu_atomic_load(&_test_in_flight_max)) {
+      cpu_atomic_store(&_test_in_flight_max, n);
+    }
+    hrtimer_start(&io->timer, _TEST_IO_NS);
+    SCHED_ASYNC_AWAIT(task, &io->io);
+    io->sum += io->io.result;
+    SCHED_ASYNC_YIELD(task);
+  }
+  SCHED_ASYNC_END(task);
+}
+
+/* Many tasks keep I/Os in flight at once on a few threads, each resumes
+ * after each of its waits exactly once. */
+void test_sched_async(void)
+{
+  usz_t cpu;
+  u64_t start;
+
+  cpu = 0;
+  start = cpu_read_tsc();
+  for (usz_t i = 0; i < _TEST_TASKS; i++) {
+    _test_ios[i].task = (sched_task_t)SCHED_TASK_INIT(_test_io_task);
+    _test_ios[i].timer = (hrtimer_t)HRTIMER_INIT(_test_io_irq);
+    _test_ios[i].sum = 0;
+    while (!sched_cpu_online(cpu)) {
+      cpu = (cpu + 1) % SMP_CPU_MAX;
+    }
+    sched_task_spawn(&_test_ios[i].task, cpu);
+    cpu = (cpu + 1) % SMP_CPU_MAX;
+  }
+
+  for (usz_t i = 0; i < _TEST_TASKS; i++) {
+    while (!sched_future_done(&_test_ios[i].task.done)) {
+      sched_yield();
+    }
+    /* 1 + 2 + ... + _TEST_ROUNDS */
+    kernel_assert(
+        _test_ios[i].sum == _TEST_ROUNDS * (_TEST_ROUNDS + 1) / 2);
+  }
+  kernel_assert(cpu_atomic_load(&_test_in_flight) == 0);
+
+  log_line_format(LOG_LEVEL_SELF_TEST,
+      "%lu async I/Os in %lu us, %lu in flight at most",
+      (u64_t)_TEST_TASKS * _TEST_ROUNDS,
+      time_cycles_to_ns(cpu_read_tsc() - start) / 1000,
+      cpu_atomic_load(&_test_in_flight_max));
+  log_builtin_test_pass();
+}
+#endif
@@ -0,0 +1,142 @@
+/* Work queues, for deferred work which may sleep or take long.
+ *
+ * Each CPU has a worker thread pinned to it, work is queued to the worker of
+ * current CPU, so that data touched by the IRQ handler queued it is likely
+ * still in cache. Works of one worker run one after another, in order they
+ * are queued. */
+#include "cpu.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "sched.h"
+#include "smp.h"
+#include "sync.h"
+
+typedef struct {
+  sync_spin_t lock base_align(64);
+  sched_work_t *head;
+  sched_work_t *tail;
+  sched_thread_t *thread;
+} worker_t;
+
+base_private worker_t _workers[SMP_CPU_MAX];
+
+base_private void _worker_main(vptr_t arg)
+{
+  worker_t *worker;
+  sched_work_t *work;
+  u64_t flags;
+
+  worker = arg;
+  while (1) {
+    flags = sync_spin_lock_irqsave(&worker->lock);
+    work = worker->head;
+    if (work != NULL) {
+      worker->head = work->next;
+      if (worker->head == NULL) {
+        worker->tail = NULL;
+      }
+    }
+    sync_spin_unlock_irqrestore(&worker->lock, flags);
+
+    if (work == NULL) {
+      sched_thread_sleep();
+    } else {
+      /* Queued again from now on runs it once more. */
+      cpu_atomic_store(&work->queued, 0);
+      work->fn(work);
+    }
+  }
+}
+
+void sched_work_bootstrap(void)
+{
+  worker_t *worker;
+
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (sched_cpu_online(i)) {
+      worker = &_workers[i];
+      sync_spin_init(&worker->lock, "sched_work");
+      worker->thread = sched_thread_new("worker", _worker_main, worker, i);
+      kernel_assert(worker->thread != NULL);
+    }
+  }
+}
+
+bo_t sched_work_queue(sched_work_t *work)
+{
+  worker_t *worker;
+  bo_t queued;
+  u64_t flags;
+
+  queued = cpu_atomic_cas(&work->queued, 0, 1);
+  if (queued) {
+    flags = intr_irq_save();
+    worker = &_workers[smp_cpu_idx()];
+    kernel_assert(worker->thread != NULL);
+    sync_spin_lock(&worker->lock);
+    work->next = NULL;
+    if (worker->tail == NULL) {
+      worker->head = work;
+    } else {
+      worker->tail->next = work;
+    }
+    worker->tail = work;
+    sync_spin_unlock(&worker->lock);
+    sched_thread_wake(worker->thread);
+    intr_irq_restore(flags);
+  }
+  return queued;
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#define _TEST_WORKS 16
+
+typedef struct {
+  sched_work_t work; /* Must be the first field */
+  u64_t idx;
+} test_work_t;
+
+base_private test_work_t _test_works[_TEST_WORKS];
+base_private volatile u64_t _test_next;
+base_private volatile u64_t _test_bad;
+
+/* Yields before checking order, the next work must not start meanwhile. */
+base_private void _test_work_fn(sched_work_t *work)
+{
+  test_work_t *test = (test_work_t *)work;
+
+  sched_yield();
+  if (test->idx != cpu_atomic_load(&_test_next)) {
+    cpu_atomic_fetch_add(&_test_bad, 1);
+  }
+  cpu_atomic_fetch_add(&_test_next, 1);
+}
+
+/* Works queued on one CPU run in order, a work queued twice before it starts
+ * runs once. */
+void test_sched_work(void)
+{
+  for (usz_t i = 0; i < _TEST_WORKS; i++) {
+    _test_works[i].work = (sched_work_t)SCHED_WORK_INIT(_test_work_fn);
+    _test_works[i].idx = i;
+  }
+
+  sched_preempt_disable();
+  for (usz_t i = 0; i < _TEST_WORKS; i++) {
+    kernel_assert(sched_work_queue(&_test_works[i].work));
+  }
+  kernel_assert(!sched_work_queue(&_test_works[_TEST_WORKS - 1].work));
+  sched_preempt_enable();
+
+  while (cpu_atomic_load(&_test_next) < _TEST_WORKS) {
+    sched_yield();
+  }
+  for (usz_t i = 0; i < 16; i++) {
+    sched_yield();
+  }
+  kernel_assert(cpu_atomic_load(&_test_next) == _TEST_WORKS);
+  kernel_assert(cpu_atomic_load(&_test_bad) == 0);
+  log_builtin_test_pass();
+}
+#endif
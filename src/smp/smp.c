@@ -0,0 +1,302 @@
+/* Symmetric multiprocessing bring up.
+ *
+ * Application processors (APs) wake up in real mode at a page below 1MB after
+ * receiving INIT and startup IPIs. A trampoline is copied there, it switches
+ * straight to long mode with control registers of bootstrap processor (BSP),
+ * then calls _ap_main on a stack prepared by BSP. APs are started one by one,
+ * so they share one copy of trampoline. Once an AP fails to come online in
+ * time, no more APs are started, so the trampoline keeps its stack and per CPU
+ * area, and it parks itself if it shows up late. Local APIC must be brought up
+ * by d_apic_bootstrap() first. */
+#include "smp.h"
+#include "containers_string.h"
+#include "cpu.h"
+#include "drivers_acpi.h"
+#include "drivers_apic.h"
+#include "drivers_time.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mem.h"
+#include "mm.h"
+#include "sched.h"
+
+/* Trampoline is copied to this physical address, it must be page aligned and
+ * below 1MB, startup IPI carries its page number. */
+#define _TRAMPOLINE_PA 0x8000
+#define _STR(x) #x
+#define _XSTR(x) _STR(x)
+
+#define _MSR_EFER 0xc0000080
+#define _MSR_GS_BASE 0xc0000101
+
+#define _AP_STACK_PG 16
+#define _AP_STACK_NAME_CAP 8
+/* INIT IPI needs 10ms to settle, startup IPI 200us, according to Intel
+ * MultiProcessor Specification. */
+#define _INIT_DELAY_US 10000
+#define _STARTUP_DELAY_US 200
+#define _ONLINE_WAIT_US 1000000
+#define _ONLINE_POLL_US 100
+
+/* Who claims an AP being started, the AP itself or BSP giving up on it. */
+#define _CLAIM_NONE 0
+#define _CLAIM_AP 1
+#define _CLAIM_BSP 2
+
+/* Per CPU area, GS base of each CPU points to its own. */
+typedef struct smp_cpu {
+  struct smp_cpu *self; /* Must be the first field */
+  usz_t idx;
+  u32_t apic_id;
+  mem_stack_t *stack;
+  u64_t start_tsc;           /* When BSP starts to wake it up */
+  volatile u64_t claim;      /* _CLAIM_* */
+  volatile u64_t online_tsc; /* 0 until it is online */
+} smp_cpu_t;
+
+base_private smp_cpu_t _cpus[SMP_CPU_MAX];
+base_private ch_t _stack_names[SMP_CPU_MAX][_AP_STACK_NAME_CAP];
+/* Slots of @_cpus taken, a CPU failed to come online keeps its slot and
+ * stack, as it may still show up late. */
+base_private usz_t _cpu_slots;
+base_private volatile u64_t _cpu_online;
+
+/* Trampoline, its fields are patched after being copied. Code and data
+ * segments of its GDT are the same as boot/boot.asm. */
+__asm__(".pushsection .text\n"
+        ".equ _trampoline_pa, " _XSTR(_TRAMPOLINE_PA) "\n"
+        ".code16\n"
+        "_trampoline_start:\n"
+        "  cli\n"
+        "  cld\n"
+        "  xorw %ax, %ax\n"
+        "  movw %ax, %ds\n"
+        "  movw %ax, %es\n"
+        "  movw %ax, %ss\n"
+        "  lgdtl _trampoline_pa + (_trampoline_gdtr - _trampoline_start)\n"
+        "  movl _trampoline_pa + (_trampoline_cr4 - _trampoline_start), %eax\n"
+        "  movl %eax, %cr4\n"
+        "  movl _trampoline_pa + (_trampoline_cr3 - _trampoline_start), %eax\n"
+        "  movl %eax, %cr3\n"
+        "  movl $" _XSTR(_MSR_EFER) ", %ecx\n"
+        "  movl _trampoline_pa + (_trampoline_efer - _trampoline_start), %eax\n"
+        "  movl _trampoline_pa + (_trampoline_efer - _trampoline_start) + 4,"
+        " %edx\n"
+        "  wrmsr\n"
+        "  movl _trampoline_pa + (_trampoline_cr0 - _trampoline_start), %eax\n"
+        "  movl %eax, %cr0\n"
+        "  ljmpl $0x08, $(_trampoline_pa + (_trampoline_64 -"
+        " _trampoline_start))\n"
+        ".code64\n"
+        "_trampoline_64:\n"
+        "  xorl %eax, %eax\n"
+        "  movw %ax, %ds\n"
+        "  movw %ax, %es\n"
+        "  movw %ax, %ss\n"
+        "  movw %ax, %fs\n"
+        "  movw %ax, %gs\n"
+        "  movq _trampoline_pa + (_trampoline_stack - _trampoline_start),"
+        " %rsp\n"
+        "  movq _trampoline_pa + (_trampoline_arg - _trampoline_start), %rdi\n"
+        "  movq _trampoline_pa + (_trampoline_entry - _trampoline_start),"
+        " %rax\n"
+        "  callq *%rax\n"
+        "1:\n"
+        "  hlt\n"
+        "  jmp 1b\n"
+        "  .balign 8\n"
+        "_trampoline_gdt:\n"
+        "  .quad 0\n"
+        "  .quad 0x00209a0000000000\n"
+        "  .quad 0x0000920000000000\n"
+        "_trampoline_gdtr:\n"
+        "  .word 3 * 8 - 1\n"
+        "  .long _trampoline_pa + (_trampoline_gdt - _trampoline_start)\n"
+        "  .balign 8\n"
+        "_trampoline_cr0:\n"
+        "  .quad 0\n"
+        "_trampoline_cr3:\n"
+        "  .quad 0\n"
+        "_trampoline_cr4:\n"
+        "  .quad 0\n"
+        "_trampoline_efer:\n"
+        "  .quad 0\n"
+        "_trampoline_stack:\n"
+        "  .quad 0\n"
+        "_trampoline_entry:\n"
+        "  .quad 0\n"
+        "_trampoline_arg:\n"
+        "  .quad 0\n"
+        "_trampoline_end:\n"
+        ".popsection\n");
+
+extern byte_t _trampoline_start[];
+extern byte_t _trampoline_cr0[];
+extern byte_t _trampoline_cr3[];
+extern byte_t _trampoline_cr4[];
+extern byte_t _trampoline_efer[];
+extern byte_t _trampoline_stack[];
+extern byte_t _trampoline_entry[];
+extern byte_t _trampoline_arg[];
+extern byte_t _trampoline_end[];
+
+/* Set a field of trampoline copy. */
+base_private void _trampoline_set(byte_t *field, u64_t val)
+{
+  byte_t *dst;
+
+  dst = (byte_t *)(_TRAMPOLINE_PA + (uptr_t)(field - _trampoline_start));
+  mm_copy(dst, (const byte_t *)&val, sizeof(val));
+}
+
+base_private void _cpu_local_set(smp_cpu_t *cpu)
+{
+  cpu_write_msr(_MSR_GS_BASE, (uptr_t)cpu);
+}
+
+/* Entry of APs, called from trampoline. An AP BSP has given up on returns to
+ * halt in trampoline with interrupts disabled. */
+base_private void _ap_main(vptr_t arg)
+{
+  smp_cpu_t *cpu = (smp_cpu_t *)arg;
+
+  if (!cpu_atomic_cas(&cpu->claim, _CLAIM_NONE, _CLAIM_AP)) {
+    return;
+  }
+  _cpu_local_set(cpu);
+  intr_init_ap(cpu->idx);
+  d_apic_init_cpu();
+  cpu_atomic_store(&cpu->online_tsc, cpu_read_tsc());
+  cpu_atomic_fetch_add(&_cpu_online, 1);
+  sched_ap_main();
+}
+
+base_private bo_t _ap_start(smp_cpu_t *cpu)
+{
+  usz_t name_len;
+
+  name_len = 0;
+  name_len += str_buf_marshal_str(
+      _stack_names[cpu->idx], name_len, _AP_STACK_NAME_CAP, "cpu", 3);
+  name_len += str_buf_marshal_uint(
+      _stack_names[cpu->idx], name_len, _AP_STACK_NAME_CAP, cpu->idx);
+  str_buf_marshal_terminator(
+      _stack_names[cpu->idx], name_len, _AP_STACK_NAME_CAP);
+  cpu->stack = mem_stack_new(_stack_names[cpu->idx], _AP_STACK_PG);
+  kernel_assert(cpu->stack != NULL);
+
+  _trampoline_set(_trampoline_stack, mem_stack_bottom(cpu->stack));
+  _trampoline_set(_trampoline_arg, (uptr_t)cpu);
+
+  cpu->start_tsc = cpu_read_tsc();
+  d_apic_send_init(cpu->apic_id);
+  time_delay_us(_INIT_DELAY_US);
+  for (usz_t i = 0; i < 2 && cpu_atomic_load(&cpu->online_tsc) == 0; i++) {
+    d_apic_send_startup(cpu->apic_id, (u8_t)(_TRAMPOLINE_PA >> 12));
+    time_delay_us(_STARTUP_DELAY_US);
+  }
+  for (usz_t waited = 0; waited < _ONLINE_WAIT_US &&
+                         cpu_atomic_load(&cpu->online_tsc) == 0;
+       waited += _ONLINE_POLL_US) {
+    time_delay_us(_ONLINE_POLL_US);
+  }
+  if (cpu_atomic_cas(&cpu->claim, _CLAIM_NONE, _CLAIM_BSP)) {
+    return false;
+  }
+  /* Claimed by the AP just in time, it is about to be online. */
+  while (cpu_atomic_load(&cpu->online_tsc) == 0) {
+    cpu_relax();
+  }
+  return true;
+}
+
+void smp_bootstrap(void)
+{
+  smp_cpu_t *cpu;
+  u32_t apic_id;
+  u64_t cr3;
+
+  cpu = &_cpus[0];
+  cpu->self = cpu;
+  cpu->idx = 0;
+  cpu->online_tsc = cpu_read_tsc();
+  _cpu_local_set(cpu);
+  _cpu_slots = 1;
+  cpu_atomic_store(&_cpu_online, 1);
+
+  if (!d_apic_ready()) {
+    log_line_format(LOG_LEVEL_WARN, "No local APIC, only bootstrap CPU runs");
+  } else {
+    cpu->apic_id = d_apic_id();
+
+    /* Page tables are in kernel image, trampoline loads CR3 in 32 bits. */
+    cr3 = cpu_read_cr3();
+    kernel_assert(cr3 <= U32_MAX);
+    mm_copy((byte_t *)_TRAMPOLINE_PA, _trampoline_start,
+        (usz_t)(_trampoline_end - _trampoline_start));
+    _trampoline_set(_trampoline_cr0, cpu_read_cr0());
+    _trampoline_set(_trampoline_cr3, cr3);
+    _trampoline_set(_trampoline_cr4, cpu_read_cr4());
+    _trampoline_set(_trampoline_efer, cpu_read_msr(_MSR_EFER));
+    _trampoline_set(_trampoline_entry, (uptr_t)_ap_main);
+
+    /* Calibrate before timing CPUs coming online. */
+    time_tsc_khz();
+
+    for (ucnt_t i = 0; i < acpi_cpu_cnt(); i++) {
+      apic_id = acpi_cpu_apic_id(i);
+      if (apic_id == cpu->apic_id) {
+        continue;
+      } else if (_cpu_slots == SMP_CPU_MAX ||
+                 (!d_apic_x2apic() && apic_id > U8_MAX)) {
+        log_line_format(
+            LOG_LEVEL_WARN, "CPU of APIC id %lu ignored", (u64_t)apic_id);
+        continue;
+      }
+
+      cpu = &_cpus[_cpu_slots];
+      cpu->self = cpu;
+      cpu->idx = _cpu_slots;
+      cpu->apic_id = apic_id;
+      _cpu_slots++;
+      if (_ap_start(cpu)) {
+        log_line_format(LOG_LEVEL_INFO,
+            "CPU %lu, APIC id %lu, online in %lu us", (u64_t)cpu->idx,
+            (u64_t)apic_id,
+            time_cycles_to_ns(cpu->online_tsc - cpu->start_tsc) / 1000);
+      } else {
+        log_line_format(LOG_LEVEL_WARN,
+            "CPU %lu, APIC id %lu, not online, no more CPUs started",
+            (u64_t)cpu->idx, (u64_t)apic_id);
+        break;
+      }
+    }
+  }
+  log_line_format(LOG_LEVEL_INFO, "CPUs online: %lu", smp_cpu_cnt());
+}
+
+usz_t smp_cpu_idx(void)
+{
+  usz_t idx;
+  __asm__ volatile("movq %%gs:%c1, %0"
+                   : "=r"(idx)
+                   : "i"(offsetof(smp_cpu_t, idx)));
+  return idx;
+}
+
+ucnt_t smp_cpu_cnt(void)
+{
+  return cpu_atomic_load(&_cpu_online);
+}
+
+bo_t smp_cpu_online(usz_t idx)
+{
+  return idx < _cpu_slots && cpu_atomic_load(&_cpus[idx].online_tsc) != 0;
+}
+
+u32_t smp_cpu_apic_id(usz_t idx)
+{
+  kernel_assert(idx < _cpu_slots);
+  return _cpus[idx].apic_id;
+}
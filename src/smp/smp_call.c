@@ -0,0 +1,228 @@
+/* Remote function calls through IPIs.
+ *
+ * Each CPU has a lock-free queue of calls, pushed by any CPU with CAS and
+ * taken as a whole by its IPI handler. Only the push finding the queue empty
+ * sends an IPI, calls queued before the handler takes them ride on that one,
+ * so a burst of calls to one CPU costs a single IPI. */
+#include "smp.h"
+#include "cpu.h"
+#include "drivers_apic.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "sched.h"
+
+typedef struct {
+  volatile u64_t head base_align(64); /* Last call queued, or 0 */
+  volatile u64_t calls;
+  volatile u64_t ipis;
+} call_queue_t;
+
+base_private call_queue_t _queues[SMP_CPU_MAX];
+
+/* Run calls queued to current CPU, in order they are queued. */
+base_private void _call_ipi(intr_id_t id, intr_parameters_t *para)
+{
+  smp_call_t *list;
+  smp_call_t *call;
+  smp_call_t *next;
+
+  (void)(id + para);
+  list = (smp_call_t *)cpu_atomic_swap(&_queues[smp_cpu_idx()].head, 0);
+  /* Pushed last in first, reverse it. */
+  call = NULL;
+  while (list != NULL) {
+    next = list->next;
+    list->next = call;
+    call = list;
+    list = next;
+  }
+  while (call != NULL) {
+    /* Caller may reuse @call once it is done. */
+    next = call->next;
+    call->fn(call->arg);
+    cpu_atomic_store(&call->done, 1);
+    call = next;
+  }
+}
+
+void smp_call_bootstrap(void)
+{
+  if (d_apic_ready()) {
+    intr_handler_register(INTR_ID_APIC_CALL, _call_ipi);
+  }
+}
+
+void smp_call_async(usz_t cpu, smp_call_t *call)
+{
+  call_queue_t *queue;
+  u64_t head;
+
+  kernel_assert(smp_cpu_online(cpu) && d_apic_ready());
+  queue = &_queues[cpu];
+  call->done = 0;
+  do {
+    head = cpu_atomic_load(&queue->head);
+    call->next = (smp_call_t *)head;
+  } while (!cpu_atomic_cas(&queue->head, head, (uptr_t)call));
+  cpu_atomic_fetch_add(&queue->calls, 1);
+  if (head == 0) {
+    cpu_atomic_fetch_add(&queue->ipis, 1);
+    d_apic_send_ipi(smp_cpu_apic_id(cpu), INTR_ID_APIC_CALL);
+  }
+}
+
+bo_t smp_call_done(smp_call_t *call)
+{
+  return cpu_atomic_load(&call->done) != 0;
+}
+
+void smp_call_function_single(usz_t cpu, smp_call_cb fn, vptr_t arg)
+{
+  smp_call_function_many(u64_literal(1) << cpu, fn, arg);
+}
+
+void smp_call_function_many(u64_t cpus, smp_call_cb fn, vptr_t arg)
+{
+  smp_call_t calls[SMP_CPU_MAX];
+  bo_t self;
+  u64_t flags;
+
+  kernel_assert(intr_irq_enabled());
+  self = false;
+  /* Queue all before waiting for any, so that they run in parallel. */
+  flags = intr_irq_save();
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    calls[i] = (smp_call_t)SMP_CALL_INIT(fn, arg);
+    calls[i].done = 1;
+    if ((cpus & (u64_literal(1) << i)) != 0 && smp_cpu_online(i)) {
+      if (i == smp_cpu_idx()) {
+        self = true;
+      } else {
+        smp_call_async(i, &calls[i]);
+      }
+    }
+  }
+  if (self) {
+    fn(arg);
+  }
+  intr_irq_restore(flags);
+
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    while (!smp_call_done(&calls[i])) {
+      cpu_relax();
+    }
+  }
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "drivers_time.h"
+
+#define _TEST_ROUNDS 1000
+#define _TEST_BURST 64
+
+base_private volatile u64_t _test_runs;
+base_private volatile u64_t _test_bad;
+base_private smp_call_t _test_calls[_TEST_BURST];
+base_private smp_call_t _test_hold_call;
+base_private volatile u64_t _test_held;
+base_private volatile u64_t _test_release;
+
+base_private void _test_count(vptr_t arg base_may_unuse)
+{
+  cpu_atomic_fetch_add(&_test_runs, 1);
+}
+
+/* Calls of a burst must run in order they are queued. */
+base_private void _test_order(vptr_t arg)
+{
+  if (cpu_atomic_fetch_add(&_test_runs, 1) != (u64_t)arg) {
+    cpu_atomic_fetch_add(&_test_bad, 1);
+  }
+}
+
+/* Keep target CPU busy in its IPI handler until released, its queue has been
+ * taken empty by then. */
+base_private void _test_hold(vptr_t arg base_may_unuse)
+{
+  cpu_atomic_store(&_test_held, 1);
+  while (cpu_atomic_load(&_test_release) == 0) {
+    cpu_relax();
+  }
+}
+
+/* A call to each CPU online runs once, a burst of calls to one CPU runs in
+ * order by a single IPI, and IPI round trip latency is logged. */
+void test_smp_call(void)
+{
+  call_queue_t *queue;
+  usz_t other;
+  u64_t calls;
+  u64_t ipis;
+  u64_t start;
+  u64_t flags;
+
+  smp_call_function_many(U64_MAX, _test_count, NULL);
+  kernel_assert(cpu_atomic_load(&_test_runs) == smp_cpu_cnt());
+
+  /* Another CPU online, if any. */
+  sched_preempt_disable();
+  flags = intr_irq_save();
+  other = smp_cpu_idx();
+  intr_irq_restore(flags);
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (i != other && smp_cpu_online(i)) {
+      other = i;
+      break;
+    }
+  }
+  sched_preempt_enable();
+
+  if (smp_cpu_cnt() > 1 && d_apic_ready()) {
+    start = cpu_read_tsc();
+    for (usz_t i = 0; i < _TEST_ROUNDS; i++) {
+      smp_call_function_single(other, _test_count, NULL);
+    }
+    start = cpu_read_tsc() - start;
+    log_line_format(LOG_LEVEL_SELF_TEST, "IPI call round trip: %lu ns",
+        time_cycles_to_ns(start / _TEST_ROUNDS));
+
+    /* Burst is queued while target is held, so that it can not take calls
+     * before all are queued, whatever the timing. */
+    cpu_atomic_store(&_test_held, 0);
+    cpu_atomic_store(&_test_release, 0);
+    _test_hold_call = (smp_call_t)SMP_CALL_INIT(_test_hold, NULL);
+    smp_call_async(other, &_test_hold_call);
+    while (cpu_atomic_load(&_test_held) == 0) {
+      cpu_relax();
+    }
+
+    queue = &_queues[other];
+    calls = cpu_atomic_load(&queue->calls);
+    ipis = cpu_atomic_load(&queue->ipis);
+    cpu_atomic_store(&_test_runs, 0);
+    flags = intr_irq_save();
+    for (usz_t i = 0; i < _TEST_BURST; i++) {
+      _test_calls[i] = (smp_call_t)SMP_CALL_INIT(_test_order, (vptr_t)i);
+      smp_call_async(other, &_test_calls[i]);
+    }
+    intr_irq_restore(flags);
+    cpu_atomic_store(&_test_release, 1);
+    while (!smp_call_done(&_test_hold_call)) {
+      cpu_relax();
+    }
+    for (usz_t i = 0; i < _TEST_BURST; i++) {
+      while (!smp_call_done(&_test_calls[i])) {
+        cpu_relax();
+      }
+    }
+    calls = cpu_atomic_load(&queue->calls) - calls;
+    ipis = cpu_atomic_load(&queue->ipis) - ipis;
+    kernel_assert(calls == _TEST_BURST && ipis == 1);
+    kernel_assert(cpu_atomic_load(&_test_bad) == 0);
+    log_line_format(LOG_LEVEL_SELF_TEST, "%lu async calls sent by %lu IPIs",
+        calls, ipis);
+  }
+  log_builtin_test_pass();
+}
+#endif
@@ -0,0 +1,388 @@
+/* Spin locks.
+ *
+ * Spin locks disable preemption while held, so a thread never spins for a
+ * lock whose holder is switched out on the same CPU. Variants disabling IRQs
+ * are for locks also taken by IRQ handlers, or by code running with IRQs
+ * disabled, like page fault handler and scheduler.
+ *
+ * With BUILD_LOCK_STAT_ENABLED on, each lock records acquisitions and cycles
+ * waited for it. Cycles are only read when a lock is found held, so locks
+ * never contended cost just the counting. */
+#include "cpu.h"
+#include "drivers_time.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "sched.h"
+#include "smp.h"
+#include "sync_private.h"
+
+#ifdef BUILD_LOCK_STAT_ENABLED
+/* Most locks sync_stat_report() logs. */
+#define _STAT_TOP_CAP 32
+
+/* Locks ever acquired, the list only grows. */
+base_private volatile u64_t _stats;
+
+void sync_stat_init(sync_stat_t *stat, const ch_t *name)
+{
+  kernel_assert(stat->listed == 0);
+  stat->name = name;
+}
+
+u64_t sync_stat_clock(void)
+{
+  return cpu_read_tsc();
+}
+
+void sync_stat_record(sync_stat_t *stat, u64_t wait_start)
+{
+  u64_t wait;
+  u64_t max;
+  u64_t head;
+
+  if (cpu_atomic_load(&stat->listed) == 0 &&
+      cpu_atomic_cas(&stat->listed, 0, 1)) {
+    do {
+      head = cpu_atomic_load(&_stats);
+      stat->next = (sync_stat_t *)head;
+    } while (!cpu_atomic_cas(&_stats, head, (uptr_t)stat));
+  }
+
+  cpu_atomic_fetch_add(&stat->acquired, 1);
+  if (wait_start != 0) {
+    wait = cpu_read_tsc() - wait_start;
+    cpu_atomic_fetch_add(&stat->contended, 1);
+    cpu_atomic_fetch_add(&stat->wait_total, wait);
+    for (max = cpu_atomic_load(&stat->wait_max); wait > max;
+         max = cpu_atomic_load(&stat->wait_max)) {
+      if (cpu_atomic_cas(&stat->wait_max, max, wait)) {
+        break;
+      }
+    }
+  }
+}
+
+void sync_stat_report(ucnt_t top_n)
+{
+  sync_stat_t *top[_STAT_TOP_CAP];
+  sync_stat_t *stat;
+  usz_t n;
+  usz_t i;
+
+  if (top_n > _STAT_TOP_CAP) {
+    top_n = _STAT_TOP_CAP;
+  }
+
+  /* Insertion sort by total wait, the list is short. */
+  n = 0;
+  for (stat = (sync_stat_t *)cpu_atomic_load(&_stats); stat != NULL;
+       stat = stat->next) {
+    for (i = n; i > 0 && top[i - 1]->wait_total < stat->wait_total; i--) {
+      if (i < top_n) {
+        top[i] = top[i - 1];
+      }
+    }
+    if (i < top_n) {
+      top[i] = stat;
+      if (n < top_n) {
+        n++;
+      }
+    }
+  }
+
+  log_line_format(LOG_LEVEL_INFO, "Locks contended the most:");
+  for (i = 0; i < n; i++) {
+    stat = top[i];
+    log_line_format(LOG_LEVEL_INFO,
+        "  %s: acquired %lu, contended %lu, wait total %lu max %lu cycles",
+        stat->name == NULL ? "unnamed" : stat->name, stat->acquired,
+        stat->contended, stat->wait_total, stat->wait_max);
+  }
+}
+#endif
+
+base_private void _spin_acquire(sync_spin_t *lock)
+{
+  u64_t ticket;
+  u64_t start;
+
+  ticket = cpu_atomic_fetch_add(&lock->next, 1);
+  start = 0;
+  if (cpu_atomic_load(&lock->owner) != ticket) {
+    start = sync_stat_clock();
+    while (cpu_atomic_load(&lock->owner) != ticket) {
+      cpu_relax();
+    }
+  }
+  sync_stat_lock_record(lock, start);
+}
+
+base_private void _spin_release(sync_spin_t *lock)
+{
+  /* Only the holder writes @owner. */
+  cpu_atomic_store(&lock->owner, lock->owner + 1);
+}
+
+void sync_spin_init(sync_spin_t *lock, const ch_t *name)
+{
+  lock->next = 0;
+  lock->owner = 0;
+  sync_stat_lock_init(lock, name);
+}
+
+void sync_spin_lock(sync_spin_t *lock)
+{
+  sched_preempt_disable();
+  _spin_acquire(lock);
+}
+
+void sync_spin_unlock(sync_spin_t *lock)
+{
+  _spin_release(lock);
+  sched_preempt_enable();
+}
+
+base_must_check bo_t sync_spin_try_lock(sync_spin_t *lock)
+{
+  u64_t owner;
+  bo_t ok;
+
+  sched_preempt_disable();
+  owner = cpu_atomic_load(&lock->owner);
+  ok = cpu_atomic_cas(&lock->next, owner, owner + 1);
+  if (ok) {
+    sync_stat_lock_record(lock, 0);
+  } else {
+    sched_preempt_enable();
+  }
+  return ok;
+}
+
+u64_t sync_spin_lock_irqsave(sync_spin_t *lock)
+{
+  u64_t flags;
+
+  flags = intr_irq_save();
+  _spin_acquire(lock);
+  return flags;
+}
+
+void sync_spin_unlock_irqrestore(sync_spin_t *lock, u64_t flags)
+{
+  _spin_release(lock);
+  intr_irq_restore(flags);
+}
+
+base_private void _mcs_acquire(sync_mcs_t *lock, sync_mcs_node_t *node)
+{
+  sync_mcs_node_t *prev;
+  u64_t start;
+
+  node->next = NULL;
+  node->waiting = 1;
+  prev = (sync_mcs_node_t *)cpu_atomic_swap(&lock->tail, (uptr_t)node);
+  start = 0;
+  if (prev != NULL) {
+    start = sync_stat_clock();
+    prev->next = node;
+    while (cpu_atomic_load(&node->waiting) != 0) {
+      cpu_relax();
+    }
+  }
+  sync_stat_lock_record(lock, start);
+}
+
+base_private void _mcs_release(sync_mcs_t *lock, sync_mcs_node_t *node)
+{
+  sync_mcs_node_t *next;
+
+  next = node->next;
+  if (next == NULL && !cpu_atomic_cas(&lock->tail, (uptr_t)node, 0)) {
+    /* A waiter swapped itself in, but has not linked to @node yet. */
+    while ((next = node->next) == NULL) {
+      cpu_relax();
+    }
+  }
+  if (next != NULL) {
+    cpu_atomic_store(&next->waiting, 0);
+  }
+}
+
+void sync_mcs_init(sync_mcs_t *lock, const ch_t *name)
+{
+  lock->tail = 0;
+  sync_stat_lock_init(lock, name);
+}
+
+void sync_mcs_lock(sync_mcs_t *lock, sync_mcs_node_t *node)
+{
+  sched_preempt_disable();
+  _mcs_acquire(lock, node);
+}
+
+void sync_mcs_unlock(sync_mcs_t *lock, sync_mcs_node_t *node)
+{
+  _mcs_release(lock, node);
+  sched_preempt_enable();
+}
+
+u64_t sync_mcs_lock_irqsave(sync_mcs_t *lock, sync_mcs_node_t *node)
+{
+  u64_t flags;
+
+  flags = intr_irq_save();
+  _mcs_acquire(lock, node);
+  return flags;
+}
+
+void sync_mcs_unlock_irqrestore(
+    sync_mcs_t *lock, sync_mcs_node_t *node, u64_t flags)
+{
+  _mcs_release(lock, node);
+  intr_irq_restore(flags);
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#define _TEST_LOOPS 20000
+
+typedef enum {
+  _TEST_LOCK_SPIN,
+  _TEST_LOCK_MCS,
+  _TEST_LOCK_RW,
+  _TEST_LOCK_SEQ,
+} test_lock_t;
+
+base_private sync_spin_t _test_spin = SYNC_SPIN_INIT("test_spin");
+base_private sync_mcs_t _test_mcs = SYNC_MCS_INIT("test_mcs");
+base_private sync_rw_t _test_rw = SYNC_RW_INIT("test_rw");
+base_private sync_seq_t _test_seq = SYNC_SEQ_INIT("test_seq");
+base_private sync_spin_t _test_try = SYNC_SPIN_INIT("test_try");
+/* Written under locks being tested without atomic operations, @_test_b is
+ * always twice of @_test_a out of write sections. */
+base_private volatile u64_t _test_a;
+base_private volatile u64_t _test_b;
+base_private volatile u64_t _test_done;
+base_private volatile u64_t _test_cycles;
+
+base_private void _test_write(void)
+{
+  _test_a = _test_a + 1;
+  _test_b = _test_a * 2;
+}
+
+base_private void _test_worker(vptr_t arg)
+{
+  test_lock_t kind = (test_lock_t)(uptr_t)arg;
+  sync_mcs_node_t node;
+  u64_t start;
+  u64_t seq;
+  u64_t a;
+  u64_t b;
+
+  start = cpu_read_tsc();
+  for (usz_t i = 0; i < _TEST_LOOPS; i++) {
+    switch (kind) {
+    case _TEST_LOCK_SPIN:
+      sync_spin_lock(&_test_spin);
+      _test_write();
+      sync_spin_unlock(&_test_spin);
+      break;
+    case _TEST_LOCK_MCS:
+      sync_mcs_lock(&_test_mcs, &node);
+      _test_write();
+      sync_mcs_unlock(&_test_mcs, &node);
+      break;
+    case _TEST_LOCK_RW:
+      /* One write out of 8 reads. */
+      if (i % 8 == 0) {
+        sync_rw_write_lock(&_test_rw);
+        _test_write();
+        sync_rw_write_unlock(&_test_rw);
+      } else {
+        sync_rw_read_lock(&_test_rw);
+        kernel_assert(_test_b == _test_a * 2);
+        sync_rw_read_unlock(&_test_rw);
+      }
+      break;
+    case _TEST_LOCK_SEQ:
+      if (i % 8 == 0) {
+        sync_seq_write_begin(&_test_seq);
+        _test_write();
+        sync_seq_write_end(&_test_seq);
+      } else {
+        do {
+          seq = sync_seq_read_begin(&_test_seq);
+          a = _test_a;
+          b = _test_b;
+        } while (sync_seq_read_retry(&_test_seq, seq));
+        kernel_assert(b == a * 2);
+      }
+      break;
+    default:
+      kernel_panic("Unknown lock kind");
+      break;
+    }
+  }
+  cpu_atomic_fetch_add(&_test_cycles, cpu_read_tsc() - start);
+  cpu_atomic_fetch_add(&_test_done, 1);
+}
+
+/* Hammer lock of @kind from a thread on each CPU, log cycles per critical
+ * section, which grow with CPUs once the lock stops scaling. */
+base_private void _test_contended(test_lock_t kind, const ch_t *name)
+{
+  sched_thread_t *thread;
+  ucnt_t n;
+  u64_t writes;
+  u64_t cycles;
+
+  n = smp_cpu_cnt();
+  _test_a = 0;
+  _test_b = 0;
+  cpu_atomic_store(&_test_done, 0);
+  cpu_atomic_store(&_test_cycles, 0);
+  for (usz_t i = 0; i < n; i++) {
+    thread = sched_thread_new(
+        "test_sync", _test_worker, (vptr_t)(uptr_t)kind, SCHED_CPU_ANY);
+    kernel_assert(thread != NULL);
+  }
+  while (cpu_atomic_load(&_test_done) < n) {
+    sched_yield();
+  }
+
+  writes = kind == _TEST_LOCK_SPIN || kind == _TEST_LOCK_MCS
+               ? _TEST_LOOPS
+               : _TEST_LOOPS / 8;
+  kernel_assert(_test_a == n * writes);
+  kernel_assert(_test_b == _test_a * 2);
+  cycles = cpu_atomic_load(&_test_cycles) / (n * _TEST_LOOPS);
+  log_line_format(LOG_LEVEL_SELF_TEST,
+      "%s lock, %lu threads: %lu cycles, %lu ns per critical section", name,
+      n, cycles, time_cycles_to_ns(cycles));
+}
+
+base_private void _test_try_lock(void)
+{
+  bo_t ok;
+
+  ok = sync_spin_try_lock(&_test_try);
+  kernel_assert(ok);
+  ok = sync_spin_try_lock(&_test_try);
+  kernel_assert(!ok);
+  sync_spin_unlock(&_test_try);
+  ok = sync_spin_try_lock(&_test_try);
+  kernel_assert(ok);
+  sync_spin_unlock(&_test_try);
+}
+
+void test_sync(void)
+{
+  _test_try_lock();
+  _test_contended(_TEST_LOCK_SPIN, "Ticket");
+  _test_contended(_TEST_LOCK_MCS, "MCS");
+  _test_contended(_TEST_LOCK_RW, "Reader writer");
+  _test_contended(_TEST_LOCK_SEQ, "Sequence");
+  log_builtin_test_pass();
+}
+#endif
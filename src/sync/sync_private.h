@@ -0,0 +1,28 @@
+/* Private header of synchronization primitives. */
+#ifndef ___SYNC_PRIVATE
+#define ___SYNC_PRIVATE
+
+#include "sync.h"
+
+#ifdef BUILD_LOCK_STAT_ENABLED
+void sync_stat_init(sync_stat_t *stat, const ch_t *name);
+/* Start of waiting for a lock, only read when it is contended. */
+u64_t sync_stat_clock(void);
+/* Record an acquisition of lock, @wait_start is 0 if it did not wait. */
+void sync_stat_record(sync_stat_t *stat, u64_t wait_start);
+#define sync_stat_lock_init(lock, name) sync_stat_init(&(lock)->stat, name)
+#define sync_stat_lock_record(lock, wait_start)                                \
+  sync_stat_record(&(lock)->stat, wait_start)
+#else
+#define sync_stat_clock() u64_literal(1)
+#define sync_stat_lock_init(lock, name)                                        \
+  do {                                                                         \
+    (void)(name);                                                              \
+  } while (0)
+#define sync_stat_lock_record(lock, wait_start)                                \
+  do {                                                                         \
+    (void)(wait_start);                                                        \
+  } while (0)
+#endif
+
+#endif
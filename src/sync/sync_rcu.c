@@ -0,0 +1,260 @@
+/* Read copy update.
+ *
+ * Readers of a table only disable preemption, or run with IRQs disabled,
+ * like IRQ handlers do. Writers publish a new copy with sync_rcu_assign(),
+ * and free the old one once every CPU has passed a quiescent state, a point
+ * where it can not be in a read section any more. Scheduler reports one on
+ * each call of it, which never happens in a read section, see sync_rcu_qs().
+ *
+ * Each CPU only bumps its own counter, a grace period ends when counters of
+ * all CPUs online have changed since it started, or they are idle, which may
+ * last long as idle CPUs take no timer IRQs. Callbacks of sync_rcu_call()
+ * are batched, a batch waits for one grace period, and is run by idle
+ * threads, or by the next sync_rcu_call() from a thread. */
+#include "cpu.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "sched.h"
+#include "smp.h"
+#include "sync_private.h"
+
+typedef struct {
+  volatile u64_t qs base_align(64); /* Quiescent states passed */
+  volatile u64_t idle;              /* Waiting for IRQs in idle thread */
+} rcu_cpu_t;
+
+base_private rcu_cpu_t _cpus[SMP_CPU_MAX];
+/* Protects callback lists below. */
+base_private sync_spin_t _lock = SYNC_SPIN_INIT("sync_rcu");
+/* Callbacks not waiting for a grace period yet. */
+base_private sync_rcu_head_t *_pending;
+/* Callbacks waiting for grace period started at @_waiting_snap. */
+base_private sync_rcu_head_t *_waiting;
+base_private u64_t _waiting_snap[SMP_CPU_MAX];
+
+base_private void _gp_start(u64_t snap[SMP_CPU_MAX])
+{
+  /* Removals before are seen by CPUs found idle later, once they leave. */
+  cpu_mfence();
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    snap[i] = _cpus[i].qs;
+  }
+}
+
+/* CPUs not taking threads, or idle, run no readers. */
+base_private bo_t _gp_done(const u64_t snap[SMP_CPU_MAX])
+{
+  bo_t done;
+
+  done = true;
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    if (sched_cpu_online(i) && cpu_atomic_load(&_cpus[i].idle) == 0 &&
+        _cpus[i].qs == snap[i]) {
+      done = false;
+      break;
+    }
+  }
+  return done;
+}
+
+void sync_rcu_read_lock(void)
+{
+  sched_preempt_disable();
+}
+
+void sync_rcu_read_unlock(void)
+{
+  sched_preempt_enable();
+}
+
+void sync_rcu_qs(void)
+{
+  _cpus[smp_cpu_idx()].qs++;
+}
+
+void sync_rcu_idle_enter(void)
+{
+  cpu_atomic_store(&_cpus[smp_cpu_idx()].idle, 1);
+}
+
+void sync_rcu_idle_exit(void)
+{
+  cpu_atomic_store(&_cpus[smp_cpu_idx()].idle, 0);
+}
+
+void sync_rcu_irq_enter(void)
+{
+  rcu_cpu_t *cpu;
+
+  cpu = &_cpus[smp_cpu_idx()];
+  if (cpu->idle != 0) {
+    cpu_atomic_store(&cpu->idle, 0);
+  }
+}
+
+void sync_rcu_synchronize(void)
+{
+  u64_t snap[SMP_CPU_MAX];
+
+  kernel_assert(sched_preempt_enabled());
+  kernel_assert(!intr_in_irq());
+
+  _gp_start(snap);
+  while (!_gp_done(snap)) {
+    /* Passes a quiescent state of current CPU as well. */
+    sched_yield();
+  }
+}
+
+void sync_rcu_call(sync_rcu_head_t *head, sync_rcu_cb fn)
+{
+  u64_t flags;
+
+  head->fn = fn;
+  flags = sync_spin_lock_irqsave(&_lock);
+  head->next = _pending;
+  _pending = head;
+  sync_spin_unlock_irqrestore(&_lock, flags);
+
+  /* Callbacks may take locks, never run them in IRQ handlers. */
+  if (intr_irq_enabled()) {
+    sync_rcu_poll();
+  }
+}
+
+void sync_rcu_poll(void)
+{
+  sync_rcu_head_t *done;
+  sync_rcu_head_t *head;
+  u64_t flags;
+
+  done = NULL;
+  flags = sync_spin_lock_irqsave(&_lock);
+  if (_waiting != NULL && _gp_done(_waiting_snap)) {
+    done = _waiting;
+    _waiting = NULL;
+  }
+  if (_waiting == NULL && _pending != NULL) {
+    _waiting = _pending;
+    _pending = NULL;
+    _gp_start(_waiting_snap);
+  }
+  sync_spin_unlock_irqrestore(&_lock, flags);
+
+  while (done != NULL) {
+    head = done;
+    done = head->next;
+    head->fn(head);
+  }
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "drivers_time.h"
+
+#define _TEST_SLOTS 8
+#define _TEST_UPDATES 200
+#define _TEST_ALIVE 0x5a5a
+#define _TEST_DEAD 0xdead
+
+typedef struct {
+  sync_rcu_head_t rcu; /* Must be the first field */
+  volatile u64_t magic;
+  volatile u64_t used;
+} test_obj_t;
+
+base_private test_obj_t _test_objs[_TEST_SLOTS];
+base_private test_obj_t *_test_ptr;
+base_private volatile u64_t _test_stop;
+base_private volatile u64_t _test_done;
+
+base_private void _test_reader(vptr_t arg base_may_unuse)
+{
+  test_obj_t *obj;
+
+  while (cpu_atomic_load(&_test_stop) == 0) {
+    sync_rcu_read_lock();
+    obj = sync_rcu_deref(_test_ptr);
+    /* Stay a while, updates must wait for us. */
+    for (usz_t i = 0; i < 64; i++) {
+      kernel_assert(obj->magic == _TEST_ALIVE);
+      cpu_relax();
+    }
+    sync_rcu_read_unlock();
+  }
+  cpu_atomic_fetch_add(&_test_done, 1);
+}
+
+base_private void _test_free(sync_rcu_head_t *head)
+{
+  test_obj_t *obj = (test_obj_t *)head;
+
+  obj->magic = _TEST_DEAD;
+  cpu_atomic_store(&obj->used, 0);
+}
+
+base_private test_obj_t *_test_obj_new(void)
+{
+  test_obj_t *obj;
+
+  obj = NULL;
+  while (obj == NULL) {
+    for (usz_t i = 0; i < _TEST_SLOTS; i++) {
+      if (cpu_atomic_cas(&_test_objs[i].used, 0, 1)) {
+        obj = &_test_objs[i];
+        break;
+      }
+    }
+    if (obj == NULL) {
+      /* All slots wait for grace periods. */
+      sync_rcu_poll();
+      sched_yield();
+    }
+  }
+  obj->magic = _TEST_ALIVE;
+  return obj;
+}
+
+/* Replace object read by a reader on each CPU, old ones are freed with
+ * deferred callbacks, and with waiting for grace periods in turn. */
+void test_sync_rcu(void)
+{
+  test_obj_t *old;
+  test_obj_t *obj;
+  ucnt_t n;
+  u64_t start;
+  u64_t cycles;
+
+  _test_ptr = _test_obj_new();
+  n = smp_cpu_cnt();
+  for (usz_t i = 0; i < n; i++) {
+    kernel_assert(sched_thread_new("test_rcu", _test_reader, NULL,
+                      SCHED_CPU_ANY) != NULL);
+  }
+
+  cycles = 0;
+  for (usz_t i = 0; i < _TEST_UPDATES; i++) {
+    obj = _test_obj_new();
+    old = _test_ptr;
+    sync_rcu_assign(_test_ptr, obj);
+    if (i % 2 == 0) {
+      sync_rcu_call(&old->rcu, _test_free);
+    } else {
+      start = cpu_read_tsc();
+      sync_rcu_synchronize();
+      cycles += cpu_read_tsc() - start;
+      _test_free(&old->rcu);
+    }
+  }
+
+  cpu_atomic_store(&_test_stop, 1);
+  while (cpu_atomic_load(&_test_done) < n) {
+    sched_yield();
+  }
+  cycles /= _TEST_UPDATES / 2;
+  log_line_format(LOG_LEVEL_SELF_TEST,
+      "Grace period with %lu readers: %lu us", n,
+      time_cycles_to_ns(cycles) / 1000);
+  log_builtin_test_pass();
+}
+#endif
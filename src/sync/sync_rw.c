@@ -0,0 +1,175 @@
+/* Reader writer locks and sequence locks. */
+#include "cpu.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "sched.h"
+#include "sync_private.h"
+
+/* Held by a writer, or a writer is waiting for readers to leave. Lower bits
+ * count readers. */
+#define _RW_WRITER 63
+
+base_private void _rw_read_acquire(sync_rw_t *lock)
+{
+  u64_t state;
+  u64_t start;
+
+  start = 0;
+  while (true) {
+    state = cpu_atomic_load(&lock->state);
+    if ((state & (u64_literal(1) << _RW_WRITER)) == 0 &&
+        cpu_atomic_cas(&lock->state, state, state + 1)) {
+      break;
+    }
+    if (start == 0) {
+      start = sync_stat_clock();
+    }
+    cpu_relax();
+  }
+  sync_stat_lock_record(lock, start);
+}
+
+base_private void _rw_read_release(sync_rw_t *lock)
+{
+  kernel_assert_d(
+      (cpu_atomic_load(&lock->state) & ~(u64_literal(1) << _RW_WRITER)) > 0);
+  /* Adding all ones is subtracting one. */
+  cpu_atomic_fetch_add(&lock->state, U64_MAX);
+}
+
+base_private void _rw_write_acquire(sync_rw_t *lock)
+{
+  u64_t start;
+
+  start = 0;
+  /* Take the writer bit first, new readers wait from now on. */
+  while (cpu_atomic_bit_test_and_set(&lock->state, _RW_WRITER)) {
+    if (start == 0) {
+      start = sync_stat_clock();
+    }
+    cpu_relax();
+  }
+  while (cpu_atomic_load(&lock->state) != (u64_literal(1) << _RW_WRITER)) {
+    if (start == 0) {
+      start = sync_stat_clock();
+    }
+    cpu_relax();
+  }
+  sync_stat_lock_record(lock, start);
+}
+
+base_private void _rw_write_release(sync_rw_t *lock)
+{
+  cpu_atomic_bit_clear(&lock->state, _RW_WRITER);
+}
+
+void sync_rw_init(sync_rw_t *lock, const ch_t *name)
+{
+  lock->state = 0;
+  sync_stat_lock_init(lock, name);
+}
+
+void sync_rw_read_lock(sync_rw_t *lock)
+{
+  sched_preempt_disable();
+  _rw_read_acquire(lock);
+}
+
+void sync_rw_read_unlock(sync_rw_t *lock)
+{
+  _rw_read_release(lock);
+  sched_preempt_enable();
+}
+
+void sync_rw_write_lock(sync_rw_t *lock)
+{
+  sched_preempt_disable();
+  _rw_write_acquire(lock);
+}
+
+void sync_rw_write_unlock(sync_rw_t *lock)
+{
+  _rw_write_release(lock);
+  sched_preempt_enable();
+}
+
+u64_t sync_rw_read_lock_irqsave(sync_rw_t *lock)
+{
+  u64_t flags;
+
+  flags = intr_irq_save();
+  _rw_read_acquire(lock);
+  return flags;
+}
+
+void sync_rw_read_unlock_irqrestore(sync_rw_t *lock, u64_t flags)
+{
+  _rw_read_release(lock);
+  intr_irq_restore(flags);
+}
+
+u64_t sync_rw_write_lock_irqsave(sync_rw_t *lock)
+{
+  u64_t flags;
+
+  flags = intr_irq_save();
+  _rw_write_acquire(lock);
+  return flags;
+}
+
+void sync_rw_write_unlock_irqrestore(sync_rw_t *lock, u64_t flags)
+{
+  _rw_write_release(lock);
+  intr_irq_restore(flags);
+}
+
+void sync_seq_init(sync_seq_t *lock, const ch_t *name)
+{
+  lock->seq = 0;
+  sync_spin_init(&lock->writer, name);
+}
+
+u64_t sync_seq_read_begin(sync_seq_t *lock)
+{
+  u64_t seq;
+
+  for (seq = cpu_atomic_load(&lock->seq); (seq & 1) != 0;
+       seq = cpu_atomic_load(&lock->seq)) {
+    cpu_relax();
+  }
+  return seq;
+}
+
+bo_t sync_seq_read_retry(sync_seq_t *lock, u64_t seq)
+{
+  /* Loads are not reordered with older loads on x86, so data read since
+   * sync_seq_read_begin() is older than this. */
+  return cpu_atomic_load(&lock->seq) != seq;
+}
+
+void sync_seq_write_begin(sync_seq_t *lock)
+{
+  sync_spin_lock(&lock->writer);
+  cpu_atomic_store(&lock->seq, lock->seq + 1);
+}
+
+void sync_seq_write_end(sync_seq_t *lock)
+{
+  cpu_atomic_store(&lock->seq, lock->seq + 1);
+  sync_spin_unlock(&lock->writer);
+}
+
+u64_t sync_seq_write_begin_irqsave(sync_seq_t *lock)
+{
+  u64_t flags;
+
+  flags = sync_spin_lock_irqsave(&lock->writer);
+  cpu_atomic_store(&lock->seq, lock->seq + 1);
+  return flags;
+}
+
+void sync_seq_write_end_irqrestore(sync_seq_t *lock, u64_t flags)
+{
+  cpu_atomic_store(&lock->seq, lock->seq + 1);
+  sync_spin_unlock_irqrestore(&lock->writer, flags);
+}
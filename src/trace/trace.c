@@ -0,0 +1,299 @@
+/* Static tracepoints.
+ *
+ * Tracepoints are macros compiled into the code traced, each checks the bit
+ * of its event and does nothing more if it is off. An event enabled writes a
+ * fixed size binary record, stamped with TSC, to the ring of current CPU,
+ * with IRQs disabled, so that an IRQ handler tracing never runs over a
+ * record half written and each ring has one producer. Records are dropped
+ * once a ring is full, until trace_dump() drains it.
+ *
+ * Dumps are lines of "TRACE " followed by "BEGIN" with TSC cycles per
+ * second, "EVENT" with id, name and fields of each event, hex encoded
+ * trace_rec_t of each record, and "END" with records dropped. Code addresses
+ * in records are preceded by "SYM" with the address and its symbol, which
+ * only the kernel knows. */
+#include "trace.h"
+#include "containers_ring.h"
+#include "containers_string.h"
+#include "cpu.h"
+#include "drivers_serial.h"
+#include "drivers_time.h"
+#include "interrupts.h"
+#include "kernel_panic.h"
+#include "kernel_sym.h"
+#include "log.h"
+#include "smp.h"
+
+#define _FIELDS_MAX 3
+#define _RECS 1024
+#define _LINE_PREFIX "TRACE "
+
+/* Binary record, dumped as is in hex. */
+typedef struct {
+  u64_t tsc;
+  u32_t event;
+  u32_t cpu;
+  u64_t fields[_FIELDS_MAX];
+} trace_rec_t;
+
+/* Fields are named "name:x" for hex, "name:d" for decimal, "name:s" for
+ * code addresses, unused ones are NULL. */
+typedef struct {
+  const ch_t *name;
+  const ch_t *fields[_FIELDS_MAX];
+} event_t;
+
+/* Indexed by trace_event_t. */
+base_private const event_t _EVENTS[TRACE_EVENT_MAX] = {
+    {"heap_alloc", {"block:x", "len:d", NULL}},
+    {"heap_free", {"block:x", NULL, NULL}},
+    {"frame_alloc", {"frame:x", NULL, NULL}},
+    {"frame_free", {"frame:x", NULL, NULL}},
+    {"page_map", {"va:x", "pa:x", "pages:d"}},
+    {"irq_entry", {"vector:d", "ip:s", NULL}},
+    {"irq_exit", {"vector:d", "cycles:d", NULL}},
+    {"pcie_cfg_read", {"bdf:x", "off:x", "val:x"}},
+    {"pcie_cfg_write", {"bdf:x", "off:x", "val:x"}},
+};
+
+typedef struct {
+  ring_t ring;
+  volatile u64_t drops;
+} trace_cpu_t;
+
+volatile u64_t trace_events_on;
+base_private trace_cpu_t _cpus[SMP_CPU_MAX];
+base_private trace_rec_t _recs[SMP_CPU_MAX][_RECS];
+base_private bo_t _ready;
+
+void trace_record(trace_event_t event, u64_t f0, u64_t f1, u64_t f2)
+{
+  trace_cpu_t *cpu;
+  trace_rec_t *rec;
+  u64_t pos;
+  u64_t flags;
+
+  flags = intr_irq_save();
+  cpu = &_cpus[smp_cpu_idx()];
+  if (ring_reserve(&cpu->ring, 1, &pos) == 0) {
+    cpu_atomic_fetch_add(&cpu->drops, 1);
+  } else {
+    rec = ring_slot(&cpu->ring, pos);
+    rec->tsc = cpu_read_tsc();
+    rec->event = event;
+    rec->cpu = (u32_t)smp_cpu_idx();
+    rec->fields[0] = f0;
+    rec->fields[1] = f1;
+    rec->fields[2] = f2;
+    ring_commit(&cpu->ring, pos, 1);
+  }
+  intr_irq_restore(flags);
+}
+
+void trace_bootstrap(void)
+{
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    ring_init(&_cpus[i].ring, _recs[i], NULL, sizeof(trace_rec_t), _RECS);
+  }
+  _ready = true;
+}
+
+void trace_enable(trace_event_t event, bo_t on)
+{
+  kernel_assert(_ready && event < TRACE_EVENT_MAX);
+  if (on) {
+    cpu_atomic_bit_test_and_set(&trace_events_on, (u8_t)event);
+  } else {
+    cpu_atomic_bit_clear(&trace_events_on, (u8_t)event);
+  }
+}
+
+/* Write symbol of each code address in @rec, unless it is @sym_last, the
+ * last one written. */
+base_private void _syms_write(const trace_rec_t *rec, uptr_t *sym_last)
+{
+  ch_t line[sizeof(_LINE_PREFIX) + 4 + 19 + KERNEL_SYM_LEN_MAX + 2];
+  const ch_t *field;
+  uptr_t addr;
+  usz_t len;
+  usz_t n;
+
+  for (usz_t i = 0; i < _FIELDS_MAX; i++) {
+    field = _EVENTS[rec->event].fields[i];
+    if (field == NULL) {
+      break;
+    }
+    n = str_len(field);
+    addr = rec->fields[i];
+    if (field[n - 1] == 's' && addr != *sym_last) {
+      len = str_buf_marshal_str(line, 0, sizeof(line), _LINE_PREFIX "SYM ",
+          sizeof(_LINE_PREFIX "SYM ") - 1);
+      len += str_buf_marshal_uint_in_hex(line, len, sizeof(line), addr);
+      line[len++] = ' ';
+      len += kernel_sym_marshal(line, len, sizeof(line), addr);
+      line[len++] = '\n';
+      serial_write_str(line, len);
+      *sym_last = addr;
+    }
+  }
+}
+
+void trace_dump(void)
+{
+  ch_t line[sizeof(_LINE_PREFIX) + sizeof(trace_rec_t) * 3 + 2];
+  const event_t *event;
+  uptr_t sym_last;
+  ring_t *ring;
+  u64_t drops;
+  u64_t pos;
+  usz_t len;
+
+  len = str_buf_marshal_format(line, 0, sizeof(line),
+      _LINE_PREFIX "BEGIN %lu\n", time_ns_to_cycles(1000000000));
+  serial_write_str(line, len);
+  for (usz_t i = 0; i < TRACE_EVENT_MAX; i++) {
+    event = &_EVENTS[i];
+    len = str_buf_marshal_format(line, 0, sizeof(line),
+        _LINE_PREFIX "EVENT %lu %s %s %s %s\n", (u64_t)i, event->name,
+        event->fields[0] == NULL ? "" : event->fields[0],
+        event->fields[1] == NULL ? "" : event->fields[1],
+        event->fields[2] == NULL ? "" : event->fields[2]);
+    serial_write_str(line, len);
+  }
+
+  drops = 0;
+  sym_last = 0;
+  for (usz_t i = 0; i < SMP_CPU_MAX; i++) {
+    ring = &_cpus[i].ring;
+    while (ring_peek(ring, 1, &pos) == 1) {
+      _syms_write(ring_slot(ring, pos), &sym_last);
+      len = str_buf_marshal_str(
+          line, 0, sizeof(line), _LINE_PREFIX, sizeof(_LINE_PREFIX) - 1);
+      len += str_buf_marshal_bytes_in_hex(line, len, sizeof(line),
+          ring_slot(ring, pos), sizeof(trace_rec_t));
+      line[len++] = '\n';
+      serial_write_str(line, len);
+      ring_release(ring, 1);
+    }
+    drops += cpu_atomic_load(&_cpus[i].drops);
+  }
+  len = str_buf_marshal_format(
+      line, 0, sizeof(line), _LINE_PREFIX "END %lu\n", drops);
+  serial_write_str(line, len);
+}
+
+#ifdef BUILD_SELF_TEST_ENABLED
+#include "drivers_apic.h"
+#include "sched.h"
+
+#define _TEST_IPIS 16
+#define _TEST_ROUNDS 256
+
+base_private volatile u64_t _test_irqs;
+
+base_private void _test_handler(
+    intr_id_t id base_may_unuse, intr_parameters_t *para base_may_unuse)
+{
+  cpu_atomic_fetch_add(&_test_irqs, 1);
+}
+
+base_private void _test_drain(ring_t *ring)
+{
+  u64_t pos;
+  usz_t n;
+
+  n = ring_peek(ring, _RECS, &pos);
+  ring_release(ring, n);
+}
+
+/* A disabled tracepoint records nothing, an enabled one records its fields in
+ * order on current CPU, IRQ entry and exit pair up, and cost of tracepoints
+ * is logged. */
+void test_trace(void)
+{
+  ring_t *ring;
+  trace_rec_t *rec;
+  intr_id_t id;
+  u64_t pos;
+  u64_t start;
+  u64_t off_cycles;
+  u64_t on_cycles;
+  u64_t entries;
+  u64_t exits;
+  usz_t n;
+
+  sched_preempt_disable();
+  ring = &_cpus[smp_cpu_idx()].ring;
+  _test_drain(ring);
+
+  start = cpu_read_tsc();
+  for (u64_t i = 0; i < _TEST_ROUNDS; i++) {
+    trace_point(TRACE_EVENT_FRAME_ALLOC, i, 0, 0);
+  }
+  off_cycles = cpu_read_tsc() - start;
+  kernel_assert(ring_len(ring) == 0);
+
+  trace_enable(TRACE_EVENT_FRAME_ALLOC, true);
+  start = cpu_read_tsc();
+  for (u64_t i = 0; i < _TEST_ROUNDS; i++) {
+    trace_point(TRACE_EVENT_FRAME_ALLOC, i, 0, 0);
+  }
+  on_cycles = cpu_read_tsc() - start;
+  trace_enable(TRACE_EVENT_FRAME_ALLOC, false);
+  /* Frames allocated by IRQ handlers meanwhile are recorded as well. */
+  n = ring_peek(ring, _RECS, &pos);
+  entries = 0;
+  for (usz_t i = 0; i < n; i++) {
+    rec = ring_slot(ring, pos + i);
+    kernel_assert(rec->cpu == smp_cpu_idx());
+    kernel_assert(i == 0 || rec->tsc >= ((trace_rec_t *)ring_slot(
+                                            ring, pos + i - 1))->tsc);
+    if (rec->event == TRACE_EVENT_FRAME_ALLOC && rec->fields[0] == entries) {
+      entries++;
+    }
+  }
+  kernel_assert(entries == _TEST_ROUNDS);
+  _test_drain(ring);
+
+  if (d_apic_ready()) {
+    kernel_assert(intr_vector_alloc(_test_handler, &id));
+    trace_enable(TRACE_EVENT_IRQ_ENTRY, true);
+    trace_enable(TRACE_EVENT_IRQ_EXIT, true);
+    for (u64_t i = 0; i < _TEST_IPIS; i++) {
+      d_apic_send_ipi(d_apic_id(), (u8_t)id);
+      while (cpu_atomic_load(&_test_irqs) == i) {
+        cpu_relax();
+      }
+    }
+    trace_enable(TRACE_EVENT_IRQ_ENTRY, false);
+    trace_enable(TRACE_EVENT_IRQ_EXIT, false);
+
+    /* Left in the ring for trace_dump() below. */
+    n = ring_peek(ring, _RECS, &pos);
+    entries = 0;
+    exits = 0;
+    for (usz_t i = 0; i < n; i++) {
+      rec = ring_slot(ring, pos + i);
+      if (rec->fields[0] == id && rec->event == TRACE_EVENT_IRQ_ENTRY) {
+        kernel_assert(entries == exits && rec->fields[1] != 0);
+        entries++;
+      } else if (rec->fields[0] == id && rec->event == TRACE_EVENT_IRQ_EXIT) {
+        exits++;
+        kernel_assert(entries == exits);
+      }
+    }
+    kernel_assert(entries == _TEST_IPIS && exits == _TEST_IPIS);
+  }
+  sched_preempt_enable();
+  /* Freeing waits for an RCU grace period by yielding. */
+  if (d_apic_ready()) {
+    intr_vector_free(id);
+  }
+
+  log_line_format(LOG_LEVEL_SELF_TEST,
+      "Tracepoint: %lu cycles disabled, %lu cycles enabled",
+      off_cycles / _TEST_ROUNDS, on_cycles / _TEST_ROUNDS);
+  trace_dump();
+  log_builtin_test_pass();
+}
+#endif
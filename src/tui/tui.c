@@ -12,8 +12,8 @@ base_private const usz_t _TILE_WIDTH = 8;
 base_private const usz_t _TILE_HEIGHT = 8;
 base_private const usz_t _TILE_X_MAX = 240;
 base_private const usz_t _TILE_Y_MAX = 135;
-base_private const usz_t _CHAR_WIDTH = 8;
-base_private const usz_t _CHAR_HEIGHT = 16;
+base_private const usz_t _CHAR_WIDTH base_may_unuse = 8;
+base_private const usz_t _CHAR_HEIGHT base_may_unuse = 16;
 
 typedef struct tui_color {
   u8_t red;
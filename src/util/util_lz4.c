@@ -0,0 +1,231 @@
+/* LZ4 block format compression, reference:
+ * https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ * Only the greedy fast path is implemented, it is good enough for compressing
+ * page sized blocks. */
+
+#include "kernel_panic.h"
+#include "util.h"
+
+#define _MIN_MATCH 4
+/* Last 5 bytes of input are always literals. */
+#define _LAST_LITERALS 5
+/* Last match must start at least 12 bytes before end of input. */
+#define _MF_LIMIT 12
+#define _MAX_OFFSET 65535
+#define _HASH_LOG 12
+
+base_private u32_t _read_32(const byte_t *p)
+{
+  return (u32_t)p[0] | ((u32_t)p[1] << 8) | ((u32_t)p[2] << 16) |
+         ((u32_t)p[3] << 24);
+}
+
+base_private u16_t _hash(u32_t seq)
+{
+  return (u16_t)((seq * 2654435761U) >> (32 - _HASH_LOG));
+}
+
+/* Write a length which does not fit in token nibble.
+ * @return false if @dst is not big enough. */
+base_private bo_t _write_len(
+    byte_t *dst, usz_t dst_cap, usz_t *op, usz_t len)
+{
+  bo_t ok = true;
+
+  while (len >= 255) {
+    if (*op >= dst_cap) {
+      ok = false;
+      break;
+    }
+    dst[(*op)++] = 255;
+    len -= 255;
+  }
+  if (ok) {
+    if (*op >= dst_cap) {
+      ok = false;
+    } else {
+      dst[(*op)++] = (byte_t)len;
+    }
+  }
+  return ok;
+}
+
+/* Write a sequence of literals and an optional match.
+ * @return false if @dst is not big enough. */
+base_private bo_t _write_seq(byte_t *dst,
+    usz_t dst_cap,
+    usz_t *op,
+    const byte_t *lit,
+    usz_t lit_len,
+    usz_t offset,  /* 0 for last sequence without match */
+    usz_t match_len)
+{
+  usz_t token_pos;
+  usz_t ml;
+  bo_t ok;
+
+  ok = (*op < dst_cap);
+  if (ok) {
+    token_pos = (*op)++;
+    dst[token_pos] = (byte_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) {
+      ok = _write_len(dst, dst_cap, op, lit_len - 15);
+    }
+  }
+  if (ok && (*op + lit_len) > dst_cap) {
+    ok = false;
+  }
+  if (ok) {
+    for (usz_t i = 0; i < lit_len; i++) {
+      dst[(*op)++] = lit[i];
+    }
+  }
+
+  if (ok && offset > 0) {
+    kernel_assert_d(offset <= _MAX_OFFSET);
+    kernel_assert_d(match_len >= _MIN_MATCH);
+    if ((*op + 2) > dst_cap) {
+      ok = false;
+    } else {
+      dst[(*op)++] = (byte_t)(offset & 0xff);
+      dst[(*op)++] = (byte_t)(offset >> 8);
+      ml = match_len - _MIN_MATCH;
+      dst[token_pos] = (byte_t)(dst[token_pos] | (ml >= 15 ? 15 : ml));
+      if (ml >= 15) {
+        ok = _write_len(dst, dst_cap, op, ml - 15);
+      }
+    }
+  }
+  return ok;
+}
+
+usz_t util_lz4_compress(const byte_t *src,
+    usz_t src_len,
+    byte_t *dst,
+    usz_t dst_cap,
+    u16_t *table)
+{
+  usz_t ip;
+  usz_t anchor;
+  usz_t op;
+  bo_t ok;
+
+  kernel_assert(src_len <= UTIL_LZ4_SRC_MAX);
+
+  for (usz_t i = 0; i < UTIL_LZ4_TABLE_LEN; i++) {
+    table[i] = 0;
+  }
+
+  ip = 0;
+  anchor = 0;
+  op = 0;
+  ok = true;
+  if (src_len > _MF_LIMIT) {
+    while (ip < src_len - _MF_LIMIT) {
+      u32_t seq = _read_32(src + ip);
+      u16_t h = _hash(seq);
+      /* Table saves position plus 1, so 0 means empty. */
+      usz_t ref = table[h];
+
+      table[h] = (u16_t)(ip + 1);
+      if (ref > 0 && (ip - (ref - 1)) <= _MAX_OFFSET &&
+          _read_32(src + ref - 1) == seq) {
+        usz_t mlen = _MIN_MATCH;
+
+        ref--;
+        while ((ip + mlen) < (src_len - _LAST_LITERALS) &&
+               src[ref + mlen] == src[ip + mlen]) {
+          mlen++;
+        }
+        ok = _write_seq(
+            dst, dst_cap, &op, src + anchor, ip - anchor, ip - ref, mlen);
+        if (!ok) {
+          break;
+        }
+        ip += mlen;
+        anchor = ip;
+      } else {
+        ip++;
+      }
+    }
+  }
+
+  if (ok) {
+    ok = _write_seq(dst, dst_cap, &op, src + anchor, src_len - anchor, 0, 0);
+  }
+  return ok ? op : 0;
+}
+
+bo_t util_lz4_decompress(
+    const byte_t *src, usz_t src_len, byte_t *dst, usz_t dst_len)
+{
+  usz_t ip;
+  usz_t op;
+  bo_t ok;
+
+  ip = 0;
+  op = 0;
+  ok = true;
+  while (ok && ip < src_len) {
+    byte_t token = src[ip++];
+    usz_t lit_len = token >> 4;
+    usz_t match_len = (token & 0xf) + _MIN_MATCH;
+    usz_t offset;
+    byte_t b;
+
+    if (lit_len == 15) {
+      do {
+        if (ip >= src_len) {
+          ok = false;
+          break;
+        }
+        b = src[ip++];
+        lit_len += b;
+      } while (b == 255);
+    }
+    if (!ok || (ip + lit_len) > src_len || (op + lit_len) > dst_len) {
+      ok = false;
+      break;
+    }
+    for (usz_t i = 0; i < lit_len; i++) {
+      dst[op++] = src[ip++];
+    }
+
+    /* The last sequence has literals only. */
+    if (ip == src_len) {
+      break;
+    }
+
+    if ((ip + 2) > src_len) {
+      ok = false;
+      break;
+    }
+    offset = (usz_t)src[ip] | ((usz_t)src[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op) {
+      ok = false;
+      break;
+    }
+
+    if ((token & 0xf) == 15) {
+      do {
+        if (ip >= src_len) {
+          ok = false;
+          break;
+        }
+        b = src[ip++];
+        match_len += b;
+      } while (b == 255);
+    }
+    if (!ok || (op + match_len) > dst_len) {
+      ok = false;
+      break;
+    }
+    /* Byte by byte copy, since a match may overlap with itself. */
+    for (usz_t i = 0; i < match_len; i++) {
+      dst[op] = dst[op - offset];
+      op++;
+    }
+  }
+  return ok && op == dst_len;
+}
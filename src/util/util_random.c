@@ -4,7 +4,7 @@
 base_private const u64_t RAND_1 = 151117737;
 base_private const u64_t RAND_2 = 119785373;
 base_private const u64_t RAND_3 = 85689495;
-base_private const u64_t RAND_4 = 76595339;
+base_private const u64_t RAND_4 base_may_unuse = 76595339;
 base_private const u64_t RAND_SUM_2 = 98781234;
 base_private const u64_t RAND_SUM_3 = 126792457;
 base_private const u64_t RAND_SUM_4 = 63498502;
@@ -0,0 +1,164 @@
+/* Kernel services needed by allocator sources when built on host. */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "host_shim.h"
+#include "cpu_info.h"
+#include "kernel_panic.h"
+#include "log.h"
+#include "mm_private.h"
+#include "sync.h"
+#include "trace.h"
+
+/* Tracepoints stay disabled on host. */
+volatile u64_t trace_events_on;
+
+/* Fake physical address of next frame. */
+static uptr_t _next_frame = PAGE_SIZE_VALUE_4K;
+/* Heap pages mapped so far, heap grows upward from VA_48_HEAP. */
+static uptr_t _mapped_end = VA_48_HEAP;
+
+void _kernel_assert_fail(const char *expr, const char *file, usz_t line)
+{
+  fprintf(stderr, "%s:%lu: assert failed: %s\n", file, line, expr);
+  abort();
+}
+
+void _kernel_panic(const char *file, usz_t line, const char *msg)
+{
+  fprintf(stderr, "%s:%lu: panic: %s\n", file, line, msg);
+  abort();
+}
+
+void _log_line_format_v(
+    log_level_t lv, const ch_t *file, usz_t line, const ch_t *format, ...)
+{
+  va_list va;
+
+  if (lv >= LOG_LEVEL_WARN) {
+    fprintf(stderr, "%s:%lu: ", file, line);
+    va_start(va, format);
+    vfprintf(stderr, format, va);
+    va_end(va);
+    fputc('\n', stderr);
+  }
+}
+
+void _log_builtin_test_pass(const ch_t *test_name, const ch_t *file, usz_t line)
+{
+  fprintf(stderr, "%s:%lu: %s passed\n", file, line, test_name);
+}
+
+/* Replay is single threaded. */
+void sync_spin_lock(sync_spin_t *lock)
+{
+  (void)lock;
+}
+
+void sync_spin_unlock(sync_spin_t *lock)
+{
+  (void)lock;
+}
+
+void cpu_mem_copy(byte_t *dst, const byte_t *src, usz_t len)
+{
+  memcpy(dst, src, len);
+}
+
+void trace_record(trace_event_t event, u64_t f0, u64_t f1, u64_t f2)
+{
+  (void)event;
+  (void)(f0 + f1 + f2);
+}
+
+bo_t mm_frame_alloc(uptr_t *out_frame)
+{
+  *out_frame = _next_frame;
+  _next_frame += PAGE_SIZE_VALUE_4K;
+  return true;
+}
+
+bo_t mm_page_map(uptr_t va, uptr_t pa)
+{
+  void *p;
+
+  (void)pa;
+  p = mmap((void *)va, PAGE_SIZE_VALUE_4K, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  if (p != (void *)va) {
+    perror("mmap heap page");
+    abort();
+  }
+  if (va + PAGE_SIZE_VALUE_4K > _mapped_end) {
+    _mapped_end = va + PAGE_SIZE_VALUE_4K;
+  }
+  return true;
+}
+
+void host_heap_reset(void)
+{
+  if (_mapped_end > VA_48_HEAP) {
+    munmap((void *)VA_48_HEAP, _mapped_end - VA_48_HEAP);
+  }
+  _mapped_end = VA_48_HEAP;
+  _next_frame = PAGE_SIZE_VALUE_4K;
+  mm_heap_bootstrap();
+  mm_allocator_bootstrap();
+}
+
+/* Bootstrap of frames and paging never runs on host. */
+static void _no_bootstrap(void)
+{
+  fprintf(stderr, "kernel bootstrap is not available on host\n");
+  abort();
+}
+
+bo_t mm_pa_range_valid(uptr_t start, uptr_t end)
+{
+  (void)start;
+  (void)end;
+  _no_bootstrap();
+  return false;
+}
+
+void mm_frame_early_bootstrap(const byte_t *mmap_info, usz_t mmap_info_len)
+{
+  (void)mmap_info;
+  (void)mmap_info_len;
+  _no_bootstrap();
+}
+
+void mm_frame_bootstrap(void)
+{
+  _no_bootstrap();
+}
+
+ucnt_t mm_frame_free_count(void)
+{
+  _no_bootstrap();
+  return 0;
+}
+
+void mm_page_early_bootstrap(uptr_t kernel_start, uptr_t kernel_end)
+{
+  (void)kernel_start;
+  (void)kernel_end;
+  _no_bootstrap();
+}
+
+void mm_page_bootstrap(uptr_t kernel_start,
+    uptr_t kernel_end,
+    uptr_t boot_stack_bottom,
+    uptr_t boot_stack_top)
+{
+  (void)kernel_start;
+  (void)kernel_end;
+  (void)boot_stack_bottom;
+  (void)boot_stack_top;
+  _no_bootstrap();
+}
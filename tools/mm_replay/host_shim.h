@@ -0,0 +1,7 @@
+#ifndef ___HOST_SHIM
+#define ___HOST_SHIM
+
+/* Unmap the whole kernel heap and bootstrap heap and allocators again. */
+void host_heap_reset(void);
+
+#endif
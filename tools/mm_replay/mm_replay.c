@@ -0,0 +1,539 @@
+/* Replay kernel allocator traces on host.
+ *
+ * Traces are dumped by mm_trace_dump() over serial, every record is a line
+ * of "MM_TRACE " followed by the hex encoded mm_trace_rec_t. Records are
+ * replayed against each allocator variant, reporting throughput and
+ * fragmentation. Kernel allocator sources are compiled into this program as
+ * they are, so a new allocator variant only needs a new entry in _VARIANTS.
+ *
+ * Usage:
+ *   mm_replay <serial.log>
+ *   mm_replay --synthetic <op count> */
+
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_shim.h"
+#include "mm_private.h"
+
+#define _LINE_PREFIX "MM_TRACE "
+
+/* Allocator variant to replay traces on. */
+typedef struct {
+  const char *name;
+  void (*reset)(void);
+  void *(*heap_alloc)(size_t len);
+  void (*heap_free)(void *block);
+  void *(*arena_new)(void);
+  void *(*arena_alloc)(void *arena, size_t size, size_t align);
+  void (*arena_free)(void *arena);
+  /* Bytes of memory the variant takes from system. */
+  size_t (*footprint)(void);
+} variant_t;
+
+/* Kernel buddy heap and arena allocator. */
+static void _buddy_reset(void)
+{
+  host_heap_reset();
+}
+
+static void *_buddy_heap_alloc(size_t len)
+{
+  usz_t all_len;
+  return mm_heap_alloc(len, &all_len);
+}
+
+static void _buddy_heap_free(void *block)
+{
+  mm_heap_free(block);
+}
+
+static void *_buddy_arena_new(void)
+{
+  return mm_allocator_new();
+}
+
+static void *_buddy_arena_alloc(void *arena, size_t size, size_t align)
+{
+  return mm_allocate(arena, size, align);
+}
+
+static void _buddy_arena_free(void *arena)
+{
+  mm_allocator_free(arena);
+}
+
+static size_t _buddy_footprint(void)
+{
+  return mm_heap_mapped_len();
+}
+
+/* Host libc malloc, as a baseline. */
+typedef struct {
+  void **blocks;
+  size_t cnt;
+  size_t cap;
+} libc_arena_t;
+
+static void _libc_reset(void)
+{
+  malloc_trim(0);
+}
+
+static void *_libc_heap_alloc(size_t len)
+{
+  return malloc(len);
+}
+
+static void _libc_heap_free(void *block)
+{
+  free(block);
+}
+
+static void *_libc_arena_new(void)
+{
+  return calloc(1, sizeof(libc_arena_t));
+}
+
+static void *_libc_arena_alloc(void *arena, size_t size, size_t align)
+{
+  libc_arena_t *a = arena;
+  void *block = NULL;
+
+  if (a->cnt == a->cap) {
+    a->cap = a->cap == 0 ? 16 : a->cap * 2;
+    a->blocks = realloc(a->blocks, a->cap * sizeof(void *));
+  }
+  if (posix_memalign(&block, align < sizeof(void *) ? sizeof(void *) : align,
+          size == 0 ? 1 : size) != 0) {
+    abort();
+  }
+  a->blocks[a->cnt++] = block;
+  return block;
+}
+
+static void _libc_arena_free(void *arena)
+{
+  libc_arena_t *a = arena;
+
+  for (size_t i = 0; i < a->cnt; i++) {
+    free(a->blocks[i]);
+  }
+  free(a->blocks);
+  free(a);
+}
+
+static size_t _libc_footprint(void)
+{
+  struct mallinfo2 mi = mallinfo2();
+  return mi.arena + mi.hblkhd;
+}
+
+static const variant_t _VARIANTS[] = {
+  { "buddy", _buddy_reset, _buddy_heap_alloc, _buddy_heap_free,
+      _buddy_arena_new, _buddy_arena_alloc, _buddy_arena_free,
+      _buddy_footprint },
+  { "libc", _libc_reset, _libc_heap_alloc, _libc_heap_free, _libc_arena_new,
+      _libc_arena_alloc, _libc_arena_free, _libc_footprint },
+};
+
+/* Map from traced addresses to addresses of replay. */
+typedef struct {
+  u64_t key; /* 0 for empty slot */
+  void *val;
+  size_t size;
+} map_slot_t;
+
+typedef struct {
+  map_slot_t *slots;
+  size_t cap; /* Power of 2 */
+  size_t cnt;
+} map_t;
+
+static size_t _map_hash(u64_t key, size_t cap)
+{
+  return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 17) & (cap - 1);
+}
+
+static void _map_init(map_t *m)
+{
+  m->cap = 1024;
+  m->cnt = 0;
+  m->slots = calloc(m->cap, sizeof(map_slot_t));
+}
+
+static void _map_put(map_t *m, u64_t key, void *val, size_t size);
+
+static void _map_grow(map_t *m)
+{
+  map_t old = *m;
+
+  m->cap *= 2;
+  m->cnt = 0;
+  m->slots = calloc(m->cap, sizeof(map_slot_t));
+  for (size_t i = 0; i < old.cap; i++) {
+    if (old.slots[i].key != 0) {
+      _map_put(m, old.slots[i].key, old.slots[i].val, old.slots[i].size);
+    }
+  }
+  free(old.slots);
+}
+
+static map_slot_t *_map_find(map_t *m, u64_t key)
+{
+  size_t i = _map_hash(key, m->cap);
+
+  while (m->slots[i].key != 0) {
+    if (m->slots[i].key == key) {
+      return &m->slots[i];
+    }
+    i = (i + 1) & (m->cap - 1);
+  }
+  return NULL;
+}
+
+static void _map_put(map_t *m, u64_t key, void *val, size_t size)
+{
+  size_t i;
+
+  if ((m->cnt + 1) * 2 > m->cap) {
+    _map_grow(m);
+  }
+  i = _map_hash(key, m->cap);
+  while (m->slots[i].key != 0 && m->slots[i].key != key) {
+    i = (i + 1) & (m->cap - 1);
+  }
+  if (m->slots[i].key == 0) {
+    m->cnt++;
+  }
+  m->slots[i].key = key;
+  m->slots[i].val = val;
+  m->slots[i].size = size;
+}
+
+/* Remove with backward shift, so that probing chains stay intact. */
+static void _map_del(map_t *m, map_slot_t *slot)
+{
+  size_t i = (size_t)(slot - m->slots);
+  size_t j = i;
+
+  m->cnt--;
+  while (true) {
+    size_t home;
+
+    m->slots[i].key = 0;
+    do {
+      j = (j + 1) & (m->cap - 1);
+      if (m->slots[j].key == 0) {
+        return;
+      }
+      home = _map_hash(m->slots[j].key, m->cap);
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+    m->slots[i] = m->slots[j];
+    i = j;
+  }
+}
+
+static void _map_free(map_t *m)
+{
+  free(m->slots);
+}
+
+/* Records to replay. */
+typedef struct {
+  mm_trace_rec_t *recs;
+  size_t cnt;
+  size_t cap;
+} trace_t;
+
+static void _trace_add(trace_t *t, const mm_trace_rec_t *rec)
+{
+  if (t->cnt == t->cap) {
+    t->cap = t->cap == 0 ? 4096 : t->cap * 2;
+    t->recs = realloc(t->recs, t->cap * sizeof(mm_trace_rec_t));
+  }
+  t->recs[t->cnt++] = *rec;
+}
+
+static int _hex_val(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/* Parse a hex encoded record, bytes may be separated by spaces. */
+static bool _parse_rec(const char *hex, mm_trace_rec_t *rec)
+{
+  byte_t *out = (byte_t *)rec;
+  size_t n = 0;
+
+  while (*hex != '\0' && n < sizeof(*rec)) {
+    int hi;
+    int lo;
+
+    if (*hex == ' ') {
+      hex++;
+      continue;
+    }
+    hi = _hex_val(hex[0]);
+    lo = hi < 0 ? -1 : _hex_val(hex[1]);
+    if (lo < 0) {
+      break;
+    }
+    out[n++] = (byte_t)(hi * 16 + lo);
+    hex += 2;
+  }
+  return n == sizeof(*rec) && rec->version == MM_TRACE_REC_VERSION;
+}
+
+static bool _trace_load(trace_t *t, const char *path)
+{
+  char line[512];
+  size_t bad = 0;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    const char *p = strstr(line, _LINE_PREFIX);
+    mm_trace_rec_t rec;
+
+    if (p == NULL) {
+      continue;
+    }
+    p += strlen(_LINE_PREFIX);
+    if (strncmp(p, "BEGIN", 5) == 0 || strncmp(p, "END", 3) == 0) {
+      continue;
+    }
+    if (_parse_rec(p, &rec)) {
+      _trace_add(t, &rec);
+    } else {
+      bad++;
+    }
+  }
+  fclose(f);
+  if (bad > 0) {
+    fprintf(stderr, "%s: %zu malformed records skipped\n", path, bad);
+  }
+  return true;
+}
+
+static u64_t _rand_next(u64_t *state)
+{
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *state >> 33;
+}
+
+/* Generate a workload mixing long lived heap blocks and short lived arenas,
+ * with log uniform sizes. */
+static void _trace_synthesize(trace_t *t, size_t op_cnt)
+{
+  u64_t rand = 42;
+  u64_t next_addr = 0x1000;
+  u64_t *live = calloc(op_cnt, sizeof(u64_t));
+  size_t live_cnt = 0;
+  u64_t arena = 0;
+
+  for (size_t i = 0; i < op_cnt; i++) {
+    mm_trace_rec_t rec;
+    u64_t dice = _rand_next(&rand) % 100;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.version = MM_TRACE_REC_VERSION;
+    rec.tsc = i;
+    if (dice < 40 || (dice < 60 && live_cnt == 0)) {
+      rec.op = MM_TRACE_OP_HEAP_ALLOC;
+      rec.size = (u32_t)(16 << (_rand_next(&rand) % 14));
+      rec.size += (u32_t)(_rand_next(&rand) % rec.size);
+      rec.addr = next_addr++;
+      live[live_cnt++] = rec.addr;
+    } else if (dice < 60) {
+      size_t victim = _rand_next(&rand) % live_cnt;
+      rec.op = MM_TRACE_OP_HEAP_FREE;
+      rec.addr = live[victim];
+      live[victim] = live[--live_cnt];
+    } else if (arena == 0 || dice < 62) {
+      if (arena != 0) {
+        rec.op = MM_TRACE_OP_ALLOCATOR_FREE;
+        rec.addr = arena;
+        _trace_add(t, &rec);
+      }
+      rec.op = MM_TRACE_OP_ALLOCATOR_NEW;
+      arena = next_addr++;
+      rec.addr = arena;
+    } else {
+      rec.op = MM_TRACE_OP_ALLOCATE;
+      rec.arena = arena;
+      rec.addr = next_addr++;
+      rec.size = (u32_t)(8 + _rand_next(&rand) % 2048);
+      rec.align_log = (u16_t)(3 + _rand_next(&rand) % 4);
+    }
+    _trace_add(t, &rec);
+  }
+  free(live);
+}
+
+typedef struct {
+  size_t ops;
+  size_t unmatched; /* Frees of blocks allocated before tracing started */
+  double secs;
+  size_t live;          /* Bytes requested and not freed yet */
+  size_t peak_live;
+  size_t peak_footprint;
+  size_t footprint_at_peak_live;
+} result_t;
+
+static double _now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void _replay(const variant_t *v, const trace_t *t, result_t *res)
+{
+  map_t blocks;
+  map_t arenas;
+  map_slot_t *slot;
+  double start;
+  double probe = 0; /* Time spent sampling footprint, not counted */
+
+  memset(res, 0, sizeof(*res));
+  _map_init(&blocks);
+  _map_init(&arenas);
+  v->reset();
+
+  start = _now();
+  for (size_t i = 0; i < t->cnt; i++) {
+    const mm_trace_rec_t *rec = &t->recs[i];
+    void *p;
+    size_t fp;
+    double probe_start;
+
+    switch (rec->op) {
+    case MM_TRACE_OP_HEAP_ALLOC:
+      p = v->heap_alloc(rec->size);
+      _map_put(&blocks, rec->addr, p, rec->size);
+      res->live += rec->size;
+      break;
+    case MM_TRACE_OP_HEAP_FREE:
+      slot = _map_find(&blocks, rec->addr);
+      if (slot == NULL) {
+        res->unmatched++;
+        break;
+      }
+      v->heap_free(slot->val);
+      res->live -= slot->size;
+      _map_del(&blocks, slot);
+      break;
+    case MM_TRACE_OP_ALLOCATOR_NEW:
+      _map_put(&arenas, rec->addr, v->arena_new(), 0);
+      break;
+    case MM_TRACE_OP_ALLOCATE:
+      slot = _map_find(&arenas, rec->arena);
+      if (slot == NULL) {
+        /* Allocator created before tracing started. */
+        _map_put(&arenas, rec->arena, v->arena_new(), 0);
+        slot = _map_find(&arenas, rec->arena);
+      }
+      v->arena_alloc(slot->val, rec->size, (size_t)1 << rec->align_log);
+      slot->size += rec->size;
+      res->live += rec->size;
+      break;
+    case MM_TRACE_OP_ALLOCATOR_FREE:
+      slot = _map_find(&arenas, rec->addr);
+      if (slot == NULL) {
+        res->unmatched++;
+        break;
+      }
+      v->arena_free(slot->val);
+      res->live -= slot->size;
+      _map_del(&arenas, slot);
+      break;
+    default:
+      fprintf(stderr, "unknown op %u at record %zu\n", rec->op, i);
+      abort();
+    }
+    res->ops++;
+
+    if (res->live > res->peak_live) {
+      res->peak_live = res->live;
+      probe_start = _now();
+      fp = v->footprint();
+      probe += _now() - probe_start;
+      res->footprint_at_peak_live = fp;
+      if (fp > res->peak_footprint) {
+        res->peak_footprint = fp;
+      }
+    }
+  }
+  res->secs = _now() - start - probe;
+
+  /* Release whatever still alive, so that next variant starts clean. */
+  for (size_t i = 0; i < blocks.cap; i++) {
+    if (blocks.slots[i].key != 0) {
+      v->heap_free(blocks.slots[i].val);
+    }
+  }
+  for (size_t i = 0; i < arenas.cap; i++) {
+    if (arenas.slots[i].key != 0) {
+      v->arena_free(arenas.slots[i].val);
+    }
+  }
+  _map_free(&blocks);
+  _map_free(&arenas);
+}
+
+static void _report(const variant_t *v, const result_t *res)
+{
+  double frag = 0;
+
+  if (res->footprint_at_peak_live > 0) {
+    frag = 100.0 * (1.0 - (double)res->peak_live /
+                              (double)res->footprint_at_peak_live);
+  }
+  printf("%-8s %10zu ops %9.3f Mops/s  peak live %10zu KiB  "
+         "footprint %10zu KiB  fragmentation %5.1f%%  unmatched %zu\n",
+      v->name, res->ops,
+      res->secs > 0 ? (double)res->ops / res->secs / 1e6 : 0.0,
+      res->peak_live / 1024, res->peak_footprint / 1024, frag,
+      res->unmatched);
+}
+
+int main(int argc, char **argv)
+{
+  trace_t trace = { NULL, 0, 0 };
+  result_t res;
+
+  if (argc == 3 && strcmp(argv[1], "--synthetic") == 0) {
+    _trace_synthesize(&trace, (size_t)strtoull(argv[2], NULL, 10));
+  } else if (argc == 2) {
+    if (!_trace_load(&trace, argv[1])) {
+      return 1;
+    }
+  } else {
+    fprintf(stderr, "usage: %s <serial.log> | --synthetic <op count>\n",
+        argv[0]);
+    return 1;
+  }
+  printf("%zu records\n", trace.cnt);
+
+  for (size_t i = 0; i < sizeof(_VARIANTS) / sizeof(_VARIANTS[0]); i++) {
+    _replay(&_VARIANTS[i], &trace, &res);
+    _report(&_VARIANTS[i], &res);
+  }
+  free(trace.recs);
+  return 0;
+}
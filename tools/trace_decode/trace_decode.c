@@ -0,0 +1,333 @@
+/* Decode kernel tracepoint dumps on host.
+ *
+ * Dumps are written by trace_dump() over serial, as lines of "TRACE "
+ * followed by "BEGIN" with TSC cycles per second, "EVENT" with id, name and
+ * fields of each event, one hex encoded record per line, and "END" with
+ * records dropped. Code addresses are symbolized by the kernel, in "SYM"
+ * lines with the address and its symbol. Records of all CPUs are merged in
+ * order of TSC, and printed one per line with time since the first one.
+ *
+ * Usage:
+ *   trace_decode <serial.log> */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _LINE_PREFIX "TRACE "
+#define _FIELDS_MAX 3
+#define _EVENTS_MAX 64
+#define _NAME_CAP 32
+#define _SYM_CAP 80
+
+/* Must match trace_rec_t of src/trace/trace.c. */
+typedef struct {
+  uint64_t tsc;
+  uint32_t event;
+  uint32_t cpu;
+  uint64_t fields[_FIELDS_MAX];
+} rec_t;
+
+typedef struct {
+  char name[_NAME_CAP];
+  char fields[_FIELDS_MAX][_NAME_CAP];
+  char formats[_FIELDS_MAX]; /* 'x', 'd' or 's', 0 for unused */
+} event_t;
+
+/* Symbols of code addresses, open addressing. */
+typedef struct {
+  uint64_t addr; /* 0 for empty slot */
+  char name[_SYM_CAP];
+} sym_t;
+
+typedef struct {
+  sym_t *slots;
+  size_t cap; /* Power of 2 */
+  size_t cnt;
+} sym_map_t;
+
+typedef struct {
+  uint64_t hz; /* TSC cycles per second */
+  uint64_t drops;
+  event_t events[_EVENTS_MAX];
+  sym_map_t syms;
+  rec_t *recs;
+  size_t cnt;
+  size_t cap;
+} trace_t;
+
+static size_t _sym_hash(uint64_t addr, size_t cap)
+{
+  return (size_t)((addr * 0x9E3779B97F4A7C15ULL) >> 17) & (cap - 1);
+}
+
+static sym_t *_sym_slot(const sym_map_t *m, uint64_t addr)
+{
+  size_t i = _sym_hash(addr, m->cap);
+
+  while (m->slots[i].addr != 0 && m->slots[i].addr != addr) {
+    i = (i + 1) & (m->cap - 1);
+  }
+  return &m->slots[i];
+}
+
+static void _sym_put(sym_map_t *m, uint64_t addr, const char *name)
+{
+  sym_t *slot;
+
+  if ((m->cnt + 1) * 2 > m->cap) {
+    sym_map_t old = *m;
+
+    m->cap = old.cap == 0 ? 256 : old.cap * 2;
+    m->cnt = 0;
+    m->slots = calloc(m->cap, sizeof(sym_t));
+    if (m->slots == NULL) {
+      abort();
+    }
+    for (size_t i = 0; i < old.cap; i++) {
+      if (old.slots[i].addr != 0) {
+        *_sym_slot(m, old.slots[i].addr) = old.slots[i];
+        m->cnt++;
+      }
+    }
+    free(old.slots);
+  }
+  slot = _sym_slot(m, addr);
+  if (slot->addr == 0) {
+    slot->addr = addr;
+    m->cnt++;
+  }
+  snprintf(slot->name, sizeof(slot->name), "%s", name);
+}
+
+/* @return NULL if @addr was not symbolized. */
+static const char *_sym_get(const sym_map_t *m, uint64_t addr)
+{
+  const sym_t *slot;
+
+  if (m->cap == 0 || addr == 0) {
+    return NULL;
+  }
+  slot = _sym_slot(m, addr);
+  return slot->addr == 0 ? NULL : slot->name;
+}
+
+/* Parse "<address> <symbol>" of a SYM line. */
+static bool _parse_sym(const char *p, trace_t *t)
+{
+  char name[_SYM_CAP];
+  uint64_t addr;
+
+  if (sscanf(p, "%" SCNx64 " %79s", &addr, name) != 2 || addr == 0) {
+    return false;
+  }
+  _sym_put(&t->syms, addr, name);
+  return true;
+}
+
+static int _hex_val(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/* Parse a hex encoded record, bytes may be separated by spaces. */
+static bool _parse_rec(const char *hex, rec_t *rec)
+{
+  unsigned char *out = (unsigned char *)rec;
+  size_t n = 0;
+
+  while (*hex != '\0' && n < sizeof(*rec)) {
+    int hi;
+    int lo;
+
+    if (*hex == ' ') {
+      hex++;
+      continue;
+    }
+    hi = _hex_val(hex[0]);
+    lo = hi < 0 ? -1 : _hex_val(hex[1]);
+    if (lo < 0) {
+      break;
+    }
+    out[n++] = (unsigned char)(hi * 16 + lo);
+    hex += 2;
+  }
+  return n == sizeof(*rec);
+}
+
+/* Parse "<id> <name> <field>:<format>..." of an EVENT line. */
+static bool _parse_event(const char *p, trace_t *t)
+{
+  char fields[_FIELDS_MAX][_NAME_CAP] = {{0}};
+  char name[_NAME_CAP];
+  unsigned id;
+  event_t *ev;
+  int n;
+
+  n = sscanf(p, "%u %31s %31s %31s %31s", &id, name, fields[0], fields[1],
+      fields[2]);
+  if (n < 2 || id >= _EVENTS_MAX) {
+    return false;
+  }
+  ev = &t->events[id];
+  memset(ev, 0, sizeof(*ev));
+  strcpy(ev->name, name);
+  for (int i = 0; i < n - 2; i++) {
+    char *colon = strrchr(fields[i], ':');
+
+    if (colon == NULL) {
+      return false;
+    }
+    *colon = '\0';
+    strcpy(ev->fields[i], fields[i]);
+    ev->formats[i] = colon[1] == 'd' || colon[1] == 's' ? colon[1] : 'x';
+  }
+  return true;
+}
+
+static void _trace_add(trace_t *t, const rec_t *rec)
+{
+  if (t->cnt == t->cap) {
+    t->cap = t->cap == 0 ? 1024 : t->cap * 2;
+    t->recs = realloc(t->recs, t->cap * sizeof(rec_t));
+    if (t->recs == NULL) {
+      abort();
+    }
+  }
+  t->recs[t->cnt++] = *rec;
+}
+
+/* Prefix at @line, not part of a longer one like "MM_TRACE ". */
+static const char *_prefix_find(const char *line)
+{
+  const char *p = strstr(line, _LINE_PREFIX);
+
+  while (p != NULL && p > line && (p[-1] == '_' || (p[-1] >= 'A' &&
+                                                   p[-1] <= 'Z'))) {
+    p = strstr(p + 1, _LINE_PREFIX);
+  }
+  return p;
+}
+
+static bool _trace_load(trace_t *t, const char *path)
+{
+  char line[512];
+  size_t bad = 0;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    const char *p = _prefix_find(line);
+    rec_t rec;
+
+    if (p == NULL) {
+      continue;
+    }
+    p += strlen(_LINE_PREFIX);
+    if (strncmp(p, "BEGIN ", 6) == 0) {
+      t->hz = strtoull(p + 6, NULL, 10);
+    } else if (strncmp(p, "END ", 4) == 0) {
+      t->drops += strtoull(p + 4, NULL, 10);
+    } else if (strncmp(p, "EVENT ", 6) == 0) {
+      if (!_parse_event(p + 6, t)) {
+        bad++;
+      }
+    } else if (strncmp(p, "SYM ", 4) == 0) {
+      if (!_parse_sym(p + 4, t)) {
+        bad++;
+      }
+    } else if (_parse_rec(p, &rec)) {
+      _trace_add(t, &rec);
+    } else {
+      bad++;
+    }
+  }
+  fclose(f);
+  if (bad > 0) {
+    fprintf(stderr, "%s: %zu malformed lines skipped\n", path, bad);
+  }
+  return true;
+}
+
+static int _rec_cmp(const void *a, const void *b)
+{
+  const rec_t *ra = a;
+  const rec_t *rb = b;
+
+  return ra->tsc < rb->tsc ? -1 : ra->tsc > rb->tsc;
+}
+
+static void _rec_print(const trace_t *t, const rec_t *rec, uint64_t first)
+{
+  const event_t *ev = NULL;
+  uint64_t ns;
+
+  ns = t->hz == 0 ? 0
+                  : (uint64_t)((unsigned __int128)(rec->tsc - first) *
+                               1000000000 / t->hz);
+  if (rec->event < _EVENTS_MAX && t->events[rec->event].name[0] != '\0') {
+    ev = &t->events[rec->event];
+  }
+  printf("%12" PRIu64 ".%03" PRIu64 " us  cpu %2" PRIu32 "  ", ns / 1000,
+      ns % 1000, rec->cpu);
+  if (ev == NULL) {
+    printf("event_%" PRIu32, rec->event);
+    for (int i = 0; i < _FIELDS_MAX; i++) {
+      printf(" 0x%" PRIx64, rec->fields[i]);
+    }
+  } else {
+    printf("%-16s", ev->name);
+    for (int i = 0; i < _FIELDS_MAX && ev->formats[i] != 0; i++) {
+      const char *sym = _sym_get(&t->syms, rec->fields[i]);
+
+      if (ev->formats[i] == 'd') {
+        printf(" %s=%" PRIu64, ev->fields[i], rec->fields[i]);
+      } else if (ev->formats[i] == 's' && sym != NULL) {
+        printf(" %s=%s", ev->fields[i], sym);
+      } else {
+        printf(" %s=0x%" PRIx64, ev->fields[i], rec->fields[i]);
+      }
+    }
+  }
+  putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+  trace_t t;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <serial.log>\n", argv[0]);
+    return 2;
+  }
+  memset(&t, 0, sizeof(t));
+  if (!_trace_load(&t, argv[1])) {
+    return 1;
+  }
+  if (t.hz < 1000000) {
+    fprintf(stderr, "%s: no TSC frequency, times are not shown\n", argv[1]);
+    t.hz = 0;
+  }
+
+  qsort(t.recs, t.cnt, sizeof(rec_t), _rec_cmp);
+  for (size_t i = 0; i < t.cnt; i++) {
+    _rec_print(&t, &t.recs[i], t.recs[0].tsc);
+  }
+  printf("%zu records, %" PRIu64 " dropped\n", t.cnt, t.drops);
+  free(t.recs);
+  free(t.syms.slots);
+  return 0;
+}